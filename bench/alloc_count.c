@@ -0,0 +1,28 @@
+#include <stdlib.h>
+
+#include "alloc_count.h"
+
+unsigned long bench_alloc_count = 0;
+unsigned long bench_alloc_bytes = 0;
+
+void *bench_malloc(size_t size) {
+    ++bench_alloc_count;
+    bench_alloc_bytes += size;
+    return malloc(size);
+}
+
+void *bench_calloc(size_t n, size_t size) {
+    ++bench_alloc_count;
+    bench_alloc_bytes += n * size;
+    return calloc(n, size);
+}
+
+void *bench_realloc(void *ptr, size_t size) {
+    ++bench_alloc_count;
+    bench_alloc_bytes += size;
+    return realloc(ptr, size);
+}
+
+void bench_free(void *ptr) {
+    free(ptr);
+}
@@ -0,0 +1,20 @@
+#ifndef ALLOC_COUNT_H_
+#define ALLOC_COUNT_H_
+
+#include <stddef.h>
+
+/**
+ * Counting allocator hooks
+ *
+ * Sources under measurement are compiled with `-Dmalloc=bench_malloc` (etc.) so
+ * every allocation they make is counted without interposing on libc
+*/
+extern unsigned long bench_alloc_count;
+extern unsigned long bench_alloc_bytes;
+
+void *bench_malloc(size_t size);
+void *bench_calloc(size_t n, size_t size);
+void *bench_realloc(void *ptr, size_t size);
+void bench_free(void *ptr);
+
+#endif
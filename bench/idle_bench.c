@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_CONNECTIONS 100000
+#define DEFAULT_PATH "/health"
+#define CONNECTIONS_PER_SOURCE 20000 // Below the default ephemeral port range
+
+/**
+ * Opens many keep-alive connections to a running server, makes one request on
+ * each and leaves them idle, then reports what they cost the server: the
+ * growth of the given processes' resident memory and of the kernel slab,
+ * per connection
+ *
+ * The server should run with enough max_connections and keep_alive_timeout_ms
+ * for all of them. Each 127.0.0.x source address has its own range of
+ * ephemeral ports, so -n past about 28000 needs the client to spread across
+ * several (-s). Both sides need an open file limit above -n
+ *
+ * Usage: idle_bench [-n connections] [-p port] [-s source_addresses] [-r request_path] [-w seconds] server_pid...
+*/
+
+static long read_kib(const char *path, const char *key) {
+    char line[256];
+    long value = -1;
+    size_t keyLength = strlen(key);
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, keyLength) == 0 && line[keyLength] == ':') {
+            value = atol(line + keyLength + 1);
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    return value;
+}
+
+static long server_rss_kib(char *pids[], int count) {
+    char path[64];
+    long total = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        snprintf(path, sizeof(path), "/proc/%s/status", pids[i]);
+        total += read_kib(path, "VmRSS");
+    }
+
+    return total;
+}
+
+static long slab_kib(void) {
+    return read_kib("/proc/meminfo", "Slab");
+}
+
+/**
+ * Connects from `source`, makes one request and waits for the whole response
+*/
+static int open_idle(struct sockaddr_in *server, struct in_addr source, const char *req, size_t reqLen) {
+    struct sockaddr_in local;
+    char buf[4096];
+    ssize_t n;
+    int one = 1;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    memset(&local, 0, sizeof local);
+    local.sin_family = AF_INET;
+    local.sin_addr = source;
+
+    // Pick the port at connect, by the full 4-tuple, rather than per source address at bind
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+
+    if (bind(sockfd, (struct sockaddr *)&local, sizeof local) == -1
+        || connect(sockfd, (struct sockaddr *)server, sizeof *server) == -1
+        || send(sockfd, req, reqLen, 0) != (ssize_t)reqLen) {
+        close(sockfd);
+        return -1;
+    }
+
+    // The responses are small: one read holds the whole of one
+    n = recv(sockfd, buf, sizeof(buf) - 1, 0);
+
+    if (n <= 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    buf[n] = '\0';
+
+    if (strncmp(buf, "HTTP/1.1 200", 12) != 0) {
+        close(sockfd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Counts connections the server has not closed (or sent anything unexpected on)
+*/
+static long count_open(int *fds, long count) {
+    struct pollfd pfd;
+    long i, open = 0;
+
+    for (i = 0; i < count; ++i) {
+        pfd.fd = fds[i];
+        pfd.events = POLLIN;
+
+        if (poll(&pfd, 1, 0) == 0) {
+            ++open;
+        }
+    }
+
+    return open;
+}
+
+int main(int argc, char *argv[]) {
+    long connections = DEFAULT_CONNECTIONS, opened = 0, i;
+    int port = 3000, sources = 0, waitSeconds = 0, opt;
+    const char *path = DEFAULT_PATH;
+    char req[512];
+    long rssBefore, rssAfter, slabBefore, slabAfter;
+    struct sockaddr_in server;
+    struct in_addr source;
+    struct rlimit limit;
+    int *fds;
+
+    while ((opt = getopt(argc, argv, "n:p:s:r:w:")) != -1) {
+        switch (opt) {
+            case 'n': connections = atol(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 's': sources = atoi(optarg); break;
+            case 'r': path = optarg; break;
+            case 'w': waitSeconds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n connections] [-p port] [-s source_addresses] [-r request_path] [-w seconds] server_pid...\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-n connections] [-p port] [-s source_addresses] [-r request_path] [-w seconds] server_pid...\n", argv[0]);
+        return 1;
+    }
+
+    if (!sources) {
+        sources = (connections + CONNECTIONS_PER_SOURCE - 1) / CONNECTIONS_PER_SOURCE;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (!(fds = malloc(sizeof(int) * connections))) {
+        return 1;
+    }
+
+    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nUser-Agent: idle_bench\r\n\r\n", path);
+
+    memset(&server, 0, sizeof server);
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    rssBefore = server_rss_kib(argv + optind, argc - optind);
+    slabBefore = slab_kib();
+
+    for (i = 0; i < connections; ++i) {
+        // 127.0.0.1, 127.0.0.2, ... in turn
+        source.s_addr = htonl(INADDR_LOOPBACK + i % sources);
+
+        if ((fds[opened] = open_idle(&server, source, req, strlen(req))) == -1) {
+            fprintf(stderr, "Stopped after %ld connections: %s\n", opened, strerror(errno));
+            break;
+        }
+
+        ++opened;
+    }
+
+    if (!opened) {
+        return 1;
+    }
+
+    // Let the workers settle (and return their read buffers) before measuring
+    sleep(1);
+
+    rssAfter = server_rss_kib(argv + optind, argc - optind);
+    slabAfter = slab_kib();
+
+    printf("%ld idle connections from %d source addresses\n\n", opened, sources);
+    printf("%-22s %12s %16s\n", "", "total KiB", "bytes/conn");
+    printf("%-22s %12ld %16.0f\n", "server RSS", rssAfter - rssBefore, (rssAfter - rssBefore) * 1024.0 / opened);
+    printf("%-22s %12ld %16.0f\n", "kernel slab (both)", slabAfter - slabBefore, (slabAfter - slabBefore) * 1024.0 / opened);
+
+    if (waitSeconds) {
+        sleep(waitSeconds);
+    }
+
+    printf("\n%ld of %ld still open after %d s\n", count_open(fds, opened), opened, waitSeconds + 1);
+
+    return opened == connections ? 0 : 1;
+}
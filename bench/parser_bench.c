@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../src/http.h"
+#include "alloc_count.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define RESPONSE_BUFFER_SIZE 8192
+
+/**
+ * Corpus used when no request files are given on the command line
+ *
+ * Header sets captured from curl, desktop/mobile browsers and crawlers, with
+ * the HTTP/1.1 request lines they send. The form post and the bare-LF request
+ * stay on HTTP/1.0, so both versions the parser accepts are covered
+*/
+static const char *defaultCorpus[] = {
+    "bench/corpus/curl.req",
+    "bench/corpus/chrome.req",
+    "bench/corpus/firefox.req",
+    "bench/corpus/safari-ios.req",
+    "bench/corpus/googlebot.req",
+    "bench/corpus/bingbot.req",
+    "bench/corpus/post-form.req",
+    "bench/corpus/lf-minimal.req",
+};
+
+typedef struct Sample {
+    const char *name;
+    char *raw;
+    size_t len;
+} Sample;
+
+typedef struct Result {
+    double ns;
+    double cycles;
+    double allocs;
+    size_t bytes;
+} Result;
+
+/**
+ * Returns a monotonic timestamp in nanoseconds
+*/
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns the CPU timestamp counter, or 0 where there is none
+*/
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Reads a whole corpus file into memory
+*/
+static int load_sample(struct Sample *s, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    long size;
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    s->raw = malloc(size + 1);
+
+    if (!s->raw || fread(s->raw, 1, size, fp) != (size_t)size) {
+        fclose(fp);
+        free(s->raw);
+        return -1;
+    }
+
+    fclose(fp);
+
+    s->raw[size] = '\0';
+    s->len = size;
+    s->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+    return 0;
+}
+
+/**
+ * Times parse_request + free_request over `iterations` runs of one sample
+*/
+static struct Result bench_parse(struct Sample *s, long iterations, int *status) {
+    struct Result r;
+    struct HttpRequest *req;
+    unsigned long long startNs, startCycles;
+    unsigned long startAllocs;
+    long i;
+
+    // Warm caches and branch predictors
+    for (i = 0; i < iterations / 10; ++i) {
+        free_request(parse_request(s->raw, s->len, status));
+    }
+
+    *status = HTTP_STATUS_OK;
+    startAllocs = bench_alloc_count;
+    startNs = now_ns();
+    startCycles = cycles();
+
+    for (i = 0; i < iterations; ++i) {
+        req = parse_request(s->raw, s->len, status);
+        free_request(req);
+    }
+
+    r.cycles = (double)(cycles() - startCycles) / iterations;
+    r.ns = (double)(now_ns() - startNs) / iterations;
+    r.allocs = (double)(bench_alloc_count - startAllocs) / iterations;
+    r.bytes = s->len;
+
+    return r;
+}
+
+/**
+ * Times serialize_response for a typical static file response
+*/
+static struct Result bench_serialize(long iterations, size_t bodyLen) {
+    struct Result r;
+    struct HttpResponse res;
+    char *out = malloc(RESPONSE_BUFFER_SIZE + bodyLen);
+    char contentLen[32];
+    unsigned long long startNs, startCycles;
+    unsigned long startAllocs;
+    size_t len = 0;
+    long i;
+
+    memset(&res, 0, sizeof(res));
+
+    res.body = malloc(bodyLen + 1);
+    memset(res.body, 'x', bodyLen);
+    res.body[bodyLen] = '\0';
+
+    snprintf(contentLen, sizeof(contentLen), "%zu", bodyLen);
+    add_response_header(HTTP_HEADER_CONTENT_TYPE, "text/plain", &res);
+    add_response_header(HTTP_HEADER_CONTENT_LENGTH, contentLen, &res);
+
+    for (i = 0; i < iterations / 10; ++i) {
+        serialize_response(out, RESPONSE_BUFFER_SIZE + bodyLen, &res, HTTP_STATUS_OK);
+    }
+
+    startAllocs = bench_alloc_count;
+    startNs = now_ns();
+    startCycles = cycles();
+
+    for (i = 0; i < iterations; ++i) {
+        len = serialize_response(out, RESPONSE_BUFFER_SIZE + bodyLen, &res, HTTP_STATUS_OK);
+    }
+
+    r.cycles = (double)(cycles() - startCycles) / iterations;
+    r.ns = (double)(now_ns() - startNs) / iterations;
+    r.allocs = (double)(bench_alloc_count - startAllocs) / iterations;
+    r.bytes = len;
+
+    free_header(res.headers);
+    free(res.body);
+    free(out);
+
+    return r;
+}
+
+static void print_result(const char *name, struct Result *r, int status) {
+    printf("%-22s %6zu %4d %10.1f %12.1f %10.3f %9.2f\n",
+        name, r->bytes, status, r->ns, r->cycles,
+        r->cycles > 0 ? r->bytes / r->cycles : 0.0, r->allocs);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = DEFAULT_ITERATIONS;
+    const char **paths = defaultCorpus;
+    int pathCount = sizeof(defaultCorpus) / sizeof(defaultCorpus[0]);
+    struct Sample *samples;
+    struct Result r, total;
+    size_t bodySizes[] = { 0, 512, 4096 };
+    int opt, i, status, loaded = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [request files...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (iterations <= 0) {
+        iterations = DEFAULT_ITERATIONS;
+    }
+
+    if (optind < argc) {
+        paths = (const char **)&argv[optind];
+        pathCount = argc - optind;
+    }
+
+    samples = calloc(pathCount, sizeof(struct Sample));
+
+    for (i = 0; i < pathCount; ++i) {
+        if (load_sample(&samples[loaded], paths[i]) == 0) {
+            ++loaded;
+        }
+    }
+
+    if (!loaded) {
+        fprintf(stderr, "No request samples loaded\n");
+        return 1;
+    }
+
+    printf("%ld iterations per sample, cycles from %s\n\n", iterations,
+#if defined(__x86_64__) || defined(__i386__)
+        "rdtsc"
+#elif defined(__aarch64__)
+        "cntvct_el0"
+#else
+        "(unavailable)"
+#endif
+    );
+
+    printf("%-22s %6s %4s %10s %12s %10s %9s\n",
+        "parse_request", "bytes", "st", "ns/req", "cycles/req", "bytes/cyc", "allocs");
+
+    memset(&total, 0, sizeof(total));
+
+    for (i = 0; i < loaded; ++i) {
+        r = bench_parse(&samples[i], iterations, &status);
+        print_result(samples[i].name, &r, status);
+
+        total.ns += r.ns;
+        total.cycles += r.cycles;
+        total.allocs += r.allocs;
+        total.bytes += r.bytes;
+    }
+
+    total.ns /= loaded;
+    total.cycles /= loaded;
+    total.allocs /= loaded;
+    total.bytes /= loaded;
+    print_result("(mean)", &total, 0);
+
+    printf("\n%-22s %6s %4s %10s %12s %10s %9s\n",
+        "serialize_response", "bytes", "st", "ns/res", "cycles/res", "bytes/cyc", "allocs");
+
+    for (i = 0; i < (int)(sizeof(bodySizes) / sizeof(bodySizes[0])); ++i) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "body %zu", bodySizes[i]);
+        r = bench_serialize(iterations, bodySizes[i]);
+        print_result(name, &r, HTTP_STATUS_OK);
+    }
+
+    for (i = 0; i < loaded; ++i) {
+        free(samples[i].raw);
+    }
+    free(samples);
+
+    return 0;
+}
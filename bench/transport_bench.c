@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#define DEFAULT_ITERATIONS 20000
+#define DEFAULT_PATH "/files/example.txt"
+
+/**
+ * Compares loopback TCP against a Unix domain socket by running the same
+ * request sequentially against a running server over both transports.
+ * Every request opens a new connection, as HTTP/1.0 closes after each response
+ *
+ * Usage: transport_bench [-n iterations] [-p port] [-u unix_socket_path] [-r request_path]
+*/
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Sends one request and reads the response until the server closes
+*/
+static int round_trip(struct sockaddr *addr, socklen_t addrLen, const char *req, size_t reqLen) {
+    char buf[4096];
+    ssize_t n;
+    int sockfd = socket(addr->sa_family, SOCK_STREAM, 0);
+
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    if (connect(sockfd, addr, addrLen) == -1 || send(sockfd, req, reqLen, 0) != (ssize_t)reqLen) {
+        close(sockfd);
+        return -1;
+    }
+
+    while ((n = recv(sockfd, buf, sizeof(buf), 0)) > 0);
+
+    close(sockfd);
+
+    return n == 0 ? 0 : -1;
+}
+
+static void run(const char *name, struct sockaddr *addr, socklen_t addrLen, const char *req, long iterations) {
+    unsigned long long *samples = malloc(sizeof(unsigned long long) * iterations);
+    unsigned long long start, total = 0;
+    long i, failed = 0;
+
+    // Warm up
+    for (i = 0; i < iterations / 10; ++i) {
+        round_trip(addr, addrLen, req, strlen(req));
+    }
+
+    for (i = 0; i < iterations; ++i) {
+        start = now_ns();
+        if (round_trip(addr, addrLen, req, strlen(req)) == -1) {
+            ++failed;
+        }
+        samples[i] = now_ns() - start;
+        total += samples[i];
+    }
+
+    qsort(samples, iterations, sizeof(unsigned long long), compare_ull);
+
+    printf("%-8s %10.0f %10.1f %10.1f %10.1f %8ld\n", name,
+        iterations / (total / 1e9),
+        total / 1e3 / iterations,
+        samples[iterations / 2] / 1e3,
+        samples[iterations * 99 / 100] / 1e3,
+        failed);
+
+    free(samples);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = DEFAULT_ITERATIONS;
+    const char *port = "3000";
+    const char *unixPath = NULL;
+    const char *path = DEFAULT_PATH;
+    char req[512];
+    struct addrinfo hints, *tcpAddr;
+    struct sockaddr_un unixAddr;
+    socklen_t unixAddrLen;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:u:r:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atol(optarg); break;
+            case 'p': port = optarg; break;
+            case 'u': unixPath = optarg; break;
+            case 'r': path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-p port] [-u unix_socket_path] [-r request_path]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: localhost\r\nUser-Agent: transport_bench\r\n\r\n", path);
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo("127.0.0.1", port, &hints, &tcpAddr) != 0) {
+        fprintf(stderr, "Error resolving 127.0.0.1:%s\n", port);
+        return 1;
+    }
+
+    printf("%ld sequential requests per transport, one connection each\n\n", iterations);
+    printf("%-8s %10s %10s %10s %10s %8s\n", "", "req/s", "mean us", "p50 us", "p99 us", "failed");
+
+    run("tcp", tcpAddr->ai_addr, tcpAddr->ai_addrlen, req, iterations);
+
+    if (unixPath) {
+        memset(&unixAddr, 0, sizeof unixAddr);
+        unixAddr.sun_family = AF_UNIX;
+        strncpy(unixAddr.sun_path, unixPath, sizeof(unixAddr.sun_path) - 1);
+        unixAddrLen = sizeof unixAddr;
+
+        if (unixPath[0] == '@') {
+            unixAddr.sun_path[0] = '\0';
+            unixAddrLen = offsetof(struct sockaddr_un, sun_path) + strlen(unixPath);
+        }
+
+        run("unix", (struct sockaddr *)&unixAddr, unixAddrLen, req, iterations);
+    }
+
+    freeaddrinfo(tcpAddr);
+
+    return 0;
+}
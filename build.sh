@@ -4,5 +4,43 @@ clang -c src/http.c
 clang -c src/date_utils.c
 clang -c src/mime.c
 clang -c src/socket.c
+clang -c src/config.c
+clang -c src/metrics.c
+clang -c src/worker.c
+clang -c src/access_log.c
+clang -c src/master.c
+clang -c src/files.c
+clang -c src/router.c
+clang -c src/handlers.c
+clang -c src/bundle.c
+clang -c src/mapcache.c
+clang -c src/shmcache.c
+clang -c src/pool.c
+clang -c src/connection.c
+clang -c src/hpack.c
+clang -c src/h2.c
+clang -c src/proxy.c
+clang -c src/ratelimit.c
+clang -c src/tls.c
+clang -c src/multipart.c
+clang -c src/websocket.c
+clang -c src/sse.c
+clang -c src/stream.c
+clang -c src/trace.c
+clang -c src/acceptor.c
 
-clang src/server.c http.o date_utils.o mime.o socket.o -o bin/server
+clang src/server.c http.o date_utils.o mime.o socket.o config.o metrics.o worker.o access_log.o master.o files.o router.o handlers.o bundle.o mapcache.o shmcache.o pool.o connection.o hpack.o h2.o proxy.o ratelimit.o tls.o multipart.o websocket.o sse.o stream.o trace.o acceptor.o -pthread -lssl -lcrypto -o bin/server
+
+# Benchmarks (parser allocations counted via bench/alloc_count.c)
+clang -O2 -c src/http.c -o bench_http.o -Dmalloc=bench_malloc -Dcalloc=bench_calloc -Drealloc=bench_realloc -Dfree=bench_free
+clang -O2 bench/parser_bench.c bench/alloc_count.c bench_http.o date_utils.o -o bin/parser_bench
+clang -O2 bench/transport_bench.c -o bin/transport_bench
+clang -O2 bench/idle_bench.c -o bin/idle_bench
+
+# Tests, run from the repository root after building: bin/server_test, bin/hpack_test, bin/shmcache_test
+clang -O2 tests/server_test.c -o bin/server_test
+clang -O2 tests/hpack_test.c hpack.o -o bin/hpack_test
+clang -O2 tests/shmcache_test.c shmcache.o -o bin/shmcache_test
+
+# Tools
+clang -O2 tools/bundle_pack.c mime.o -lz -o bin/bundle_pack
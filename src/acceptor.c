@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "acceptor.h"
+#include "metrics.h"
+#include "socket.h"
+
+static struct AcceptorSlot *slots = NULL;
+static int (*channels)[2] = NULL; // Per worker slot: the acceptors' end, then the worker's
+static int *accepting = NULL; // Per worker slot: a worker there takes new connections
+static int slotCount = 0;
+
+static int threadCount = 0;
+static pthread_t threads[ACCEPTOR_MAX_THREADS];
+static int running = 0;
+static int stopRequested = 0;
+static int wakePipe[2] = { -1, -1 };
+
+static int listeners[MAX_LISTENERS];
+static int listenerTls[MAX_LISTENERS];
+static int listenerCount = 0;
+static int acceptBatch = 1;
+
+/**
+ * Sets up handing connections from `threads` acceptor threads in the master to
+ * `workers` worker slots, before they fork. 0 threads leaves workers to accept
+ * for themselves
+ *
+ * Connections can only pass between processes as SCM_RIGHTS, so each slot's
+ * queue is a non-blocking SOCK_SEQPACKET socketpair, one message per
+ * connection, whose readability is the worker's wakeup. It outlives the
+ * worker, so connections queued for one that dies go to its replacement
+*/
+int acceptor_init(int workers, int threads) {
+    int i;
+
+    if (threads <= 0) {
+        return 0;
+    }
+
+    slots = mmap(NULL, sizeof(struct AcceptorSlot) * workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (slots == MAP_FAILED) {
+        perror("Error mapping acceptor slots");
+        slots = NULL;
+        return -1;
+    }
+
+    if (!(channels = malloc(sizeof(channels[0]) * workers)) || !(accepting = calloc(workers, sizeof(int)))) {
+        perror("Error allocating acceptor channels");
+        return -1;
+    }
+
+    for (slotCount = 0; slotCount < workers; ++slotCount) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, channels[slotCount]) == -1) {
+            perror("Error creating acceptor channel");
+            for (i = 0; i < slotCount; ++i) {
+                close(channels[i][0]);
+                close(channels[i][1]);
+            }
+            slotCount = 0;
+            return -1;
+        }
+    }
+
+    if (pipe(wakePipe) == -1) {
+        perror("Error creating acceptor wake pipe");
+        return -1;
+    }
+
+    fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wakePipe[1], F_SETFD, FD_CLOEXEC);
+
+    threadCount = threads < ACCEPTOR_MAX_THREADS ? threads : ACCEPTOR_MAX_THREADS;
+
+    return 0;
+}
+
+/**
+ * The socket worker slot `worker` receives its connections on, -1 if workers accept for themselves
+*/
+int acceptor_fd(int worker) {
+    return worker < slotCount ? channels[worker][1] : -1;
+}
+
+/**
+ * In a worker forked into slot `worker`, closes every channel end but the one it receives on
+*/
+void acceptor_forked(int worker) {
+    int i;
+
+    for (i = 0; i < slotCount; ++i) {
+        close(channels[i][0]);
+        if (i != worker) {
+            close(channels[i][1]);
+        }
+    }
+
+    if (slotCount) {
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+    }
+}
+
+/**
+ * Marks whether the worker in slot `worker` is to be given new connections
+*/
+void acceptor_open(int worker, int open) {
+    if (worker < slotCount) {
+        __atomic_store_n(&accepting[worker], open, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Connections the worker in `slot` has open or has yet to take
+*/
+static long load(int slot) {
+    const struct MetricsSlot *m = metrics_slot(slot);
+
+    return (long)(__atomic_load_n(&m->connectionsOpened, __ATOMIC_RELAXED) - __atomic_load_n(&m->connectionsClosed, __ATOMIC_RELAXED))
+        + __atomic_load_n(&slots[slot].queued, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sends `sockfd` to the least loaded worker taking connections, or the next
+ * least loaded while their queues are full. Ties go round from `turn`, so
+ * idle workers share a burst. Returns -1 if none would take it
+*/
+static int hand_off(int sockfd, const struct sockaddr_storage *addr, int tls, unsigned int turn) {
+    struct AcceptorHandoff handoff;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    unsigned long long tried = 0;
+    long best, l;
+    int i, slot, target;
+
+    memset(&handoff, 0, sizeof handoff);
+    handoff.tls = tls;
+    handoff.addr = *addr;
+
+    iov.iov_base = &handoff;
+    iov.iov_len = sizeof handoff;
+
+    memset(&msg, 0, sizeof msg);
+    memset(control, 0, sizeof control);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sockfd, sizeof(int));
+
+    for (;;) {
+        target = -1;
+        best = 0;
+
+        for (i = 0; i < slotCount; ++i) {
+            slot = (turn + i) % slotCount;
+
+            if (!__atomic_load_n(&accepting[slot], __ATOMIC_ACQUIRE) || (tried & (1ULL << slot))) {
+                continue;
+            }
+
+            l = load(slot);
+
+            if (target == -1 || l < best) {
+                target = slot;
+                best = l;
+            }
+        }
+
+        if (target == -1) {
+            return -1;
+        }
+
+        // Counted before it can be taken, so the worker never takes more than was counted
+        __atomic_add_fetch(&slots[target].queued, 1, __ATOMIC_RELAXED);
+
+        if (sendmsg(channels[target][0], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)sizeof handoff) {
+            return 0;
+        }
+
+        __atomic_sub_fetch(&slots[target].queued, 1, __ATOMIC_RELAXED);
+        tried |= 1ULL << target;
+    }
+}
+
+/**
+ * Accepts on every listener and hands the connections off until acceptor_stop
+ *
+ * Runs in the master, which forks workers while it does, so it sticks to
+ * system calls and atomics: no allocation and no stdio, whose locks a child
+ * forked from under it would inherit held
+*/
+static void *acceptor_run(void *arg) {
+    struct pollfd fds[MAX_LISTENERS + 1];
+    struct sockaddr_storage addr;
+    unsigned int turn = (unsigned int)(intptr_t)arg;
+    int i, accepted, sockfd;
+
+    fds[0].fd = wakePipe[0];
+    fds[0].events = POLLIN;
+
+    for (i = 0; i < listenerCount; ++i) {
+        fds[i + 1].fd = listeners[i];
+        fds[i + 1].events = POLLIN;
+    }
+
+    while (!__atomic_load_n(&stopRequested, __ATOMIC_ACQUIRE)) {
+        if (poll(fds, listenerCount + 1, -1) == -1) {
+            continue;
+        }
+
+        for (i = 0; i < listenerCount; ++i) {
+            if (!fds[i + 1].revents) {
+                continue;
+            }
+
+            // The other acceptor threads woke too, whoever gets there first takes it
+            for (accepted = 0; accepted < acceptBatch; ++accepted) {
+                if ((sockfd = accept_connection(listeners[i], &addr)) == -1) {
+                    break;
+                }
+
+                // A worker given the connection holds its own copy, which has to be the last for its close to end it
+                hand_off(sockfd, &addr, listenerTls[i], turn++);
+                close(sockfd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the acceptor threads on the `count` listeners in `listenSockfds`,
+ * configured as `c->listeners`
+*/
+int acceptor_start(const int listenSockfds[], const struct ServerConfig *c, int count) {
+    sigset_t all, saved;
+    char drain[64];
+    int i;
+
+    if (!threadCount || running) {
+        return 0;
+    }
+
+    for (i = 0; i < count; ++i) {
+        listeners[i] = listenSockfds[i];
+        listenerTls[i] = c->listeners[i].tls;
+    }
+    listenerCount = count;
+    acceptBatch = c->acceptBatch;
+
+    while (read(wakePipe[0], drain, sizeof(drain)) > 0);
+    __atomic_store_n(&stopRequested, 0, __ATOMIC_RELEASE);
+
+    // Signals are left to the master's own thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+
+    for (running = 0; running < threadCount; ++running) {
+        if (pthread_create(&threads[running], NULL, acceptor_run, (void *)(intptr_t)running) != 0) {
+            perror("Error starting acceptor thread");
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (running < threadCount) {
+        acceptor_stop();
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stops the acceptor threads, leaving new connections in the listeners' backlogs
+*/
+void acceptor_stop(void) {
+    int i;
+
+    if (!running) {
+        return;
+    }
+
+    __atomic_store_n(&stopRequested, 1, __ATOMIC_RELEASE);
+    write(wakePipe[1], "", 1);
+
+    for (i = 0; i < running; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    running = 0;
+}
+
+/**
+ * Takes the next connection handed to worker slot `worker`, with its client
+ * address and whether it came in on a TLS listener. Returns -1 once there are none
+*/
+int acceptor_receive(int worker, struct sockaddr_storage *addr, int *tls) {
+    struct AcceptorHandoff handoff;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    int sockfd = -1;
+    ssize_t n;
+
+    iov.iov_base = &handoff;
+    iov.iov_len = sizeof handoff;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    if ((n = recvmsg(channels[worker][1], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) == -1) {
+        return -1;
+    }
+
+    __atomic_sub_fetch(&slots[worker].queued, 1, __ATOMIC_RELAXED);
+
+    if ((cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&sockfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (n != (ssize_t)sizeof handoff || sockfd == -1) {
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    *addr = handoff.addr;
+    *tls = handoff.tls;
+
+    return sockfd;
+}
@@ -0,0 +1,36 @@
+#ifndef ACCEPTOR_H_
+#define ACCEPTOR_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+#define ACCEPTOR_MAX_THREADS 4
+
+/**
+ * Sent with each connection handed to a worker, the connection itself
+ * travelling as SCM_RIGHTS ancillary data
+*/
+typedef struct AcceptorHandoff {
+    int tls; // Accepted on a TLS listener
+    struct sockaddr_storage addr;
+} AcceptorHandoff;
+
+/**
+ * How many connections have been handed to a worker slot and not yet taken.
+ * Shared, the acceptor threads add and the worker subtracts
+*/
+typedef struct AcceptorSlot {
+    long queued;
+} __attribute__((aligned(64))) AcceptorSlot;
+
+int acceptor_init(int workers, int threads);
+int acceptor_fd(int worker);
+void acceptor_forked(int worker);
+void acceptor_open(int worker, int open);
+int acceptor_start(const int listenSockfds[], const struct ServerConfig *c, int count);
+void acceptor_stop(void);
+int acceptor_receive(int worker, struct sockaddr_storage *addr, int *tls);
+
+#endif
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "access_log.h"
+
+static struct AccessLogRing *rings = NULL;
+static int ringCount = 0;
+static int logFd = -1;
+static pthread_t writerThread;
+static int writerStopping = 0;
+
+/**
+ * Maps one ring per worker in memory shared by every process forked afterwards
+*/
+int access_log_init(int workers) {
+    rings = mmap(NULL, sizeof(struct AccessLogRing) * workers, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (rings == MAP_FAILED) {
+        perror("Error mapping access log rings");
+        rings = NULL;
+        return -1;
+    }
+
+    ringCount = workers;
+
+    return 0;
+}
+
+struct AccessLogRing *access_log_ring(int worker) {
+    return rings ? &rings[worker % ringCount] : NULL;
+}
+
+/**
+ * Copies the raw client address into a record (formatting is left to the writer)
+*/
+void access_log_set_client(struct AccessLogRecord *rec, const struct sockaddr *addr) {
+    rec->family = addr->sa_family;
+
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memcpy(rec->addr, &in->sin_addr, sizeof(in->sin_addr));
+        rec->port = ntohs(in->sin_port);
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(rec->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        rec->port = ntohs(in6->sin6_port);
+    }
+}
+
+/**
+ * Pushes a record onto the ring without blocking
+ *
+ * Returns -1 and counts a drop if the writer has fallen behind and the ring is full
+*/
+int access_log_write(struct AccessLogRing *ring, const struct AccessLogRecord *rec) {
+    unsigned long head = ring->head;
+
+    if (head - ring->cachedTail >= ACCESS_LOG_RING_SIZE) {
+        ring->cachedTail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        if (head - ring->cachedTail >= ACCESS_LOG_RING_SIZE) {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+
+    memcpy(&ring->records[head & (ACCESS_LOG_RING_SIZE - 1)], rec, sizeof(*rec));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Appends `s` to `dst`, quoting it if it contains spaces, quotes or control chars
+*/
+static size_t append_quoted(char *dst, const char *s) {
+    size_t len = 0;
+    const char *p;
+    int quote = 0;
+
+    for (p = s; *p; ++p) {
+        if (*p <= ' ' || *p == '"' || *p == '\\' || *p == 0x7f) {
+            quote = 1;
+            break;
+        }
+    }
+
+    if (!quote) {
+        len = strlen(s);
+        memcpy(dst, s, len);
+        return len;
+    }
+
+    dst[len++] = '"';
+    for (p = s; *p; ++p) {
+        if (*p == '"' || *p == '\\') {
+            dst[len++] = '\\';
+            dst[len++] = *p;
+        } else if ((unsigned char)*p < ' ' || *p == 0x7f) {
+            len += sprintf(dst + len, "\\x%02x", (unsigned char)*p);
+        } else {
+            dst[len++] = *p;
+        }
+    }
+    dst[len++] = '"';
+
+    return len;
+}
+
+/**
+ * Formats one record as a logfmt line, returns its length
+ *
+ * `lastSec`/`secStr` cache the formatted second so strftime runs at most once a second
+*/
+static size_t format_record(char *dst, const struct AccessLogRecord *rec, time_t *lastSec, char *secStr) {
+    char client[INET6_ADDRSTRLEN];
+    time_t sec = rec->timeNs / 1000000000ULL;
+    struct tm tm;
+    size_t len;
+
+    if (sec != *lastSec) {
+        gmtime_r(&sec, &tm);
+        strftime(secStr, 32, "%Y-%m-%dT%H:%M:%S", &tm);
+        *lastSec = sec;
+    }
+
+    if (rec->family == AF_INET || rec->family == AF_INET6) {
+        inet_ntop(rec->family, rec->addr, client, sizeof(client));
+    } else if (rec->family == AF_UNIX) {
+        strcpy(client, "unix");
+    } else {
+        strcpy(client, "-");
+    }
+
+    len = sprintf(dst, "ts=%s.%03lluZ client=%s method=%s path=", secStr,
+        (rec->timeNs / 1000000ULL) % 1000, client, rec->method[0] ? rec->method : "-");
+    len += append_quoted(dst + len, rec->path[0] ? rec->path : "-");
+    len += sprintf(dst + len, " status=%u bytes=%lu duration_us=%llu\n",
+        rec->status, rec->bytes, rec->durationNs / 1000);
+
+    return len;
+}
+
+/**
+ * Writes the whole batch, retrying short writes
+*/
+static void flush_batch(char *batch, size_t len) {
+    size_t written = 0;
+    ssize_t n;
+
+    while (written < len) {
+        n = write(logFd, batch + written, len - written);
+
+        if (n == -1) {
+            perror("Error writing access log");
+            return;
+        }
+
+        written += n;
+    }
+}
+
+/**
+ * Background writer: drains every ring into large batched writes
+*/
+static void *writer_run(void *arg) {
+    // Worst case: every path byte escaped as \xNN plus the fixed fields
+    size_t maxLine = ACCESS_LOG_PATH_MAX * 4 + 256;
+    char *batch = malloc(ACCESS_LOG_BATCH_SIZE + maxLine);
+    char secStr[32];
+    time_t lastSec = 0;
+    struct timespec idle = { 0, ACCESS_LOG_IDLE_SLEEP_MS * 1000000L };
+    struct AccessLogRing *ring;
+    unsigned long head, tail, dropped;
+    size_t len = 0;
+    int i, drained;
+
+    (void)arg;
+
+    if (!batch) {
+        perror("Error allocating access log batch");
+        return NULL;
+    }
+
+    for(;;) {
+        drained = 0;
+
+        for (i = 0; i < ringCount; ++i) {
+            ring = &rings[i];
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            tail = ring->tail;
+
+            for (; tail != head; ++tail) {
+                len += format_record(batch + len, &ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)], &lastSec, secStr);
+                ++drained;
+
+                if (len >= ACCESS_LOG_BATCH_SIZE) {
+                    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+                    flush_batch(batch, len);
+                    len = 0;
+                }
+            }
+
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+            // Report drops in the log itself so gaps are visible
+            dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            if (dropped != ring->reportedDrops) {
+                len += sprintf(batch + len, "# worker %d dropped %lu access log records\n",
+                    i, dropped - ring->reportedDrops);
+                ring->reportedDrops = dropped;
+            }
+        }
+
+        if (len) {
+            flush_batch(batch, len);
+            len = 0;
+        }
+
+        if (!drained) {
+            // Only exit on an empty pass so everything queued before stopping is written
+            if (__atomic_load_n(&writerStopping, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    free(batch);
+
+    return NULL;
+}
+
+/**
+ * Opens the log file and starts the background writer thread
+*/
+int access_log_start(const char *path) {
+    if (!rings) {
+        return -1;
+    }
+
+    logFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (logFd == -1) {
+        perror("Error opening access log");
+        return -1;
+    }
+
+    if (pthread_create(&writerThread, NULL, writer_run, NULL) != 0) {
+        perror("Error starting access log writer");
+        close(logFd);
+        logFd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Switches the writer to `path` (e.g. after rotation) without losing records
+ *
+ * The new file is dup2'd over the old descriptor, so the writer never sees a closed fd
+*/
+int access_log_reopen(const char *path) {
+    int fd;
+
+    if (logFd == -1) {
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        perror("Error reopening access log");
+        return -1;
+    }
+
+    dup2(fd, logFd);
+    close(fd);
+
+    return 0;
+}
+
+/**
+ * Drains every ring into the log and stops the writer thread
+*/
+void access_log_stop(void) {
+    if (logFd == -1) {
+        return;
+    }
+
+    __atomic_store_n(&writerStopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writerThread, NULL);
+
+    close(logFd);
+    logFd = -1;
+}
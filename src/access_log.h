@@ -0,0 +1,51 @@
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <sys/socket.h>
+
+#define ACCESS_LOG_PATH "./access.log"
+#define ACCESS_LOG_RING_SIZE 4096 // Records per worker, must be a power of 2
+#define ACCESS_LOG_PATH_MAX 192
+#define ACCESS_LOG_BATCH_SIZE 65536
+#define ACCESS_LOG_IDLE_SLEEP_MS 10
+
+/**
+ * Fixed-size access log record, copied into a ring by the request path and
+ * formatted into text by the background writer
+*/
+typedef struct AccessLogRecord {
+    unsigned long long timeNs; // CLOCK_REALTIME at start of request
+    unsigned long long durationNs;
+    unsigned long bytes;
+    unsigned short status;
+    unsigned short family;
+    unsigned short port;
+    unsigned char addr[16];
+    char method[8];
+    char path[ACCESS_LOG_PATH_MAX];
+} AccessLogRecord;
+
+/**
+ * Single-producer single-consumer ring owned by one worker
+ *
+ * The worker only advances `head` and the writer only advances `tail`, each
+ * on its own cache line, so neither side ever waits for the other
+*/
+typedef struct AccessLogRing {
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long cachedTail;
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long reportedDrops;
+    struct AccessLogRecord records[ACCESS_LOG_RING_SIZE] __attribute__((aligned(64)));
+} AccessLogRing;
+
+int access_log_init(int workers);
+struct AccessLogRing *access_log_ring(int worker);
+void access_log_set_client(struct AccessLogRecord *rec, const struct sockaddr *addr);
+int access_log_write(struct AccessLogRing *ring, const struct AccessLogRecord *rec);
+int access_log_start(const char *path);
+int access_log_reopen(const char *path);
+void access_log_stop(void);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "bundle.h"
+
+/**
+ * Maps a bundle and checks its index, so lookups can trust every offset in it
+ *
+ * The whole file is read ahead, so after a restart the first requests do not
+ * wait on the disk
+*/
+int bundle_open(struct Bundle *b, const char *path) {
+    struct stat st;
+    const struct BundleEntry *e;
+    uint32_t i;
+
+    memset(b, 0, sizeof(struct Bundle));
+    b->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (b->fd == -1) {
+        perror("Error opening bundle");
+        return -1;
+    }
+
+    if (fstat(b->fd, &st) == -1 || (size_t)st.st_size < sizeof(struct BundleHeader)) {
+        fprintf(stderr, "Bundle %s is too small\n", path);
+        close(b->fd);
+        return -1;
+    }
+
+    b->size = st.st_size;
+    b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, b->fd, 0);
+
+    if (b->map == MAP_FAILED) {
+        perror("Error mapping bundle");
+        close(b->fd);
+        memset(b, 0, sizeof(struct Bundle));
+        return -1;
+    }
+
+    b->header = (const struct BundleHeader *)b->map;
+    b->entries = (const struct BundleEntry *)(b->map + sizeof(struct BundleHeader));
+    b->strings = b->map + b->header->stringsOffset;
+
+    if (memcmp(b->header->magic, BUNDLE_MAGIC, sizeof(b->header->magic)) != 0
+        || b->header->version != BUNDLE_VERSION
+        || b->header->size != b->size
+        || sizeof(struct BundleHeader) + (uint64_t)b->header->entryCount * sizeof(struct BundleEntry) > b->header->stringsOffset
+        || b->header->stringsOffset + b->header->stringsLength > b->size
+        || (b->header->stringsLength && b->strings[b->header->stringsLength - 1] != '\0')) {
+        fprintf(stderr, "Bundle %s is corrupt or from another version\n", path);
+        bundle_close(b);
+        return -1;
+    }
+
+    for (i = 0; i < b->header->entryCount; ++i) {
+        e = &b->entries[i];
+
+        if (e->pathOffset + e->pathLength >= b->header->stringsLength
+            || e->mimeOffset >= b->header->stringsLength
+            || e->offset + e->length > b->size
+            || e->gzipOffset + e->gzipLength > b->size
+            || memchr(e->etag, '\0', sizeof(e->etag)) == NULL || e->etag[0] != '"') {
+            fprintf(stderr, "Bundle %s: entry %u is corrupt\n", path, i);
+            bundle_close(b);
+            return -1;
+        }
+    }
+
+#ifdef MADV_WILLNEED
+    madvise((void *)b->map, b->size, MADV_WILLNEED);
+#endif
+
+    return 0;
+}
+
+void bundle_close(struct Bundle *b) {
+    if (b->map) {
+        munmap((void *)b->map, b->size);
+        close(b->fd);
+    }
+
+    memset(b, 0, sizeof(struct Bundle));
+}
+
+const char *bundle_string(const struct Bundle *b, uint64_t offset) {
+    return b->strings + offset;
+}
+
+/**
+ * Binary search of the sorted index for `len` bytes of `path`, or NULL if it is not in the bundle
+*/
+const struct BundleEntry *bundle_find(const struct Bundle *b, const char *path, size_t len) {
+    const struct BundleEntry *e;
+    size_t lo = 0, hi, n;
+    int cmp;
+
+    if (!b->map) {
+        return NULL;
+    }
+
+    hi = b->header->entryCount;
+
+    while (lo < hi) {
+        e = &b->entries[lo + (hi - lo) / 2];
+        n = len < e->pathLength ? len : e->pathLength;
+        cmp = memcmp(path, b->strings + e->pathOffset, n);
+
+        if (cmp == 0) {
+            cmp = len < e->pathLength ? -1 : len > e->pathLength;
+        }
+
+        if (cmp == 0) {
+            return e;
+        }
+
+        if (cmp < 0) {
+            hi = lo + (hi - lo) / 2;
+        } else {
+            lo = lo + (hi - lo) / 2 + 1;
+        }
+    }
+
+    return NULL;
+}
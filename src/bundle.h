@@ -0,0 +1,57 @@
+#ifndef BUNDLE_H_
+#define BUNDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "BHTTPBN1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 4096 // Contents start on a page boundary
+#define BUNDLE_ETAG_SIZE 24
+#define BUNDLE_MIME_MAX 128
+
+/**
+ * Static asset bundle, written by tools/bundle_pack and mmap'd by the server
+ *
+ * Layout: header, entries sorted by path, a string table (paths and MIME types),
+ * then every file's contents (and gzip variant) starting on a page boundary.
+ * All offsets are from the start of the file
+*/
+typedef struct BundleHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entryCount;
+    uint64_t stringsOffset;
+    uint64_t stringsLength;
+    uint64_t size; // Of the whole file, to detect truncation
+} BundleHeader;
+
+typedef struct BundleEntry {
+    uint64_t pathOffset; // Relative to the document root, no leading `/`
+    uint32_t pathLength;
+    uint32_t mimeOffset;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t gzipOffset;
+    uint64_t gzipLength; // 0 = no gzip variant
+    char etag[BUNDLE_ETAG_SIZE]; // Quoted, null terminated
+} BundleEntry;
+
+/**
+ * A bundle opened by bundle_open. `fd` stays open so bodies can be sent with sendfile
+*/
+typedef struct Bundle {
+    int fd;
+    const char *map;
+    size_t size;
+    const struct BundleHeader *header;
+    const struct BundleEntry *entries;
+    const char *strings;
+} Bundle;
+
+int bundle_open(struct Bundle *b, const char *path);
+void bundle_close(struct Bundle *b);
+const struct BundleEntry *bundle_find(const struct Bundle *b, const char *path, size_t len);
+const char *bundle_string(const struct Bundle *b, uint64_t offset);
+
+#endif
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "socket.h"
+#include "access_log.h"
+#include "ratelimit.h"
+
+void config_defaults(struct ServerConfig *c) {
+    memset(c, 0, sizeof(struct ServerConfig));
+
+    c->backlog = CONFIG_DEFAULT_BACKLOG;
+    c->acceptBatch = CONFIG_DEFAULT_ACCEPT_BATCH;
+    c->requestTimeoutMs = CONFIG_DEFAULT_REQUEST_TIMEOUT_MS;
+    c->keepAliveTimeoutMs = CONFIG_DEFAULT_KEEP_ALIVE_TIMEOUT_MS;
+    c->maxConnections = CONFIG_DEFAULT_MAX_CONNECTIONS;
+    c->http2 = 1;
+    c->tcpNoDelay = 1;
+    c->unixSocketMode = UNIX_SOCKET_DEFAULT_MODE;
+    c->shutdownTimeoutMs = CONFIG_DEFAULT_SHUTDOWN_TIMEOUT_MS;
+    c->mmapMaxBytes = CONFIG_DEFAULT_MMAP_MAX_BYTES;
+    c->sharedCacheBytes = CONFIG_DEFAULT_SHARED_CACHE_BYTES;
+    c->proxyHealthIntervalMs = CONFIG_DEFAULT_PROXY_HEALTH_INTERVAL_MS;
+    c->uploadMaxBytes = CONFIG_DEFAULT_UPLOAD_MAX_BYTES;
+    strcpy(c->accessLogPath, ACCESS_LOG_PATH);
+    strcpy(c->tracePath, CONFIG_DEFAULT_TRACE_PATH);
+    strcpy(c->documentRoot, CONFIG_DEFAULT_DOCUMENT_ROOT);
+}
+
+int config_add_listener(struct ServerConfig *c, const char *address) {
+    if (c->listenerCount == MAX_LISTENERS) {
+        fprintf(stderr, "Too many listeners (max %d)\n", MAX_LISTENERS);
+        return -1;
+    }
+
+    if (strlen(address) >= CONFIG_ADDRESS_MAX) {
+        fprintf(stderr, "Listen address too long: %s\n", address);
+        return -1;
+    }
+
+    strcpy(c->listeners[c->listenerCount++].address, address);
+
+    return 0;
+}
+
+/**
+ * Parses `on`/`off` (or a number) into a flag
+*/
+static int parse_flag(const char *value) {
+    if (strcasecmp(value, "on") == 0 || strcasecmp(value, "yes") == 0) {
+        return 1;
+    }
+    if (strcasecmp(value, "off") == 0 || strcasecmp(value, "no") == 0) {
+        return 0;
+    }
+
+    return atoi(value) != 0;
+}
+
+/**
+ * Reads the `<per second> <burst>` of a rate limit, `rate` having been split off the line already
+*/
+static int parse_rate(const char *rate, int *perSecond, int *burst) {
+    char *next = strtok(NULL, " \t\r\n");
+
+    if (rate == NULL || next == NULL || atoi(rate) <= 0 || atoi(next) <= 0 || atoi(next) > RATELIMIT_MAX_BURST) {
+        return -1;
+    }
+
+    *perSecond = atoi(rate);
+    *burst = atoi(next);
+
+    return 0;
+}
+
+/**
+ * Reads `key value` lines from `path` over the current values of `c`
+*/
+int config_load(struct ServerConfig *c, const char *path) {
+    char line[CONFIG_LINE_MAX];
+    char *key, *value, *end;
+    int lineCount = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        ++lineCount;
+
+        // Strip comments and trailing whitespace
+        if ((end = strchr(line, '#')) != NULL) {
+            *end = '\0';
+        }
+
+        if ((key = strtok(line, " \t\r\n")) == NULL) {
+            continue;
+        }
+
+        if ((value = strtok(NULL, " \t\r\n")) == NULL) {
+            fprintf(stderr, "%s:%d: missing value for %s\n", path, lineCount, key);
+            fclose(fp);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (strcmp(key, "listen") == 0) {
+            if (config_add_listener(c, value) == -1) {
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+
+            if ((value = strtok(NULL, " \t\r\n")) != NULL) {
+                if (strcmp(value, "tls") != 0) {
+                    fprintf(stderr, "%s:%d: unknown listen option %s\n", path, lineCount, value);
+                    fclose(fp);
+                    errno = EINVAL;
+                    return -1;
+                }
+                c->listeners[c->listenerCount - 1].tls = 1;
+            }
+        } else if (strcmp(key, "workers") == 0) {
+            c->workers = atoi(value);
+        } else if (strcmp(key, "backlog") == 0) {
+            c->backlog = atoi(value);
+        } else if (strcmp(key, "accept_batch") == 0) {
+            c->acceptBatch = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(key, "acceptor_threads") == 0) {
+            c->acceptorThreads = atoi(value);
+        } else if (strcmp(key, "request_timeout_ms") == 0) {
+            c->requestTimeoutMs = atoi(value);
+        } else if (strcmp(key, "keep_alive_timeout_ms") == 0) {
+            c->keepAliveTimeoutMs = atoi(value);
+        } else if (strcmp(key, "max_connections") == 0) {
+            c->maxConnections = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(key, "http2") == 0) {
+            c->http2 = parse_flag(value);
+        } else if (strcmp(key, "autoindex") == 0) {
+            c->autoindex = parse_flag(value);
+        } else if (strcmp(key, "events") == 0) {
+            c->events = parse_flag(value);
+        } else if (strcmp(key, "tcp_nodelay") == 0) {
+            c->tcpNoDelay = parse_flag(value);
+        } else if (strcmp(key, "tcp_defer_accept") == 0) {
+            c->tcpDeferAccept = atoi(value);
+        } else if (strcmp(key, "tcp_fastopen") == 0) {
+            c->tcpFastOpen = atoi(value);
+        } else if (strcmp(key, "so_rcvbuf") == 0) {
+            c->rcvBuf = atoi(value);
+        } else if (strcmp(key, "so_sndbuf") == 0) {
+            c->sndBuf = atoi(value);
+        } else if (strcmp(key, "unix_socket_mode") == 0) {
+            c->unixSocketMode = strtol(value, NULL, 8);
+        } else if (strcmp(key, "access_log") == 0) {
+            if (strlen(value) >= sizeof(c->accessLogPath)) {
+                fprintf(stderr, "%s:%d: access_log path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->accessLogPath, value);
+        } else if (strcmp(key, "trace_sample") == 0) {
+            c->traceSample = atoi(value);
+        } else if (strcmp(key, "trace_path") == 0) {
+            if (strlen(value) >= sizeof(c->tracePath)) {
+                fprintf(stderr, "%s:%d: trace_path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->tracePath, value);
+        } else if (strcmp(key, "document_root") == 0) {
+            if (strlen(value) >= sizeof(c->documentRoot)) {
+                fprintf(stderr, "%s:%d: document_root path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->documentRoot, value);
+        } else if (strcmp(key, "bundle") == 0) {
+            if (strlen(value) >= sizeof(c->bundlePath)) {
+                fprintf(stderr, "%s:%d: bundle path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->bundlePath, value);
+        } else if (strcmp(key, "mmap_max_bytes") == 0) {
+            c->mmapMaxBytes = atol(value);
+        } else if (strcmp(key, "shared_cache_bytes") == 0) {
+            c->sharedCacheBytes = atol(value);
+        } else if (strcmp(key, "proxy_prefix") == 0) {
+            if (value[0] != '/' || strlen(value) >= sizeof(c->proxyPrefix)) {
+                fprintf(stderr, "%s:%d: proxy_prefix must be a path under %d bytes\n", path, lineCount, (int)sizeof(c->proxyPrefix));
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->proxyPrefix, value);
+        } else if (strcmp(key, "proxy_upstream") == 0) {
+            struct sockaddr_storage addr;
+            socklen_t addrLen;
+
+            if (c->proxyUpstreamCount == MAX_UPSTREAMS || strlen(value) >= CONFIG_ADDRESS_MAX
+                || resolve_address(value, &addr, &addrLen) == -1) {
+                fprintf(stderr, "%s:%d: invalid proxy_upstream %s (max %d)\n", path, lineCount, value, MAX_UPSTREAMS);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->proxyUpstreams[c->proxyUpstreamCount++], value);
+        } else if (strcmp(key, "proxy_health_interval_ms") == 0) {
+            c->proxyHealthIntervalMs = atoi(value) > 0 ? atoi(value) : 1;
+        } else if (strcmp(key, "rate_limit") == 0) {
+            if (parse_rate(value, &c->rateLimit, &c->rateBurst) == -1) {
+                fprintf(stderr, "%s:%d: rate_limit takes <per second> <burst> (burst max %d)\n", path, lineCount, RATELIMIT_MAX_BURST);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+        } else if (strcmp(key, "rate_limit_route") == 0) {
+            struct RateRoute *r = &c->rateRoutes[c->rateRouteCount];
+
+            if (c->rateRouteCount == MAX_RATE_ROUTES || value[0] != '/' || strlen(value) >= sizeof(r->prefix)
+                || parse_rate(strtok(NULL, " \t\r\n"), &r->rate, &r->burst) == -1) {
+                fprintf(stderr, "%s:%d: rate_limit_route takes <prefix> <per second> <burst> (max %d)\n", path, lineCount, MAX_RATE_ROUTES);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(r->prefix, value);
+            r->prefixLength = strlen(value);
+            c->rateRouteCount++;
+        } else if (strcmp(key, "upload_dir") == 0) {
+            if (strlen(value) >= sizeof(c->uploadDir)) {
+                fprintf(stderr, "%s:%d: upload_dir path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->uploadDir, value);
+        } else if (strcmp(key, "upload_max_bytes") == 0) {
+            c->uploadMaxBytes = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "tls_certificate") == 0) {
+            if (strlen(value) >= sizeof(c->tlsCertificate)) {
+                fprintf(stderr, "%s:%d: tls_certificate path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->tlsCertificate, value);
+        } else if (strcmp(key, "tls_certificate_key") == 0) {
+            if (strlen(value) >= sizeof(c->tlsCertificateKey)) {
+                fprintf(stderr, "%s:%d: tls_certificate_key path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->tlsCertificateKey, value);
+        } else if (strcmp(key, "upgrade_socket") == 0) {
+            if (strlen(value) >= sizeof(c->upgradeSocket)) {
+                fprintf(stderr, "%s:%d: upgrade_socket path too long\n", path, lineCount);
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+            strcpy(c->upgradeSocket, value);
+        } else if (strcmp(key, "shutdown_timeout_ms") == 0) {
+            c->shutdownTimeoutMs = atoi(value);
+        } else {
+            fprintf(stderr, "%s:%d: unknown setting %s\n", path, lineCount, key);
+            fclose(fp);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/**
+ * Builds the config from defaults, the config file and command line flags
+ *
+ * Usage: server [-c config_file] [-l listen_address]... [-u unix_socket_path]...
+ *               [-m unix_socket_mode] [-t takeover_socket]
+ *
+ * Settings come from the config file (CONFIG_DEFAULT_PATH if present), then
+ * the flags: -l adds a listener (see ListenerConfig) and -m sets the Unix
+ * socket permissions (octal). Without any listener, CONFIG_DEFAULT_LISTEN is
+ * used. -u adds a Unix socket listener (`@name` for the abstract namespace)
+ * on top of those. -t takes the listening sockets over from a running server
+ * (its upgrade_socket path, or `fd:N` for an inherited socket)
+ *
+ * Called again on reload, so it must not have side effects beyond `c`
+*/
+int config_from_args(struct ServerConfig *c, int argc, char *argv[]) {
+    const char *configPath = NULL;
+    const char *optstring = "c:l:u:m:t:";
+    char address[CONFIG_ADDRESS_MAX];
+    int opt;
+
+    config_defaults(c);
+
+    // Config file first so flags can add to it
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        if (opt == 'c') {
+            configPath = optarg;
+        } else if (opt == '?') {
+            fprintf(stderr, "Usage: %s [-c config_file] [-l listen_address]... [-u unix_socket_path]... "
+                "[-m unix_socket_mode] [-t takeover_socket]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    // A missing default config file is fine, anything else is an error
+    if (config_load(c, configPath ? configPath : CONFIG_DEFAULT_PATH) == -1 && (configPath || errno != ENOENT)) {
+        fprintf(stderr, "Error loading config %s\n", configPath ? configPath : CONFIG_DEFAULT_PATH);
+        return -1;
+    }
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        switch (opt) {
+            case 'l':
+                if (config_add_listener(c, optarg) == -1) {
+                    return -1;
+                }
+                break;
+            case 'm':
+                c->unixSocketMode = strtol(optarg, NULL, 8);
+                break;
+            case 't':
+                if (strlen(optarg) >= sizeof(c->takeover)) {
+                    fprintf(stderr, "Takeover socket path too long\n");
+                    return -1;
+                }
+                strcpy(c->takeover, optarg);
+                break;
+        }
+    }
+
+    if (c->listenerCount == 0) {
+        config_add_listener(c, CONFIG_DEFAULT_LISTEN);
+    }
+
+    // Unix sockets from -u are always in addition to the TCP listeners
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        if (opt == 'u') {
+            snprintf(address, sizeof(address), "unix:%s", optarg);
+            if (config_add_listener(c, address) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <sys/types.h>
+
+#define MAX_LISTENERS 8
+#define MAX_UPSTREAMS 8
+#define MAX_RATE_ROUTES 8
+#define UNIX_SOCKET_DEFAULT_MODE 0660
+#define CONFIG_DEFAULT_PATH "./server.conf"
+#define CONFIG_DEFAULT_LISTEN "0.0.0.0:3000"
+#define CONFIG_DEFAULT_DOCUMENT_ROOT "."
+#define CONFIG_DEFAULT_BACKLOG 511
+#define CONFIG_DEFAULT_ACCEPT_BATCH 16
+#define CONFIG_DEFAULT_REQUEST_TIMEOUT_MS 10000
+#define CONFIG_DEFAULT_KEEP_ALIVE_TIMEOUT_MS 75000
+#define CONFIG_DEFAULT_MAX_CONNECTIONS 16384
+#define CONFIG_DEFAULT_SHUTDOWN_TIMEOUT_MS 30000
+#define CONFIG_DEFAULT_TRACE_PATH "./trace"
+#define CONFIG_DEFAULT_MMAP_MAX_BYTES 262144
+#define CONFIG_DEFAULT_SHARED_CACHE_BYTES (64L << 20)
+#define CONFIG_DEFAULT_PROXY_HEALTH_INTERVAL_MS 2000
+#define CONFIG_DEFAULT_UPLOAD_MAX_BYTES (1ULL << 30)
+#define CONFIG_ADDRESS_MAX 108
+#define CONFIG_LINE_MAX 512
+
+/**
+ * A `listen` directive: `port`, `host:port`, `[v6host]:port` or `unix:path`,
+ * then `tls` for a listener that terminates TLS
+*/
+typedef struct ListenerConfig {
+    char address[CONFIG_ADDRESS_MAX];
+    int tls;
+} ListenerConfig;
+
+/**
+ * A `rate_limit_route` directive: requests under `prefix` get a bucket per client of their own
+*/
+typedef struct RateRoute {
+    char prefix[CONFIG_ADDRESS_MAX];
+    size_t prefixLength;
+    int rate; // Requests per second
+    int burst;
+} RateRoute;
+
+/**
+ * Runtime configuration, read from a file of `key value` lines (`#` starts a comment)
+*/
+typedef struct ServerConfig {
+    struct ListenerConfig listeners[MAX_LISTENERS];
+    int listenerCount;
+    int workers; // 0 = one per CPU
+    int backlog;
+    int acceptBatch; // Max connections accepted per listener wakeup
+    int acceptorThreads; // Threads in the master accepting for the workers, read at startup only. 0 = workers accept
+    int requestTimeoutMs; // For a whole request head (and body) to arrive
+    int keepAliveTimeoutMs; // How long an idle connection is kept open between requests
+    int maxConnections; // Per worker, the longest idle connection is closed to make room past it
+    int http2; // Cleartext HTTP/2, by prior knowledge or Upgrade: h2c
+    int events; // Server-Sent Events: GET /events subscribes, POST /events publishes to every subscriber
+    int tcpNoDelay;
+    int tcpDeferAccept; // Seconds, 0 = off
+    int tcpFastOpen; // Pending TFO queue length, 0 = off
+    int rcvBuf; // Bytes, 0 = kernel default
+    int sndBuf;
+    mode_t unixSocketMode;
+    char accessLogPath[CONFIG_ADDRESS_MAX];
+    int traceSample; // Every Nth request is traced, 0 = off
+    char tracePath[CONFIG_ADDRESS_MAX]; // SIGUSR1 writes each worker's traces to <path>.<worker>.json
+    char documentRoot[CONFIG_ADDRESS_MAX]; // Request paths are resolved beneath this directory
+    char bundlePath[CONFIG_ADDRESS_MAX]; // Static asset bundle served before the document root, empty = off
+    int autoindex; // Directories under the document root are answered with a listing of their entries
+    long mmapMaxBytes; // Files up to this size are served from cached mappings, larger ones with sendfile. 0 = off
+    long sharedCacheBytes; // Of those, this much is cached once for every worker rather than per worker, read at startup only. 0 = off
+    char proxyPrefix[CONFIG_ADDRESS_MAX]; // Requests under this path go to the upstreams, empty = off
+    char proxyUpstreams[MAX_UPSTREAMS][CONFIG_ADDRESS_MAX]; // Addresses as for listeners
+    int proxyUpstreamCount;
+    int proxyHealthIntervalMs; // How often a worker retries an upstream it could not connect to
+    int rateLimit; // Requests per second per client address, 0 = off
+    int rateBurst; // Requests a client can make at once after being quiet
+    struct RateRoute rateRoutes[MAX_RATE_ROUTES]; // Checked in order, the first matching prefix applies
+    int rateRouteCount;
+    char uploadDir[CONFIG_ADDRESS_MAX]; // Where POST /upload stores files, empty = off
+    unsigned long long uploadMaxBytes; // Largest multipart body taken, streamed so it is not held in memory
+    char tlsCertificate[CONFIG_ADDRESS_MAX]; // PEM chain for the TLS listeners, leaf first
+    char tlsCertificateKey[CONFIG_ADDRESS_MAX];
+    char upgradeSocket[CONFIG_ADDRESS_MAX]; // Where a new binary can take the listeners over, empty = off
+    int shutdownTimeoutMs; // How long retiring workers may drain before being killed
+    char takeover[CONFIG_ADDRESS_MAX]; // -t: take listeners over from this socket at startup
+} ServerConfig;
+
+void config_defaults(struct ServerConfig *c);
+int config_add_listener(struct ServerConfig *c, const char *address);
+int config_load(struct ServerConfig *c, const char *path);
+int config_from_args(struct ServerConfig *c, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "connection.h"
+
+struct ConnectionTable *connection_table_create(void) {
+    return calloc(1, sizeof(struct ConnectionTable));
+}
+
+/**
+ * Allocates a slab of CONNECTION_SLAB_SIZE connections onto the free list
+ *
+ * Like buffers, connections are never returned to malloc: the table grows to
+ * the worker's peak and is reused from there
+*/
+static int grow(struct ConnectionTable *t) {
+    struct Connection *slab = calloc(CONNECTION_SLAB_SIZE, sizeof(struct Connection));
+    int i;
+
+    if (!slab) {
+        return -1;
+    }
+
+    for (i = CONNECTION_SLAB_SIZE - 1; i >= 0; --i) {
+        slab[i].timerNext = t->free;
+        t->free = &slab[i];
+    }
+
+    t->allocated += CONNECTION_SLAB_SIZE;
+
+    return 0;
+}
+
+/**
+ * Takes a connection for `fd`, not on any timer list yet. NULL if memory is exhausted
+*/
+struct Connection *connection_get(struct ConnectionTable *t, int fd) {
+    struct Connection *c;
+
+    if (!t->free && grow(t) == -1) {
+        return NULL;
+    }
+
+    c = t->free;
+    t->free = c->timerNext;
+    memset(c, 0, sizeof(struct Connection));
+    c->fd = fd;
+    c->state = CONNECTION_STATE_COUNT;
+    ++t->active;
+
+    return c;
+}
+
+static void unlink_timer(struct ConnectionTable *t, struct Connection *c) {
+    if (c->state == CONNECTION_STATE_COUNT) {
+        return;
+    }
+
+    if (c->timerPrev) {
+        c->timerPrev->timerNext = c->timerNext;
+    } else {
+        t->timers[c->state] = c->timerNext;
+    }
+
+    if (c->timerNext) {
+        c->timerNext->timerPrev = c->timerPrev;
+    } else {
+        t->timersTail[c->state] = c->timerPrev;
+    }
+
+    c->timerPrev = c->timerNext = NULL;
+    c->state = CONNECTION_STATE_COUNT;
+}
+
+/**
+ * Gives back a connection. The caller has closed the socket and released its
+ * buffer and response
+ *
+ * It is only reused after connection_recycle: an event for it may still be
+ * waiting in the batch epoll_wait returned, and has to find it closed (`fd`
+ * -1) rather than taken by another connection
+*/
+void connection_put(struct ConnectionTable *t, struct Connection *c) {
+    unlink_timer(t, c);
+    c->fd = -1;
+    c->timerNext = t->closed;
+    t->closed = c;
+    --t->active;
+}
+
+/**
+ * Moves the connections put back since the last call onto the free list, once
+ * no event from before they were closed can still be handled
+*/
+void connection_recycle(struct ConnectionTable *t) {
+    struct Connection *c;
+
+    while ((c = t->closed)) {
+        t->closed = c->timerNext;
+        c->timerNext = t->free;
+        t->free = c;
+    }
+}
+
+/**
+ * Moves `c` to `state`, expiring at `deadline`
+ *
+ * Deadlines must be now plus the fixed timeout of `state`, which is what keeps
+ * each list sorted. Re-arming in the same state moves the connection to the back
+*/
+void connection_arm(struct ConnectionTable *t, struct Connection *c, enum ConnectionState state, unsigned int deadline) {
+    unlink_timer(t, c);
+
+    c->state = state;
+    c->deadline = deadline;
+    c->timerPrev = t->timersTail[state];
+    c->timerNext = NULL;
+
+    if (t->timersTail[state]) {
+        t->timersTail[state]->timerNext = c;
+    } else {
+        t->timers[state] = c;
+    }
+
+    t->timersTail[state] = c;
+}
+
+/**
+ * Returns the oldest connection in `state` if its deadline has passed, else NULL
+ *
+ * The worker's clock is milliseconds in 32 bits, so it wraps every 49 days:
+ * deadlines are compared by signed difference, which is right as long as no
+ * timeout is longer than 24 days
+*/
+struct Connection *connection_expired(const struct ConnectionTable *t, enum ConnectionState state, unsigned int now) {
+    struct Connection *c = t->timers[state];
+
+    return c && (int)(c->deadline - now) <= 0 ? c : NULL;
+}
+
+/**
+ * Milliseconds until the next deadline in any state, or -1 if there is none (as epoll_wait takes it)
+*/
+int connection_next_timeout(const struct ConnectionTable *t, unsigned int now) {
+    int i, timeout = -1, left;
+
+    for (i = 0; i < CONNECTION_STATE_COUNT; ++i) {
+        if (!t->timers[i]) {
+            continue;
+        }
+
+        left = (int)(t->timers[i]->deadline - now);
+        left = left > 0 ? left : 0;
+
+        if (timeout == -1 || left < timeout) {
+            timeout = left;
+        }
+    }
+
+    return timeout;
+}
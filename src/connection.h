@@ -0,0 +1,138 @@
+#ifndef CONNECTION_H_
+#define CONNECTION_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "pool.h"
+#include "mapcache.h"
+#include "access_log.h"
+
+#define CONNECTION_SLAB_SIZE 1024 // Connections carved from each allocation
+
+struct H2Session;
+struct ProxyLink;
+struct Upload;
+struct WebSocket;
+struct SseSubscriber;
+struct ResponseStream;
+
+/**
+ * What a connection is waiting for. Each state has its own timeout, so each
+ * has its own timer list
+*/
+typedef enum ConnectionState {
+    CONNECTION_IDLE, // Between requests, holding nothing but the socket
+    CONNECTION_READING, // Waiting for the rest of a request, or the first one on a new connection
+    CONNECTION_WRITING, // Waiting for the client to take more of a response
+    CONNECTION_STATE_COUNT
+} ConnectionState;
+
+/**
+ * What is spoken on a connection. HTTP/2 connections start out as HTTP/1 ones
+ * and switch on the client preface or an Upgrade: h2c, WebSocket ones on an
+ * Upgrade: websocket a route takes, and event streams once the head of their
+ * response is sent. Upstream connections are the proxy's own,
+ * to the servers it forwards to. Connections to a TLS listener only start on
+ * HTTP/1 once their handshake is done
+*/
+typedef enum ConnectionProtocol {
+    CONNECTION_HTTP1,
+    CONNECTION_H2,
+    CONNECTION_UPSTREAM,
+    CONNECTION_TLS_HANDSHAKE,
+    CONNECTION_WEBSOCKET,
+    CONNECTION_EVENTS
+} ConnectionProtocol;
+
+/**
+ * A response being sent: the serialized head (and in-memory body) in `data`,
+ * then `bodyLength` bytes of a mapping, then a range of a file
+ *
+ * Recycled through a per-worker free list, so only connections with a
+ * response in flight hold one
+*/
+typedef struct Response {
+    struct Response *next;
+    struct PoolBuffer *buf; // Holds `data` unless it outgrew a large buffer
+    char *data;
+    size_t length;
+    const char *body;
+    size_t bodyLength;
+    size_t sent; // Of `data` and `body`
+    struct MapEntry *mapping;
+    int fileFd; // -1 without a file body
+    int fileShared; // Not ours to close
+    int copiesBody; // Sent by copying it in process (HTTP/2, TLS without kTLS), so never from a file mapping
+    off_t fileOffset;
+    off_t fileEnd;
+    int status;
+    int keepAlive;
+    unsigned long long sendStart;
+    unsigned long long requestStart;
+    unsigned long long bytes; // Sent so far, including the file
+    unsigned int traceId; // Nonzero if the request is sampled, see trace.h
+    struct ProxyLink *proxy; // Forwarding the request upstream, see proxy.h. `data` is then the response head
+    struct Upload *upload; // Receiving the request's multipart body, nothing to send until it is in
+    struct WebSocket *websocket; // A 101 the connection switches to WebSocket after
+    struct ResponseStream *stream; // The body, written as it is sent instead of `body`, see stream.h
+    struct SseSubscriber *events; // A 200 the connection streams published events after, see sse.h
+    struct AccessLogRecord rec;
+} Response;
+
+/**
+ * An open client connection
+ *
+ * Kept to 64 bytes (one cache line): the read buffer and response are only
+ * attached while a request is in flight, so an idle keep-alive connection
+ * costs the worker nothing else. The target is under 256 bytes of worker
+ * memory per idle connection, allocator overhead included, next to the 4-5 KiB
+ * the kernel keeps for a TCP socket and its epoll registration: 100k idle
+ * connections should cost the workers under 25 MiB. bench/idle_bench measures both
+*/
+typedef struct Connection {
+    int fd;
+    unsigned short port; // Client address, kept for the access log
+    unsigned char family;
+    unsigned char state : 4;
+    unsigned char protocol : 4; // ConnectionProtocol
+    unsigned int deadline; // Milliseconds on the worker's clock, see connection_expired
+    unsigned int scanned; // Bytes of `in` already searched for the end of the head
+    struct Connection *timerPrev;
+    struct Connection *timerNext; // Next to expire in the same state, or next free connection
+    union {
+        struct PoolBuffer *in; // NULL while idle
+        struct H2Session *h2; // Holds its own input, see h2.h
+        struct WebSocket *ws; // Likewise, see websocket.h
+        struct SseSubscriber *sse; // Streaming published events, reads nothing
+        struct ProxyLink *upstream; // An upstream connection's exchange
+    };
+    struct Response *out; // NULL unless a response is being sent
+    unsigned char addr[16];
+} Connection;
+
+/**
+ * Per-worker slab of connections and their timer lists
+ *
+ * Every connection in a state has the same timeout, so appending to the list
+ * for its state keeps each list in deadline order: the head is always the
+ * next to expire and arming a timer is O(1)
+*/
+typedef struct ConnectionTable {
+    struct Connection *free;
+    struct Connection *closed; // Put back since the last connection_recycle, not reused until then
+    struct Connection *timers[CONNECTION_STATE_COUNT];
+    struct Connection *timersTail[CONNECTION_STATE_COUNT];
+    size_t active;
+    size_t allocated;
+} ConnectionTable;
+
+struct ConnectionTable *connection_table_create(void);
+struct Connection *connection_get(struct ConnectionTable *t, int fd);
+void connection_put(struct ConnectionTable *t, struct Connection *c);
+void connection_recycle(struct ConnectionTable *t);
+void connection_arm(struct ConnectionTable *t, struct Connection *c, enum ConnectionState state, unsigned int deadline);
+struct Connection *connection_expired(const struct ConnectionTable *t, enum ConnectionState state, unsigned int now);
+int connection_next_timeout(const struct ConnectionTable *t, unsigned int now);
+
+#endif
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+
+#include "files.h"
+
+/**
+ * Opens the document root, which every file is then opened relative to
+*/
+int files_open_root(const char *path) {
+    int rootfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (rootfd == -1) {
+        perror("Error opening document root");
+    }
+
+    return rootfd;
+}
+
+/**
+ * Opens the directory uploads are stored in, which has to be writable
+*/
+int files_open_upload_dir(const char *path) {
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirfd != -1 && faccessat(dirfd, ".", W_OK | X_OK, 0) == -1) {
+        close(dirfd);
+        dirfd = -1;
+    }
+
+    if (dirfd == -1) {
+        perror("Error opening upload directory");
+    }
+
+    return dirfd;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/**
+ * Normalizes the path of a request target into `dst` in a single pass
+ *
+ * Percent-decodes, collapses `//` and removes `.` and `..` segments, stopping at
+ * the query string. The result always starts with `/`, so equal files get equal
+ * paths and it can be used as a cache key.
+ * Returns the length, or -1 for a malformed escape, an encoded NUL, a `..` above
+ * the root or a path longer than `cap`
+*/
+ssize_t normalize_path(char *dst, size_t cap, const char *src, size_t len) {
+    const char *end = src + len;
+    size_t out = 0, segment = 1; // Offset in `dst` where the current segment starts
+    int c, last = 0;
+
+    if (!len || *src != '/' || cap < 2) {
+        return -1;
+    }
+
+    dst[out++] = '/';
+    ++src;
+
+    while (!last) {
+        if (src == end || *src == '?' || *src == '#') {
+            last = 1;
+            c = '/';
+        } else if (*src == '%') {
+            if (end - src < 3 || hex_value(src[1]) == -1 || hex_value(src[2]) == -1) {
+                return -1;
+            }
+
+            c = hex_value(src[1]) << 4 | hex_value(src[2]);
+            src += 3;
+
+            if (c == 0) {
+                return -1;
+            }
+        } else {
+            c = *src++;
+        }
+
+        // Room for this byte and the terminator
+        if (out + 1 >= cap) {
+            return -1;
+        }
+
+        if (c != '/') {
+            dst[out++] = c;
+            continue;
+        }
+
+        // End of a segment: drop `.`, back up over `..` and ignore empty ones
+        if (out - segment == 1 && dst[segment] == '.') {
+            out = segment;
+        } else if (out - segment == 2 && dst[segment] == '.' && dst[segment + 1] == '.') {
+            if (segment == 1) {
+                return -1;
+            }
+
+            // Back to just after the previous `/`
+            for (out = segment - 1; dst[out - 1] != '/'; --out);
+        } else if (out != segment && !last) {
+            dst[out++] = '/';
+        }
+
+        segment = out;
+    }
+
+    dst[out] = '\0';
+
+    return out;
+}
+
+/**
+ * Whether the path of the request target `src` has a `.` or `..` segment,
+ * percent-encoded or not: one normalize_path resolves, but that a server the
+ * target is passed on to as it is would resolve by itself
+*/
+int has_dot_segment(const char *src, size_t len) {
+    const char *end = src + len;
+    size_t length = 0, dots = 0; // Of the current segment
+    int c, last;
+
+    for (;;) {
+        last = src == end || *src == '?' || *src == '#';
+
+        if (last) {
+            c = '/';
+        } else if (*src == '%' && end - src >= 3 && hex_value(src[1]) != -1 && hex_value(src[2]) != -1) {
+            c = hex_value(src[1]) << 4 | hex_value(src[2]);
+            src += 3;
+        } else {
+            c = *src++;
+        }
+
+        if (c != '/') {
+            ++length;
+            dots += c == '.';
+            continue;
+        }
+
+        if ((length == 1 || length == 2) && dots == length) {
+            return 1;
+        }
+
+        if (last) {
+            return 0;
+        }
+
+        length = dots = 0;
+    }
+}
+
+/**
+ * Opens `path` for reading, relative to `rootfd`
+ *
+ * `path` is a normalized path (see normalize_path) without its leading `/`.
+ * With openat2 the kernel resolves the path with RESOLVE_BENEATH, so neither `..`
+ * nor a symlink can leave the document root. Older kernels fall back to openat,
+ * where normalize_path already rules out `..` but symlinks are followed
+*/
+int files_open(int rootfd, const char *path) {
+    const char *relative = path[0] ? path : ".";
+
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+    struct open_how how;
+    int fd;
+
+    memset(&how, 0, sizeof how);
+    how.flags = O_RDONLY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    fd = syscall(SYS_openat2, rootfd, relative, &how, sizeof how);
+
+    if (fd != -1 || errno != ENOSYS) {
+        return fd;
+    }
+#endif
+
+    return openat(rootfd, relative, O_RDONLY | O_CLOEXEC);
+}
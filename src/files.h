@@ -0,0 +1,14 @@
+#ifndef FILES_H_
+#define FILES_H_
+
+#include <sys/types.h>
+
+#define FILES_PATH_MAX 1024
+
+int files_open_root(const char *path);
+int files_open_upload_dir(const char *path);
+ssize_t normalize_path(char *dst, size_t cap, const char *src, size_t len);
+int has_dot_segment(const char *src, size_t len);
+int files_open(int rootfd, const char *path);
+
+#endif
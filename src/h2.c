@@ -0,0 +1,1115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "h2.h"
+#include "connection.h"
+#include "date_utils.h"
+
+#define H2_HEADER_BLOCK_STACK 1024 // Response header blocks encoded on the stack up to this size
+
+/**
+ * Request headers the decoder is filling in, see on_header
+*/
+typedef struct HeaderState {
+    struct HttpRequest *req; // NULL while decoding a block only to keep the table in step
+    int hasMethod;
+    int hasPath;
+    int regular; // Seen a regular header: no more pseudo-headers allowed
+    size_t listSize; // As SETTINGS_MAX_HEADER_LIST_SIZE counts it, name, value and 32 for each header
+    int status; // Answer the request with this instead, 0 if fine
+} HeaderState;
+
+/**
+ * Response headers that describe the HTTP/1 connection and must not be sent
+ * on an HTTP/2 one (RFC 7540 8.1.2.2)
+*/
+static const char *connectionHeaders[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"
+};
+
+static unsigned int read_u24(const unsigned char *p) {
+    return (unsigned int)p[0] << 16 | (unsigned int)p[1] << 8 | p[2];
+}
+
+static unsigned int read_u31(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3]) & 0x7fffffff;
+}
+
+static void write_u32(unsigned char *p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void write_frame_header(unsigned char *p, size_t length, int type, int flags, unsigned int streamId) {
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    write_u32(p + 5, streamId & 0x7fffffff);
+}
+
+/**
+ * Makes room for `n` more bytes of output, returning where they go
+*/
+static unsigned char *reserve(struct H2Session *s, size_t n) {
+    size_t cap = s->outCap ? s->outCap : H2_OUTPUT_TARGET;
+    char *out;
+
+    if (s->outLength + n <= s->outCap) {
+        return (unsigned char *)s->out + s->outLength;
+    }
+
+    // Drop what the socket has taken before growing
+    if (s->outSent) {
+        memmove(s->out, s->out + s->outSent, s->outLength - s->outSent);
+        s->outLength -= s->outSent;
+        s->outSent = 0;
+
+        if (s->outLength + n <= s->outCap) {
+            return (unsigned char *)s->out + s->outLength;
+        }
+    }
+
+    while (cap < s->outLength + n) {
+        cap *= 2;
+    }
+
+    if (!(out = realloc(s->out, cap))) {
+        return NULL;
+    }
+
+    s->out = out;
+    s->outCap = cap;
+
+    return (unsigned char *)s->out + s->outLength;
+}
+
+/**
+ * Queues a frame with its whole payload
+*/
+static int queue_frame(struct H2Session *s, int type, int flags, unsigned int streamId, const void *payload, size_t length) {
+    unsigned char *p = reserve(s, H2_FRAME_HEADER_LENGTH + length);
+
+    if (!p) {
+        return -1;
+    }
+
+    write_frame_header(p, length, type, flags, streamId);
+
+    if (length) {
+        memcpy(p + H2_FRAME_HEADER_LENGTH, payload, length);
+    }
+
+    s->outLength += H2_FRAME_HEADER_LENGTH + length;
+
+    return 0;
+}
+
+static int queue_u32_frame(struct H2Session *s, int type, unsigned int streamId, unsigned int value) {
+    unsigned char payload[4];
+
+    write_u32(payload, value);
+
+    return queue_frame(s, type, 0, streamId, payload, sizeof(payload));
+}
+
+/**
+ * Queues a GOAWAY and stops taking new streams
+*/
+void h2_goaway(struct H2Session *s, enum H2Error code) {
+    unsigned char payload[8];
+
+    if (s->goaway) {
+        return;
+    }
+
+    write_u32(payload, s->lastStreamId);
+    write_u32(payload + 4, code);
+    queue_frame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    s->goaway = 1;
+}
+
+static struct H2Stream *find_stream(struct H2Session *s, unsigned int id) {
+    int i;
+
+    if (!s->streamCount) {
+        return NULL;
+    }
+
+    for (i = 0; i < H2_MAX_STREAMS; ++i) {
+        if (s->streams[i].state != H2_STREAM_IDLE && s->streams[i].id == id) {
+            return &s->streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct H2Stream *open_stream(struct H2Session *s, unsigned int id) {
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; ++i) {
+        if (s->streams[i].state == H2_STREAM_IDLE) {
+            memset(&s->streams[i], 0, sizeof(s->streams[i]));
+            s->streams[i].id = id;
+            s->streams[i].state = H2_STREAM_OPEN;
+            s->streams[i].sendWindow = s->peerInitialWindow;
+            ++s->streamCount;
+            return &s->streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Releases a stream, handing back any response it was still sending
+*/
+static void close_stream(struct H2Session *s, struct H2Stream *st) {
+    if (st->response) {
+        s->onDone(s, st->response);
+    }
+
+    free_request(st->req);
+    memset(st, 0, sizeof(*st));
+    --s->streamCount;
+}
+
+/**
+ * Closes a stream with RST_STREAM, dropping whatever it was still sending or receiving
+*/
+int h2_reset(struct H2Session *s, unsigned int id, enum H2Error code) {
+    struct H2Stream *st = find_stream(s, id);
+
+    if (st) {
+        close_stream(s, st);
+    }
+
+    return queue_u32_frame(s, H2_RST_STREAM, id, code);
+}
+
+/**
+ * A response has been framed to its end: the stream is done unless the
+ * client is still sending, in which case it is told to stop (RFC 7540 8.1)
+*/
+static int finish_stream(struct H2Session *s, struct H2Stream *st) {
+    unsigned int id = st->id;
+    int remoteClosed = st->remoteClosed;
+
+    close_stream(s, st);
+
+    return remoteClosed ? 0 : queue_u32_frame(s, H2_RST_STREAM, id, H2_NO_ERROR);
+}
+
+static int add_request_header(struct HttpRequest *req, const char *name, size_t nameLength, const char *value, size_t valueLength) {
+    struct HttpRequestHeader *header = calloc(1, sizeof(HttpRequestHeader));
+
+    if (!header) {
+        return -1;
+    }
+
+    // Link header in straight away so it is freed with the request on error
+    header->next = req->headers;
+    req->headers = header;
+
+    if (!(header->name = malloc(nameLength + 1)) || !(header->value = malloc(valueLength + 1))) {
+        return -1;
+    }
+
+    memcpy(header->name, name, nameLength);
+    header->name[nameLength] = '\0';
+    memcpy(header->value, value, valueLength);
+    header->value[valueLength] = '\0';
+
+    return 0;
+}
+
+static int name_is(const char *name, size_t nameLength, const char *s) {
+    return nameLength == strlen(s) && memcmp(name, s, nameLength) == 0;
+}
+
+/**
+ * Fills in the request from one decoded header. Malformed requests are
+ * answered with 400 rather than reset, as parse_request would
+ *
+ * A few bytes of block can stand for a large header by indexing the table,
+ * so what is kept is limited by the decoded size: past the
+ * SETTINGS_MAX_HEADER_LIST_SIZE advertised the request is answered with 431,
+ * the rest of the block only decoded to keep the table in step
+*/
+static int on_header(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength) {
+    struct HeaderState *h = arg;
+    struct HttpRequest *req = h->req;
+    int method;
+    size_t i;
+
+    if (!req || h->status) {
+        return 0;
+    }
+
+    h->listSize += nameLength + valueLength + HPACK_ENTRY_OVERHEAD;
+
+    if (h->listSize > HTTP_MAX_HEAD_SIZE) {
+        h->status = HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
+        return 0;
+    }
+
+    if (nameLength && name[0] == ':') {
+        if (h->regular) {
+            h->status = HTTP_STATUS_BAD_REQUEST;
+        } else if (name_is(name, nameLength, ":method")) {
+            if ((method = parse_method(value, valueLength)) == -1) {
+                h->status = HTTP_STATUS_NOT_IMPLEMENTED;
+            } else {
+                req->method = method;
+                h->hasMethod = 1;
+            }
+        } else if (name_is(name, nameLength, ":path")) {
+            if (h->hasPath || !valueLength) {
+                h->status = HTTP_STATUS_BAD_REQUEST;
+            } else if (set_request_target(req, value, valueLength) == -1) {
+                h->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            } else {
+                h->hasPath = 1;
+            }
+        } else if (name_is(name, nameLength, ":authority")) {
+            // Handlers look for the HTTP/1 Host header
+            if (add_request_header(req, "host", 4, value, valueLength) == -1) {
+                h->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            }
+        } else if (!name_is(name, nameLength, ":scheme")) {
+            h->status = HTTP_STATUS_BAD_REQUEST;
+        }
+
+        return 0;
+    }
+
+    h->regular = 1;
+
+    // Names must arrive lowercase, and connection-specific headers not at all
+    for (i = 0; i < nameLength; ++i) {
+        if (name[i] >= 'A' && name[i] <= 'Z') {
+            h->status = HTTP_STATUS_BAD_REQUEST;
+            return 0;
+        }
+    }
+
+    if (name_is(name, nameLength, "connection")) {
+        h->status = HTTP_STATUS_BAD_REQUEST;
+    } else if (add_request_header(req, name, nameLength, value, valueLength) == -1) {
+        h->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    return 0;
+}
+
+/**
+ * Hands a complete request to the worker. The stream waits for h2_respond
+*/
+static void dispatch(struct H2Session *s, struct H2Stream *st) {
+    struct HttpRequest *req = st->req;
+
+    st->req = NULL;
+    st->state = H2_STREAM_RESPONDING;
+
+    if (req->body) {
+        req->body[req->contentLength] = '\0';
+    }
+
+    s->onRequest(s, st->id, req, 0);
+}
+
+/**
+ * Decodes a complete header block: a new request, or trailers (which are
+ * dropped) on one already open
+*/
+static int end_headers(struct H2Session *s, unsigned int id, const unsigned char *block, size_t length, int endStream) {
+    struct HeaderState h;
+    struct H2Stream *st = find_stream(s, id);
+
+    memset(&h, 0, sizeof(h));
+
+    if (st) {
+        // Trailers, which must end the stream
+        if (st->remoteClosed || !endStream) {
+            h2_goaway(s, H2_PROTOCOL_ERROR);
+            return -1;
+        }
+    } else if (id > s->lastStreamId && (id & 1)) {
+        s->lastStreamId = id;
+
+        // Past the limit, or after GOAWAY, the block is still decoded for the table
+        if (!s->goaway && (st = open_stream(s, id))) {
+            if (!(st->req = calloc(1, sizeof(HttpRequest)))) {
+                close_stream(s, st);
+                st = NULL;
+            } else {
+                st->req->paramCount = -1;
+                st->req->keepAlive = 1;
+                h.req = st->req;
+            }
+        }
+    } else {
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    if (hpack_decode(&s->decoder, block, length, on_header, &h) == -1) {
+        h2_goaway(s, H2_COMPRESSION_ERROR);
+        return -1;
+    }
+
+    if (!st) {
+        return s->goaway ? 0 : queue_u32_frame(s, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+    }
+
+    if (!h.req) {
+        st->remoteClosed = 1;
+        if (st->req) {
+            dispatch(s, st);
+        }
+        return 0;
+    }
+
+    if (!h.status && (!h.hasMethod || !h.hasPath)) {
+        h.status = HTTP_STATUS_BAD_REQUEST;
+    }
+
+    if (!h.status && !(st->req->version = strdup(H2_VERSION))) {
+        h.status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    st->remoteClosed = endStream;
+
+    if (h.status) {
+        free_request(st->req);
+        st->req = NULL;
+        st->state = H2_STREAM_RESPONDING;
+        s->onRequest(s, id, NULL, h.status);
+    } else if (endStream) {
+        dispatch(s, st);
+    }
+
+    return 0;
+}
+
+/**
+ * Adds a request body chunk. A body past HTTP_MAX_BODY_SIZE is answered
+ * with 400 as parse_request does
+*/
+static void receive_body(struct H2Session *s, struct H2Stream *st, const unsigned char *data, size_t length) {
+    struct HttpRequest *req = st->req;
+    size_t cap;
+    char *body;
+
+    if (req->contentLength + length > HTTP_MAX_BODY_SIZE) {
+        free_request(req);
+        st->req = NULL;
+        st->state = H2_STREAM_RESPONDING;
+        s->onRequest(s, st->id, NULL, HTTP_STATUS_BAD_REQUEST);
+        return;
+    }
+
+    // One more for the terminator added by dispatch
+    if (req->contentLength + length + 1 > st->bodyCap) {
+        cap = st->bodyCap ? st->bodyCap : 1024;
+
+        while (cap < req->contentLength + length + 1) {
+            cap *= 2;
+        }
+
+        if (!(body = realloc(req->body, cap))) {
+            free_request(req);
+            st->req = NULL;
+            st->state = H2_STREAM_RESPONDING;
+            s->onRequest(s, st->id, NULL, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        req->body = body;
+        st->bodyCap = cap;
+    }
+
+    memcpy(req->body + req->contentLength, data, length);
+    req->contentLength += length;
+}
+
+/**
+ * Strips padding (and the priority fields of HEADERS) from a frame payload
+*/
+static int unpad(const unsigned char **payload, size_t *length, int flags, size_t skip) {
+    size_t pad = 0;
+
+    if (flags & H2_FLAG_PADDED) {
+        if (!*length) {
+            return -1;
+        }
+        pad = (*payload)[0];
+        ++*payload;
+        --*length;
+    }
+
+    if (pad + skip > *length) {
+        return -1;
+    }
+
+    *payload += skip;
+    *length -= pad + skip;
+
+    return 0;
+}
+
+static int on_data(struct H2Session *s, unsigned int id, int flags, const unsigned char *payload, size_t length) {
+    struct H2Stream *st = find_stream(s, id);
+    size_t frameLength = length;
+
+    if (!id || id > s->lastStreamId) {
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    if (unpad(&payload, &length, flags, 0) == -1) {
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    // The whole frame counts against the connection window, which is given back straight away
+    if (frameLength && queue_u32_frame(s, H2_WINDOW_UPDATE, 0, frameLength) == -1) {
+        return -1;
+    }
+
+    // Frames for a stream already answered (or reset) are dropped
+    if (!st || st->remoteClosed) {
+        return st ? h2_reset(s, id, H2_STREAM_CLOSED) : 0;
+    }
+
+    if (st->req) {
+        receive_body(s, st, payload, length);
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        st->remoteClosed = 1;
+
+        if (st->req) {
+            dispatch(s, st);
+        }
+    } else if (frameLength && st->req) {
+        return queue_u32_frame(s, H2_WINDOW_UPDATE, id, frameLength);
+    }
+
+    return 0;
+}
+
+static int on_headers(struct H2Session *s, unsigned int id, int flags, const unsigned char *payload, size_t length) {
+
+    if (!id || unpad(&payload, &length, flags, flags & H2_FLAG_PRIORITY ? 5 : 0) == -1) {
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    if (flags & H2_FLAG_END_HEADERS) {
+        return end_headers(s, id, payload, length, flags & H2_FLAG_END_STREAM);
+    }
+
+    // Continued: collect the block until END_HEADERS (frames are smaller than HTTP_MAX_HEAD_SIZE)
+    if (!(s->headerBlock = malloc(HTTP_MAX_HEAD_SIZE))) {
+        return -1;
+    }
+
+    memcpy(s->headerBlock, payload, length);
+    s->headerBlockLength = length;
+    s->continuation = id;
+    s->continuationEndStream = flags & H2_FLAG_END_STREAM;
+
+    return 0;
+}
+
+static int on_continuation(struct H2Session *s, unsigned int id, int flags, const unsigned char *payload, size_t length) {
+    int r;
+
+    // Only continues a header block left open by HEADERS, on the same stream
+    if (!s->continuation || id != s->continuation || s->headerBlockLength + length > HTTP_MAX_HEAD_SIZE) {
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    memcpy(s->headerBlock + s->headerBlockLength, payload, length);
+    s->headerBlockLength += length;
+
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+        return 0;
+    }
+
+    s->continuation = 0;
+    r = end_headers(s, id, s->headerBlock, s->headerBlockLength, s->continuationEndStream);
+    free(s->headerBlock);
+    s->headerBlock = NULL;
+    s->headerBlockLength = 0;
+
+    return r;
+}
+
+/**
+ * Applies a SETTINGS payload, from a frame or the HTTP2-Settings header
+*/
+static int apply_settings(struct H2Session *s, const unsigned char *payload, size_t length) {
+    unsigned int id, value;
+    long delta;
+    size_t off;
+    int i;
+
+    if (length % 6) {
+        h2_goaway(s, H2_FRAME_SIZE_ERROR);
+        return -1;
+    }
+
+    for (off = 0; off < length; off += 6) {
+        id = (unsigned int)payload[off] << 8 | payload[off + 1];
+        value = (unsigned int)payload[off + 2] << 24 | (unsigned int)payload[off + 3] << 16
+            | (unsigned int)payload[off + 4] << 8 | payload[off + 5];
+
+        switch (id) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    h2_goaway(s, H2_PROTOCOL_ERROR);
+                    return -1;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_MAX_WINDOW) {
+                    h2_goaway(s, H2_FLOW_CONTROL_ERROR);
+                    return -1;
+                }
+                // Applies to every open stream as a change, not a reset (RFC 7540 6.9.2)
+                delta = (long)value - s->peerInitialWindow;
+                s->peerInitialWindow = value;
+                for (i = 0; i < H2_MAX_STREAMS; ++i) {
+                    if (s->streams[i].state != H2_STREAM_IDLE) {
+                        s->streams[i].sendWindow += delta;
+                    }
+                }
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+                    h2_goaway(s, H2_PROTOCOL_ERROR);
+                    return -1;
+                }
+                s->peerMaxFrame = value;
+                break;
+            default:
+                // Our encoder never indexes, so the peer's table size does not matter
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static int on_frame(struct H2Session *s, int type, int flags, unsigned int id, const unsigned char *payload, size_t length) {
+    struct H2Stream *st;
+    unsigned int increment;
+
+    if (s->continuation && type != H2_CONTINUATION) {
+        h2_goaway(s, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            return on_data(s, id, flags, payload, length);
+        case H2_HEADERS:
+            return on_headers(s, id, flags, payload, length);
+        case H2_CONTINUATION:
+            return on_continuation(s, id, flags, payload, length);
+        case H2_PRIORITY:
+            // Streams are served round robin whatever their priority
+            if (!id || length != 5) {
+                h2_goaway(s, !id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            return 0;
+        case H2_RST_STREAM:
+            if (!id || length != 4 || id > s->lastStreamId) {
+                h2_goaway(s, length != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            if ((st = find_stream(s, id))) {
+                close_stream(s, st);
+            }
+            return 0;
+        case H2_SETTINGS:
+            if (id || ((flags & H2_FLAG_ACK) && length)) {
+                h2_goaway(s, id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            if (flags & H2_FLAG_ACK) {
+                return 0;
+            }
+            if (apply_settings(s, payload, length) == -1) {
+                return -1;
+            }
+            return queue_frame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        case H2_PING:
+            if (id || length != 8) {
+                h2_goaway(s, id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            return flags & H2_FLAG_ACK ? 0 : queue_frame(s, H2_PING, H2_FLAG_ACK, 0, payload, length);
+        case H2_GOAWAY:
+            // Streams already open are still answered
+            s->goaway = 1;
+            return 0;
+        case H2_WINDOW_UPDATE:
+            if (length != 4) {
+                h2_goaway(s, H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            increment = read_u31(payload);
+            if (!id) {
+                if (!increment || s->sendWindow + increment > H2_MAX_WINDOW) {
+                    h2_goaway(s, !increment ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                    return -1;
+                }
+                s->sendWindow += increment;
+            } else if ((st = find_stream(s, id))) {
+                if (!increment || st->sendWindow + increment > H2_MAX_WINDOW) {
+                    return h2_reset(s, id, !increment ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                }
+                st->sendWindow += increment;
+            }
+            return 0;
+        case H2_PUSH_PROMISE:
+            // Clients cannot push
+            h2_goaway(s, H2_PROTOCOL_ERROR);
+            return -1;
+        default:
+            // Unknown frame types are ignored (RFC 7540 4.1)
+            return 0;
+    }
+}
+
+/**
+ * Consumes the preface and every complete frame in `data`, returning how
+ * much was used, or -1 to close the connection once the GOAWAY queued for
+ * it has been sent
+*/
+ssize_t h2_receive(struct H2Session *s, const unsigned char *data, size_t length) {
+    size_t off = 0, frameLength;
+
+    if (!s->prefaceReceived) {
+        if (length < H2_PREFACE_LENGTH) {
+            return memcmp(data, H2_PREFACE, length) == 0 ? 0 : -1;
+        }
+        if (!h2_is_preface((const char *)data, length)) {
+            return -1;
+        }
+        s->prefaceReceived = 1;
+        off = H2_PREFACE_LENGTH;
+    }
+
+    while (length - off >= H2_FRAME_HEADER_LENGTH) {
+        frameLength = read_u24(data + off);
+
+        if (frameLength > H2_MAX_FRAME_SIZE) {
+            h2_goaway(s, H2_FRAME_SIZE_ERROR);
+            return -1;
+        }
+
+        if (length - off < H2_FRAME_HEADER_LENGTH + frameLength) {
+            break;
+        }
+
+        if (on_frame(s, data[off + 3], data[off + 4], read_u31(data + off + 5), data + off + H2_FRAME_HEADER_LENGTH, frameLength) == -1) {
+            h2_goaway(s, H2_INTERNAL_ERROR);
+            return -1;
+        }
+
+        off += H2_FRAME_HEADER_LENGTH + frameLength;
+    }
+
+    return off;
+}
+
+/**
+ * Queues a header block as HEADERS and as many CONTINUATION frames as the
+ * peer's frame size needs
+*/
+static int queue_headers(struct H2Session *s, unsigned int id, const unsigned char *block, size_t length, int endStream) {
+    size_t n = length > s->peerMaxFrame ? s->peerMaxFrame : length;
+    int type = H2_HEADERS, flags = endStream ? H2_FLAG_END_STREAM : 0;
+
+    for (;;) {
+        if (queue_frame(s, type, flags | (n == length ? H2_FLAG_END_HEADERS : 0), id, block, n) == -1) {
+            return -1;
+        }
+
+        block += n;
+        length -= n;
+
+        if (!length) {
+            return 0;
+        }
+
+        type = H2_CONTINUATION;
+        flags = 0;
+        n = length > s->peerMaxFrame ? s->peerMaxFrame : length;
+    }
+}
+
+/**
+ * Encodes the response head. Returns the length the block needs, which is
+ * only all there if it is no more than `cap`
+*/
+static size_t encode_head(unsigned char *dst, size_t cap, struct HttpResponse *res, int status, long long contentLength) {
+    struct HttpRequestHeader *h;
+    char date[HTTP_HEADER_DATE_LENGTH];
+    char length[24];
+    size_t off, i;
+
+    off = hpack_encode_status(dst, cap, 0, status);
+    off = hpack_encode_header(dst, cap, off, "server", SERVER_NAME);
+    current_date_time(date);
+    off = hpack_encode_header(dst, cap, off, "date", date);
+
+    if (contentLength != -1) {
+        snprintf(length, sizeof(length), "%lld", contentLength);
+        off = hpack_encode_header(dst, cap, off, "content-length", length);
+    }
+
+    for (h = res ? res->headers : NULL; h; h = h->next) {
+        for (i = 0; i < sizeof(connectionHeaders) / sizeof(connectionHeaders[0]); ++i) {
+            if (strcasecmp(h->name, connectionHeaders[i]) == 0) {
+                break;
+            }
+        }
+
+        if (i == sizeof(connectionHeaders) / sizeof(connectionHeaders[0])) {
+            off = hpack_encode_header(dst, cap, off, h->name, h->value);
+        }
+    }
+
+    return off;
+}
+
+/**
+ * Starts the response on a stream: the head now, the body as h2_pump frames
+ * it. `o` holds the body as the worker set it up for HTTP/1 (a mapping or
+ * a file range) with no head; an in-memory body is copied into it from
+ * `res`. `o` is handed to onDone once sent, or at once if the stream has
+ * been reset in the meantime
+*/
+int h2_respond(struct H2Session *s, unsigned int streamId, struct Response *o, struct HttpResponse *res) {
+    unsigned char stackBlock[H2_HEADER_BLOCK_STACK], *block = stackBlock;
+    struct H2Stream *st = find_stream(s, streamId);
+    const char *body;
+    long long contentLength = -1;
+    size_t length;
+    int r;
+
+    if (!st) {
+        s->onDone(s, o);
+        return 0;
+    }
+
+    if (!o->body && o->fileFd == -1) {
+        body = res && res->body ? res->body : reason_from_status_code(o->status);
+
+        // Nothing follows 1xx, 204 and 304 (RFC 7230 3.3.3)
+        if (o->status < HTTP_STATUS_OK || o->status == HTTP_STATUS_NO_CONTENT || o->status == HTTP_STATUS_NOT_MODIFIED) {
+            body = "";
+        }
+
+        o->length = strlen(body);
+
+        if (o->length && !(o->data = malloc(o->length))) {
+            close_stream(s, st);
+            s->onDone(s, o);
+            return queue_u32_frame(s, H2_RST_STREAM, streamId, H2_INTERNAL_ERROR);
+        }
+
+        memcpy(o->data, body, o->length);
+
+        if (!res || !get_header_value(HTTP_HEADER_CONTENT_LENGTH, res->headers)) {
+            contentLength = o->length;
+        }
+    }
+
+    length = encode_head(block, sizeof(stackBlock), res, o->status, contentLength);
+
+    if (length > sizeof(stackBlock)) {
+        if (!(block = malloc(length))) {
+            close_stream(s, st);
+            s->onDone(s, o);
+            return queue_u32_frame(s, H2_RST_STREAM, streamId, H2_INTERNAL_ERROR);
+        }
+        encode_head(block, length, res, o->status, contentLength);
+    }
+
+    st->response = o;
+    st->state = H2_STREAM_RESPONDING;
+
+    if (!o->length && !o->bodyLength && (o->fileFd == -1 || o->fileOffset == o->fileEnd)) {
+        r = queue_headers(s, streamId, block, length, 1);
+        if (r == 0) {
+            r = finish_stream(s, st);
+        }
+    } else {
+        r = queue_headers(s, streamId, block, length, 0);
+    }
+
+    if (block != stackBlock) {
+        free(block);
+    }
+
+    return r;
+}
+
+/**
+ * Frames the next DATA of a stream's response, as much as the windows and
+ * the peer's frame size allow
+*/
+static int frame_data(struct H2Session *s, struct H2Stream *st) {
+    struct Response *o = st->response;
+    size_t memoryLeft = o->length + o->bodyLength - o->sent;
+    size_t left = memoryLeft + (o->fileFd != -1 ? (size_t)(o->fileEnd - o->fileOffset) : 0);
+    size_t n = left, take, done = 0;
+    unsigned char *p;
+    ssize_t r;
+
+    if ((long)n > s->sendWindow) {
+        n = s->sendWindow;
+    }
+    if ((long)n > st->sendWindow) {
+        n = st->sendWindow;
+    }
+    if (n > s->peerMaxFrame) {
+        n = s->peerMaxFrame;
+    }
+
+    if (!(p = reserve(s, H2_FRAME_HEADER_LENGTH + n))) {
+        return -1;
+    }
+
+    // The head went out as HEADERS, so `data` is only ever an in-memory body
+    if (o->sent < o->length) {
+        take = o->length - o->sent < n ? o->length - o->sent : n;
+        memcpy(p + H2_FRAME_HEADER_LENGTH, o->data + o->sent, take);
+        o->sent += take;
+        done += take;
+    }
+
+    if (done < n && o->sent < o->length + o->bodyLength) {
+        take = o->length + o->bodyLength - o->sent;
+        take = take < n - done ? take : n - done;
+        memcpy(p + H2_FRAME_HEADER_LENGTH + done, o->body + (o->sent - o->length), take);
+        o->sent += take;
+        done += take;
+    }
+
+    while (done < n) {
+        r = pread(o->fileFd, p + H2_FRAME_HEADER_LENGTH + done, n - done, o->fileOffset);
+
+        if (r <= 0) {
+            return h2_reset(s, st->id, H2_INTERNAL_ERROR);
+        }
+
+        o->fileOffset += r;
+        done += r;
+    }
+
+    write_frame_header(p, n, H2_DATA, n == left ? H2_FLAG_END_STREAM : 0, st->id);
+    s->outLength += H2_FRAME_HEADER_LENGTH + n;
+    s->sendWindow -= n;
+    st->sendWindow -= n;
+    o->bytes += n;
+
+    return n == left ? finish_stream(s, st) : 0;
+}
+
+/**
+ * Frames DATA from the streams with a response to send, one frame from each
+ * in turn, until the output holds H2_OUTPUT_TARGET or flow control stops
+ * it. Returns -1 if out of memory
+ *
+ * Waits for the client preface, which after an upgrade carries the
+ * client's SETTINGS (and windows) for the response to stream 1
+*/
+int h2_pump(struct H2Session *s) {
+    struct H2Stream *st;
+    int i, k, progress = s->prefaceReceived;
+
+    while (progress && s->sendWindow > 0 && s->outLength - s->outSent < H2_OUTPUT_TARGET) {
+        progress = 0;
+
+        for (k = 0; k < H2_MAX_STREAMS; ++k) {
+            i = (s->nextStream + k) % H2_MAX_STREAMS;
+            st = &s->streams[i];
+
+            if (st->state == H2_STREAM_RESPONDING && st->response && st->sendWindow > 0) {
+                if (frame_data(s, st) == -1) {
+                    return -1;
+                }
+                s->nextStream = i + 1;
+                progress = 1;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Records `n` bytes of output taken by the socket, releasing the buffer once
+ * it is empty and no stream could need it soon
+*/
+void h2_output_sent(struct H2Session *s, size_t n) {
+    s->outSent += n;
+
+    if (s->outSent < s->outLength) {
+        return;
+    }
+
+    s->outSent = s->outLength = 0;
+
+    if (!s->streamCount) {
+        free(s->out);
+        s->out = NULL;
+        s->outCap = 0;
+    }
+}
+
+/**
+ * Decodes base64url without padding, as HTTP2-Settings is sent
+*/
+static long decode_base64url(unsigned char *dst, size_t cap, const char *src) {
+    unsigned int acc = 0;
+    int bits = 0, v;
+    size_t n = 0;
+
+    for (; *src && *src != '='; ++src) {
+        if (*src >= 'A' && *src <= 'Z') {
+            v = *src - 'A';
+        } else if (*src >= 'a' && *src <= 'z') {
+            v = *src - 'a' + 26;
+        } else if (*src >= '0' && *src <= '9') {
+            v = *src - '0' + 52;
+        } else if (*src == '-') {
+            v = 62;
+        } else if (*src == '_') {
+            v = 63;
+        } else {
+            return -1;
+        }
+
+        acc = acc << 6 | v;
+        bits += 6;
+
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == cap) {
+                return -1;
+            }
+            dst[n++] = acc >> bits;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Takes over a connection upgraded from HTTP/1.1 (RFC 7540 3.2): applies the
+ * HTTP2-Settings header and answers the upgrading request as stream 1, which
+ * the client has already half-closed. The 101 must have been sent first
+*/
+int h2_upgrade(struct H2Session *s, const char *settings, struct HttpRequest *req) {
+    unsigned char payload[6 * 16];
+    struct H2Stream *st;
+    long length = decode_base64url(payload, sizeof(payload), settings);
+
+    if (length == -1 || apply_settings(s, payload, length) == -1 || !(st = open_stream(s, 1))) {
+        return -1;
+    }
+
+    free(req->version);
+
+    if (!(req->version = strdup(H2_VERSION))) {
+        return -1;
+    }
+
+    s->lastStreamId = 1;
+    st->remoteClosed = 1;
+    st->state = H2_STREAM_RESPONDING;
+    s->onRequest(s, 1, req, 0);
+
+    return 0;
+}
+
+int h2_is_preface(const char *data, size_t length) {
+    return length >= H2_PREFACE_LENGTH && memcmp(data, H2_PREFACE, H2_PREFACE_LENGTH) == 0;
+}
+
+/**
+ * Starts a session with our SETTINGS queued, which must be the first frame
+ * the client sees
+*/
+struct H2Session *h2_session_create(H2RequestHandler onRequest, H2ResponseDone onDone, struct Worker *w, struct Connection *c) {
+    unsigned char settings[12];
+    struct H2Session *s = calloc(1, sizeof(H2Session));
+
+    if (!s) {
+        return NULL;
+    }
+
+    hpack_table_init(&s->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    s->sendWindow = H2_DEFAULT_WINDOW;
+    s->peerInitialWindow = H2_DEFAULT_WINDOW;
+    s->peerMaxFrame = H2_MAX_FRAME_SIZE;
+    s->onRequest = onRequest;
+    s->onDone = onDone;
+    s->worker = w;
+    s->connection = c;
+
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(settings + 2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    write_u32(settings + 8, HTTP_MAX_HEAD_SIZE);
+
+    if (queue_frame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings)) == -1) {
+        free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+/**
+ * Frees the session, handing back the responses still being sent. `in` is
+ * the caller's to return to its pool first
+*/
+void h2_session_free(struct H2Session *s) {
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    for (i = 0; i < H2_MAX_STREAMS; ++i) {
+        if (s->streams[i].state != H2_STREAM_IDLE) {
+            close_stream(s, &s->streams[i]);
+        }
+    }
+
+    hpack_table_free(&s->decoder);
+    free(s->headerBlock);
+    free(s->out);
+    free(s);
+}
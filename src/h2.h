@@ -0,0 +1,121 @@
+#ifndef H2_H_
+#define H2_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http.h"
+#include "hpack.h"
+#include "pool.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+#define H2_VERSION "HTTP/2.0"
+#define H2_FRAME_HEADER_LENGTH 9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_FRAME_SIZE 16384 // The largest frame we accept, and the default for what we send
+#define H2_MAX_STREAMS 100 // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_OUTPUT_TARGET 65536 // DATA is only framed this far ahead of the socket
+
+typedef enum H2FrameType {
+    H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+    H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+} H2FrameType;
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+typedef enum H2Error {
+    H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM, H2_INADEQUATE_SECURITY, H2_HTTP_1_1_REQUIRED
+} H2Error;
+
+typedef enum H2Setting {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1, H2_SETTINGS_ENABLE_PUSH, H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_SETTINGS_MAX_FRAME_SIZE, H2_SETTINGS_MAX_HEADER_LIST_SIZE
+} H2Setting;
+
+typedef enum H2StreamState {
+    H2_STREAM_IDLE, // Free slot
+    H2_STREAM_OPEN, // Receiving the request
+    H2_STREAM_RESPONDING // Request complete, waiting for or sending the response
+} H2StreamState;
+
+struct H2Session;
+struct Response;
+struct Worker;
+struct Connection;
+
+/**
+ * Called with each complete request, which it owns, or with NULL and the
+ * status to answer a request that could not be taken with (like
+ * parse_request). Expected to answer with h2_respond
+*/
+typedef void (*H2RequestHandler)(struct H2Session *s, unsigned int streamId, struct HttpRequest *req, int status);
+
+/**
+ * Called once a response has been sent, or its stream reset, to log and release it
+*/
+typedef void (*H2ResponseDone)(struct H2Session *s, struct Response *o);
+
+typedef struct H2Stream {
+    unsigned int id;
+    enum H2StreamState state;
+    long sendWindow; // Signed: a smaller SETTINGS_INITIAL_WINDOW_SIZE can take it below zero
+    struct HttpRequest *req; // Being received
+    size_t bodyCap;
+    int remoteClosed; // The client has ended its side of the stream
+    struct Response *response; // Body left to send, see h2_respond
+} H2Stream;
+
+/**
+ * One HTTP/2 connection
+ *
+ * Frames are parsed straight out of `in`, and everything sent is framed into
+ * `out` ahead of the socket: control frames and headers as they come, DATA
+ * only as flow control and H2_OUTPUT_TARGET allow, taking a frame from each
+ * stream in turn. Both buffers are released while there is nothing in them
+*/
+typedef struct H2Session {
+    struct PoolBuffer *in;
+    char *out;
+    size_t outLength;
+    size_t outSent;
+    size_t outCap;
+    struct HpackTable decoder;
+    struct H2Stream streams[H2_MAX_STREAMS];
+    int streamCount;
+    int nextStream; // Where the round robin over streams picks up
+    unsigned int lastStreamId; // Highest stream the client has opened
+    long sendWindow; // Connection-level
+    long peerInitialWindow;
+    size_t peerMaxFrame;
+    int prefaceReceived;
+    unsigned int continuation; // Stream whose header block continues in the next frame, 0 if none
+    int continuationEndStream;
+    unsigned char *headerBlock;
+    size_t headerBlockLength;
+    int goaway; // Sent or received a GOAWAY: no new streams, close once drained
+    H2RequestHandler onRequest;
+    H2ResponseDone onDone;
+    struct Worker *worker;
+    struct Connection *connection;
+} H2Session;
+
+struct H2Session *h2_session_create(H2RequestHandler onRequest, H2ResponseDone onDone, struct Worker *w, struct Connection *c);
+void h2_session_free(struct H2Session *s);
+int h2_upgrade(struct H2Session *s, const char *settings, struct HttpRequest *req);
+ssize_t h2_receive(struct H2Session *s, const unsigned char *data, size_t length);
+int h2_respond(struct H2Session *s, unsigned int streamId, struct Response *o, struct HttpResponse *res);
+int h2_pump(struct H2Session *s);
+void h2_goaway(struct H2Session *s, enum H2Error code);
+int h2_reset(struct H2Session *s, unsigned int streamId, enum H2Error code);
+void h2_output_sent(struct H2Session *s, size_t n);
+int h2_is_preface(const char *data, size_t length);
+
+#endif
@@ -0,0 +1,699 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "http.h"
+#include "mime.h"
+#include "files.h"
+#include "metrics.h"
+#include "bundle.h"
+#include "sse.h"
+#include "worker.h"
+#include "handlers.h"
+
+/**
+ * Returns 1 if the parameters of an Accept-Encoding element (`len` bytes from
+ * `params`, each after a `;`) give it a weight above 0. Without a q-value it has 1
+*/
+static int weighted(const char *params, size_t len) {
+    const char *end = params + len, *q;
+
+    for (q = memchr(params, ';', len); q; q = memchr(q, ';', end - q)) {
+        q += 1 + strspn(q + 1, " \t");
+
+        if (end - q >= 2 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+            // 0, 0. or 0.000 to 0.999, or 1 and up
+            for (q += 2; q < end && (*q == '0' || *q == '.'); ++q);
+
+            return q < end && *q >= '1' && *q <= '9';
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Returns 1 if `acceptEncoding` takes gzip: listed with a weight above 0, or
+ * not listed and `*` is (RFC 9110 12.5.3)
+*/
+static int accepts_gzip(const char *acceptEncoding) {
+    size_t element, len;
+    int any = 0;
+
+    while (acceptEncoding && *acceptEncoding) {
+        acceptEncoding += strspn(acceptEncoding, " \t,");
+        element = strcspn(acceptEncoding, ",");
+        len = strcspn(acceptEncoding, " \t,;");
+
+        if ((len == 4 && strncasecmp(acceptEncoding, "gzip", 4) == 0)
+            || (len == 6 && strncasecmp(acceptEncoding, "x-gzip", 6) == 0)) {
+            return weighted(acceptEncoding + len, element - len);
+        }
+
+        if (len == 1 && *acceptEncoding == '*') {
+            any = weighted(acceptEncoding + len, element - len);
+        }
+
+        acceptEncoding += element;
+    }
+
+    return any;
+}
+
+/**
+ * Returns 1 if `list`, an If-None-Match value, is `*` or has `etag` in it,
+ * weak or not (the comparison is weak, RFC 9110 13.1.2)
+*/
+static int etag_listed(const char *list, const char *etag) {
+    size_t length = strlen(etag), len;
+
+    while (list && *list) {
+        list += strspn(list, " \t,");
+        list += strncmp(list, "W/", 2) == 0 ? 2 : 0;
+        len = strcspn(list, " \t,");
+
+        if ((len == 1 && *list == '*') || (len == length && strncmp(list, etag, length) == 0)) {
+            return 1;
+        }
+
+        list += len;
+    }
+
+    return 0;
+}
+
+/**
+ * Serves a bundle entry: no filesystem access, the body is sent from the bundle's fd
+ *
+ * Prefers the gzip variant when the client accepts it. The variants differ, so
+ * the gzip one is tagged apart, by a `-gz` suffix to the entry's ETag. An
+ * If-None-Match listing the tag of the variant served is answered with 304
+*/
+static int serve_bundle_entry(struct RouteContext *ctx, const struct Bundle *b, const struct BundleEntry *e) {
+    char length[32], gzipEtag[BUNDLE_ETAG_SIZE + 3];
+    const char *ifNoneMatch = get_header_value(HTTP_HEADER_IF_NONE_MATCH, ctx->req->headers);
+    int gzip = e->gzipLength && accepts_gzip(get_header_value(HTTP_HEADER_ACCEPT_ENCODING, ctx->req->headers));
+    size_t etagLength = strlen(e->etag);
+
+    // Before its closing quote
+    memcpy(gzipEtag, e->etag, etagLength - 1);
+    strcpy(gzipEtag + etagLength - 1, "-gz\"");
+
+    if (add_response_header(HTTP_HEADER_ETAG, gzip ? gzipEtag : (char *)e->etag, ctx->res) == -1
+        || (e->gzipLength && add_response_header(HTTP_HEADER_VARY, HTTP_HEADER_ACCEPT_ENCODING, ctx->res) == -1)) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ifNoneMatch && etag_listed(ifNoneMatch, gzip ? gzipEtag : e->etag)) {
+        ctx->res->body = strdup("");
+        return ctx->res->body ? HTTP_STATUS_NOT_MODIFIED : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    snprintf(length, sizeof(length), "%llu", (unsigned long long)(gzip ? e->gzipLength : e->length));
+
+    if (add_response_header(HTTP_HEADER_CONTENT_TYPE, (char *)bundle_string(b, e->mimeOffset), ctx->res) == -1
+        || add_response_header(HTTP_HEADER_CONTENT_LENGTH, length, ctx->res) == -1
+        || (gzip && add_response_header(HTTP_HEADER_CONTENT_ENCODING, "gzip", ctx->res) == -1)) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->fileFd = b->fd;
+    ctx->fileShared = 1;
+    ctx->fileOffset = gzip ? e->gzipOffset : e->offset;
+    ctx->fileSize = gzip ? e->gzipLength : e->length;
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * A directory listing being streamed
+*/
+typedef struct DirectoryListing {
+    DIR *dir;
+    char path[3 * FILES_PATH_MAX + 2]; // As requested, percent-encoded and ending with a slash
+} DirectoryListing;
+
+/**
+ * Escapes `len` bytes of `s` for HTML text and attributes into `dst`, which
+ * needs room for six bytes each
+*/
+static size_t escape_html(char *dst, const char *s, size_t len) {
+    size_t off = 0, i;
+
+    for (i = 0; i < len; ++i) {
+        switch (s[i]) {
+            case '&': memcpy(dst + off, "&amp;", 5); off += 5; break;
+            case '<': memcpy(dst + off, "&lt;", 4); off += 4; break;
+            case '>': memcpy(dst + off, "&gt;", 4); off += 4; break;
+            case '"': memcpy(dst + off, "&quot;", 6); off += 6; break;
+            case '\'': memcpy(dst + off, "&#39;", 5); off += 5; break;
+            default: dst[off++] = s[i];
+        }
+    }
+
+    return off;
+}
+
+/**
+ * Percent-encodes a path segment for a URL into `dst`, which needs room for three bytes each
+*/
+static size_t escape_url(char *dst, const char *s, size_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char c;
+    size_t off = 0, i;
+
+    for (i = 0; i < len; ++i) {
+        c = s[i];
+
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~", c)) {
+            dst[off++] = c;
+        } else {
+            dst[off++] = '%';
+            dst[off++] = hex[c >> 4];
+            dst[off++] = hex[c & 15];
+        }
+    }
+
+    return off;
+}
+
+/**
+ * Percent-encodes each segment of a path into `dst`, keeping the slashes
+ * between them. `dst` needs room for three bytes each
+*/
+static size_t escape_url_path(char *dst, const char *s, size_t len) {
+    size_t off = 0, i;
+
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '/') {
+            dst[off++] = '/';
+        } else {
+            off += escape_url(dst + off, s + i, 1);
+        }
+    }
+
+    return off;
+}
+
+/**
+ * Lists the next entries of a directory, and ends the page after the last
+*/
+static int produce_listing(struct ResponseStream *s) {
+    struct DirectoryListing *l = s->state;
+    char href[3 * 256], name[6 * 256];
+    size_t hrefLength, nameLength, len;
+    struct dirent *entry;
+    struct stat st;
+    int i, dir;
+
+    for (i = 0; i < DIRECTORY_BATCH; ++i) {
+        if (!(entry = readdir(l->dir))) {
+            stream_end(s);
+            return stream_printf(s, "</ul>\n</body>\n</html>\n");
+        }
+
+        if (entry->d_name[0] == '.' && (!entry->d_name[1] || (entry->d_name[1] == '.' && !entry->d_name[2]))) {
+            continue;
+        }
+
+        len = strlen(entry->d_name);
+        hrefLength = escape_url(href, entry->d_name, len);
+        nameLength = escape_html(name, entry->d_name, len);
+
+        if (fstatat(dirfd(l->dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            st.st_mode = 0;
+            st.st_size = 0;
+        }
+
+        dir = S_ISDIR(st.st_mode);
+
+        if (stream_printf(s, "<li><a href=\"%s%.*s%s\">%.*s%s</a>", l->path, (int)hrefLength, href, dir ? "/" : "",
+                (int)nameLength, name, dir ? "/" : "") == -1
+            || (S_ISREG(st.st_mode) && stream_printf(s, " %lld", (long long)st.st_size) == -1)
+            || stream_write(s, "</li>\n", 6) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void close_listing(struct ResponseStream *s) {
+    struct DirectoryListing *l = s->state;
+
+    closedir(l->dir);
+    free(l);
+}
+
+static const struct StreamHandler directoryListing = {
+    .produce = produce_listing,
+    .close = close_listing
+};
+
+/**
+ * Answers a directory with a listing of its entries, streamed as they are
+ * read so a large directory starts arriving at once and is never held whole.
+ * Entries come in the order the directory keeps them. Takes `fd`
+*/
+static int list_directory(struct RouteContext *ctx, int fd) {
+    char title[6 * FILES_PATH_MAX];
+    struct DirectoryListing *l;
+    size_t len = strlen(ctx->path), titleLength;
+    const char *slash = len && ctx->path[len - 1] == '/' ? "" : "/";
+
+    if (!(l = calloc(1, sizeof(struct DirectoryListing)))) {
+        close(fd);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!(l->dir = fdopendir(fd))) {
+        close(fd);
+        free(l);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    // Links are absolute, so they work whether or not the request ended with a slash.
+    // Percent-encoded like the entry names, which leaves nothing to escape for HTML
+    len = escape_url_path(l->path, ctx->path, len);
+    snprintf(l->path + len, sizeof(l->path) - len, "%s", slash);
+
+    if (!(ctx->stream = stream_create(&directoryListing, l, ctx->worker->pool))) {
+        closedir(l->dir);
+        free(l);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    titleLength = escape_html(title, ctx->path, strlen(ctx->path));
+
+    if (add_response_header(HTTP_HEADER_CONTENT_TYPE, "text/html; charset=utf-8", ctx->res) == -1
+        || stream_printf(ctx->stream, "<!DOCTYPE html>\n<html>\n<head><title>Index of %.*s%s</title></head>\n"
+            "<body>\n<h1>Index of %.*s%s</h1>\n<ul>\n", (int)titleLength, title, slash, (int)titleLength, title, slash) == -1
+        || (strcmp(l->path, "/") != 0 && stream_printf(ctx->stream, "<li><a href=\"../\">../</a></li>\n") == -1)) {
+        stream_free(ctx->stream);
+        ctx->stream = NULL;
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Serves the file named by the route's wildcard, from the bundle if it has it,
+ * otherwise from beneath the document root
+ *
+ * Only opens (or maps) the file and adds its headers; the worker sends the body
+*/
+int handle_static(struct RouteContext *ctx) {
+    char mime[128];
+    char length[32];
+    struct stat st;
+    size_t len;
+    const char *path = route_param(ctx, "path", &len);
+    const struct BundleEntry *entry;
+    int fd;
+
+    if (!path) {
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    if (ctx->worker->bundle && (entry = bundle_find(ctx->worker->bundle, path, len)) != NULL) {
+        return serve_bundle_entry(ctx, ctx->worker->bundle, entry);
+    }
+
+    if ((ctx->fileFd = files_open(ctx->worker->rootfd, path)) == -1) {
+        switch (errno) {
+            case EACCES: return HTTP_STATUS_FORBIDDEN;
+            case ENOENT:
+            case ENOTDIR:
+            case ENAMETOOLONG:
+            case EXDEV: // Symlink out of the document root
+            case ELOOP: return HTTP_STATUS_NOT_FOUND;
+            default: return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (fstat(ctx->fileFd, &st) == -1) {
+        st.st_mode = 0;
+    }
+
+    if (S_ISDIR(st.st_mode) && ctx->worker->config->autoindex) {
+        fd = ctx->fileFd;
+        ctx->fileFd = -1;
+        return list_directory(ctx, fd);
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        close(ctx->fileFd);
+        ctx->fileFd = -1;
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    // Small files are sent from a mapping shared with later requests for the same path. The file
+    // stays open beside it, for a response that cannot send from the mapping
+    if (ctx->worker->mapCache && st.st_size > 0 && st.st_size <= ctx->worker->config->mmapMaxBytes) {
+        int hit;
+
+        ctx->mapping = mapcache_get(ctx->worker->mapCache, ctx->path, ctx->fileFd, &st, &hit);
+
+        if (hit) {
+            METRICS_ADD(ctx->worker->metrics->cacheHits, 1);
+        } else {
+            METRICS_ADD(ctx->worker->metrics->cacheMisses, 1);
+        }
+    }
+
+    mime[0] = '\0';
+    if (mime_type_from_path(mime, (char *)path) == -1 || !mime[0]) {
+        strcpy(mime, DEFAULT_MIME);
+    }
+
+    snprintf(length, sizeof(length), "%lld", (long long)st.st_size);
+    ctx->fileSize = st.st_size;
+
+    if (add_response_header(HTTP_HEADER_CONTENT_TYPE, mime, ctx->res) == -1
+        || add_response_header(HTTP_HEADER_CONTENT_LENGTH, length, ctx->res) == -1) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Prometheus scrape of every worker's counters
+*/
+int handle_metrics(struct RouteContext *ctx) {
+    size_t len;
+
+    ctx->res->body = metrics_render(&len);
+
+    if (!ctx->res->body || add_response_header(HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4", ctx->res) == -1) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Sends a snapshot of the counters, as the Prometheus text /metrics serves
+*/
+static int send_metrics(struct WebSocket *ws) {
+    size_t len;
+    char *body = metrics_render(&len);
+    int r;
+
+    if (!body) {
+        return -1;
+    }
+
+    r = websocket_send(ws, WEBSOCKET_TEXT, body, len);
+    free(body);
+
+    return r;
+}
+
+static int live_metrics_message(struct WebSocket *ws, enum WebSocketOpcode opcode, const char *data, size_t len) {
+    (void)opcode;
+    (void)data;
+    (void)len;
+
+    return send_metrics(ws) == -1 ? WEBSOCKET_CLOSE_POLICY : 0;
+}
+
+static const struct WebSocketHandler liveMetrics = {
+    .open = send_metrics,
+    .message = live_metrics_message
+};
+
+/**
+ * The counters of /metrics over a WebSocket: a snapshot on connecting, and
+ * another for each message the client sends
+*/
+int handle_live_metrics(struct RouteContext *ctx) {
+    if (!websocket_requested(ctx->req)) {
+        return add_response_header("Upgrade", "websocket", ctx->res) == -1
+            ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_UPGRADE_REQUIRED;
+    }
+
+    ctx->websocket = &liveMetrics;
+
+    return HTTP_STATUS_SWITCHING_PROTOCOLS;
+}
+
+/**
+ * Subscribes the connection to published events, sent as a text/event-stream
+ * for as long as the client stays. A reconnecting client's Last-Event-ID picks
+ * up from the events it missed, as far as the ring still holds them
+*/
+int handle_events(struct RouteContext *ctx) {
+    const char *lastId = get_header_value("Last-Event-ID", ctx->req->headers);
+
+    if (!ctx->worker->config->events) {
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    if (add_response_header(HTTP_HEADER_CONTENT_TYPE, SSE_CONTENT_TYPE, ctx->res) == -1
+        || add_response_header("Cache-Control", "no-cache", ctx->res) == -1) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->subscribe = 1;
+    ctx->lastEventId = lastId ? strtoull(lastId, NULL, 10) : 0;
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Publishes the body as an event to every subscriber, its type from the
+ * `event` query parameter. Answers with the event's id
+*/
+int handle_publish(struct RouteContext *ctx) {
+    char event[SSE_NAME_MAX];
+    long long id;
+
+    if (!ctx->worker->config->events) {
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    if (get_query_param(ctx->req, "event", event, sizeof(event)) == -1) {
+        event[0] = '\0';
+    }
+
+    if ((id = sse_publish(event, ctx->req->body ? ctx->req->body : "", ctx->req->contentLength)) == -1) {
+        return HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    if (!(ctx->res->body = malloc(32))) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    snprintf(ctx->res->body, 32, "%lld\n", id);
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Liveness check for load balancers: answers as long as a worker is accepting
+*/
+int handle_health(struct RouteContext *ctx) {
+    ctx->res->body = strdup("OK\n");
+
+    if (!ctx->res->body || add_response_header(HTTP_HEADER_CONTENT_TYPE, "text/plain", ctx->res) == -1) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * An upload being stored: the file part being written, and what has been stored so far
+*/
+typedef struct FileUpload {
+    int fd; // -1 between file parts
+    char temp[64]; // Written under this name, linked to `name` once complete
+    char name[MULTIPART_NAME_MAX];
+    unsigned long long size;
+    int stored;
+    char summary[UPLOAD_SUMMARY_MAX];
+    size_t summaryLength;
+} FileUpload;
+
+/**
+ * Starts a part, storing it if it is a file. Other form fields are skipped
+ *
+ * Only the last component of the client's file name is kept, and names that
+ * would be hidden or not a plain file name are refused
+*/
+static int upload_part(void *user, const struct MultipartPart *part) {
+    static unsigned int sequence = 0;
+    struct RouteContext *ctx = user;
+    struct FileUpload *u = ctx->uploadState;
+    const char *name = part->filename, *slash;
+
+    if (!name[0]) {
+        return 0;
+    }
+
+    // Browsers on Windows send the whole path
+    if ((slash = strrchr(name, '/'))) {
+        name = slash + 1;
+    }
+    if ((slash = strrchr(name, '\\'))) {
+        name = slash + 1;
+    }
+
+    if (!name[0] || name[0] == '.' || strlen(name) >= sizeof(u->name)) {
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    strcpy(u->name, name);
+    snprintf(u->temp, sizeof(u->temp), ".upload-%d-%u", (int)getpid(), ++sequence);
+
+    if ((u->fd = openat(ctx->worker->uploadfd, u->temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) == -1) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    u->size = 0;
+
+    return 0;
+}
+
+static int upload_data(void *user, const char *data, size_t len) {
+    struct FileUpload *u = ((struct RouteContext *)user)->uploadState;
+    ssize_t n;
+
+    while (u->fd != -1 && len) {
+        if ((n = write(u->fd, data, len)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+
+        data += n;
+        len -= n;
+        u->size += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Gives a complete file its name. An existing file is never replaced
+*/
+static int upload_part_end(void *user) {
+    struct RouteContext *ctx = user;
+    struct FileUpload *u = ctx->uploadState;
+    int uploadfd = ctx->worker->uploadfd, result;
+
+    if (u->fd == -1) {
+        return 0;
+    }
+
+    result = close(u->fd);
+    u->fd = -1;
+
+    if (result == -1 || linkat(uploadfd, u->temp, uploadfd, u->name, 0) == -1) {
+        result = errno == EEXIST ? HTTP_STATUS_CONFLICT : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        unlinkat(uploadfd, u->temp, 0);
+        return result;
+    }
+
+    unlinkat(uploadfd, u->temp, 0);
+
+    result = snprintf(u->summary + u->summaryLength, sizeof(u->summary) - u->summaryLength, "%s %llu\n", u->name, u->size);
+    if (result > 0 && (size_t)result < sizeof(u->summary) - u->summaryLength) {
+        u->summaryLength += result;
+    }
+    u->stored++;
+
+    return 0;
+}
+
+static int upload_end(struct RouteContext *ctx) {
+    struct FileUpload *u = ctx->uploadState;
+    int stored = u->stored;
+
+    ctx->res->body = stored ? strndup(u->summary, u->summaryLength) : NULL;
+    free(u);
+
+    if (!stored) {
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    if (!ctx->res->body || add_response_header(HTTP_HEADER_CONTENT_TYPE, "text/plain", ctx->res) == -1) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    return HTTP_STATUS_CREATED;
+}
+
+/**
+ * Drops the file part cut short. Files already stored are kept
+*/
+static void upload_abort(struct RouteContext *ctx) {
+    struct FileUpload *u = ctx->uploadState;
+
+    if (u->fd != -1) {
+        close(u->fd);
+        unlinkat(ctx->worker->uploadfd, u->temp, 0);
+    }
+
+    free(u);
+}
+
+static const struct UploadHandler fileUpload = {
+    { upload_part, upload_data, upload_part_end }, upload_end, upload_abort
+};
+
+/**
+ * Stores the files of a multipart/form-data POST in the upload directory,
+ * under their own names, as they arrive. Answers 201 with a `name size` line
+ * for each
+*/
+int handle_upload(struct RouteContext *ctx) {
+    struct FileUpload *u;
+    size_t boundaryLength;
+
+    if (ctx->worker->uploadfd == -1) {
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    if (!multipart_boundary(get_header_value(HTTP_HEADER_CONTENT_TYPE, ctx->req->headers), &boundaryLength)) {
+        return HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE;
+    }
+
+    if (!(u = calloc(1, sizeof(struct FileUpload)))) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    u->fd = -1;
+    ctx->upload = &fileUpload;
+    ctx->uploadState = u;
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Registers the server's endpoints. New endpoints go here, static files are the
+ * catch-all for everything else
+*/
+int register_routes(struct Router *r) {
+    if (router_add(r, GET, METRICS_PATH, handle_metrics) == -1
+        || router_add(r, GET, LIVE_METRICS_PATH, handle_live_metrics) == -1
+        || router_add(r, GET, HEALTH_PATH, handle_health) == -1
+        || router_add(r, GET, SSE_PATH, handle_events) == -1
+        || router_add(r, POST, SSE_PATH, handle_publish) == -1
+        || router_add(r, POST, UPLOAD_PATH, handle_upload) == -1
+        || router_add(r, GET, "/*path", handle_static) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
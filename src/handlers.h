@@ -0,0 +1,21 @@
+#ifndef HANDLERS_H_
+#define HANDLERS_H_
+
+#include "router.h"
+
+#define HEALTH_PATH "/health"
+#define LIVE_METRICS_PATH "/metrics/live"
+#define UPLOAD_PATH "/upload"
+#define DIRECTORY_BATCH 64 // Entries listed each time the client has taken the last ones
+#define UPLOAD_SUMMARY_MAX 4096 // The 201 lists each stored file, as many as fit
+
+int handle_static(struct RouteContext *ctx);
+int handle_metrics(struct RouteContext *ctx);
+int handle_live_metrics(struct RouteContext *ctx);
+int handle_events(struct RouteContext *ctx);
+int handle_publish(struct RouteContext *ctx);
+int handle_health(struct RouteContext *ctx);
+int handle_upload(struct RouteContext *ctx);
+int register_routes(struct Router *r);
+
+#endif
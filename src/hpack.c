@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "hpack.h"
+
+/**
+ * RFC 7541 Appendix A. Requests mostly hit these, so decoding them costs an
+ * array lookup and encoding a response header finds its name here
+*/
+static const char *const staticTable[HPACK_STATIC_ENTRIES][2] = {
+    { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+    { ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+    { "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" }
+};
+
+/**
+ * The Huffman code of RFC 7541 Appendix B is canonical, so it is fully
+ * described by how many codes there are of each length (1 to 30 bits) and the
+ * symbols in code order. 256 is EOS
+*/
+static const unsigned short huffmanCounts[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const unsigned short huffmanSymbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256
+};
+
+/**
+ * Decodes Huffman-coded `src` into `dst`, which must hold `len * 8 / 5` bytes
+ * (the shortest code is 5 bits)
+ *
+ * Walks the code a bit at a time: at each length the code read so far is a
+ * symbol if it falls within that length's range. Returns the decoded length,
+ * or -1 for EOS, an unfinished code or padding that is not a prefix of EOS
+*/
+static long huffman_decode(char *dst, const unsigned char *src, size_t len) {
+    unsigned int code = 0, first = 0;
+    int bits = 0, index = 0, i, ones = 1;
+    long out = 0;
+    size_t pos;
+
+    for (pos = 0; pos < len; ++pos) {
+        for (i = 7; i >= 0; --i) {
+            int bit = (src[pos] >> i) & 1;
+
+            code = (code << 1) | bit;
+            ones &= bit;
+            first <<= 1;
+            ++bits;
+
+            if (code - first < huffmanCounts[bits]) {
+                if (huffmanSymbols[index + code - first] == 256) {
+                    return -1;
+                }
+
+                dst[out++] = huffmanSymbols[index + code - first];
+                code = first = 0;
+                bits = index = 0;
+                ones = 1;
+                continue;
+            }
+
+            if (bits == 30) {
+                return -1;
+            }
+
+            first += huffmanCounts[bits];
+            index += huffmanCounts[bits];
+        }
+    }
+
+    // Padding is the most significant bits of EOS (all ones), and shorter than a byte
+    return bits > 7 || !ones ? -1 : out;
+}
+
+/**
+ * Reads an integer with an `prefix`-bit prefix (RFC 7541 5.1) at `*pos`
+*/
+static int decode_int(const unsigned char *block, size_t length, size_t *pos, int prefix, size_t *value) {
+    size_t max = (1u << prefix) - 1;
+    int shift = 0;
+
+    if (*pos >= length) {
+        return -1;
+    }
+
+    *value = block[(*pos)++] & max;
+
+    if (*value < max) {
+        return 0;
+    }
+
+    while (*pos < length) {
+        unsigned char b = block[(*pos)++];
+
+        if (shift > 28) {
+            return -1;
+        }
+
+        *value += (size_t)(b & 0x7f) << shift;
+        shift += 7;
+
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Reads a string literal at `*pos`, decoding Huffman into `scratch` (advanced past it)
+*/
+static int decode_string(const unsigned char *block, size_t length, size_t *pos, char **scratch,
+    const char **str, size_t *strLength) {
+    int huffman;
+    size_t len;
+    long decoded;
+
+    if (*pos >= length) {
+        return -1;
+    }
+
+    huffman = block[*pos] & 0x80;
+
+    if (decode_int(block, length, pos, 7, &len) == -1 || len > length - *pos) {
+        return -1;
+    }
+
+    if (!huffman) {
+        *str = (const char *)block + *pos;
+        *strLength = len;
+        *pos += len;
+        return 0;
+    }
+
+    if ((decoded = huffman_decode(*scratch, block + *pos, len)) == -1) {
+        return -1;
+    }
+
+    *str = *scratch;
+    *strLength = decoded;
+    *scratch += decoded;
+    *pos += len;
+
+    return 0;
+}
+
+void hpack_table_init(struct HpackTable *t, size_t limit) {
+    memset(t, 0, sizeof(struct HpackTable));
+    t->maxSize = t->limit = limit;
+}
+
+void hpack_table_free(struct HpackTable *t) {
+    size_t i;
+
+    for (i = 0; i < t->count; ++i) {
+        free(t->entries[(t->first + i) % t->slots].name);
+    }
+
+    free(t->entries);
+    memset(t, 0, sizeof(struct HpackTable));
+}
+
+static void evict(struct HpackTable *t, size_t maxSize) {
+    struct HpackEntry *e;
+
+    while (t->count && t->size > maxSize) {
+        e = &t->entries[(t->first + t->count - 1) % t->slots];
+        t->size -= HPACK_ENTRY_OVERHEAD + e->nameLength + e->valueLength;
+        free(e->name);
+        --t->count;
+    }
+}
+
+/**
+ * Adds an entry at the front, evicting from the back to make room
+ *
+ * `name` may point into an entry about to be evicted, so it is copied first
+*/
+static int insert(struct HpackTable *t, const char *name, size_t nameLength, const char *value, size_t valueLength) {
+    size_t size = HPACK_ENTRY_OVERHEAD + nameLength + valueLength;
+    struct HpackEntry *entries;
+    char *copy;
+    size_t i;
+
+    // Too big for the table: it just empties it (RFC 7541 4.4)
+    if (size > t->maxSize) {
+        evict(t, 0);
+        return 0;
+    }
+
+    if (!(copy = malloc(nameLength + valueLength + 2))) {
+        return -1;
+    }
+
+    memcpy(copy, name, nameLength);
+    copy[nameLength] = '\0';
+    memcpy(copy + nameLength + 1, value, valueLength);
+    copy[nameLength + 1 + valueLength] = '\0';
+
+    evict(t, t->maxSize - size);
+
+    if (t->count == t->slots) {
+        if (!(entries = malloc(sizeof(struct HpackEntry) * (t->slots ? t->slots * 2 : 16)))) {
+            free(copy);
+            return -1;
+        }
+
+        for (i = 0; i < t->count; ++i) {
+            entries[i] = t->entries[(t->first + i) % t->slots];
+        }
+
+        free(t->entries);
+        t->entries = entries;
+        t->slots = t->slots ? t->slots * 2 : 16;
+        t->first = 0;
+    }
+
+    t->first = (t->first + t->slots - 1) % t->slots;
+    t->entries[t->first].name = copy;
+    t->entries[t->first].nameLength = nameLength;
+    t->entries[t->first].value = copy + nameLength + 1;
+    t->entries[t->first].valueLength = valueLength;
+    t->size += size;
+    ++t->count;
+
+    return 0;
+}
+
+/**
+ * Looks up `index` (1-based, static entries first)
+*/
+static int lookup(const struct HpackTable *t, size_t index, const char **name, size_t *nameLength,
+    const char **value, size_t *valueLength) {
+    const struct HpackEntry *e;
+
+    if (index == 0) {
+        return -1;
+    }
+
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name = staticTable[index - 1][0];
+        *nameLength = strlen(*name);
+        *value = staticTable[index - 1][1];
+        *valueLength = strlen(*value);
+        return 0;
+    }
+
+    if (index - HPACK_STATIC_ENTRIES > t->count) {
+        return -1;
+    }
+
+    e = &t->entries[(t->first + index - HPACK_STATIC_ENTRIES - 1) % t->slots];
+    *name = e->name;
+    *nameLength = e->nameLength;
+    *value = e->value;
+    *valueLength = e->valueLength;
+
+    return 0;
+}
+
+/**
+ * Decodes a complete header block, calling `cb` for each header in order
+ *
+ * Returns 0, -1 if the block is malformed (a connection error, as the table
+ * may now be out of step with the peer's), or what `cb` returned to stop
+*/
+int hpack_decode(struct HpackTable *t, const unsigned char *block, size_t length, HpackHeaderCallback cb, void *arg) {
+    const char *name, *value;
+    size_t nameLength, valueLength, index, pos = 0;
+    char *scratch = NULL, *next;
+    int result = 0, prefix;
+    unsigned char b;
+
+    while (pos < length && !result) {
+        b = block[pos];
+
+        if (b & 0x80) {
+            // Indexed header field
+            if (decode_int(block, length, &pos, 7, &index) == -1
+                || lookup(t, index, &name, &nameLength, &value, &valueLength) == -1) {
+                result = -1;
+                break;
+            }
+
+            result = cb(arg, name, nameLength, value, valueLength);
+            continue;
+        }
+
+        if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, at most what we advertised
+            if (decode_int(block, length, &pos, 5, &index) == -1 || index > t->limit) {
+                result = -1;
+                break;
+            }
+
+            t->maxSize = index;
+            evict(t, index);
+            continue;
+        }
+
+        // Literal: with incremental indexing (6-bit prefix), or without/never indexed (4-bit)
+        prefix = (b & 0xc0) == 0x40 ? 6 : 4;
+
+        // Huffman strings decode to at most 8/5 of their length, one scratch buffer holds both
+        if (!scratch && !(scratch = malloc(length * 8 / 5 + 1))) {
+            result = -1;
+            break;
+        }
+        next = scratch;
+
+        if (decode_int(block, length, &pos, prefix, &index) == -1) {
+            result = -1;
+            break;
+        }
+
+        if (index) {
+            if (lookup(t, index, &name, &nameLength, &value, &valueLength) == -1) {
+                result = -1;
+                break;
+            }
+        } else if (decode_string(block, length, &pos, &next, &name, &nameLength) == -1) {
+            result = -1;
+            break;
+        }
+
+        if (decode_string(block, length, &pos, &next, &value, &valueLength) == -1) {
+            result = -1;
+            break;
+        }
+
+        // Passed on before it is added: a name taken from the table may be in an entry adding it evicts
+        result = cb(arg, name, nameLength, value, valueLength);
+
+        if (prefix == 6 && insert(t, name, nameLength, value, valueLength) == -1) {
+            result = -1;
+        }
+    }
+
+    free(scratch);
+
+    return result;
+}
+
+/**
+ * Appends an integer with a `prefix`-bit prefix, the rest of the first byte being `bits`
+*/
+static size_t encode_int(unsigned char *dst, size_t cap, size_t off, int prefix, unsigned char bits, size_t value) {
+    size_t max = (1u << prefix) - 1;
+
+    if (value < max) {
+        if (off < cap) {
+            dst[off] = bits | value;
+        }
+        return off + 1;
+    }
+
+    if (off < cap) {
+        dst[off] = bits | max;
+    }
+    ++off;
+    value -= max;
+
+    for (; value >= 0x80; value >>= 7, ++off) {
+        if (off < cap) {
+            dst[off] = (value & 0x7f) | 0x80;
+        }
+    }
+
+    if (off < cap) {
+        dst[off] = value;
+    }
+
+    return off + 1;
+}
+
+/**
+ * Appends a string literal, never Huffman-coded: response headers are short
+ * and mostly indexed, so it would save little for a lot of work
+*/
+static size_t encode_string(unsigned char *dst, size_t cap, size_t off, const char *s, size_t len, int lower) {
+    size_t i;
+
+    off = encode_int(dst, cap, off, 7, 0, len);
+
+    for (i = 0; i < len; ++i, ++off) {
+        if (off < cap) {
+            dst[off] = lower ? tolower((unsigned char)s[i]) : s[i];
+        }
+    }
+
+    return off;
+}
+
+/**
+ * Appends `:status`: a one byte index for the statuses in the static table,
+ * a literal with an indexed name for the rest
+ *
+ * Like serialize_response, never writes past `cap` and returns the offset it
+ * would have reached
+*/
+size_t hpack_encode_status(unsigned char *dst, size_t cap, size_t off, int status) {
+    char digits[8];
+    int i;
+
+    for (i = 7; i < 14; ++i) {
+        if (atoi(staticTable[i][1]) == status) {
+            return encode_int(dst, cap, off, 7, 0x80, i + 1);
+        }
+    }
+
+    snprintf(digits, sizeof(digits), "%03d", status % 1000);
+    off = encode_int(dst, cap, off, 4, 0, 8);
+
+    return encode_string(dst, cap, off, digits, 3, 0);
+}
+
+/**
+ * Appends a header as a literal without indexing, lowercasing the name as
+ * HTTP/2 requires. Names in the static table are sent as their index, and
+ * a header matching a static entry exactly as just that index
+*/
+size_t hpack_encode_header(unsigned char *dst, size_t cap, size_t off, const char *name, const char *value) {
+    int i, nameIndex = 0;
+
+    for (i = 14; i < HPACK_STATIC_ENTRIES; ++i) {
+        if (strcasecmp(staticTable[i][0], name) == 0) {
+            if (strcmp(staticTable[i][1], value) == 0) {
+                return encode_int(dst, cap, off, 7, 0x80, i + 1);
+            }
+            if (!nameIndex) {
+                nameIndex = i + 1;
+            }
+        }
+    }
+
+    if (nameIndex) {
+        off = encode_int(dst, cap, off, 4, 0, nameIndex);
+    } else {
+        off = encode_int(dst, cap, off, 4, 0, 0);
+        off = encode_string(dst, cap, off, name, strlen(name), 1);
+    }
+
+    return encode_string(dst, cap, off, value, strlen(value), 0);
+}
@@ -0,0 +1,49 @@
+#ifndef HPACK_H_
+#define HPACK_H_
+
+#include <stddef.h>
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE until the peer says otherwise
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_ENTRY_OVERHEAD 32 // Counted against the table size for every entry (RFC 7541 4.1)
+
+/**
+ * A dynamic table entry, `name` and `value` in one allocation
+*/
+typedef struct HpackEntry {
+    char *name;
+    size_t nameLength;
+    char *value;
+    size_t valueLength;
+} HpackEntry;
+
+/**
+ * The decoder's dynamic table: a ring of entries, newest first
+ *
+ * Only ever grows to what the table size allows (one entry per 32 bytes at
+ * most), and starts empty so a connection that sends no indexed headers never
+ * allocates it
+*/
+typedef struct HpackTable {
+    struct HpackEntry *entries;
+    size_t slots;
+    size_t count;
+    size_t first; // Slot of the newest entry
+    size_t size; // As counted by RFC 7541 4.1
+    size_t maxSize; // Current limit, lowered or raised by the encoder up to `limit`
+    size_t limit; // SETTINGS_HEADER_TABLE_SIZE we advertised
+} HpackTable;
+
+/**
+ * Called for each decoded header, with strings only valid during the call. A
+ * non-zero return stops decoding and is passed back by hpack_decode
+*/
+typedef int (*HpackHeaderCallback)(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength);
+
+void hpack_table_init(struct HpackTable *t, size_t limit);
+void hpack_table_free(struct HpackTable *t);
+int hpack_decode(struct HpackTable *t, const unsigned char *block, size_t length, HpackHeaderCallback cb, void *arg);
+size_t hpack_encode_status(unsigned char *dst, size_t cap, size_t off, int status);
+size_t hpack_encode_header(unsigned char *dst, size_t cap, size_t off, const char *name, const char *value);
+
+#endif
@@ -1,6 +1,20 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "http.h"
+#include "date_utils.h"
 
 /**
  * Accepts status scode and returns corresponding reason
@@ -82,3 +96,1008 @@ const char *reason_from_status_code(int status) {
         default: return "OK";
 	}
 }
+
+/**
+ * Returns the request line token for a method
+*/
+const char *method_name(enum HttpMethod method) {
+    switch (method) {
+        case GET: return HTTP_METHOD_GET;
+        case POST: return HTTP_METHOD_POST;
+        case PUT: return HTTP_METHOD_PUT;
+        case DELETE: return HTTP_METHOD_DELETE;
+        default: return "-";
+    }
+}
+
+/**
+ * Free memory allocated for the request struct header
+*/
+void free_header(struct HttpRequestHeader *h) {
+    if (h) {
+        free(h->name);
+        free(h->value);
+        free_header(h->next);
+        free(h);
+    }
+}
+
+/**
+ * Free memory allocated for the request struct
+*/
+void free_request(struct HttpRequest *req) {
+    if (!req) {
+        return;
+    }
+    free(req->path);
+    free(req->version);
+    free_header(req->headers);
+    free(req->body);
+    free(req);
+}
+
+/**
+ * Free memory allocated for the response struct
+*/
+void free_response(struct HttpResponse *res) {
+    if (!res) {
+        return;
+    }
+    free(res->body);
+    free_header(res->headers);
+    free(res);
+}
+
+/**
+ * Accepts a header name and returns pointer to value
+*/
+char *get_header_value(char *name, struct HttpRequestHeader *headers) {
+    struct HttpRequestHeader *header;
+
+    for (header = headers; header; header = header->next) {
+        if (strcasecmp(header->name, name) == 0) {
+            return header->value;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Adds a header to a response
+*/
+int add_response_header(char *name, char *value, struct HttpResponse *res) {
+    struct HttpRequestHeader *header = NULL;
+
+    header = malloc(sizeof(HttpRequestHeader));
+
+    if (!header) {
+        return -1;
+    }
+
+    header->name = malloc(strlen(name) + 1);
+    header->value = malloc(strlen(value) + 1);
+
+    if (!header->name || !header->value) {
+        header->next = NULL;
+        free_header(header);
+        return -1;
+    }
+
+    strcpy(header->name, name);
+    strcpy(header->value, value);
+
+    header->next = res->headers;
+    res->headers = header;
+
+    return 0;
+}
+
+/**
+ * Appends `len` bytes of `src` to `dst` at offset `off`, never writing past `cap`
+ *
+ * Returns the new offset, which keeps counting past `cap` so callers can size a retry
+*/
+static size_t append(char *dst, size_t cap, size_t off, const char *src, size_t len) {
+    if (off < cap) {
+        memcpy(dst + off, src, off + len <= cap ? len : cap - off);
+    }
+
+    return off + len;
+}
+
+/**
+ * Serializes the status line and headers of a response, up to and including the blank line
+ *
+ * Adds a Content-Length header unless `contentLength` is -1 (the handler set
+ * its own, or the response has no body). Same contract as serialize_response
+*/
+size_t serialize_head(char *dst, size_t cap, struct HttpResponse *res, int status, long long contentLength) {
+    char line[HTTP_STATUS_REASON_MAX_SIZE + 32];
+    char date[HTTP_HEADER_DATE_LENGTH];
+    const char *reason = reason_from_status_code(status);
+    struct HttpRequestHeader *header = NULL;
+    size_t off = 0;
+    int len;
+
+    // Initial response line
+    len = snprintf(line, sizeof(line), "%s %d %s\r\n", res && res->version ? res->version : HTTP_VERSION, status, reason);
+    off = append(dst, cap, off, line, len);
+
+    // Default headers
+    off = append(dst, cap, off, "Server: " SERVER_NAME "\r\n", strlen("Server: " SERVER_NAME "\r\n"));
+
+    current_date_time(date);
+    off = append(dst, cap, off, "Date: ", strlen("Date: "));
+    off = append(dst, cap, off, date, strlen(date));
+    off = append(dst, cap, off, "\r\n", 2);
+
+    // Persistent connections need to know where the body ends
+    if (contentLength >= 0) {
+        len = snprintf(line, sizeof(line), HTTP_HEADER_CONTENT_LENGTH ": %lld\r\n", contentLength);
+        off = append(dst, cap, off, line, len);
+    }
+
+    // Add headers from res struct
+    if (res) {
+        for (header = res->headers; header; header = header->next) {
+            off = append(dst, cap, off, header->name, strlen(header->name));
+            off = append(dst, cap, off, ": ", 2);
+            off = append(dst, cap, off, header->value, strlen(header->value));
+            off = append(dst, cap, off, "\r\n", 2);
+        }
+    }
+
+    return append(dst, cap, off, "\r\n", 2);
+}
+
+/**
+ * Serializes the status line, headers and body of a response into `dst`
+ *
+ * Never writes more than `cap` bytes. Returns the full length of the response, so
+ * a return value greater than `cap` means `dst` was too small and holds a truncated copy
+*/
+size_t serialize_response(char *dst, size_t cap, struct HttpResponse *res, int status) {
+    // Body (falls back to the reason phrase so error responses are readable)
+    const char *body = res && res->body ? res->body : reason_from_status_code(status);
+    size_t len = strlen(body);
+    size_t off;
+
+    // 1xx, 204 and 304 have no body, and a handler that set Content-Length has already framed it
+    if (status < HTTP_STATUS_OK || status == HTTP_STATUS_NO_CONTENT || status == HTTP_STATUS_NOT_MODIFIED) {
+        return serialize_head(dst, cap, res, status, -1);
+    }
+
+    off = serialize_head(dst, cap, res, status,
+        res && get_header_value(HTTP_HEADER_CONTENT_LENGTH, res->headers) ? -1 : (long long)len);
+
+    return append(dst, cap, off, body, len);
+}
+
+/**
+ * Waits up to HTTP_SEND_TIMEOUT_MS for `sockfd` to accept more data
+*/
+static int wait_writable(int sockfd) {
+    struct pollfd pfd;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLOUT;
+
+    return poll(&pfd, 1, HTTP_SEND_TIMEOUT_MS);
+}
+
+/**
+ * Sends all `length` bytes of `buf`, waiting while the socket is full
+*/
+static ssize_t send_all(int sockfd, const char *buf, size_t length) {
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < length) {
+        n = send(sockfd, buf + sent, length - sent, 0);
+
+        // Non-blocking socket is full, wait for the client to read
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (errno == EINTR || wait_writable(sockfd) > 0) {
+                continue;
+            }
+        }
+
+        if (n == -1) {
+            return -1;
+        }
+
+        sent += n;
+    }
+
+    return sent;
+}
+
+/**
+ * Builds and sends the response to the client
+ *
+ * Returns the number of bytes sent, or -1 on error
+*/
+ssize_t send_response(int sockfd, struct HttpResponse *res, int status) {
+    char stackBuf[HTTP_RESPONSE_BUFFER_SIZE];
+    char *resStr = stackBuf;
+    size_t length;
+    ssize_t sent;
+
+    length = serialize_response(resStr, sizeof(stackBuf), res, status);
+
+    // Only large bodies need a heap buffer
+    if (length > sizeof(stackBuf)) {
+        resStr = malloc(length);
+
+        if (!resStr) {
+            return -1;
+        }
+
+        serialize_response(resStr, length, res, status);
+    }
+
+    sent = send_all(sockfd, resStr, length);
+
+    if (resStr != stackBuf) {
+        free(resStr);
+    }
+
+    return sent;
+}
+
+/**
+ * Sends the status line and headers of `res`, then `size` bytes of the file `fd`
+ * from `offset` as the body
+ *
+ * The body goes from the page cache to the socket with sendfile, without being
+ * copied through the process. Returns the number of bytes sent, or -1 on error
+ * (including the file shrinking while it is sent)
+*/
+ssize_t send_file_response(int sockfd, struct HttpResponse *res, int status, int fd, off_t offset, off_t size) {
+    char head[HTTP_RESPONSE_BUFFER_SIZE];
+    size_t length = serialize_head(head, sizeof(head), res, status, -1);
+    off_t end = offset + size;
+    ssize_t n;
+
+    if (length > sizeof(head) || send_all(sockfd, head, length) == -1) {
+        return -1;
+    }
+
+    while (offset < end) {
+#ifdef __linux__
+        n = sendfile(sockfd, fd, &offset, end - offset);
+#else
+        char buf[HTTP_RESPONSE_BUFFER_SIZE];
+
+        n = pread(fd, buf, end - offset < (off_t)sizeof(buf) ? end - offset : (off_t)sizeof(buf), offset);
+        if (n > 0 && send_all(sockfd, buf, n) == -1) {
+            return -1;
+        }
+        if (n > 0) {
+            offset += n;
+        }
+#endif
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (errno == EINTR || wait_writable(sockfd) > 0) {
+                continue;
+            }
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+    }
+
+    return length + size;
+}
+
+/**
+ * Sends the status line and headers of `res` followed by `length` bytes of `body`
+ * with writev, so a mapped file goes out without being copied into the process
+ *
+ * `body` is only ever read by the kernel: if it is a mapping of a file that has
+ * since been truncated, writev fails with EFAULT instead of the process taking
+ * a SIGBUS. Returns the number of bytes sent, or -1 on error
+*/
+ssize_t send_mapped_response(int sockfd, struct HttpResponse *res, int status, const void *body, size_t length) {
+    char head[HTTP_RESPONSE_BUFFER_SIZE];
+    size_t headLength = serialize_head(head, sizeof(head), res, status, -1);
+    size_t total = headLength + length, sent = 0;
+    struct iovec iov[2];
+    ssize_t n;
+
+    if (headLength > sizeof(head)) {
+        return -1;
+    }
+
+    while (sent < total) {
+        if (sent < headLength) {
+            iov[0].iov_base = head + sent;
+            iov[0].iov_len = headLength - sent;
+            iov[1].iov_base = (void *)body;
+            iov[1].iov_len = length;
+            n = writev(sockfd, iov, 2);
+        } else {
+            iov[0].iov_base = (char *)body + (sent - headLength);
+            iov[0].iov_len = total - sent;
+            n = writev(sockfd, iov, 1);
+        }
+
+        // Non-blocking socket is full, wait for the client to read
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (errno == EINTR || wait_writable(sockfd) > 0) {
+                continue;
+            }
+        }
+
+        if (n == -1) {
+            return -1;
+        }
+
+        sent += n;
+    }
+
+    return sent;
+}
+
+/**
+ * Returns length of `s` up to the first `c` or `end`, whichever comes first
+*/
+static size_t span(const char *s, const char *end, char c) {
+    const char *p = memchr(s, c, end - s);
+
+    return p ? (size_t)(p - s) : (size_t)(end - s);
+}
+
+/**
+ * Returns length of the request head (request line and headers, including the blank line)
+ * in `raw`, or 0 if the blank line has not been received yet
+*/
+size_t request_head_length(const char *raw, size_t rawLen) {
+    const char *end = raw + rawLen;
+    const char *p = raw;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        ++p;
+
+        if (p < end && *p == '\n') {
+            return p + 1 - raw;
+        }
+
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n') {
+            return p + 2 - raw;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Incremental form of request_head_length, for a head arriving in pieces
+ *
+ * Only looks at the new bytes: `state` carries how much of a `\n\n` or `\n\r\n`
+ * terminator ended the previous piece (start with 0). Returns the number of
+ * bytes of `data` up to and including the blank line, or 0 if it has not arrived
+*/
+size_t scan_head_end(const char *data, size_t len, int *state) {
+    const char *end = data + len;
+    const char *p = data;
+
+    while (p < end) {
+        // Nothing pending, skip straight to the next line end
+        if (*state == 0) {
+            if ((p = memchr(p, '\n', end - p)) == NULL) {
+                return 0;
+            }
+
+            *state = 1;
+            ++p;
+            continue;
+        }
+
+        if (*p == '\n') {
+            *state = 0;
+            return p + 1 - data;
+        }
+
+        *state = *p == '\r' && *state == 1 ? 2 : 0;
+        ++p;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the method named by the `len` bytes of `s`, or -1 if it is not one we handle
+*/
+int parse_method(const char *s, size_t len) {
+    int method;
+
+    for (method = 0; method < HTTP_METHOD_COUNT; ++method) {
+        if (len == strlen(method_name(method)) && memcmp(s, method_name(method), len) == 0) {
+            return method;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Copies the request target into `req->path`, splitting off the query string
+ *
+ * The target is kept as sent, it is only decoded when resolved against the
+ * document root, and the query only parsed if a handler asks for it
+*/
+int set_request_target(struct HttpRequest *req, const char *target, size_t len) {
+    // Allocate correct amount of memory based on path length (+ 1 for null terminating char)
+    req->path = malloc(len + 1);
+
+    if (!req->path) {
+        return -1;
+    }
+
+    memcpy(req->path, target, len);
+    req->path[len] = '\0';
+
+    req->paramCount = -1;
+    if ((req->query = memchr(req->path, '?', len)) != NULL) {
+        *req->query++ = '\0';
+        req->queryLength = req->path + len - req->query;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the request's Content-Length into `*length`, 0 without one. Returns
+ * -1 unless every Content-Length header is the same run of digits, as a body
+ * framed two ways could be read as one by this server and another by the next
+*/
+static int parse_content_length(struct HttpRequestHeader *headers, size_t *length) {
+    struct HttpRequestHeader *header;
+    const char *p;
+    size_t value;
+    int seen = 0;
+
+    *length = 0;
+
+    for (header = headers; header; header = header->next) {
+        if (strcasecmp(header->name, HTTP_HEADER_CONTENT_LENGTH) != 0) {
+            continue;
+        }
+
+        if (!header->value[0]) {
+            return -1;
+        }
+
+        for (value = 0, p = header->value; *p; ++p) {
+            if (*p < '0' || *p > '9' || value > (SIZE_MAX - 9) / 10) {
+                return -1;
+            }
+            value = value * 10 + (*p - '0');
+        }
+
+        if (seen && value != *length) {
+            return -1;
+        }
+
+        *length = value;
+        seen = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Parses the request line and headers at the start of `rawLen` bytes of raw
+ * request into HttpRequest struct, leaving the body to parse_request_body
+ *
+ * Sets `headLength` to where the body starts. `contentLength` is taken from
+ * the header, whatever the method, for parse_request_body (or a proxy) to
+ * judge. A body is only ever framed by Content-Length: one sent chunked is
+ * refused, as it would be left to be read as the next request. On failure
+ * returns NULL and sets `status` to the HTTP status the caller should respond with
+*/
+struct HttpRequest *parse_request_head(const char *raw, size_t rawLen, size_t *headLength, int *status) {
+    struct HttpRequest *req = NULL;
+    struct HttpRequestHeader *header = NULL;
+    const char *start = raw, *end = raw + rawLen;
+    size_t len = span(raw, end, ' '); // Store length of each part (method, path, etc.)
+    char *connection;
+    int method;
+
+    req = calloc(1, sizeof(struct HttpRequest));
+
+    if (!req) {
+        *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        return NULL;
+    }
+
+    if (!len || len < strlen(HTTP_METHOD_GET) || len > strlen(HTTP_METHOD_DELETE) || len == rawLen) {
+        *status = HTTP_STATUS_BAD_REQUEST;
+        free_request(req);
+        return NULL;
+    }
+
+    // If valid method, copy method to struct (already includes null terminator)
+    if ((method = parse_method(raw, len)) == -1) {
+        *status = HTTP_STATUS_NOT_IMPLEMENTED;
+        free_request(req);
+        return NULL;
+    }
+    req->method = method;
+
+    // Move pointer to start of path and determine path length
+    raw += len + 1;
+    len = span(raw, end, ' ');
+
+    // No path (or nothing after it) - 400 Bad Request
+    if (!len || raw + len == end) {
+        *status = HTTP_STATUS_BAD_REQUEST;
+        free_request(req);
+        return NULL;
+    }
+
+    if (set_request_target(req, raw, len) == -1) {
+        *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        free_request(req);
+        return NULL;
+    }
+
+    // Move pointer to start of HTTP version
+    raw += len + 1;
+
+    // Length of HTTP version
+    len = span(raw, end, '\n');
+
+    // If second to last char is \r, is CLRF so reduce length by 1
+    if (len && raw[len - 1] == '\r') {
+        --len;
+    }
+
+    // Check version is supported (both have the same length)
+    if (len != strlen(HTTP_VERSION) || (memcmp(raw, HTTP_VERSION, len) != 0 && memcmp(raw, HTTP_VERSION_1_1, len) != 0)) {
+        *status = HTTP_STATUS_HTTP_VERSION_NOT_SUPPORTED;
+        free_request(req);
+        return NULL;
+    }
+
+    // Allocate memory for HTTP version based on length of HTTP version (+ 1 for null terminating char)
+    req->version = malloc(len + 1);
+
+    if (!req->version) {
+        *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        free_request(req);
+        return NULL;
+    }
+
+    // Copy version to struct member and add null terminating char
+    memcpy(req->version, raw, len);
+    req->version[len] = '\0';
+
+    // Move pointer to start of first line of headers (passed <CR> or <LF>)
+    raw += len + 1;
+
+    // If pointing at \n then is CRLF and we only moved passed the \r
+    if (raw < end && raw[0] == '\n') {
+        ++raw;
+    }
+
+    // While next line exists and does not start with \r or \n (blank line indicates end of headers and start of body)
+    while (raw < end && raw[0] != '\n' && raw[0] != '\r') {
+        size_t lineLen = span(raw, end, '\n');
+
+        // Length of header name
+        len = span(raw, raw + lineLen, ':');
+
+        // No header name or no colon - 400 Bad Request
+        if (!len || len == lineLen) {
+            *status = HTTP_STATUS_BAD_REQUEST;
+            free_request(req);
+            return NULL;
+        }
+
+        header = calloc(1, sizeof(HttpRequestHeader));
+
+        if (!header) {
+            *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            free_request(req);
+            return NULL;
+        }
+
+        // Link header in straight away so it is freed with the request on error
+        header->next = req->headers;
+        req->headers = header;
+
+        // Allocate memory based on length of header name (+ 1 for null terminator)
+        header->name = malloc(len + 1);
+
+        if (!header->name) {
+            *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            free_request(req);
+            return NULL;
+        }
+
+        memcpy(header->name, raw, len);
+
+        // Add null terminating char to end of header name
+        header->name[len] = '\0';
+
+        // Move raw req buffer passed colon
+        raw += len + 1;
+        lineLen -= len + 1;
+
+        // Ignore any spaces between ":" and value (e.g: Header-Name:   header-value)
+        while (lineLen && *raw == ' ') {
+            ++raw;
+            --lineLen;
+        }
+
+        // Length of header value
+        len = lineLen;
+
+        // If second to last char is CR then request uses CRLF so reduce length by 1
+        if (len && raw[len - 1] == '\r') {
+            --len;
+        }
+
+        // Allocate memory based on length of header value (+ 1 for null terminator)
+        header->value = malloc(len + 1);
+
+        if (!header->value) {
+            *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            free_request(req);
+            return NULL;
+        }
+
+        memcpy(header->value, raw, len);
+
+        // Add null terminating char to end of header value
+        header->value[len] = '\0';
+
+        // Move to next header (passed <LF>)
+        raw += lineLen < (size_t)(end - raw) ? lineLen + 1 : lineLen;
+    }
+
+    // Move passed blank line
+    if (raw < end && raw[0] == '\r') {
+        ++raw;
+    }
+    if (raw < end && raw[0] == '\n') {
+        ++raw;
+    }
+
+    // HTTP/1.1 connections persist unless the client says otherwise, HTTP/1.0 ones only if it asks
+    connection = get_header_value(HTTP_HEADER_CONNECTION, req->headers);
+
+    if (strcmp(req->version, HTTP_VERSION_1_1) == 0) {
+        req->keepAlive = !connection || strcasecmp(connection, "close") != 0;
+    } else {
+        req->keepAlive = connection && strcasecmp(connection, "keep-alive") == 0;
+    }
+
+    *headLength = raw - start;
+
+    if (get_header_value("Transfer-Encoding", req->headers)) {
+        *status = HTTP_STATUS_NOT_IMPLEMENTED;
+        free_request(req);
+        return NULL;
+    }
+
+    if (parse_content_length(req->headers, &req->contentLength) == -1) {
+        *status = HTTP_STATUS_BAD_REQUEST;
+        free_request(req);
+        return NULL;
+    }
+
+    return req;
+}
+
+/**
+ * Copies the body of a request parsed by parse_request_head out of the
+ * `available` bytes that follow its head, as much of it as has arrived. The
+ * body of a GET is not kept, the caller still skips over it
+ *
+ * Returns -1 and sets `status` if the body is empty or too large to buffer
+*/
+int parse_request_body(struct HttpRequest *req, const char *raw, size_t available, int *status) {
+    if (!get_header_value(HTTP_HEADER_CONTENT_LENGTH, req->headers)) {
+        return 0;
+    }
+
+    if ((req->contentLength == 0 && req->method != GET) || req->contentLength > HTTP_MAX_BODY_SIZE) {
+        *status = HTTP_STATUS_BAD_REQUEST;
+        return -1;
+    }
+
+    if (req->method == GET) {
+        return 0;
+    }
+
+    // Allocate memory based on length of body (+ 1 for null terminator)
+    req->body = calloc(req->contentLength + 1, 1);
+
+    if (!req->body) {
+        *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        return -1;
+    }
+
+    // Copy as much of the body as has been received
+    memcpy(req->body, raw, available < req->contentLength ? available : req->contentLength);
+
+    return 0;
+}
+
+/**
+ * Parses `rawLen` bytes of raw request into HttpRequest struct
+ *
+ * Does not touch any socket. On failure returns NULL and sets `status` to the
+ * HTTP status the caller should respond with
+*/
+struct HttpRequest *parse_request(const char *raw, size_t rawLen, int *status) {
+    size_t headLength;
+    struct HttpRequest *req = parse_request_head(raw, rawLen, &headLength, status);
+
+    if (req && parse_request_body(req, raw + headLength, rawLen - headLength, status) == -1) {
+        free_request(req);
+        return NULL;
+    }
+
+    return req;
+}
+
+/**
+ * Advances `s` over `len` bytes of a chunked body (RFC 7230 4.1) without
+ * decoding it
+ *
+ * Returns how many of the bytes belong to the body: all of them, or fewer
+ * once its end (after any trailers) has been reached and `s->state` is
+ * CHUNK_END. Returns -1 if the framing is malformed
+*/
+ssize_t scan_chunked(struct ChunkScanner *s, const char *data, size_t len) {
+    size_t i = 0, take;
+    char ch;
+    int digit;
+
+    while (i < len && s->state != CHUNK_END) {
+        if (s->state == CHUNK_DATA) {
+            take = s->left < len - i ? s->left : len - i;
+            s->left -= take;
+            i += take;
+            if (!s->left) {
+                s->state = CHUNK_DATA_CR;
+            }
+            continue;
+        }
+
+        ch = data[i++];
+
+        switch (s->state) {
+            case CHUNK_SIZE:
+                digit = ch >= '0' && ch <= '9' ? ch - '0'
+                    : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+                    : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+
+                if (digit != -1) {
+                    if (s->left >> 60) {
+                        return -1;
+                    }
+                    s->left = s->left << 4 | digit;
+                    s->digits = 1;
+                } else if (!s->digits) {
+                    return -1;
+                } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                    s->state = CHUNK_EXTENSION;
+                } else if (ch == '\r') {
+                    s->state = CHUNK_SIZE_LF;
+                } else if (ch == '\n') {
+                    s->state = s->left ? CHUNK_DATA : CHUNK_TRAILER;
+                } else {
+                    return -1;
+                }
+                break;
+            case CHUNK_EXTENSION:
+                if (ch == '\n') {
+                    s->state = s->left ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                break;
+            case CHUNK_SIZE_LF:
+                if (ch != '\n') {
+                    return -1;
+                }
+                s->state = s->left ? CHUNK_DATA : CHUNK_TRAILER;
+                break;
+            case CHUNK_DATA_CR:
+                if (ch == '\r') {
+                    s->state = CHUNK_DATA_LF;
+                    break;
+                }
+                // A bare LF ends the chunk too
+                /* fall through */
+            case CHUNK_DATA_LF:
+                if (ch != '\n') {
+                    return -1;
+                }
+                s->state = CHUNK_SIZE;
+                s->digits = 0;
+                break;
+            case CHUNK_TRAILER:
+                s->state = ch == '\r' ? CHUNK_END_LF : ch == '\n' ? CHUNK_END : CHUNK_TRAILER_LINE;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (ch == '\n') {
+                    s->state = CHUNK_TRAILER;
+                }
+                break;
+            case CHUNK_END_LF:
+                if (ch != '\n') {
+                    return -1;
+                }
+                s->state = CHUNK_END;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return i;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/**
+ * Decodes `len` bytes of a query key or value (`%XX` escapes and `+` for space) into `dst`
+ *
+ * Null terminates `dst`. Returns the decoded length, or -1 if it does not fit in
+ * `cap` or an escape is malformed
+*/
+ssize_t decode_query_component(char *dst, size_t cap, const char *src, size_t len) {
+    const char *end = src + len;
+    size_t out = 0;
+
+    while (src < end) {
+        if (out + 1 >= cap) {
+            return -1;
+        }
+
+        if (*src == '%') {
+            if (end - src < 3 || hex_digit(src[1]) == -1 || hex_digit(src[2]) == -1) {
+                return -1;
+            }
+
+            dst[out++] = hex_digit(src[1]) << 4 | hex_digit(src[2]);
+            src += 3;
+        } else {
+            dst[out++] = *src == '+' ? ' ' : *src;
+            ++src;
+        }
+    }
+
+    if (!cap) {
+        return -1;
+    }
+
+    dst[out] = '\0';
+
+    return out;
+}
+
+/**
+ * Compares an encoded query component against a plain string, decoding as it goes
+*/
+static int query_component_equals(const char *src, size_t len, const char *s) {
+    const char *end = src + len;
+    int c;
+
+    while (src < end) {
+        if (*src == '%' && end - src >= 3 && hex_digit(src[1]) != -1 && hex_digit(src[2]) != -1) {
+            c = hex_digit(src[1]) << 4 | hex_digit(src[2]);
+            src += 3;
+        } else {
+            c = *src == '+' ? ' ' : *src;
+            ++src;
+        }
+
+        if (!*s || c != (unsigned char)*s++) {
+            return 0;
+        }
+    }
+
+    return !*s;
+}
+
+/**
+ * Splits the query string into `req->params`, without copying or decoding
+ *
+ * Pairs are separated by `&` (empty ones are skipped) and a pair without `=`
+ * has an empty value. Parameters beyond HTTP_MAX_QUERY_PARAMS are ignored.
+ * Only runs once per request, returns the number of parameters
+*/
+int parse_query(struct HttpRequest *req) {
+    const char *p, *end, *pair;
+    size_t len;
+    struct HttpQueryParam *param;
+
+    if (req->paramCount >= 0) {
+        return req->paramCount;
+    }
+
+    req->paramCount = 0;
+
+    if (!req->query) {
+        return 0;
+    }
+
+    p = req->query;
+    end = req->query + req->queryLength;
+
+    while (p < end && req->paramCount < HTTP_MAX_QUERY_PARAMS) {
+        len = span(p, end, '&');
+        pair = p;
+        p += len < (size_t)(end - p) ? len + 1 : len;
+
+        if (!len) {
+            continue;
+        }
+
+        param = &req->params[req->paramCount++];
+        param->key = pair;
+        param->keyLength = span(pair, pair + len, '=');
+
+        if (param->keyLength < len) {
+            param->value = pair + param->keyLength + 1;
+            param->valueLength = len - param->keyLength - 1;
+        } else {
+            param->value = pair + len;
+            param->valueLength = 0;
+        }
+    }
+
+    return req->paramCount;
+}
+
+/**
+ * Returns the first query parameter whose decoded key is `key`, or NULL
+*/
+const struct HttpQueryParam *find_query_param(struct HttpRequest *req, const char *key) {
+    int i;
+
+    parse_query(req);
+
+    for (i = 0; i < req->paramCount; ++i) {
+        if (query_component_equals(req->params[i].key, req->params[i].keyLength, key)) {
+            return &req->params[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Decodes the value of query parameter `key` into `dst`
+ *
+ * Returns its length, or -1 if there is no such parameter or it does not fit
+*/
+ssize_t get_query_param(struct HttpRequest *req, const char *key, char *dst, size_t cap) {
+    const struct HttpQueryParam *param = find_query_param(req, key);
+
+    if (!param) {
+        return -1;
+    }
+
+    return decode_query_component(dst, cap, param->value, param->valueLength);
+}
@@ -1,13 +1,20 @@
 #ifndef HTTP_H_
 #define HTTP_H_
 
-#define PORT "3000"
+#include <stddef.h>
+#include <sys/types.h>
+
 #define HTTP_VERSION "HTTP/1.0"
+#define HTTP_VERSION_1_1 "HTTP/1.1"
 #define HTTP_HEADER_DATE_FORMAT "%a, %d %Y %b %X %Z"
 #define HTTP_HEADER_DATE_LENGTH 30
 #define SERVER_NAME "Palmers Basic HTTP"
 #define HTTP_STATUS_REASON_MAX_SIZE 32
 #define HTTP_MAX_BODY_SIZE 1000000
+#define HTTP_RESPONSE_BUFFER_SIZE 4096
+#define HTTP_SEND_TIMEOUT_MS 30000
+#define HTTP_MAX_QUERY_PARAMS 16
+#define HTTP_MAX_HEAD_SIZE 65536
 
 /**
  * HTTP methods
@@ -16,12 +23,19 @@
 #define HTTP_METHOD_POST "POST"
 #define HTTP_METHOD_PUT "PUT"
 #define HTTP_METHOD_DELETE "DELETE"
+#define HTTP_METHOD_COUNT 4
 
 /**
  * HTTP header names
 */
 #define HTTP_HEADER_CONTENT_LENGTH "Content-Length"
 #define HTTP_HEADER_CONTENT_TYPE "Content-Type"
+#define HTTP_HEADER_CONTENT_ENCODING "Content-Encoding"
+#define HTTP_HEADER_ACCEPT_ENCODING "Accept-Encoding"
+#define HTTP_HEADER_ETAG "ETag"
+#define HTTP_HEADER_IF_NONE_MATCH "If-None-Match"
+#define HTTP_HEADER_VARY "Vary"
+#define HTTP_HEADER_CONNECTION "Connection"
 
 /**
  * HTTP status codes
@@ -57,6 +71,9 @@
 #define HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE 413
 #define HTTP_STATUS_REQUEST_URI_TOO_LARGE 414
 #define HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE 415
+#define HTTP_STATUS_UPGRADE_REQUIRED 426
+#define HTTP_STATUS_TOO_MANY_REQUESTS 429
+#define HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE 431
 #define HTTP_STATUS_INTERNAL_SERVER_ERROR 500
 #define HTTP_STATUS_NOT_IMPLEMENTED 501
 #define HTTP_STATUS_BAD_GATEWAY 502
@@ -72,25 +89,73 @@ typedef struct HttpRequestHeader {
     struct HttpRequestHeader *next;
 } HttpRequestHeader;
 
+/**
+ * One `key=value` pair of a query string, as raw (still encoded) slices of the request
+*/
+typedef struct HttpQueryParam {
+    const char *key;
+    size_t keyLength;
+    const char *value;
+    size_t valueLength;
+} HttpQueryParam;
+
 typedef struct HttpRequest {
     enum HttpMethod method;
-    char *path;
+    char *path; // Request target up to the `?`
+    char *query; // After the `?` in the same allocation as `path`, NULL without one
+    size_t queryLength;
+    struct HttpQueryParam params[HTTP_MAX_QUERY_PARAMS]; // Filled on first lookup, see get_query_param
+    int paramCount; // -1 until the query has been split
     char *version;
+    int keepAlive; // Client wants the connection kept open (HTTP/1.1 without `close`, or HTTP/1.0 with `keep-alive`)
+    size_t contentLength;
     struct HttpRequestHeader *headers;
     char *body;
 } HttpRequest;
 
+/**
+ * Where scan_chunked is in a chunked body, zeroed to start
+*/
+typedef enum ChunkState {
+    CHUNK_SIZE, CHUNK_EXTENSION, CHUNK_SIZE_LF, CHUNK_DATA, CHUNK_DATA_CR, CHUNK_DATA_LF,
+    CHUNK_TRAILER, CHUNK_TRAILER_LINE, CHUNK_END_LF, CHUNK_END
+} ChunkState;
+
+typedef struct ChunkScanner {
+    enum ChunkState state;
+    int digits; // Seen a digit of the chunk size
+    unsigned long long left; // Of the chunk size, or of the chunk being skipped
+} ChunkScanner;
+
 typedef struct HttpResponse {
+    const char *version; // Of the status line, HTTP_VERSION if NULL
     struct HttpRequestHeader *headers;
     char *body;
 } HttpResponse;
 
-typedef struct HttpQueryParam {
-    char *key;
-    char *value;
-    struct HttpQueryParam *next;
-} HttpQueryParam;
-
 const char *reason_from_status_code(int status);
+const char *method_name(enum HttpMethod method);
+void free_header(struct HttpRequestHeader *h);
+void free_request(struct HttpRequest *req);
+void free_response(struct HttpResponse *res);
+char *get_header_value(char *name, struct HttpRequestHeader *headers);
+int add_response_header(char *name, char *value, struct HttpResponse *res);
+size_t request_head_length(const char *raw, size_t rawLen);
+size_t scan_head_end(const char *data, size_t len, int *state);
+int parse_method(const char *s, size_t len);
+int set_request_target(struct HttpRequest *req, const char *target, size_t len);
+struct HttpRequest *parse_request_head(const char *raw, size_t rawLen, size_t *headLength, int *status);
+int parse_request_body(struct HttpRequest *req, const char *raw, size_t available, int *status);
+struct HttpRequest *parse_request(const char *raw, size_t rawLen, int *status);
+ssize_t scan_chunked(struct ChunkScanner *s, const char *data, size_t len);
+ssize_t decode_query_component(char *dst, size_t cap, const char *src, size_t len);
+int parse_query(struct HttpRequest *req);
+const struct HttpQueryParam *find_query_param(struct HttpRequest *req, const char *key);
+ssize_t get_query_param(struct HttpRequest *req, const char *key, char *dst, size_t cap);
+size_t serialize_head(char *dst, size_t cap, struct HttpResponse *res, int status, long long contentLength);
+size_t serialize_response(char *dst, size_t cap, struct HttpResponse *res, int status);
+ssize_t send_response(int sockfd, struct HttpResponse *res, int status);
+ssize_t send_file_response(int sockfd, struct HttpResponse *res, int status, int fd, off_t offset, off_t size);
+ssize_t send_mapped_response(int sockfd, struct HttpResponse *res, int status, const void *body, size_t length);
 
 #endif
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mapcache.h"
+
+struct MapCache *mapcache_create(void) {
+    return calloc(1, sizeof(struct MapCache));
+}
+
+/**
+ * FNV-1a of the key
+*/
+static unsigned long hash_key(const char *key) {
+    unsigned long hash = 2166136261UL;
+
+    while (*key) {
+        hash = (hash ^ (unsigned char)*key++) * 16777619UL;
+    }
+
+    return hash;
+}
+
+static void unref(struct MapEntry *e) {
+    if (--e->refs == 0) {
+        if (e->shared) {
+            shmcache_release(e->shared);
+        } else {
+            munmap(e->map, e->size);
+        }
+        free(e->key);
+        free(e);
+    }
+}
+
+/**
+ * Drops the table's reference to the entry in `slot`
+*/
+static void evict(struct MapCache *c, size_t slot) {
+    struct MapEntry *e = c->slots[slot];
+
+    c->slots[slot] = NULL;
+    e->cached = 0;
+    unref(e);
+}
+
+/**
+ * Returns true if the entry still describes the file as it is now
+*/
+static int is_fresh(const struct MapEntry *e, const struct stat *st) {
+    return e->ino == st->st_ino && e->dev == st->st_dev && e->size == st->st_size
+        && e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Wraps a body pinned in the shared cache, so the caller releases it like any other entry
+*/
+static struct MapEntry *get_shared(const char *key, unsigned long hash, int fd, const struct stat *st, int *hit) {
+    struct MapEntry *e;
+    struct ShmSlot *pin;
+    const char *body;
+
+    if (!(body = shmcache_get(key, hash, fd, st, &pin, hit))) {
+        return NULL;
+    }
+
+    if (!(e = calloc(1, sizeof(struct MapEntry)))) {
+        shmcache_release(pin);
+        return NULL;
+    }
+
+    e->map = (void *)body;
+    e->size = st->st_size;
+    e->refs = 1;
+    e->shared = pin;
+
+    return e;
+}
+
+/**
+ * Returns a referenced mapping of the open file `fd` (described by `st`), mapping
+ * it only if the cache has no up-to-date one
+ *
+ * Files the cache every worker shares holds (see shmcache_init) are served
+ * from there first, so a file read in by one worker is a hit in all of them.
+ * What it cannot take is mapped per worker as before
+ *
+ * Each key probes at most MAPCACHE_MAX_PROBE slots; when they are all taken the
+ * least recently used one is replaced. Returns NULL if the file cannot be mapped.
+ * The caller may close `fd` straight away and must mapcache_release the entry
+*/
+struct MapEntry *mapcache_get(struct MapCache *c, const char *key, int fd, const struct stat *st, int *hit) {
+    unsigned long hash = hash_key(key);
+    size_t i, slot, victim = hash & (MAPCACHE_SLOTS - 1);
+    int settled = 0; // Victim is an empty slot or the stale entry for this key
+    struct MapEntry *e;
+
+    if ((e = get_shared(key, hash, fd, st, hit))) {
+        return e;
+    }
+
+    *hit = 0;
+    ++c->clock;
+
+    for (i = 0; i < MAPCACHE_MAX_PROBE; ++i) {
+        slot = (hash + i) & (MAPCACHE_SLOTS - 1);
+        e = c->slots[slot];
+
+        if (!e) {
+            if (!settled) {
+                victim = slot;
+                settled = 1;
+            }
+            continue;
+        }
+
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            if (is_fresh(e, st)) {
+                e->lastUsed = c->clock;
+                ++e->refs;
+                *hit = 1;
+                return e;
+            }
+
+            // File changed since it was mapped, requests still sending the old one keep it alive
+            victim = slot;
+            break;
+        }
+
+        if (!settled && e->lastUsed < c->slots[victim]->lastUsed) {
+            victim = slot;
+        }
+    }
+
+    e = calloc(1, sizeof(struct MapEntry));
+
+    if (!e || !(e->key = strdup(key))) {
+        free(e);
+        return NULL;
+    }
+
+    e->map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (e->map == MAP_FAILED) {
+        free(e->key);
+        free(e);
+        return NULL;
+    }
+
+    // Small files are sent whole, so read them in now rather than fault page by page
+    madvise(e->map, st->st_size, MADV_WILLNEED);
+
+    e->hash = hash;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->lastUsed = c->clock;
+    e->refs = 2; // The table and the caller
+    e->cached = 1;
+
+    if (c->slots[victim]) {
+        evict(c, victim);
+    }
+
+    c->slots[victim] = e;
+
+    return e;
+}
+
+void mapcache_release(struct MapEntry *e) {
+    unref(e);
+}
+
+/**
+ * Removes an entry whose file turned out to be shorter than its mapping
+*/
+void mapcache_invalidate(struct MapCache *c, struct MapEntry *e) {
+    size_t i, slot;
+
+    if (!e->cached) {
+        return;
+    }
+
+    for (i = 0; i < MAPCACHE_MAX_PROBE; ++i) {
+        slot = (e->hash + i) & (MAPCACHE_SLOTS - 1);
+
+        if (c->slots[slot] == e) {
+            evict(c, slot);
+            return;
+        }
+    }
+}
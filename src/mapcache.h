@@ -0,0 +1,47 @@
+#ifndef MAPCACHE_H_
+#define MAPCACHE_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "shmcache.h"
+
+#define MAPCACHE_SLOTS 1024 // Must be a power of 2
+#define MAPCACHE_MAX_PROBE 8
+
+/**
+ * A file mapped once and shared by every request serving it
+ *
+ * `refs` counts requests still sending from `map`. An entry replaced or evicted
+ * while in use is only unmapped once the last of them releases it
+*/
+typedef struct MapEntry {
+    char *key;
+    unsigned long hash;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    void *map;
+    int refs;
+    int cached; // Still in the table, so the table holds a reference too
+    unsigned long lastUsed;
+    struct ShmSlot *shared; // `map` is pinned in the shared cache rather than mapped
+} MapEntry;
+
+/**
+ * Per-worker table of mappings, keyed by normalized path (see normalize_path)
+*/
+typedef struct MapCache {
+    struct MapEntry *slots[MAPCACHE_SLOTS];
+    unsigned long clock;
+} MapCache;
+
+struct MapCache *mapcache_create(void);
+struct MapEntry *mapcache_get(struct MapCache *c, const char *key, int fd, const struct stat *st, int *hit);
+void mapcache_release(struct MapEntry *e);
+void mapcache_invalidate(struct MapCache *c, struct MapEntry *e);
+
+#endif
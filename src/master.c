@@ -0,0 +1,821 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "socket.h"
+#include "metrics.h"
+#include "access_log.h"
+#include "ratelimit.h"
+#include "sse.h"
+#include "shmcache.h"
+#include "acceptor.h"
+#include "tls.h"
+#include "worker.h"
+#include "files.h"
+#include "router.h"
+#include "handlers.h"
+#include "bundle.h"
+#include "master.h"
+
+static struct ServerConfig config;
+static struct WorkerProcess procs[METRICS_MAX_WORKERS];
+static int generation = 0;
+static int workerCount = 0;
+
+static int listenSockfds[MAX_LISTENERS];
+static char listenAddresses[MAX_LISTENERS][CONFIG_ADDRESS_MAX];
+static int listenerCount = 0;
+static int rootfd = -1;
+static int uploadfd = -1; // Only with an upload_dir
+static struct Router router;
+static struct Bundle bundle;
+static struct ssl_ctx_st *tls = NULL; // Only with a TLS listener
+
+static int upgradeSockfd = -1; // Listening for a new binary to take over
+static int handoffSockfd = -1; // Connection to the new binary, waiting for its ready byte
+static int shuttingDown = 0;
+
+static int signalPipe[2] = { -1, -1 };
+static volatile sig_atomic_t reloadRequested = 0;
+static volatile sig_atomic_t upgradeRequested = 0;
+static volatile sig_atomic_t quitRequested = 0;
+static volatile sig_atomic_t terminateRequested = 0;
+static volatile sig_atomic_t dumpRequested = 0;
+
+static int savedArgc;
+static char **savedArgv;
+
+/**
+ * Records the signal and wakes the master loop through the self-pipe
+*/
+static void on_signal(int sig) {
+    int savedErrno = errno;
+
+    switch (sig) {
+        case SIGHUP: reloadRequested = 1; break;
+        case SIGUSR2: upgradeRequested = 1; break;
+        case SIGUSR1: dumpRequested = 1; break;
+        case SIGQUIT: quitRequested = 1; break;
+        case SIGTERM:
+        case SIGINT: terminateRequested = 1; break;
+    }
+
+    write(signalPipe[1], "", 1);
+    errno = savedErrno;
+}
+
+static unsigned long long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Forks a worker for `slot`, which accepts on the listening sockets until told to stop
+*/
+static int spawn_worker(int slot) {
+    struct Worker w;
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("Error creating fork");
+        return -1;
+    }
+
+    // Is child process - drop everything that belongs to the master and run the worker loop
+    if (pid == 0) {
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        close(signalPipe[0]);
+        close(signalPipe[1]);
+        if (upgradeSockfd != -1) {
+            close(upgradeSockfd);
+        }
+        if (handoffSockfd != -1) {
+            close(handoffSockfd);
+        }
+        acceptor_forked(slot);
+        shmcache_forked(slot);
+
+        memset(&w, 0, sizeof w);
+        w.id = slot;
+        memcpy(w.listenSockfds, listenSockfds, sizeof(listenSockfds));
+        w.listenerCount = listenerCount;
+        w.rootfd = rootfd;
+        w.uploadfd = uploadfd;
+        w.router = &router;
+        w.bundle = &bundle;
+        w.tls = tls;
+        w.config = &config;
+        w.metrics = metrics_slot(slot);
+        w.accessLog = access_log_ring(slot);
+
+        worker_run(&w);
+        _exit(0);
+    }
+
+    procs[slot].pid = pid;
+    procs[slot].generation = generation;
+    procs[slot].retireDeadlineMs = 0;
+    acceptor_open(slot, 1);
+
+    return 0;
+}
+
+/**
+ * Starts workers of the current generation until there are workerCount of them.
+ * Workers of an older generation not yet retired do not count towards it
+ *
+ * Each worker owns a metrics slot and access log ring, so a new worker takes a
+ * slot no live (possibly still draining) worker is using
+*/
+static void ensure_workers(void) {
+    int live = 0, slot;
+
+    if (shuttingDown) {
+        return;
+    }
+
+    for (slot = 0; slot < METRICS_MAX_WORKERS; ++slot) {
+        if (procs[slot].pid && !procs[slot].retireDeadlineMs && procs[slot].generation == generation) {
+            ++live;
+        }
+    }
+
+    for (slot = 0; slot < METRICS_MAX_WORKERS && live < workerCount; ++slot) {
+        if (!procs[slot].pid && spawn_worker(slot) == 0) {
+            ++live;
+        }
+    }
+
+    if (live < workerCount) {
+        fprintf(stderr, "Only %d of %d workers running, waiting for draining workers to exit\n", live, workerCount);
+    }
+}
+
+/**
+ * Asks every current worker, or with `olderOnly` those of an older generation,
+ * to stop accepting, finish its connections and exit
+*/
+static void retire_workers(int olderOnly) {
+    unsigned long long deadline = now_ms() + config.shutdownTimeoutMs;
+    int slot;
+
+    for (slot = 0; slot < METRICS_MAX_WORKERS; ++slot) {
+        if (procs[slot].pid && !procs[slot].retireDeadlineMs && (!olderOnly || procs[slot].generation != generation)) {
+            procs[slot].retireDeadlineMs = deadline;
+            acceptor_open(slot, 0);
+            kill(procs[slot].pid, SIGQUIT);
+        }
+    }
+}
+
+/**
+ * Passes SIGUSR1 on to the workers, each writing out its own traces
+*/
+static void dump_traces(void) {
+    int slot;
+
+    for (slot = 0; slot < METRICS_MAX_WORKERS; ++slot) {
+        if (procs[slot].pid) {
+            kill(procs[slot].pid, SIGUSR1);
+        }
+    }
+}
+
+/**
+ * Collects exited workers, freeing their slots and what they held of the
+ * shared file cache
+*/
+static void reap_workers(void) {
+    pid_t pid;
+    int status, slot;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (slot = 0; slot < METRICS_MAX_WORKERS; ++slot) {
+            if (procs[slot].pid == pid) {
+                if (!procs[slot].retireDeadlineMs) {
+                    fprintf(stderr, "Worker %d (pid %d) exited unexpectedly, restarting\n", slot, (int)pid);
+                }
+                procs[slot].pid = 0;
+                acceptor_open(slot, 0);
+                shmcache_worker_exited(slot);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Kills retiring workers that are still draining past shutdown_timeout_ms
+*/
+static int enforce_deadlines(void) {
+    unsigned long long now = now_ms();
+    int slot, retiring = 0;
+
+    for (slot = 0; slot < METRICS_MAX_WORKERS; ++slot) {
+        if (procs[slot].pid && procs[slot].retireDeadlineMs) {
+            ++retiring;
+
+            if (now >= procs[slot].retireDeadlineMs) {
+                kill(procs[slot].pid, SIGKILL);
+            }
+        }
+    }
+
+    return retiring;
+}
+
+static int live_workers(void) {
+    int slot, live = 0;
+
+    for (slot = 0; slot < METRICS_MAX_WORKERS; ++slot) {
+        if (procs[slot].pid) {
+            ++live;
+        }
+    }
+
+    return live;
+}
+
+/**
+ * Makes the open listeners match `c`, reusing sockets whose address is unchanged
+ *
+ * Sockets handed over by a previous binary (`inherited`) are adopted by address
+ * before anything is bound, so a takeover never closes an accept queue. Returns
+ * -1 (leaving the current listeners untouched) if a new listener cannot be created
+*/
+static int sync_listeners(const struct ServerConfig *c, int inherited[], char inheritedAddresses[][CONFIG_ADDRESS_MAX],
+    int inheritedCount) {
+    int fds[MAX_LISTENERS];
+    int i, j, created[MAX_LISTENERS];
+
+    for (i = 0; i < c->listenerCount; ++i) {
+        fds[i] = -1;
+        created[i] = 0;
+
+        for (j = 0; j < listenerCount; ++j) {
+            if (listenSockfds[j] != -1 && strcmp(listenAddresses[j], c->listeners[i].address) == 0) {
+                fds[i] = listenSockfds[j];
+                break;
+            }
+        }
+
+        for (j = 0; fds[i] == -1 && j < inheritedCount; ++j) {
+            if (inherited[j] != -1 && strcmp(inheritedAddresses[j], c->listeners[i].address) == 0) {
+                fds[i] = inherited[j];
+                inherited[j] = -1;
+            }
+        }
+
+        if (fds[i] == -1) {
+            fds[i] = create_listening_socket(c->listeners[i].address, c);
+            created[i] = 1;
+        }
+
+        if (fds[i] == -1) {
+            fprintf(stderr, "Error creating listener %s\n", c->listeners[i].address);
+
+            for (j = 0; j < i; ++j) {
+                if (created[j]) {
+                    close(fds[j]);
+                }
+            }
+
+            return -1;
+        }
+    }
+
+    // Close listeners that are no longer configured
+    for (j = 0; j < listenerCount; ++j) {
+        for (i = 0; i < c->listenerCount; ++i) {
+            if (fds[i] == listenSockfds[j]) {
+                break;
+            }
+        }
+
+        if (i == c->listenerCount) {
+            close(listenSockfds[j]);
+        }
+    }
+
+    for (i = 0; i < c->listenerCount; ++i) {
+        listenSockfds[i] = fds[i];
+        strcpy(listenAddresses[i], c->listeners[i].address);
+    }
+
+    listenerCount = c->listenerCount;
+
+    return 0;
+}
+
+/**
+ * Opens the socket a new binary connects to for the takeover, if configured
+*/
+static void sync_upgrade_socket(void) {
+    if (upgradeSockfd != -1) {
+        close(upgradeSockfd);
+        upgradeSockfd = -1;
+    }
+
+    if (config.upgradeSocket[0] && !shuttingDown) {
+        upgradeSockfd = create_unix_listening_socket(config.upgradeSocket, 0600, 1);
+    }
+}
+
+static int configured_workers(const struct ServerConfig *c) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = c->workers > 0 ? c->workers : cpus < 1 ? 1 : (int)cpus;
+
+    // Leave room for a full generation of draining workers next to the new one
+    return count > METRICS_MAX_WORKERS / 2 ? METRICS_MAX_WORKERS / 2 : count;
+}
+
+/**
+ * Returns the TLS context `c` needs (NULL if it has no TLS listener) in
+ * `*ctx`, or -1 if it cannot be set up
+*/
+static int tls_for(const struct ServerConfig *c, struct ssl_ctx_st **ctx) {
+    int i;
+
+    *ctx = NULL;
+
+    for (i = 0; i < c->listenerCount; ++i) {
+        if (c->listeners[i].tls) {
+            return (*ctx = tls_create(c)) ? 0 : -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Opens the upload directory if one is configured, leaving -1 in `fd` if not
+*/
+static int upload_dir_for(const struct ServerConfig *c, int *fd) {
+    *fd = -1;
+
+    return c->uploadDir[0] && (*fd = files_open_upload_dir(c->uploadDir)) == -1 ? -1 : 0;
+}
+
+/**
+ * SIGHUP: re-read the config, keep listening sockets and replace the workers
+ *
+ * Workers of the old generation stop accepting and finish their connections
+ * while the new generation already accepts from the same sockets
+*/
+static void reload(void) {
+    struct ServerConfig next;
+    struct Bundle nextBundle;
+    struct ssl_ctx_st *nextTls;
+    int nextRootfd, nextUploadfd;
+
+    if (config_from_args(&next, savedArgc, savedArgv) == -1) {
+        fprintf(stderr, "Reload failed, keeping current config\n");
+        return;
+    }
+
+    if ((nextRootfd = files_open_root(next.documentRoot)) == -1) {
+        fprintf(stderr, "Reload failed, keeping current config\n");
+        return;
+    }
+
+    if (upload_dir_for(&next, &nextUploadfd) == -1) {
+        close(nextRootfd);
+        fprintf(stderr, "Reload failed, keeping current config\n");
+        return;
+    }
+
+    memset(&nextBundle, 0, sizeof nextBundle);
+
+    if (next.bundlePath[0] && bundle_open(&nextBundle, next.bundlePath) == -1) {
+        close(nextRootfd);
+        if (nextUploadfd != -1) {
+            close(nextUploadfd);
+        }
+        fprintf(stderr, "Reload failed, keeping current config\n");
+        return;
+    }
+
+    // Certificates are read again, so a renewed one is picked up by a reload
+    if (tls_for(&next, &nextTls) == -1) {
+        close(nextRootfd);
+        if (nextUploadfd != -1) {
+            close(nextUploadfd);
+        }
+        bundle_close(&nextBundle);
+        fprintf(stderr, "Reload failed, keeping current config\n");
+        return;
+    }
+
+    // The acceptor threads poll the listeners, some of which may be closed here
+    acceptor_stop();
+
+    if (sync_listeners(&next, NULL, NULL, 0) == -1) {
+        acceptor_start(listenSockfds, &config, listenerCount);
+        close(nextRootfd);
+        if (nextUploadfd != -1) {
+            close(nextUploadfd);
+        }
+        bundle_close(&nextBundle);
+        tls_free(nextTls);
+        fprintf(stderr, "Reload failed, keeping current config\n");
+        return;
+    }
+
+    // Retiring workers hold their own copy of the old root, upload directory, bundle and TLS context
+    close(rootfd);
+    rootfd = nextRootfd;
+    if (uploadfd != -1) {
+        close(uploadfd);
+    }
+    uploadfd = nextUploadfd;
+    bundle_close(&bundle);
+    bundle = nextBundle;
+    tls_free(tls);
+    tls = nextTls;
+
+    // Takeover only applies at startup
+    next.takeover[0] = '\0';
+    config = next;
+    workerCount = configured_workers(&config);
+
+    if (acceptor_start(listenSockfds, &config, listenerCount) == -1) {
+        fprintf(stderr, "Acceptor threads failed to restart, new connections wait in the backlog\n");
+    }
+
+    sync_upgrade_socket();
+    access_log_reopen(config.accessLogPath);
+
+    // The new generation takes connections before the old one stops, so they always have a worker to go to
+    ++generation;
+    ensure_workers();
+    retire_workers(1);
+
+    printf("Reloaded config, generation %d with %d workers\n", generation, workerCount);
+}
+
+/**
+ * Hands the listening sockets to a new binary connected on `sockfd`
+*/
+static void start_handoff(int sockfd) {
+    if (handoffSockfd != -1) {
+        fprintf(stderr, "Upgrade already in progress\n");
+        close(sockfd);
+        return;
+    }
+
+    if (send_listeners(sockfd, listenSockfds, listenAddresses, listenerCount) == -1) {
+        close(sockfd);
+        return;
+    }
+
+    handoffSockfd = sockfd;
+}
+
+/**
+ * SIGUSR2: start the binary on disk, passing it the listening sockets
+ *
+ * The new process gets one end of a socket pair (-t fd:N) and receives the
+ * listeners over it with SCM_RIGHTS, exactly as if it had connected to upgrade_socket
+*/
+static void start_upgrade(void) {
+    int pair[2], i;
+    char fdArg[32];
+    char **args;
+    pid_t pid;
+
+    if (handoffSockfd != -1) {
+        fprintf(stderr, "Upgrade already in progress\n");
+        return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        perror("Error creating upgrade socket pair");
+        return;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        perror("Error forking new binary");
+        close(pair[0]);
+        close(pair[1]);
+        return;
+    }
+
+    if (pid == 0) {
+        args = calloc(savedArgc + 3, sizeof(char *));
+
+        for (i = 0; i < savedArgc; ++i) {
+            args[i] = savedArgv[i];
+        }
+
+        snprintf(fdArg, sizeof(fdArg), "fd:%d", pair[1]);
+        args[savedArgc] = "-t";
+        args[savedArgc + 1] = fdArg;
+
+        // Leave the new binary in its own process group so our shutdown cannot reach it
+        setpgid(0, 0);
+        close(pair[0]);
+        execvp(savedArgv[0], args);
+        perror("Error starting new binary");
+        _exit(1);
+    }
+
+    close(pair[1]);
+    start_handoff(pair[0]);
+}
+
+/**
+ * Reads the new binary's answer: a ready byte means it is serving, so this
+ * process drains and exits. EOF means it failed and this process carries on
+*/
+static void finish_handoff(void) {
+    char ready = 0;
+    ssize_t n = read(handoffSockfd, &ready, 1);
+
+    if (n == -1 && errno == EINTR) {
+        return;
+    }
+
+    close(handoffSockfd);
+    handoffSockfd = -1;
+
+    if (n == 1 && ready == MASTER_READY_BYTE) {
+        printf("New binary is serving, draining workers\n");
+        shuttingDown = 1;
+        acceptor_stop();
+        sync_upgrade_socket();
+        retire_workers(0);
+    } else {
+        fprintf(stderr, "Upgrade failed, still serving\n");
+    }
+}
+
+/**
+ * Receives listeners from the server being replaced (-t) and adopts them
+*/
+static int take_over(int *handoff) {
+    int fds[MAX_LISTENERS];
+    char addresses[MAX_LISTENERS][CONFIG_ADDRESS_MAX];
+    int count, i;
+
+    if (strncmp(config.takeover, "fd:", 3) == 0) {
+        *handoff = atoi(config.takeover + 3);
+    } else {
+        *handoff = connect_unix_socket(config.takeover);
+    }
+
+    if (*handoff == -1) {
+        perror("Error connecting to the server being replaced");
+        return -1;
+    }
+
+    if ((count = receive_listeners(*handoff, fds, addresses)) == -1) {
+        return -1;
+    }
+
+    if (sync_listeners(&config, fds, addresses, count) == -1) {
+        return -1;
+    }
+
+    // Inherited sockets that are no longer configured
+    for (i = 0; i < count; ++i) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Raises the open file limit as far as allowed, as every idle keep-alive connection holds a descriptor
+*/
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void install_signal_handlers(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // Writing to a closed connection should fail the send, not kill the worker
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * Runs the master process: owns the listening sockets and shared memory,
+ * keeps workerCount workers running and handles the control signals
+ *
+ *   SIGHUP  reload the config and replace the workers gracefully
+ *   SIGUSR2 start the binary on disk and hand it the listening sockets
+ *   SIGUSR1 have the workers write out their sampled request traces
+ *   SIGQUIT stop accepting, let workers finish their connections and exit
+ *   SIGTERM/SIGINT exit immediately
+*/
+int master_run(int argc, char *argv[]) {
+    struct pollfd fds[3];
+    int nfds, takeoverSockfd = -1;
+    char drain[64];
+
+    savedArgc = argc;
+    savedArgv = argv;
+
+    if (config_from_args(&config, argc, argv) == -1) {
+        return 1;
+    }
+
+    workerCount = configured_workers(&config);
+
+    if (pipe(signalPipe) == -1) {
+        perror("Error creating signal pipe");
+        return 1;
+    }
+
+    fcntl(signalPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(signalPipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(signalPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(signalPipe[1], F_SETFD, FD_CLOEXEC);
+
+    install_signal_handlers();
+    raise_fd_limit();
+
+    if ((rootfd = files_open_root(config.documentRoot)) == -1 || upload_dir_for(&config, &uploadfd) == -1) {
+        return 1;
+    }
+
+    if (config.bundlePath[0] && bundle_open(&bundle, config.bundlePath) == -1) {
+        return 1;
+    }
+
+    if (tls_for(&config, &tls) == -1) {
+        return 1;
+    }
+
+    // Built once here and inherited by every worker
+    router_init(&router);
+    if (register_routes(&router) == -1) {
+        return 1;
+    }
+
+    if (config.takeover[0]) {
+        if (take_over(&takeoverSockfd) == -1) {
+            return 1;
+        }
+    } else if (sync_listeners(&config, NULL, NULL, 0) == -1) {
+        return 1;
+    }
+
+    // Shared before forking so every worker writes its own slot of the same mapping
+    if (metrics_init(METRICS_MAX_WORKERS) == -1 || access_log_init(METRICS_MAX_WORKERS) == -1
+        || ratelimit_init() == -1 || sse_init(METRICS_MAX_WORKERS) == -1
+        || (config.mmapMaxBytes > 0 && shmcache_init(config.sharedCacheBytes, config.mmapMaxBytes, METRICS_MAX_WORKERS) == -1)
+        || acceptor_init(METRICS_MAX_WORKERS, config.acceptorThreads) == -1) {
+        return 1;
+    }
+
+    // Logging is best effort: a server that cannot open its log still serves
+    if (access_log_start(config.accessLogPath) == -1) {
+        fprintf(stderr, "Access logging disabled\n");
+    }
+
+    ensure_workers();
+    sync_upgrade_socket();
+
+    if (acceptor_start(listenSockfds, &config, listenerCount) == -1) {
+        return 1;
+    }
+
+    // Workers are accepting, the old binary can start draining
+    if (takeoverSockfd != -1) {
+        char ready = MASTER_READY_BYTE;
+
+        write(takeoverSockfd, &ready, 1);
+        close(takeoverSockfd);
+    }
+
+    printf("Waiting for connections on %d workers... \n\n", workerCount);
+
+    for(;;) {
+        nfds = 0;
+        fds[nfds].fd = signalPipe[0];
+        fds[nfds++].events = POLLIN;
+
+        if (upgradeSockfd != -1) {
+            fds[nfds].fd = upgradeSockfd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        if (handoffSockfd != -1) {
+            fds[nfds].fd = handoffSockfd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        // Wake up every second while workers are draining to enforce their deadline
+        if (poll(fds, nfds, enforce_deadlines() ? 1000 : -1) == -1 && errno != EINTR) {
+            perror("Error polling in master");
+        }
+
+        while (read(signalPipe[0], drain, sizeof(drain)) > 0);
+
+        reap_workers();
+
+        if (terminateRequested) {
+            int slot;
+
+            for (slot = 0; slot < METRICS_MAX_WORKERS; ++slot) {
+                if (procs[slot].pid) {
+                    kill(procs[slot].pid, SIGTERM);
+                }
+            }
+            access_log_stop();
+            return 0;
+        }
+
+        if (quitRequested && !shuttingDown) {
+            shuttingDown = 1;
+            acceptor_stop();
+            sync_upgrade_socket();
+            retire_workers(0);
+        }
+
+        if (reloadRequested) {
+            reloadRequested = 0;
+            if (!shuttingDown) {
+                reload();
+            }
+        }
+
+        if (dumpRequested) {
+            dumpRequested = 0;
+            dump_traces();
+        }
+
+        if (upgradeRequested) {
+            upgradeRequested = 0;
+            if (!shuttingDown) {
+                start_upgrade();
+            }
+        }
+
+        if (upgradeSockfd != -1) {
+            int sockfd = accept(upgradeSockfd, NULL, NULL);
+
+            if (sockfd != -1) {
+                start_handoff(sockfd);
+            }
+        }
+
+        if (handoffSockfd != -1) {
+            struct pollfd pfd = { handoffSockfd, POLLIN, 0 };
+
+            if (poll(&pfd, 1, 0) == 1) {
+                finish_handoff();
+            }
+        }
+
+        if (shuttingDown) {
+            if (!live_workers()) {
+                access_log_stop();
+                return 0;
+            }
+        } else {
+            ensure_workers();
+        }
+    }
+}
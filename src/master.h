@@ -0,0 +1,22 @@
+#ifndef MASTER_H_
+#define MASTER_H_
+
+#include <sys/types.h>
+
+#define MASTER_READY_BYTE 'R' // Sent by a new binary once its workers accept
+
+/**
+ * A worker process in a metrics/access log slot
+ *
+ * Workers of an older generation keep their slot while draining, until they
+ * exit or are killed at `retireDeadlineMs`
+*/
+typedef struct WorkerProcess {
+    pid_t pid; // 0 = slot is free
+    int generation;
+    unsigned long long retireDeadlineMs; // 0 = current worker
+} WorkerProcess;
+
+int master_run(int argc, char *argv[]);
+
+#endif
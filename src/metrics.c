@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "metrics.h"
+#include "http.h"
+
+static struct MetricsSlot *slots = NULL;
+static int slotCount = 0;
+
+static const char *phaseNames[METRICS_PHASE_COUNT] = { "parse", "handler", "send" };
+
+/**
+ * Maps one slot per worker in memory shared by every process forked afterwards
+*/
+int metrics_init(int workers) {
+    if (workers > METRICS_MAX_WORKERS) {
+        workers = METRICS_MAX_WORKERS;
+    }
+
+    slots = mmap(NULL, sizeof(struct MetricsSlot) * workers, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (slots == MAP_FAILED) {
+        perror("Error mapping metrics");
+        slots = NULL;
+        return -1;
+    }
+
+    slotCount = workers;
+
+    return 0;
+}
+
+/**
+ * Returns the slot owned by `worker`
+*/
+struct MetricsSlot *metrics_slot(int worker) {
+    return &slots[worker % slotCount];
+}
+
+unsigned long long metrics_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_count_status(struct MetricsSlot *slot, int status) {
+    if (status < METRICS_STATUS_MIN || status > METRICS_STATUS_MAX) {
+        return;
+    }
+
+    METRICS_ADD(slot->requests[status - METRICS_STATUS_MIN], 1);
+}
+
+/**
+ * Records `ns` in the log2 latency histogram of `phase`
+*/
+void metrics_observe(struct MetricsSlot *slot, enum MetricsPhase phase, unsigned long long ns) {
+    unsigned long long scaled = ns >> METRICS_HISTOGRAM_SHIFT;
+    int bucket = scaled ? 64 - __builtin_clzll(scaled) : 0;
+
+    if (bucket > METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS;
+    }
+
+    METRICS_ADD(slot->latency[phase][bucket], 1);
+    METRICS_ADD(slot->latencySumNs[phase], ns);
+}
+
+/**
+ * Sums `count` unsigned longs from `src` into `dst`
+*/
+static void sum_into(unsigned long *dst, const unsigned long *src, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Aggregates every worker slot and renders them in Prometheus text format
+ *
+ * Returns a malloc'd, NUL terminated string (caller frees) and sets `len`
+*/
+char *metrics_render(size_t *len) {
+    struct MetricsSlot *total;
+    char *out = NULL;
+    FILE *fp;
+    unsigned long cumulative;
+    int i, phase, status;
+
+    if (!slots) {
+        return NULL;
+    }
+
+    total = calloc(1, sizeof(struct MetricsSlot));
+
+    if (!total) {
+        return NULL;
+    }
+
+    // Every field is an unsigned long (padding stays zero), so a slot can be summed as a flat array
+    for (i = 0; i < slotCount; ++i) {
+        sum_into((unsigned long *)total, (const unsigned long *)&slots[i],
+            sizeof(struct MetricsSlot) / sizeof(unsigned long));
+    }
+
+    fp = open_memstream(&out, len);
+
+    if (!fp) {
+        free(total);
+        return NULL;
+    }
+
+    fprintf(fp, "# HELP basic_http_requests_total Responses sent, by status code.\n");
+    fprintf(fp, "# TYPE basic_http_requests_total counter\n");
+    for (status = METRICS_STATUS_MIN; status <= METRICS_STATUS_MAX; ++status) {
+        if (total->requests[status - METRICS_STATUS_MIN]) {
+            fprintf(fp, "basic_http_requests_total{code=\"%d\"} %lu\n",
+                status, total->requests[status - METRICS_STATUS_MIN]);
+        }
+    }
+
+    fprintf(fp, "# HELP basic_http_received_bytes_total Request bytes received.\n");
+    fprintf(fp, "# TYPE basic_http_received_bytes_total counter\n");
+    fprintf(fp, "basic_http_received_bytes_total %lu\n", total->bytesIn);
+
+    fprintf(fp, "# HELP basic_http_sent_bytes_total Response bytes sent.\n");
+    fprintf(fp, "# TYPE basic_http_sent_bytes_total counter\n");
+    fprintf(fp, "basic_http_sent_bytes_total %lu\n", total->bytesOut);
+
+    fprintf(fp, "# HELP basic_http_connections_total Connections accepted.\n");
+    fprintf(fp, "# TYPE basic_http_connections_total counter\n");
+    fprintf(fp, "basic_http_connections_total %lu\n", total->connectionsOpened);
+
+    fprintf(fp, "# HELP basic_http_active_connections Connections currently open.\n");
+    fprintf(fp, "# TYPE basic_http_active_connections gauge\n");
+    fprintf(fp, "basic_http_active_connections %lu\n",
+        total->connectionsOpened - total->connectionsClosed);
+
+    fprintf(fp, "# HELP basic_http_cache_hits_total File cache hits.\n");
+    fprintf(fp, "# TYPE basic_http_cache_hits_total counter\n");
+    fprintf(fp, "basic_http_cache_hits_total %lu\n", total->cacheHits);
+
+    fprintf(fp, "# HELP basic_http_cache_misses_total File cache misses.\n");
+    fprintf(fp, "# TYPE basic_http_cache_misses_total counter\n");
+    fprintf(fp, "basic_http_cache_misses_total %lu\n", total->cacheMisses);
+
+    fprintf(fp, "# HELP basic_http_accept_errors_total Failed accept calls.\n");
+    fprintf(fp, "# TYPE basic_http_accept_errors_total counter\n");
+    fprintf(fp, "basic_http_accept_errors_total %lu\n", total->acceptErrors);
+
+    fprintf(fp, "# HELP basic_http_access_log_dropped_total Access log records dropped because the writer fell behind.\n");
+    fprintf(fp, "# TYPE basic_http_access_log_dropped_total counter\n");
+    fprintf(fp, "basic_http_access_log_dropped_total %lu\n", total->accessLogDrops);
+
+    fprintf(fp, "# HELP basic_http_rate_limited_total Requests and new connections refused for being over a rate limit.\n");
+    fprintf(fp, "# TYPE basic_http_rate_limited_total counter\n");
+    fprintf(fp, "basic_http_rate_limited_total %lu\n", total->rateLimited);
+
+    fprintf(fp, "# HELP basic_http_phase_duration_seconds Time spent per request phase.\n");
+    fprintf(fp, "# TYPE basic_http_phase_duration_seconds histogram\n");
+    for (phase = 0; phase < METRICS_PHASE_COUNT; ++phase) {
+        cumulative = 0;
+
+        for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i) {
+            cumulative += total->latency[phase][i];
+            fprintf(fp, "basic_http_phase_duration_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %lu\n",
+                phaseNames[phase], (double)(1ULL << (i + METRICS_HISTOGRAM_SHIFT)) / 1e9, cumulative);
+        }
+
+        cumulative += total->latency[phase][METRICS_HISTOGRAM_BUCKETS];
+        fprintf(fp, "basic_http_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n",
+            phaseNames[phase], cumulative);
+        fprintf(fp, "basic_http_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n",
+            phaseNames[phase], total->latencySumNs[phase] / 1e9);
+        fprintf(fp, "basic_http_phase_duration_seconds_count{phase=\"%s\"} %lu\n",
+            phaseNames[phase], cumulative);
+    }
+
+    fclose(fp);
+    free(total);
+
+    return out;
+}
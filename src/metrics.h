@@ -0,0 +1,62 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stddef.h>
+
+#define METRICS_PATH "/metrics"
+#define METRICS_MAX_WORKERS 64
+#define METRICS_CACHE_LINE_SIZE 64
+#define METRICS_STATUS_MIN 100
+#define METRICS_STATUS_MAX 599
+
+/**
+ * Latency histograms use log2 buckets: bucket `i` counts durations below
+ * 2^(i + METRICS_HISTOGRAM_SHIFT) ns, so the first bucket is ~1us and the last ~8.6s.
+ * One extra bucket past the end counts anything slower
+*/
+#define METRICS_HISTOGRAM_SHIFT 10
+#define METRICS_HISTOGRAM_BUCKETS 24
+
+typedef enum MetricsPhase {
+    METRICS_PHASE_PARSE,
+    METRICS_PHASE_HANDLER,
+    METRICS_PHASE_SEND,
+    METRICS_PHASE_COUNT
+} MetricsPhase;
+
+/**
+ * Counters owned by a single worker
+ *
+ * Only the owning worker writes a slot, so updates are plain loads and stores
+ * (no locked instructions). Slots are cache line aligned so workers never share
+ * a line, and readers sum every slot when rendering
+*/
+typedef struct MetricsSlot {
+    unsigned long requests[METRICS_STATUS_MAX - METRICS_STATUS_MIN + 1];
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long connectionsOpened;
+    unsigned long connectionsClosed;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+    unsigned long acceptErrors;
+    unsigned long accessLogDrops;
+    unsigned long rateLimited;
+    unsigned long latency[METRICS_PHASE_COUNT][METRICS_HISTOGRAM_BUCKETS + 1];
+    unsigned long latencySumNs[METRICS_PHASE_COUNT];
+} __attribute__((aligned(METRICS_CACHE_LINE_SIZE))) MetricsSlot;
+
+/**
+ * Single-writer increment: a relaxed load and store, never a read-modify-write
+*/
+#define METRICS_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+int metrics_init(int workers);
+struct MetricsSlot *metrics_slot(int worker);
+unsigned long long metrics_now_ns(void);
+void metrics_count_status(struct MetricsSlot *slot, int status);
+void metrics_observe(struct MetricsSlot *slot, enum MetricsPhase phase, unsigned long long ns);
+char *metrics_render(size_t *len);
+
+#endif
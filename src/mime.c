@@ -3,6 +3,16 @@
 #include <string.h>
 
 #include "mime.h"
+#include "trace.h"
+
+static const char *typesPath = MIME_TYPES_PATH;
+
+/**
+ * Reads MIME types from the table at `path` rather than MIME_TYPES_PATH
+*/
+void mime_set_types_path(const char *path) {
+    typesPath = path;
+}
 
 /**
  * Attempts to get a MIME type from a filepath
@@ -16,6 +26,8 @@ int mime_type_from_path(char *mime, char *path) {
     int lineCount = 1;
     FILE *mime_types;
 
+    TRACE_PROBE1(mime_lookup, path);
+
     if ((ext = strrchr(path, '.')) == NULL) {
         strcpy(mime, DEFAULT_MIME);
         return 0;
@@ -24,7 +36,7 @@ int mime_type_from_path(char *mime, char *path) {
     // Ignore '.' at start of extension
     ++ext;
 
-	mime_types = fopen(MIME_TYPES_PATH, "r");
+	mime_types = fopen(typesPath, "r");
 
     if (mime_types == NULL) {
         return -1;
@@ -50,5 +62,7 @@ int mime_type_from_path(char *mime, char *path) {
 
     fclose(mime_types);
 
+    TRACE_PROBE2(mime_done, path, mime);
+
     return 0;
 }
@@ -1,9 +1,10 @@
 #ifndef MIME_H_
 #define MIME_H_
 
-#define MIME_TYPES_PATH "./mime-types.tsv"
+#define MIME_TYPES_PATH "./src/mime-types.tsv"
 #define DEFAULT_MIME "application/octet-stream"
 
 int mime_type_from_path(char *mime, char *path);
+void mime_set_types_path(const char *path);
 
 #endif
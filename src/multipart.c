@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "multipart.h"
+
+#define MULTIPART_FORM_DATA "multipart/form-data"
+
+/**
+ * Finds parameter `name` in the `; key=value` list after `s`, returning its value
+*/
+static const char *find_param(const char *s, const char *name) {
+    size_t length = strlen(name), keyLength;
+
+    while ((s = strchr(s, ';'))) {
+        s += 1 + strspn(s + 1, " \t");
+        keyLength = strcspn(s, "=; \t");
+
+        if (keyLength == length && s[length] == '=' && strncasecmp(s, name, length) == 0) {
+            return s + length + 1;
+        }
+
+        // A quoted value may hold a `;` of its own
+        s += keyLength;
+        if (s[0] == '=' && s[1] == '"') {
+            for (s += 2; *s && *s != '"'; ++s) {
+                if (*s == '\\' && s[1]) {
+                    ++s;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Copies a parameter value, quoted or not, into `dst`, cut short if it does not fit
+*/
+static void copy_value(const char *s, char *dst, size_t cap) {
+    size_t n = 0;
+
+    if (*s == '"') {
+        for (++s; *s && *s != '"'; ++s) {
+            if (*s == '\\' && s[1]) {
+                ++s;
+            }
+            if (n + 1 < cap) {
+                dst[n++] = *s;
+            }
+        }
+    } else {
+        for (; *s && *s != ';' && *s != ' ' && *s != '\t'; ++s) {
+            if (n + 1 < cap) {
+                dst[n++] = *s;
+            }
+        }
+    }
+
+    dst[n] = '\0';
+}
+
+/**
+ * Returns the boundary of a multipart/form-data Content-Type, setting
+ * `length`, or NULL if it is not one or its boundary is missing or too long
+ *
+ * Points into `contentType`, the boundary is not null terminated
+*/
+const char *multipart_boundary(const char *contentType, size_t *length) {
+    size_t typeLength = strlen(MULTIPART_FORM_DATA), len;
+    const char *b;
+
+    if (!contentType || strncasecmp(contentType, MULTIPART_FORM_DATA, typeLength) != 0
+        || (contentType[typeLength] && !strchr("; \t", contentType[typeLength]))
+        || !(b = find_param(contentType + typeLength, "boundary"))) {
+        return NULL;
+    }
+
+    if (*b == '"') {
+        len = strcspn(++b, "\"");
+
+        if (!b[len]) {
+            return NULL;
+        }
+    } else {
+        len = strcspn(b, "; \t");
+    }
+
+    if (len == 0 || len > MULTIPART_BOUNDARY_MAX) {
+        return NULL;
+    }
+
+    *length = len;
+
+    return b;
+}
+
+/**
+ * Sets `p` up to parse a body sent with `contentType`, handing what it finds to
+ * `callbacks` with `user`
+ *
+ * Returns -1 if the content type has no usable boundary
+*/
+int multipart_init(struct MultipartParser *p, const char *contentType, const struct MultipartCallbacks *callbacks,
+    void *user) {
+    const char *boundary;
+    size_t length, i;
+
+    memset(p, 0, sizeof(*p));
+
+    if (!(boundary = multipart_boundary(contentType, &length))) {
+        p->state = MULTIPART_FAILED;
+        return -1;
+    }
+
+    memcpy(p->delimiter, "\r\n--", 4);
+    memcpy(p->delimiter + 4, boundary, length);
+    p->delimiterLength = length + 4;
+
+    memset(p->skip, (int)p->delimiterLength, sizeof(p->skip));
+    for (i = 0; i + 1 < p->delimiterLength; ++i) {
+        p->skip[p->delimiter[i]] = p->delimiterLength - 1 - i;
+    }
+
+    // The first delimiter may open the body, with no line end before it
+    memcpy(p->held, "\r\n", 2);
+    p->heldLength = 2;
+
+    p->state = MULTIPART_PREAMBLE;
+    p->callbacks = callbacks;
+    p->user = user;
+
+    return 0;
+}
+
+static int fail(struct MultipartParser *p, int result) {
+    p->state = MULTIPART_FAILED;
+    p->result = result;
+
+    return -1;
+}
+
+/**
+ * Passes `len` body bytes on to the current part, or drops them outside of one
+*/
+static int emit(struct MultipartParser *p, const char *data, size_t len) {
+    int r;
+
+    if (len && p->state == MULTIPART_DATA && p->callbacks->data && (r = p->callbacks->data(p->user, data, len))) {
+        return fail(p, r);
+    }
+
+    return 0;
+}
+
+static int end_delimiter(struct MultipartParser *p) {
+    int r;
+
+    if (p->state == MULTIPART_DATA && p->callbacks->partEnd && (r = p->callbacks->partEnd(p->user))) {
+        return fail(p, r);
+    }
+
+    p->state = MULTIPART_AFTER_DELIMITER;
+
+    return 0;
+}
+
+/**
+ * Boyer-Moore-Horspool search for the delimiter in `data`, -1 if it is not there whole
+*/
+static ssize_t find_delimiter(const struct MultipartParser *p, const unsigned char *data, size_t len) {
+    const unsigned char *d = p->delimiter;
+    size_t m = p->delimiterLength, i = 0;
+    unsigned char last;
+
+    while (i + m <= len) {
+        last = data[i + m - 1];
+
+        if (last == d[m - 1] && memcmp(data + i, d, m - 1) == 0) {
+            return i;
+        }
+
+        i += p->skip[last];
+    }
+
+    return -1;
+}
+
+/**
+ * Returns how many bytes at the end of `data` could be the start of a delimiter
+ * that the next piece completes
+*/
+static size_t partial_tail(const struct MultipartParser *p, const char *data, size_t len) {
+    size_t from = len > p->delimiterLength - 1 ? len - (p->delimiterLength - 1) : 0;
+    const char *cr;
+
+    // Every delimiter starts with the CR of its line end
+    while ((cr = memchr(data + from, '\r', len - from))) {
+        if (memcmp(cr, p->delimiter, data + len - cr) == 0) {
+            return data + len - cr;
+        }
+
+        from = cr - data + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Passes on the body in `data` up to the next delimiter, holding back a tail
+ * that may be the start of one
+ *
+ * Returns the bytes of `data` used, the delimiter included if it was found
+*/
+static ssize_t scan(struct MultipartParser *p, const char *data, size_t len) {
+    char window[2 * MULTIPART_DELIMITER_MAX];
+    size_t m = p->delimiterLength, k = p->heldLength, take, avail, i, tail;
+    ssize_t at;
+
+    // A delimiter started in the held back bytes can only end in the first `m` of these
+    if (k) {
+        take = len < m ? len : m;
+        memcpy(window, p->held, k);
+        memcpy(window + k, data, take);
+
+        for (i = 0; i < k; ++i) {
+            avail = k + take - i;
+
+            if (memcmp(window + i, p->delimiter, avail < m ? avail : m) != 0) {
+                continue;
+            }
+
+            if (emit(p, window, i) == -1) {
+                return -1;
+            }
+
+            if (avail >= m) {
+                p->heldLength = 0;
+                return end_delimiter(p) == -1 ? -1 : (ssize_t)(i + m - k);
+            }
+
+            // Still only the start of one, and this piece was short enough to be all in it
+            memmove(p->held, window + i, avail);
+            p->heldLength = avail;
+
+            return len;
+        }
+
+        p->heldLength = 0;
+
+        if (emit(p, window, k) == -1) {
+            return -1;
+        }
+    }
+
+    if ((at = find_delimiter(p, (const unsigned char *)data, len)) != -1) {
+        if (emit(p, data, at) == -1 || end_delimiter(p) == -1) {
+            return -1;
+        }
+        return at + m;
+    }
+
+    tail = partial_tail(p, data, len);
+
+    if (emit(p, data, len - tail) == -1) {
+        return -1;
+    }
+
+    memcpy(p->held, data + len - tail, tail);
+    p->heldLength = tail;
+
+    return len;
+}
+
+/**
+ * Takes what a part's header line says about it. Only Content-Disposition and
+ * Content-Type matter, the rest are skipped
+*/
+static void parse_header(struct MultipartParser *p) {
+    char *colon = strchr(p->line, ':');
+    const char *value, *param;
+
+    if (!colon) {
+        return;
+    }
+
+    *colon = '\0';
+    value = colon + 1 + strspn(colon + 1, " \t");
+
+    if (strcasecmp(p->line, "Content-Disposition") == 0) {
+        if ((param = find_param(value, "name"))) {
+            copy_value(param, p->part.name, sizeof(p->part.name));
+        }
+        if ((param = find_param(value, "filename"))) {
+            copy_value(param, p->part.filename, sizeof(p->part.filename));
+        }
+    } else if (strcasecmp(p->line, "Content-Type") == 0) {
+        snprintf(p->part.contentType, sizeof(p->part.contentType), "%s", value);
+    }
+}
+
+static void start_headers(struct MultipartParser *p) {
+    memset(&p->part, 0, sizeof(p->part));
+    p->lineLength = 0;
+    p->state = MULTIPART_HEADER;
+}
+
+/**
+ * Parses the next `len` bytes of the body. Everything is used: whatever may
+ * still turn out to be a delimiter is kept until the next call decides
+ *
+ * Returns -1 if the body is malformed or a callback stopped the parse, see `result`
+*/
+int multipart_parse(struct MultipartParser *p, const char *data, size_t len) {
+    const char *end = data + len, *newline;
+    ssize_t used;
+    size_t n;
+    char c;
+    int r;
+
+    while (data < end) {
+        switch (p->state) {
+            case MULTIPART_PREAMBLE:
+            case MULTIPART_DATA:
+                if ((used = scan(p, data, end - data)) == -1) {
+                    return -1;
+                }
+                data += used;
+                break;
+            case MULTIPART_AFTER_DELIMITER:
+                c = *data++;
+                if (c == '-') {
+                    p->state = MULTIPART_CLOSE_DASH;
+                } else if (c == '\n') {
+                    start_headers(p);
+                } else if (c == '\r' || c == ' ' || c == '\t') {
+                    p->state = MULTIPART_DELIMITER_LINE;
+                } else {
+                    return fail(p, 0);
+                }
+                break;
+            case MULTIPART_CLOSE_DASH:
+                if (*data++ != '-') {
+                    return fail(p, 0);
+                }
+                p->state = MULTIPART_EPILOGUE;
+                break;
+            case MULTIPART_DELIMITER_LINE:
+                c = *data++;
+                if (c == '\n') {
+                    start_headers(p);
+                } else if (c != '\r' && c != ' ' && c != '\t') {
+                    return fail(p, 0);
+                }
+                break;
+            case MULTIPART_HEADER:
+                newline = memchr(data, '\n', end - data);
+                n = (newline ? newline : end) - data;
+
+                if (p->lineLength + n >= sizeof(p->line)) {
+                    return fail(p, 0);
+                }
+
+                memcpy(p->line + p->lineLength, data, n);
+                p->lineLength += n;
+                data += n;
+
+                if (!newline) {
+                    break;
+                }
+
+                ++data;
+                if (p->lineLength && p->line[p->lineLength - 1] == '\r') {
+                    --p->lineLength;
+                }
+                p->line[p->lineLength] = '\0';
+
+                if (p->lineLength) {
+                    parse_header(p);
+                    p->lineLength = 0;
+                    break;
+                }
+
+                // A blank line, the body follows
+                p->state = MULTIPART_DATA;
+
+                if (p->callbacks->part && (r = p->callbacks->part(p->user, &p->part))) {
+                    return fail(p, r);
+                }
+                break;
+            case MULTIPART_EPILOGUE:
+                return 0;
+            case MULTIPART_FAILED:
+                return -1;
+        }
+    }
+
+    return p->state == MULTIPART_FAILED ? -1 : 0;
+}
+
+/**
+ * Returns 1 once the closing delimiter has been parsed
+*/
+int multipart_done(const struct MultipartParser *p) {
+    return p->state == MULTIPART_EPILOGUE;
+}
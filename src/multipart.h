@@ -0,0 +1,76 @@
+#ifndef MULTIPART_H_
+#define MULTIPART_H_
+
+#include <stddef.h>
+
+#define MULTIPART_BOUNDARY_MAX 70 // RFC 2046 5.1.1
+#define MULTIPART_DELIMITER_MAX (MULTIPART_BOUNDARY_MAX + 4) // CRLF "--" boundary
+#define MULTIPART_HEADER_MAX 1024 // One header line of a part
+#define MULTIPART_NAME_MAX 256
+
+/**
+ * Where the parser is between two calls. Body bytes are only ever looked at
+ * while searching for the next delimiter, everything else is a line or a few
+ * bytes read one at a time
+*/
+typedef enum MultipartState {
+    MULTIPART_PREAMBLE, // Before the first delimiter, discarded
+    MULTIPART_DATA, // A part's body, passed on up to the next delimiter
+    MULTIPART_AFTER_DELIMITER, // "--" ends the body, anything else the delimiter's line
+    MULTIPART_CLOSE_DASH,
+    MULTIPART_DELIMITER_LINE, // Padding up to the line end
+    MULTIPART_HEADER, // A part's header lines, up to a blank one
+    MULTIPART_EPILOGUE, // After the closing delimiter, discarded
+    MULTIPART_FAILED // Stopped, see `result`
+} MultipartState;
+
+/**
+ * What a part's headers say about it. Empty strings for what they leave out
+*/
+typedef struct MultipartPart {
+    char name[MULTIPART_NAME_MAX]; // Form field name
+    char filename[MULTIPART_NAME_MAX]; // Only file fields have one, as the client sent it
+    char contentType[MULTIPART_NAME_MAX];
+} MultipartPart;
+
+/**
+ * Called as parts are found. Each returns 0 to go on, anything else stops the
+ * parse and is kept in the parser's `result` (an HTTP status, by convention)
+*/
+typedef struct MultipartCallbacks {
+    int (*part)(void *user, const struct MultipartPart *part); // Its headers are all in
+    int (*data)(void *user, const char *data, size_t len); // The next bytes of its body
+    int (*partEnd)(void *user);
+} MultipartCallbacks;
+
+/**
+ * Incremental multipart/form-data parser
+ *
+ * Takes a body in pieces of any size and never holds more than a delimiter's
+ * worth of it: body bytes are passed on as soon as they cannot be the start of
+ * one, so memory per upload stays the size of this struct however large the
+ * upload. Delimiters are searched for with Boyer-Moore-Horspool, which skips
+ * most of the body a delimiter length at a time
+*/
+typedef struct MultipartParser {
+    enum MultipartState state;
+    unsigned char delimiter[MULTIPART_DELIMITER_MAX];
+    size_t delimiterLength;
+    unsigned char skip[256]; // Horspool shift for each byte at the end of the window
+    char held[MULTIPART_DELIMITER_MAX]; // End of the last piece, which a delimiter may start in
+    size_t heldLength;
+    char line[MULTIPART_HEADER_MAX];
+    size_t lineLength;
+    struct MultipartPart part;
+    const struct MultipartCallbacks *callbacks;
+    void *user;
+    int result; // What a callback stopped the parse with, 0 if the body was malformed
+} MultipartParser;
+
+const char *multipart_boundary(const char *contentType, size_t *length);
+int multipart_init(struct MultipartParser *p, const char *contentType, const struct MultipartCallbacks *callbacks,
+    void *user);
+int multipart_parse(struct MultipartParser *p, const char *data, size_t len);
+int multipart_done(const struct MultipartParser *p);
+
+#endif
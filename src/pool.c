@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+static const size_t classSizes[POOL_CLASS_COUNT] = { POOL_SMALL_SIZE, POOL_LARGE_SIZE };
+
+struct BufferPool *pool_create(void) {
+    return calloc(1, sizeof(struct BufferPool));
+}
+
+/**
+ * Allocates a slab of POOL_SLAB_BUFFERS buffers of class `cls` onto the free list
+ *
+ * A buffer's header sits in front of its data, so a POOL_SMALL_SIZE buffer
+ * holds a little less than 4 KiB of data
+*/
+static int grow(struct BufferPool *p, enum PoolClass cls) {
+    char *slab = malloc(classSizes[cls] * POOL_SLAB_BUFFERS);
+    struct PoolBuffer *b;
+    int i;
+
+    if (!slab) {
+        return -1;
+    }
+
+    for (i = 0; i < POOL_SLAB_BUFFERS; ++i) {
+        b = (struct PoolBuffer *)(slab + classSizes[cls] * i);
+        b->cap = classSizes[cls] - sizeof(struct PoolBuffer);
+        b->cls = cls;
+        b->next = p->free[cls];
+        p->free[cls] = b;
+    }
+
+    p->allocated[cls] += POOL_SLAB_BUFFERS;
+
+    return 0;
+}
+
+/**
+ * Takes an empty buffer of class `cls`, or NULL if memory is exhausted
+*/
+struct PoolBuffer *pool_get(struct BufferPool *p, enum PoolClass cls) {
+    struct PoolBuffer *b;
+
+    if (!p->free[cls] && grow(p, cls) == -1) {
+        return NULL;
+    }
+
+    b = p->free[cls];
+    p->free[cls] = b->next;
+    b->next = NULL;
+    b->len = 0;
+    ++p->inUse[cls];
+
+    return b;
+}
+
+/**
+ * Returns a buffer (and any buffers chained to it) to the pool. NULL is a no-op
+*/
+void pool_put(struct BufferPool *p, struct PoolBuffer *b) {
+    struct PoolBuffer *next;
+
+    for (; b; b = next) {
+        next = b->next;
+        b->next = p->free[b->cls];
+        p->free[b->cls] = b;
+        --p->inUse[b->cls];
+    }
+}
+
+size_t pool_chain_length(const struct PoolBuffer *b) {
+    size_t len = 0;
+
+    for (; b; b = b->next) {
+        len += b->len;
+    }
+
+    return len;
+}
+
+/**
+ * Copies the contents of a chain into `dst`, which must hold pool_chain_length bytes
+*/
+size_t pool_copy_chain(char *dst, const struct PoolBuffer *b) {
+    size_t off = 0;
+
+    for (; b; b = b->next) {
+        memcpy(dst + off, b->data, b->len);
+        off += b->len;
+    }
+
+    return off;
+}
+
+/**
+ * Drops the first `n` bytes of a chain, returning what is left of it
+ *
+ * Buffers emptied entirely go back to the pool, and the rest of the first
+ * one still holding data is moved to its front. Returns NULL (having
+ * released everything) once nothing is left, so an idle connection holds no buffer
+*/
+struct PoolBuffer *pool_consume(struct BufferPool *p, struct PoolBuffer *b, size_t n) {
+    struct PoolBuffer *next;
+
+    while (b && n >= b->len) {
+        n -= b->len;
+        next = b->next;
+        b->next = NULL;
+        pool_put(p, b);
+        b = next;
+    }
+
+    if (b && n) {
+        memmove(b->data, b->data + n, b->len - n);
+        b->len -= n;
+    }
+
+    return b;
+}
@@ -0,0 +1,44 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+#define POOL_SMALL_SIZE 4096 // Fits a typical request head
+#define POOL_LARGE_SIZE 16384
+#define POOL_SLAB_BUFFERS 32 // Buffers carved from each allocation
+
+typedef enum PoolClass { POOL_SMALL, POOL_LARGE, POOL_CLASS_COUNT } PoolClass;
+
+/**
+ * A fixed-size buffer from a BufferPool. Buffers only form a chain (`next`)
+ * when a request head outgrows a large buffer
+*/
+typedef struct PoolBuffer {
+    struct PoolBuffer *next;
+    size_t len; // Bytes used
+    size_t cap;
+    enum PoolClass cls;
+    char data[];
+} PoolBuffer;
+
+/**
+ * Per-worker free lists of recycled buffers
+ *
+ * Buffers are never returned to malloc: a connection takes one when it has
+ * data to read and gives it back as soon as it is done with it, so memory use
+ * follows the number of busy connections rather than open ones
+*/
+typedef struct BufferPool {
+    struct PoolBuffer *free[POOL_CLASS_COUNT];
+    size_t inUse[POOL_CLASS_COUNT];
+    size_t allocated[POOL_CLASS_COUNT];
+} BufferPool;
+
+struct BufferPool *pool_create(void);
+struct PoolBuffer *pool_get(struct BufferPool *p, enum PoolClass cls);
+void pool_put(struct BufferPool *p, struct PoolBuffer *b);
+size_t pool_chain_length(const struct PoolBuffer *b);
+size_t pool_copy_chain(char *dst, const struct PoolBuffer *b);
+struct PoolBuffer *pool_consume(struct BufferPool *p, struct PoolBuffer *b, size_t n);
+
+#endif
@@ -0,0 +1,1314 @@
+#define _GNU_SOURCE // splice, pipe2
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "http.h"
+#include "socket.h"
+#include "connection.h"
+#include "worker.h"
+#include "proxy.h"
+#include "tls.h"
+
+/**
+ * How far a step of an exchange got
+*/
+typedef enum ProxyStep {
+    STEP_NEXT, // On to the next phase
+    STEP_BLOCKED, // Waiting for `wantUpstream` / `wantClient`
+    STEP_UPSTREAM_FAILED,
+    STEP_CLIENT_FAILED
+} ProxyStep;
+
+// Not forwarded upstream: they describe the client's connection (RFC 7230 6.1), or are replaced
+static const char *const requestSkipped[] = {
+    HTTP_HEADER_CONNECTION, "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding", "Upgrade",
+    "Expect", "HTTP2-Settings", HTTP_HEADER_CONTENT_LENGTH, "X-Forwarded-For", NULL
+};
+
+// Not passed back to the client. The body is passed on framed as it came, so its Transfer-Encoding stays
+static const char *const responseSkipped[] = {
+    HTTP_HEADER_CONNECTION, "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade", NULL
+};
+
+static int is_listed(const char *const *list, const char *name, size_t len) {
+    for (; *list; ++list) {
+        if (strlen(*list) == len && strncasecmp(*list, name, len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Whether a comma separated header value lists `token`
+*/
+static int has_token(const char *value, size_t valueLength, const char *token) {
+    const char *end = value + valueLength;
+    size_t len, tokenLength = strlen(token);
+
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            ++value;
+        }
+
+        for (len = 0; value + len < end && value[len] != ',' && value[len] != ' ' && value[len] != '\t'; ++len);
+
+        if (len == tokenLength && strncasecmp(value, token, len) == 0) {
+            return 1;
+        }
+
+        value += len;
+    }
+
+    return 0;
+}
+
+struct Proxy *proxy_create(const struct ServerConfig *c) {
+    struct Proxy *p = calloc(1, sizeof(struct Proxy));
+    int i;
+
+    if (!p) {
+        return NULL;
+    }
+
+    strcpy(p->prefix, c->proxyPrefix);
+    p->prefixLength = strlen(p->prefix);
+    p->intervalMs = c->proxyHealthIntervalMs;
+
+    // Already checked by config_load
+    for (i = 0; i < c->proxyUpstreamCount; ++i) {
+        if (resolve_address(c->proxyUpstreams[i], &p->servers[p->count].addr, &p->servers[p->count].addrLength) == 0) {
+            ++p->count;
+        }
+    }
+
+    return p;
+}
+
+/**
+ * Whether the normalized `path` is the prefix or beneath it
+*/
+int proxy_matches(const struct Proxy *p, const char *path) {
+    if (strncmp(path, p->prefix, p->prefixLength) != 0) {
+        return 0;
+    }
+
+    return p->prefix[p->prefixLength - 1] == '/' || path[p->prefixLength] == '\0'
+        || path[p->prefixLength] == '/';
+}
+
+static int set_upstream_events(struct Worker *w, struct ProxyLink *link, unsigned int events) {
+    struct epoll_event ev;
+    int op = !link->upstreamEvents ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+    if (events == link->upstreamEvents) {
+        return 0;
+    }
+
+    // Out of the set rather than watched for nothing, or a hangup would keep waking the worker
+    ev.events = events;
+    ev.data.ptr = link->conn;
+
+    if (epoll_ctl(w->epollfd, op, link->conn->fd, &ev) == -1) {
+        return -1;
+    }
+
+    link->upstreamEvents = events;
+
+    return 0;
+}
+
+static int set_client_events(struct Worker *w, struct ProxyLink *link, unsigned int events) {
+    struct epoll_event ev;
+
+    if (events == link->clientEvents) {
+        return 0;
+    }
+
+    ev.events = events;
+    ev.data.ptr = link->client;
+
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_MOD, link->client->fd, &ev) == -1) {
+        return -1;
+    }
+
+    link->clientEvents = events;
+
+    return 0;
+}
+
+/**
+ * Takes an empty pipe for the response body, from the worker's spares if it has one
+*/
+static int take_pipe(struct Proxy *p, struct ProxyLink *link) {
+    if (p->pipeCount) {
+        --p->pipeCount;
+        link->pipe[0] = p->pipes[p->pipeCount][0];
+        link->pipe[1] = p->pipes[p->pipeCount][1];
+        return 0;
+    }
+
+    return pipe2(link->pipe, O_NONBLOCK | O_CLOEXEC);
+}
+
+/**
+ * Keeps the link's pipe for the next response if it is empty, else closes it
+*/
+static void drop_pipe(struct Proxy *p, struct ProxyLink *link) {
+    if (link->pipe[0] == -1) {
+        return;
+    }
+
+    if (!link->piped && p->pipeCount < PROXY_MAX_PIPES) {
+        p->pipes[p->pipeCount][0] = link->pipe[0];
+        p->pipes[p->pipeCount][1] = link->pipe[1];
+        ++p->pipeCount;
+    } else {
+        close(link->pipe[0]);
+        close(link->pipe[1]);
+    }
+
+    link->pipe[0] = link->pipe[1] = -1;
+    link->piped = 0;
+}
+
+/**
+ * Releases what the link holds for the exchange it was forwarding
+*/
+static void reset_link(struct Worker *w, struct ProxyLink *link) {
+    if (link->outBuf) {
+        pool_put(w->pool, link->outBuf);
+    } else {
+        free(link->out);
+    }
+
+    link->outBuf = NULL;
+    link->out = NULL;
+    link->outLength = link->outSent = 0;
+
+    pool_put(w->pool, link->in);
+    link->in = NULL;
+    link->inStart = 0;
+
+    drop_pipe(w->proxy, link);
+
+    link->client = NULL;
+    link->response = NULL;
+}
+
+/**
+ * Closes the upstream connection, leaving the link with none
+*/
+static void disconnect(struct Worker *w, struct ProxyLink *link) {
+    if (!link->conn) {
+        return;
+    }
+
+    // Closing the socket also takes it out of the epoll set
+    close(link->conn->fd);
+    link->conn->fd = -1;
+    connection_put(w->connections, link->conn);
+    link->conn = NULL;
+    link->upstreamEvents = 0;
+}
+
+static void close_link(struct Worker *w, struct ProxyLink *link) {
+    struct Proxy *p = w->proxy;
+
+    reset_link(w, link);
+    disconnect(w, link);
+
+    link->next = p->freeLinks;
+    p->freeLinks = link;
+}
+
+static void unpool(struct ProxyLink *link) {
+    struct ProxyLink **l;
+
+    for (l = &link->server->idle; *l; l = &(*l)->next) {
+        if (*l == link) {
+            *l = link->next;
+            --link->server->idleCount;
+            return;
+        }
+    }
+}
+
+static void mark_down(struct Worker *w, struct ProxyServer *s) {
+    s->down = 1;
+    s->probeAt = worker_clock(w) + w->proxy->intervalMs;
+}
+
+/**
+ * Starts connecting `link` to `s`. It is watched for writing, which is when
+ * the connection is up (or has failed)
+*/
+static int connect_link(struct Worker *w, struct ProxyLink *link, struct ProxyServer *s) {
+    struct Connection *u;
+    int fd, one = 1;
+
+    fd = socket(s->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd != -1 && s->addr.ss_family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // A Unix socket with a full backlog says EAGAIN, which counts as refused too
+    if (fd == -1 || (connect(fd, (struct sockaddr *)&s->addr, s->addrLength) == -1 && errno != EINPROGRESS)
+        || !(u = connection_get(w->connections, fd))) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    u->protocol = CONNECTION_UPSTREAM;
+    u->family = s->addr.ss_family;
+    u->upstream = link;
+
+    link->conn = u;
+    link->server = s;
+    link->phase = PROXY_CONNECTING;
+    link->outSent = 0;
+    link->upstreamEvents = 0;
+
+    if (set_upstream_events(w, link, EPOLLOUT) == -1) {
+        close(fd);
+        connection_put(w->connections, u);
+        link->conn = NULL;
+        return -1;
+    }
+
+    connection_arm(w->connections, u, CONNECTION_WRITING, worker_clock(w) + HTTP_SEND_TIMEOUT_MS);
+
+    return 0;
+}
+
+static struct ProxyLink *open_link(struct Worker *w, struct ProxyServer *s) {
+    struct Proxy *p = w->proxy;
+    struct ProxyLink *link = p->freeLinks;
+
+    if (link) {
+        p->freeLinks = link->next;
+    } else if (!(link = malloc(sizeof(struct ProxyLink)))) {
+        return NULL;
+    }
+
+    memset(link, 0, sizeof(struct ProxyLink));
+    link->pipe[0] = link->pipe[1] = -1;
+
+    if (connect_link(w, link, s) == -1) {
+        link->next = p->freeLinks;
+        p->freeLinks = link;
+        return NULL;
+    }
+
+    return link;
+}
+
+/**
+ * Pools a link that has finished an exchange, watched for reading only to
+ * notice the upstream closing it
+*/
+static int pool_link(struct Worker *w, struct ProxyLink *link) {
+    struct ProxyServer *s = link->server;
+
+    if (w->proxy->draining || s->idleCount >= PROXY_MAX_IDLE || set_upstream_events(w, link, EPOLLIN) == -1) {
+        return -1;
+    }
+
+    reset_link(w, link);
+    link->phase = PROXY_POOLED;
+    link->next = s->idle;
+    s->idle = link;
+    ++s->idleCount;
+    connection_arm(w->connections, link->conn, CONNECTION_IDLE, worker_clock(w) + w->config->keepAliveTimeoutMs);
+
+    return 0;
+}
+
+/**
+ * Round robin over the upstreams that are up, preferring a pooled connection
+ * to each. Upstreams that cannot even be connected to are marked down on the way
+*/
+static struct ProxyLink *take_link(struct Worker *w) {
+    struct Proxy *p = w->proxy;
+    struct ProxyServer *s;
+    struct ProxyLink *link;
+    int tried;
+
+    for (tried = 0; tried < p->count; ++tried) {
+        s = &p->servers[p->next];
+        p->next = (p->next + 1) % p->count;
+
+        if (s->down) {
+            continue;
+        }
+
+        if ((link = s->idle)) {
+            s->idle = link->next;
+            --s->idleCount;
+            link->phase = PROXY_SENDING;
+            link->replay = 1;
+            return link;
+        }
+
+        if ((link = open_link(w, s))) {
+            return link;
+        }
+
+        mark_down(w, s);
+    }
+
+    return NULL;
+}
+
+static size_t append(char *dst, size_t cap, size_t off, const char *src, size_t len) {
+    if (off < cap) {
+        memcpy(dst + off, src, off + len <= cap ? len : cap - off);
+    }
+
+    return off + len;
+}
+
+/**
+ * Appends the headers of a request in the order they were received (the parser
+ * keeps them newest first), less the ones not forwarded
+*/
+static size_t append_headers(char *dst, size_t cap, size_t off, const struct HttpRequestHeader *h) {
+    if (!h) {
+        return off;
+    }
+
+    off = append_headers(dst, cap, off, h->next);
+
+    if (is_listed(requestSkipped, h->name, strlen(h->name))) {
+        return off;
+    }
+
+    off = append(dst, cap, off, h->name, strlen(h->name));
+    off = append(dst, cap, off, ": ", 2);
+    off = append(dst, cap, off, h->value, strlen(h->value));
+
+    return append(dst, cap, off, "\r\n", 2);
+}
+
+/**
+ * Serializes the request head to forward. Same contract as serialize_head
+ *
+ * The client's address is added to X-Forwarded-For, and an HTTP/1.0 request
+ * asks for keep-alive so the upstream connection can be pooled
+*/
+static size_t serialize_request(char *dst, size_t cap, struct HttpRequest *req, const struct Connection *c) {
+    char line[64 + INET6_ADDRSTRLEN];
+    char addr[INET6_ADDRSTRLEN] = "";
+    const char *forwarded = get_header_value("X-Forwarded-For", req->headers);
+    const char *method = method_name(req->method);
+    size_t off = 0;
+    int len;
+
+    if (c->family == AF_INET || c->family == AF_INET6) {
+        inet_ntop(c->family, c->addr, addr, sizeof(addr));
+    }
+
+    off = append(dst, cap, off, method, strlen(method));
+    off = append(dst, cap, off, " ", 1);
+    off = append(dst, cap, off, req->path, strlen(req->path));
+    if (req->query) {
+        off = append(dst, cap, off, "?", 1);
+        off = append(dst, cap, off, req->query, req->queryLength);
+    }
+    off = append(dst, cap, off, " ", 1);
+    off = append(dst, cap, off, req->version, strlen(req->version));
+    off = append(dst, cap, off, "\r\n", 2);
+
+    off = append_headers(dst, cap, off, req->headers);
+
+    if (forwarded || addr[0]) {
+        off = append(dst, cap, off, "X-Forwarded-For: ", strlen("X-Forwarded-For: "));
+        if (forwarded) {
+            off = append(dst, cap, off, forwarded, strlen(forwarded));
+            off = append(dst, cap, off, addr[0] ? ", " : "", addr[0] ? 2 : 0);
+        }
+        off = append(dst, cap, off, addr, strlen(addr));
+        off = append(dst, cap, off, "\r\n", 2);
+    }
+
+    if (req->contentLength) {
+        len = snprintf(line, sizeof(line), HTTP_HEADER_CONTENT_LENGTH ": %llu\r\n", (unsigned long long)req->contentLength);
+        off = append(dst, cap, off, line, len);
+    }
+
+    if (strcmp(req->version, HTTP_VERSION_1_1) != 0) {
+        off = append(dst, cap, off, "Connection: keep-alive\r\n", strlen("Connection: keep-alive\r\n"));
+    }
+
+    return append(dst, cap, off, "\r\n", 2);
+}
+
+/**
+ * Serializes the request into the smallest buffer it fits
+*/
+static int build_request(struct Worker *w, struct ProxyLink *link, struct HttpRequest *req, const struct Connection *c) {
+    enum PoolClass cls;
+    size_t cap = 0;
+
+    for (cls = POOL_SMALL; cls < POOL_CLASS_COUNT; ++cls) {
+        if (!(link->outBuf = pool_get(w->pool, cls))) {
+            break;
+        }
+
+        link->out = link->outBuf->data;
+        cap = link->outBuf->cap;
+        link->outLength = serialize_request(link->out, cap, req, c);
+
+        if (link->outLength <= cap) {
+            return 0;
+        }
+
+        pool_put(w->pool, link->outBuf);
+        link->outBuf = NULL;
+    }
+
+    link->outLength = serialize_request(NULL, 0, req, c);
+
+    if (!(link->out = malloc(link->outLength))) {
+        return -1;
+    }
+
+    serialize_request(link->out, link->outLength, req, c);
+
+    return 0;
+}
+
+/**
+ * Hands the link back to the worker's pool (or closes it) and the client back
+ * to the worker, waiting for its next request
+*/
+static int end_exchange(struct Worker *w, struct ProxyLink *link, int result) {
+    struct Connection *client = link->client;
+
+    link->response->proxy = NULL;
+
+    if (result != PROXY_CLOSE) {
+        set_client_events(w, link, EPOLLIN);
+        connection_arm(w->connections, client, CONNECTION_READING, worker_clock(w) + w->config->requestTimeoutMs);
+    }
+
+    if (result != PROXY_DONE || !link->keepAlive || pool_link(w, link) == -1) {
+        close_link(w, link);
+    }
+
+    return result;
+}
+
+/**
+ * Gives up on the exchange before anything of a response has been passed on,
+ * leaving `status` for the worker to answer with
+*/
+static int fail(struct Worker *w, struct ProxyLink *link, int status) {
+    struct Response *o = link->response;
+
+    // The worker serializes its own response in place of a head that was never sent
+    if (o->buf) {
+        pool_put(w->pool, o->buf);
+    } else {
+        free(o->data);
+    }
+
+    o->buf = NULL;
+    o->data = NULL;
+    o->length = o->sent = 0;
+    o->status = status;
+
+    return end_exchange(w, link, PROXY_FAILED);
+}
+
+/**
+ * Bytes of `len` newly received that belong to the response body, or -1 if
+ * its framing is broken. Anything after the end means the upstream connection
+ * is out of step and cannot be pooled
+*/
+static ssize_t take_body(struct ProxyLink *link, const char *data, size_t len) {
+    ssize_t n = len;
+
+    if (link->chunked) {
+        n = scan_chunked(&link->chunk, data, len);
+    } else if (link->responseLeft >= 0) {
+        n = (size_t)link->responseLeft < len ? link->responseLeft : (long long)len;
+        link->responseLeft -= n;
+    }
+
+    if (n >= 0 && (size_t)n < len) {
+        link->keepAlive = 0;
+    }
+
+    return n;
+}
+
+static int body_done(const struct ProxyLink *link) {
+    if (link->piped || (link->in && link->inStart < link->in->len)) {
+        return 0;
+    }
+
+    return link->chunked ? link->chunk.state == CHUNK_END : link->responseLeft >= 0 ? link->responseLeft == 0 : link->ended;
+}
+
+/**
+ * Checks an upstream status line and headers and writes the head the client
+ * gets, in its own version and with its own Connection header
+ *
+ * Returns 1 for an interim (1xx) response to skip, -1 if the head is not
+ * something that can be passed on
+*/
+static int parse_response_head(struct Worker *w, struct ProxyLink *link, size_t headLength) {
+    const char *head = link->in->data, *end = head + headLength, *line, *eol, *colon, *value;
+    struct Response *o = link->response;
+    int status, minor, close = 0, keepAlive = 0, otherEncoding = 0;
+    long long contentLength = -1;
+    size_t valueLength, off, cap;
+    char *dst, *digitsEnd;
+
+    if (headLength < 14 || strncmp(head, "HTTP/1.", 7) != 0 || head[7] < '0' || head[7] > '9' || head[8] != ' '
+        || head[9] < '1' || head[9] > '5' || head[10] < '0' || head[10] > '9' || head[11] < '0' || head[11] > '9'
+        || (head[12] != ' ' && head[12] != '\r' && head[12] != '\n')) {
+        return -1;
+    }
+
+    minor = head[7] - '0';
+    status = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+
+    // Expect is not forwarded, so a 100 Continue is not for the client. A 101 cannot be, Upgrade is not either
+    if (status < 200) {
+        return status == HTTP_STATUS_SWITCHING_PROTOCOLS ? -1 : 1;
+    }
+
+    link->chunked = 0;
+    memset(&link->chunk, 0, sizeof(link->chunk));
+
+    for (line = (const char *)memchr(head, '\n', end - head) + 1; line < end && *line != '\r' && *line != '\n'; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+
+        if (!(colon = memchr(line, ':', eol - line))) {
+            return -1;
+        }
+
+        for (value = colon + 1; value < eol && (*value == ' ' || *value == '\t'); ++value);
+        for (valueLength = eol - value; valueLength && (value[valueLength - 1] == '\r' || value[valueLength - 1] == ' '); --valueLength);
+
+        if (colon - line == 14 && strncasecmp(line, HTTP_HEADER_CONTENT_LENGTH, 14) == 0) {
+            errno = 0;
+            if (!valueLength || *value < '0' || *value > '9'
+                || (contentLength = strtoll(value, &digitsEnd, 10)) < 0 || errno || digitsEnd != value + valueLength) {
+                return -1;
+            }
+        } else if (colon - line == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            // Chunked only counts last, after any other coding
+            if (valueLength >= 7 && strncasecmp(value + valueLength - 7, "chunked", 7) == 0) {
+                link->chunked = 1;
+            } else {
+                otherEncoding = 1;
+            }
+        } else if (colon - line == 10 && strncasecmp(line, HTTP_HEADER_CONNECTION, 10) == 0) {
+            close |= has_token(value, valueLength, "close");
+            keepAlive |= has_token(value, valueLength, "keep-alive");
+        }
+    }
+
+    // An HTTP/1.0 request cannot be answered chunked
+    if (link->chunked && !link->http11) {
+        return -1;
+    }
+
+    if (status == HTTP_STATUS_NO_CONTENT || status == HTTP_STATUS_NOT_MODIFIED) {
+        link->chunked = 0;
+        link->responseLeft = 0;
+    } else if (link->chunked || otherEncoding) {
+        link->chunked = !otherEncoding;
+        link->responseLeft = -1;
+    } else {
+        link->responseLeft = contentLength;
+    }
+
+    // Without a length the body runs until the upstream closes, and the client has to be closed to tell it the same
+    link->keepAlive = (minor ? !close : keepAlive) && (link->chunked || link->responseLeft >= 0);
+    if (!link->chunked && link->responseLeft < 0) {
+        o->keepAlive = 0;
+    }
+
+    o->status = status;
+
+    // Room for a CR added to every line, and the Connection header
+    cap = 2 * headLength + 64;
+    o->buf = cap <= POOL_LARGE_SIZE ? pool_get(w->pool, cap <= POOL_SMALL_SIZE ? POOL_SMALL : POOL_LARGE) : NULL;
+    if (!(dst = o->buf ? o->buf->data : malloc(cap))) {
+        return -1;
+    }
+    o->data = dst;
+
+    eol = memchr(head, '\n', end - head);
+    off = append(dst, cap, 0, link->http11 ? HTTP_VERSION_1_1 : HTTP_VERSION, strlen(HTTP_VERSION));
+    off = append(dst, cap, off, head + 8, eol - head - 8);
+    if (dst[off - 1] != '\r') {
+        off = append(dst, cap, off, "\r", 1);
+    }
+    off = append(dst, cap, off, "\n", 1);
+
+    for (line = eol + 1; line < end && *line != '\r' && *line != '\n'; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        colon = memchr(line, ':', eol - line);
+
+        if (!is_listed(responseSkipped, line, colon - line)) {
+            off = append(dst, cap, off, line, eol - line);
+            if (eol == line || eol[-1] != '\r') {
+                off = append(dst, cap, off, "\r", 1);
+            }
+            off = append(dst, cap, off, "\n", 1);
+        }
+    }
+
+    // Same as for the worker's own responses
+    if (link->http11 ? !o->keepAlive : o->keepAlive) {
+        off = append(dst, cap, off, o->keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n",
+            strlen(o->keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n"));
+    }
+
+    o->length = append(dst, cap, off, "\r\n", 2);
+    o->sent = 0;
+
+    return 0;
+}
+
+static enum ProxyStep connected(struct Worker *w, struct ProxyLink *link) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    (void)w;
+
+    if (getsockopt(link->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+        return STEP_UPSTREAM_FAILED;
+    }
+
+    link->phase = PROXY_SENDING;
+
+    return STEP_NEXT;
+}
+
+/**
+ * Sends the request head, then streams the body up out of the client's buffer
+ * as it arrives. Whatever the client sent after the body stays there
+*/
+static enum ProxyStep send_request(struct Worker *w, struct ProxyLink *link) {
+    struct Connection *c = link->client;
+    size_t take;
+    ssize_t n;
+
+    while (link->outSent < link->outLength) {
+        n = send(link->conn->fd, link->out + link->outSent, link->outLength - link->outSent, 0);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            link->wantUpstream = EPOLLOUT;
+            return STEP_BLOCKED;
+        }
+        if (n == -1) {
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        link->outSent += n;
+    }
+
+    while (link->requestLeft) {
+        if (!c->in) {
+            if (!(c->in = pool_get(w->pool, POOL_LARGE))) {
+                return STEP_CLIENT_FAILED;
+            }
+
+            do {
+                n = tls_recv(c->fd, c->in->data, c->in->cap);
+            } while (n == -1 && errno == EINTR);
+
+            if (n <= 0) {
+                pool_put(w->pool, c->in);
+                c->in = NULL;
+
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    link->wantClient = EPOLLIN;
+                    return STEP_BLOCKED;
+                }
+
+                return STEP_CLIENT_FAILED;
+            }
+
+            c->in->len = n;
+        }
+
+        take = c->in->len < link->requestLeft ? c->in->len : link->requestLeft;
+        n = send(link->conn->fd, c->in->data, take, 0);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            link->wantUpstream = EPOLLOUT;
+            return STEP_BLOCKED;
+        }
+        if (n == -1) {
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        METRICS_ADD(w->metrics->bytesIn, n);
+        c->in = pool_consume(w->pool, c->in, n);
+        link->requestLeft -= n;
+    }
+
+    link->phase = PROXY_WAITING;
+
+    return STEP_NEXT;
+}
+
+/**
+ * Reads the response head, and with it the start of the body
+*/
+static enum ProxyStep receive_head(struct Worker *w, struct ProxyLink *link) {
+    struct PoolBuffer *large;
+    size_t headLength;
+    ssize_t n;
+    int interim;
+
+    for (;;) {
+        if (!link->in && !(link->in = pool_get(w->pool, POOL_SMALL))) {
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        if (link->in->len == link->in->cap) {
+            // Heads are only given a large buffer, and only if they need it
+            if (link->in->cls == POOL_LARGE || !(large = pool_get(w->pool, POOL_LARGE))) {
+                return STEP_UPSTREAM_FAILED;
+            }
+
+            memcpy(large->data, link->in->data, link->in->len);
+            large->len = link->in->len;
+            pool_put(w->pool, link->in);
+            link->in = large;
+        }
+
+        n = recv(link->conn->fd, link->in->data + link->in->len, link->in->cap - link->in->len, 0);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            link->wantUpstream = EPOLLIN;
+            return STEP_BLOCKED;
+        }
+        if (n <= 0) {
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        link->in->len += n;
+        link->replay = 0;
+
+        while ((headLength = request_head_length(link->in->data, link->in->len))) {
+            if ((interim = parse_response_head(w, link, headLength)) == -1) {
+                return STEP_UPSTREAM_FAILED;
+            }
+
+            if (interim) {
+                memmove(link->in->data, link->in->data + headLength, link->in->len - headLength);
+                link->in->len -= headLength;
+                continue;
+            }
+
+            // What came with the head of the body
+            if ((n = take_body(link, link->in->data + headLength, link->in->len - headLength)) == -1) {
+                return STEP_UPSTREAM_FAILED;
+            }
+
+            link->inStart = headLength;
+            link->in->len = headLength + n;
+            link->phase = PROXY_RESPONDING;
+
+            return STEP_NEXT;
+        }
+    }
+}
+
+/**
+ * Passes the response on: the head and whatever body came with it from
+ * memory, then the rest through a pipe with splice. Chunked bodies are read
+ * through `in` instead, to find where they end
+*/
+static enum ProxyStep respond(struct Worker *w, struct ProxyLink *link) {
+    struct Response *o = link->response;
+    struct Connection *c = link->client;
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t take, want;
+    ssize_t n;
+    int count;
+
+    for (;;) {
+        count = 0;
+        if (o->sent < o->length) {
+            iov[count].iov_base = o->data + o->sent;
+            iov[count++].iov_len = o->length - o->sent;
+        }
+        if (link->in && link->inStart < link->in->len) {
+            iov[count].iov_base = link->in->data + link->inStart;
+            iov[count++].iov_len = link->in->len - link->inStart;
+        }
+
+        if (count) {
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+
+            n = tls_sendmsg(c->fd, &msg, 0);
+
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                link->wantClient = EPOLLOUT;
+                return STEP_BLOCKED;
+            }
+            if (n == -1) {
+                return STEP_CLIENT_FAILED;
+            }
+
+            o->bytes += n;
+            take = (size_t)n < o->length - o->sent ? (size_t)n : o->length - o->sent;
+            o->sent += take;
+            link->inStart += n - take;
+            continue;
+        }
+
+#ifdef __linux__
+        if (link->piped) {
+            n = splice(link->pipe[0], NULL, c->fd, NULL, link->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN) {
+                link->wantClient = EPOLLOUT;
+                return STEP_BLOCKED;
+            }
+            if (n <= 0) {
+                return STEP_CLIENT_FAILED;
+            }
+
+            o->bytes += n;
+            link->piped -= n;
+            continue;
+        }
+#endif
+
+        if (body_done(link)) {
+            return STEP_NEXT;
+        }
+
+#ifdef __linux__
+        // Only refilled once empty, so a full pipe never looks like a quiet upstream. A client
+        // whose records are encrypted in process reads the body through `in` like a chunked one
+        if (!link->chunked && tls_zero_copy(c->fd) && (link->pipe[0] != -1 || take_pipe(w->proxy, link) == 0)) {
+            pool_put(w->pool, link->in);
+            link->in = NULL;
+
+            want = link->responseLeft >= 0 && link->responseLeft < PROXY_PIPE_SIZE ? link->responseLeft : PROXY_PIPE_SIZE;
+            n = splice(link->conn->fd, NULL, link->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1 && errno == EAGAIN) {
+                link->wantUpstream = EPOLLIN;
+                return STEP_BLOCKED;
+            }
+            if (n == 0 && link->responseLeft < 0) {
+                link->ended = 1;
+                continue;
+            }
+            if (n <= 0) {
+                return STEP_UPSTREAM_FAILED;
+            }
+
+            link->piped += n;
+            if (link->responseLeft >= 0) {
+                link->responseLeft -= n;
+            }
+            continue;
+        }
+#endif
+
+        if (!link->in && !(link->in = pool_get(w->pool, POOL_LARGE))) {
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        want = link->responseLeft >= 0 && (size_t)link->responseLeft < link->in->cap ? (size_t)link->responseLeft : link->in->cap;
+        n = recv(link->conn->fd, link->in->data, want, 0);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            link->in->len = link->inStart = 0;
+            link->wantUpstream = EPOLLIN;
+            return STEP_BLOCKED;
+        }
+        if (n == 0 && !link->chunked && link->responseLeft < 0) {
+            link->in->len = link->inStart = 0;
+            link->ended = 1;
+            continue;
+        }
+        if (n <= 0 || (n = take_body(link, link->in->data, n)) == -1) {
+            return STEP_UPSTREAM_FAILED;
+        }
+
+        link->in->len = n;
+        link->inStart = 0;
+    }
+}
+
+/**
+ * Moves the exchange onto a new connection: to the same upstream when a
+ * pooled connection turned out to have been closed under it, else to the
+ * next upstream that is up, after marking down the one that refused it
+*/
+static int retry(struct Worker *w, struct ProxyLink *link) {
+    struct Proxy *p = w->proxy;
+    struct ProxyServer *s = link->server;
+    int tried;
+
+    disconnect(w, link);
+
+    if (link->replay) {
+        link->replay = 0;
+
+        if (link->in) {
+            link->in->len = 0;
+        }
+        if (connect_link(w, link, s) == 0) {
+            return 0;
+        }
+    }
+
+    mark_down(w, s);
+
+    for (tried = 0; tried < p->count; ++tried) {
+        s = &p->servers[p->next];
+        p->next = (p->next + 1) % p->count;
+
+        if (s->down) {
+            continue;
+        }
+        if (connect_link(w, link, s) == 0) {
+            return 0;
+        }
+
+        mark_down(w, s);
+    }
+
+    return -1;
+}
+
+/**
+ * Carries the exchange on as far as both sockets allow
+*/
+static int run(struct Worker *w, struct ProxyLink *link) {
+    enum ProxyStep step;
+    unsigned int now;
+
+    for (;;) {
+        link->wantUpstream = link->wantClient = 0;
+
+        switch (link->phase) {
+            case PROXY_CONNECTING:
+                step = connected(w, link);
+                break;
+            case PROXY_SENDING:
+                step = send_request(w, link);
+                break;
+            case PROXY_WAITING:
+                step = receive_head(w, link);
+                break;
+            default:
+                step = respond(w, link);
+                if (step == STEP_NEXT) {
+                    return end_exchange(w, link, PROXY_DONE);
+                }
+        }
+
+        if (step == STEP_NEXT) {
+            continue;
+        }
+
+        if (step == STEP_BLOCKED) {
+            break;
+        }
+
+        if (step == STEP_CLIENT_FAILED || link->phase == PROXY_RESPONDING) {
+            return end_exchange(w, link, PROXY_CLOSE);
+        }
+
+        if (!link->replay && link->phase != PROXY_CONNECTING) {
+            return fail(w, link, HTTP_STATUS_BAD_GATEWAY);
+        }
+
+        if (retry(w, link) == -1) {
+            return fail(w, link, HTTP_STATUS_BAD_GATEWAY);
+        }
+
+        link->wantUpstream = EPOLLOUT;
+        break;
+    }
+
+    // Both sockets are given the send timeout, the upstream's first so it expires first
+    now = worker_clock(w);
+
+    if (set_upstream_events(w, link, link->wantUpstream) == -1 || set_client_events(w, link, link->wantClient) == -1) {
+        return end_exchange(w, link, PROXY_CLOSE);
+    }
+
+    connection_arm(w->connections, link->conn, CONNECTION_WRITING, now + HTTP_SEND_TIMEOUT_MS);
+    connection_arm(w->connections, link->client, CONNECTION_WRITING, now + HTTP_SEND_TIMEOUT_MS);
+
+    return PROXY_PENDING;
+}
+
+/**
+ * Starts forwarding `req`, which it takes, with `o` as its response at the
+ * front of the client's (otherwise empty) queue. The body, if any, is taken
+ * from `c->in` as it arrives
+ *
+ * Returns -1 if the request cannot be forwarded, with `o->status` saying why
+*/
+int proxy_start(struct Worker *w, struct Connection *c, struct HttpRequest *req, struct Response *o) {
+    struct ProxyLink *link;
+    unsigned int now;
+
+    // The body is streamed as it comes, which needs its length up front
+    if (get_header_value("Transfer-Encoding", req->headers)) {
+        o->status = HTTP_STATUS_LENGTH_REQUIRED;
+        free_request(req);
+        return -1;
+    }
+
+    if (!(link = take_link(w))) {
+        o->status = HTTP_STATUS_BAD_GATEWAY;
+        free_request(req);
+        return -1;
+    }
+
+    link->client = c;
+    link->response = o;
+    link->clientEvents = c->state == CONNECTION_WRITING ? EPOLLOUT : EPOLLIN;
+
+    if (build_request(w, link, req, c) == -1 || set_upstream_events(w, link, EPOLLOUT) == -1
+        || set_client_events(w, link, 0) == -1) {
+        o->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        close_link(w, link);
+        free_request(req);
+        return -1;
+    }
+
+    link->http11 = strcmp(req->version, HTTP_VERSION_1_1) == 0;
+    link->requestLeft = req->contentLength;
+    link->replay = link->replay && !req->contentLength;
+    link->outSent = 0;
+    link->responseLeft = 0;
+    link->chunked = 0;
+    link->ended = 0;
+    link->keepAlive = 0;
+
+    free_request(req);
+
+    o->proxy = link;
+    o->sendStart = metrics_now_ns();
+    c->out = o;
+
+    now = worker_clock(w);
+    connection_arm(w->connections, link->conn, CONNECTION_WRITING, now + HTTP_SEND_TIMEOUT_MS);
+    connection_arm(w->connections, c, CONNECTION_WRITING, now + HTTP_SEND_TIMEOUT_MS);
+
+    return 0;
+}
+
+/**
+ * Carries on with the exchange a client connection is waiting on
+*/
+int proxy_client_event(struct Worker *w, struct Connection *c, unsigned int events) {
+    struct ProxyLink *link = c->out->proxy;
+
+    // Gone, whatever was still to be read or written
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return end_exchange(w, link, PROXY_CLOSE);
+    }
+
+    return run(w, link);
+}
+
+/**
+ * A probe has connected, or failed to
+*/
+static void probed(struct Worker *w, struct ProxyLink *link) {
+    struct ProxyServer *s = link->server;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    s->probing = 0;
+
+    if (getsockopt(link->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+        mark_down(w, s);
+        close_link(w, link);
+        return;
+    }
+
+    // Back in the round robin, starting with this connection
+    s->down = 0;
+
+    if (pool_link(w, link) == -1) {
+        close_link(w, link);
+    }
+}
+
+/**
+ * Carries on with the exchange on an upstream connection
+ *
+ * Returns the client connection waiting on it, with what has become of its
+ * request in `*result`, or NULL if there is none (a pooled connection or a probe)
+*/
+struct Connection *proxy_upstream_event(struct Worker *w, struct Connection *u, unsigned int events, int *result) {
+    struct ProxyLink *link = u->upstream;
+    struct Connection *client = link->client;
+
+    (void)events;
+
+    switch (link->phase) {
+        case PROXY_POOLED:
+            // Closed by the upstream, or out of step with it
+            unpool(link);
+            close_link(w, link);
+            return NULL;
+        case PROXY_PROBING:
+            probed(w, link);
+            return NULL;
+        default:
+            *result = run(w, link);
+            return client;
+    }
+}
+
+/**
+ * An upstream connection has had the send timeout without progress. Same
+ * contract as proxy_upstream_event
+*/
+struct Connection *proxy_expired(struct Worker *w, struct Connection *u, int *result) {
+    struct ProxyLink *link = u->upstream;
+    struct Connection *client = link->client;
+
+    if (link->phase == PROXY_PROBING || link->phase == PROXY_CONNECTING) {
+        link->server->probing = 0;
+        mark_down(w, link->server);
+    }
+
+    if (!client) {
+        if (link->phase == PROXY_POOLED) {
+            unpool(link);
+        }
+        close_link(w, link);
+        return NULL;
+    }
+
+    *result = link->phase == PROXY_RESPONDING ? end_exchange(w, link, PROXY_CLOSE)
+        : fail(w, link, HTTP_STATUS_GATEWAY_TIME_OUT);
+
+    return client;
+}
+
+/**
+ * Drops the exchange of a client that is being closed
+*/
+void proxy_abort(struct Worker *w, struct ProxyLink *link) {
+    close_link(w, link);
+}
+
+/**
+ * Closes an upstream connection that is not forwarding anything: pooled, or a probe
+*/
+void proxy_close(struct Worker *w, struct Connection *u) {
+    struct ProxyLink *link = u->upstream;
+
+    if (link->phase == PROXY_POOLED) {
+        unpool(link);
+    } else if (link->phase == PROXY_PROBING) {
+        link->server->probing = 0;
+    }
+
+    close_link(w, link);
+}
+
+/**
+ * Probes the upstreams that are down and due for it
+ *
+ * Returns the milliseconds until the next is due, or -1 if none is (as epoll_wait takes it)
+*/
+int proxy_check(struct Worker *w) {
+    struct Proxy *p = w->proxy;
+    struct ProxyServer *s;
+    struct ProxyLink *link;
+    unsigned int now = worker_clock(w);
+    int i, left, timeout = -1;
+
+    for (i = 0; i < p->count && !p->draining; ++i) {
+        s = &p->servers[i];
+
+        if (!s->down || s->probing) {
+            continue;
+        }
+
+        left = (int)(s->probeAt - now);
+
+        if (left <= 0) {
+            if ((link = open_link(w, s))) {
+                link->phase = PROXY_PROBING;
+                s->probing = 1;
+                continue;
+            }
+
+            mark_down(w, s);
+            left = p->intervalMs;
+        }
+
+        if (timeout == -1 || left < timeout) {
+            timeout = left;
+        }
+    }
+
+    return timeout;
+}
+
+/**
+ * Stops pooling and probing, for a worker that is stopping. Pooled connections
+ * are idle ones, closed with the rest
+*/
+void proxy_drain(struct Worker *w) {
+    w->proxy->draining = 1;
+}
@@ -0,0 +1,118 @@
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "http.h"
+#include "pool.h"
+
+#define PROXY_MAX_IDLE 16 // Keep-alive connections a worker pools per upstream
+#define PROXY_MAX_PIPES 16 // Empty pipes a worker keeps for splicing
+#define PROXY_PIPE_SIZE 65536 // Spliced into a pipe at a time (the default pipe capacity)
+
+struct Worker;
+struct Connection;
+struct Response;
+
+typedef enum ProxyPhase {
+    PROXY_CONNECTING,
+    PROXY_SENDING, // The request head, then its body
+    PROXY_WAITING, // For the response head
+    PROXY_RESPONDING, // Passing the response on to the client
+    PROXY_POOLED, // Idle in its upstream's pool
+    PROXY_PROBING // Connecting to an upstream marked down, to see if it is back
+} ProxyPhase;
+
+/**
+ * What has become of a proxied request, for the worker to carry on with the client
+*/
+typedef enum ProxyResult {
+    PROXY_PENDING, // Waiting on one of the sockets
+    PROXY_DONE, // The response has been passed on whole
+    PROXY_FAILED, // Nothing was passed on, answer with the Response's status instead
+    PROXY_CLOSE // Gave up part way through a response, the client has to be closed
+} ProxyResult;
+
+/**
+ * A configured upstream and the connections to it pooled between requests
+ *
+ * An upstream that refuses a connection is marked down and skipped by the
+ * round robin until a probe connects to it again
+*/
+typedef struct ProxyServer {
+    struct sockaddr_storage addr;
+    socklen_t addrLength;
+    int down;
+    int probing;
+    unsigned int probeAt; // On the worker's clock
+    struct ProxyLink *idle;
+    int idleCount;
+} ProxyServer;
+
+/**
+ * An upstream connection, and the request it is forwarding if any
+ *
+ * Bodies are streamed both ways as they arrive, never held whole: the request
+ * body out of the client's `in` buffer, the response body through a pipe with
+ * splice, or through `in` when chunked framing has to be followed to find its end
+*/
+typedef struct ProxyLink {
+    struct Connection *conn;
+    struct Connection *client; // NULL while pooled
+    struct Response *response; // At the front of the client's queue
+    struct ProxyServer *server;
+    struct ProxyLink *next; // In the upstream's pool, or the free list
+    enum ProxyPhase phase;
+    int replay; // Taken from the pool with a request that is safe to send again on a new connection
+    int http11; // The client's version, which the request is forwarded in
+    struct PoolBuffer *outBuf; // Holds `out` unless it outgrew a large buffer
+    char *out; // Request head
+    size_t outLength;
+    size_t outSent;
+    unsigned long long requestLeft; // Of the request body
+    struct PoolBuffer *in; // Response head, then body not spliced
+    size_t inStart; // Of what is left to pass on
+    long long responseLeft; // Of a Content-Length body, -1 for chunked or until close
+    int chunked;
+    struct ChunkScanner chunk;
+    int ended; // The upstream closed, ending a body without a length
+    int keepAlive; // The upstream can be pooled after this response
+    int pipe[2];
+    size_t piped; // Bytes in the pipe
+    unsigned int upstreamEvents; // As watched, 0 when out of the epoll set
+    unsigned int clientEvents;
+    unsigned int wantUpstream; // What the last step blocked on
+    unsigned int wantClient;
+} ProxyLink;
+
+/**
+ * Per-worker proxy state, created from the config by proxy_create
+*/
+typedef struct Proxy {
+    char prefix[CONFIG_ADDRESS_MAX];
+    size_t prefixLength;
+    struct ProxyServer servers[MAX_UPSTREAMS];
+    int count;
+    int next; // Where the round robin picks up
+    int intervalMs; // Between probes of an upstream that is down
+    struct ProxyLink *freeLinks;
+    int pipes[PROXY_MAX_PIPES][2];
+    int pipeCount;
+    int draining; // Stopping: nothing more is pooled or probed
+} Proxy;
+
+struct Proxy *proxy_create(const struct ServerConfig *c);
+int proxy_matches(const struct Proxy *p, const char *path);
+int proxy_start(struct Worker *w, struct Connection *c, struct HttpRequest *req, struct Response *o);
+int proxy_client_event(struct Worker *w, struct Connection *c, unsigned int events);
+struct Connection *proxy_upstream_event(struct Worker *w, struct Connection *u, unsigned int events, int *result);
+struct Connection *proxy_expired(struct Worker *w, struct Connection *u, int *result);
+void proxy_abort(struct Worker *w, struct ProxyLink *link);
+void proxy_close(struct Worker *w, struct Connection *u);
+int proxy_check(struct Worker *w);
+void proxy_drain(struct Worker *w);
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "ratelimit.h"
+#include "http.h"
+
+#define TOKEN_MASK ((1ULL << RATELIMIT_TOKEN_BITS) - 1)
+#define STAMP_MASK ((1ULL << RATELIMIT_STAMP_BITS) - 1)
+
+static struct RateShard *shards = NULL;
+
+// The 429 sent to limited clients, serialized again only when its Date goes stale
+static char response[512];
+static size_t responseLength = 0;
+static time_t responseTime = 0;
+
+/**
+ * Maps the bucket table in memory shared by every process forked afterwards
+ *
+ * Pages are only backed once a client hashes to them, so an unused table costs nothing
+*/
+int ratelimit_init(void) {
+    shards = mmap(NULL, sizeof(struct RateShard) * RATELIMIT_SHARDS, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (shards == MAP_FAILED) {
+        perror("Error mapping rate limit table");
+        shards = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Milliseconds on a clock every worker shares, wrapped to the width of a bucket's stamp
+*/
+static unsigned long long now_ms(void) {
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return ((unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000) & STAMP_MASK;
+}
+
+/**
+ * Milliseconds from `stamp` to `now`, or -1 if another worker has already
+ * stamped the bucket later than `now`
+*/
+static long long since(unsigned long long stamp, unsigned long long now) {
+    unsigned long long elapsed = (now - stamp) & STAMP_MASK;
+
+    return elapsed > STAMP_MASK / 2 ? -1 : (long long)elapsed;
+}
+
+/**
+ * Hashes a client address, and the route limit it is checked against (0 for
+ * the per-address one), into a bucket key. FNV-1a, never 0
+*/
+unsigned long long ratelimit_key(int family, const unsigned char *addr, int route) {
+    unsigned long long h = 14695981039346656037ULL;
+    int i;
+
+    h = (h ^ (unsigned char)family) * 1099511628211ULL;
+    h = (h ^ (unsigned char)route) * 1099511628211ULL;
+
+    for (i = 0; i < 16; ++i) {
+        h = (h ^ addr[i]) * 1099511628211ULL;
+    }
+
+    // Fold the well mixed high bits into the low ones the slot is picked by
+    h ^= h >> 32;
+
+    return h ? h : 1;
+}
+
+/**
+ * Finds the bucket for `key` in its shard, claiming a free or expired slot
+ * for it if it has none
+ *
+ * Returns NULL if every slot it can probe belongs to a client seen recently
+*/
+static struct RateBucket *find_bucket(unsigned long long key, unsigned long long now) {
+    struct RateShard *shard = &shards[(key >> 40) & (RATELIMIT_SHARDS - 1)];
+    struct RateBucket *b, *claim = NULL;
+    unsigned long long seen, state;
+    long long elapsed;
+    size_t i;
+
+    for (i = 0; i < RATELIMIT_MAX_PROBE; ++i) {
+        b = &shard->buckets[(key + i) & (RATELIMIT_SHARD_SLOTS - 1)];
+        seen = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+
+        if (seen == key) {
+            return b;
+        }
+
+        if (!claim) {
+            state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+            elapsed = since(state >> RATELIMIT_TOKEN_BITS, now);
+
+            if (seen == 0 || (state && elapsed >= RATELIMIT_EXPIRE_MS)) {
+                claim = b;
+            }
+        }
+    }
+
+    if (!claim) {
+        return NULL;
+    }
+
+    // Another worker may claim it first, for this client or another
+    seen = __atomic_load_n(&claim->key, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&claim->key, &seen, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return seen == key ? claim : NULL;
+    }
+
+    // A zero state is a full bucket
+    __atomic_store_n(&claim->state, 0, __ATOMIC_RELEASE);
+
+    return claim;
+}
+
+/**
+ * Refills the bucket for `key` at `rate` tokens a second up to `burst`, and
+ * takes a token from it if `consume` is set
+ *
+ * Returns 1 if the bucket had a token, 0 if the client is over its limit. Lock
+ * free: workers only ever race on the one bucket, and the loser retries its
+ * compare-and-swap. A client that cannot be given a bucket is let through
+*/
+int ratelimit_take(unsigned long long key, int rate, int burst, int consume) {
+    unsigned long long now, stamp, tokens, full, old, next;
+    struct RateBucket *b;
+    long long elapsed;
+
+    if (!shards) {
+        return 1;
+    }
+
+    now = now_ms();
+
+    if (!(b = find_bucket(key, now))) {
+        return 1;
+    }
+
+    full = (unsigned long long)burst * RATELIMIT_TOKEN_UNIT;
+    old = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+
+    do {
+        stamp = old >> RATELIMIT_TOKEN_BITS;
+        tokens = old & TOKEN_MASK;
+        elapsed = since(stamp, now);
+
+        if (!old || elapsed >= RATELIMIT_EXPIRE_MS) {
+            tokens = full;
+            stamp = now;
+        } else if (elapsed > 0) {
+            tokens += (unsigned long long)elapsed * rate;
+            stamp = now;
+        }
+
+        // Also after a reload lowered the burst
+        if (tokens > full) {
+            tokens = full;
+        }
+
+        if (tokens < RATELIMIT_TOKEN_UNIT) {
+            return 0;
+        }
+
+        if (!consume) {
+            return 1;
+        }
+
+        next = (stamp << RATELIMIT_TOKEN_BITS) | (tokens - RATELIMIT_TOKEN_UNIT);
+    } while (!__atomic_compare_exchange_n(&b->state, &old, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return 1;
+}
+
+/**
+ * Returns the serialized `429 Too Many Requests` sent to limited clients,
+ * setting `len`. The connection is closed after it
+*/
+const char *ratelimit_response(size_t *len) {
+    struct HttpRequestHeader connection = { HTTP_HEADER_CONNECTION, "close", NULL };
+    struct HttpRequestHeader retry = { "Retry-After", "1", &connection };
+    struct HttpResponse res = { NULL, &retry, NULL };
+    time_t now = time(NULL);
+
+    if (now != responseTime || !responseLength) {
+        responseLength = serialize_response(response, sizeof(response), &res, HTTP_STATUS_TOO_MANY_REQUESTS);
+        responseTime = now;
+    }
+
+    *len = responseLength;
+
+    return response;
+}
@@ -0,0 +1,43 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#include <stddef.h>
+
+#define RATELIMIT_SHARDS 64 // Must be a power of 2
+#define RATELIMIT_SHARD_SLOTS 1024 // Must be a power of 2
+#define RATELIMIT_MAX_PROBE 8
+#define RATELIMIT_EXPIRE_MS 60000 // A bucket left alone this long can be taken by another client
+#define RATELIMIT_MAX_BURST 65535
+
+/**
+ * Bucket state packs the time it was last refilled (milliseconds, the top
+ * RATELIMIT_STAMP_BITS) and what it holds (thousandths of a token, the rest) into
+ * one word, so a request updates it with a single compare-and-swap. In
+ * thousandths, a bucket refills by exactly `rate` per millisecond
+*/
+#define RATELIMIT_TOKEN_BITS 26
+#define RATELIMIT_STAMP_BITS (64 - RATELIMIT_TOKEN_BITS)
+#define RATELIMIT_TOKEN_UNIT 1000
+
+/**
+ * One client's bucket. `key` is 0 while the slot has never been used
+*/
+typedef struct RateBucket {
+    unsigned long long key;
+    unsigned long long state;
+} RateBucket;
+
+/**
+ * A run of slots a key is probed for in. The high bits of a key pick the
+ * shard and the low bits where in it to start, so probing never leaves it
+*/
+typedef struct RateShard {
+    struct RateBucket buckets[RATELIMIT_SHARD_SLOTS];
+} __attribute__((aligned(64))) RateShard;
+
+int ratelimit_init(void);
+unsigned long long ratelimit_key(int family, const unsigned char *addr, int route);
+int ratelimit_take(unsigned long long key, int rate, int burst, int consume);
+const char *ratelimit_response(size_t *len);
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+void router_init(struct Router *r) {
+    memset(r, 0, sizeof(struct Router));
+}
+
+static struct RouteNode *new_node(const char *prefix, size_t len) {
+    struct RouteNode *n = calloc(1, sizeof(struct RouteNode));
+
+    if (!n) {
+        return NULL;
+    }
+
+    n->prefix = malloc(len + 1);
+
+    if (!n->prefix) {
+        free(n);
+        return NULL;
+    }
+
+    memcpy(n->prefix, prefix, len);
+    n->prefix[len] = '\0';
+    n->prefixLength = len;
+
+    return n;
+}
+
+/**
+ * Adds a static child to `n`, keeping `indices` in step with `children`
+*/
+static int add_child(struct RouteNode *n, struct RouteNode *child) {
+    struct RouteNode **children = realloc(n->children, sizeof(struct RouteNode *) * (n->childCount + 1));
+    char *indices;
+
+    if (!children) {
+        return -1;
+    }
+
+    n->children = children;
+    indices = realloc(n->indices, n->childCount + 1);
+
+    if (!indices) {
+        return -1;
+    }
+
+    n->indices = indices;
+    n->children[n->childCount] = child;
+    n->indices[n->childCount++] = child->prefix[0];
+
+    return 0;
+}
+
+/**
+ * Splits `n` after `at` bytes of its prefix, moving the rest (and everything below) into a new child
+*/
+static int split_node(struct RouteNode *n, size_t at) {
+    struct RouteNode *rest = new_node(n->prefix + at, n->prefixLength - at);
+
+    if (!rest) {
+        return -1;
+    }
+
+    rest->children = n->children;
+    rest->indices = n->indices;
+    rest->childCount = n->childCount;
+    rest->param = n->param;
+    rest->wildcard = n->wildcard;
+    memcpy(rest->handlers, n->handlers, sizeof(n->handlers));
+
+    n->children = NULL;
+    n->indices = NULL;
+    n->childCount = 0;
+    n->param = NULL;
+    n->wildcard = NULL;
+    memset(n->handlers, 0, sizeof(n->handlers));
+    n->prefix[at] = '\0';
+    n->prefixLength = at;
+
+    return add_child(n, rest);
+}
+
+/**
+ * Returns the `:` or `*` child of `n` called `name`, creating it if needed
+*/
+static struct RouteNode *param_child(struct RouteNode **child, const char *name, size_t len, const char *pattern) {
+    if (*child) {
+        if (strlen((*child)->name) != len || memcmp((*child)->name, name, len) != 0) {
+            fprintf(stderr, "Route %s: conflicts with parameter %s\n", pattern, (*child)->name);
+            return NULL;
+        }
+        return *child;
+    }
+
+    if (!(*child = new_node("", 0)) || !((*child)->name = malloc(len + 1))) {
+        return NULL;
+    }
+
+    memcpy((*child)->name, name, len);
+    (*child)->name[len] = '\0';
+
+    return *child;
+}
+
+/**
+ * Registers `handler` for `method` on `pattern`
+ *
+ * Patterns are made of static bytes, `:name` segments matching one path segment
+ * and an optional trailing `*name` matching the rest of the path (including
+ * nothing). Static routes win over parameters, which win over wildcards, so
+ * `/health` can sit next to a catch-all `*path` after `/`. Called at startup, before
+ * workers are forked
+*/
+int router_add(struct Router *r, enum HttpMethod method, const char *pattern, RouteHandler handler) {
+    struct RouteNode *n = &r->root, *child;
+    const char *p = pattern;
+    size_t len, common;
+    int i;
+
+    if (*pattern != '/') {
+        fprintf(stderr, "Route %s: must start with /\n", pattern);
+        return -1;
+    }
+
+    while (*p) {
+        if (*p == ':' || *p == '*') {
+            len = *p == ':' ? strcspn(p + 1, "/") : strlen(p + 1);
+
+            if (!len || p[-1] != '/') {
+                fprintf(stderr, "Route %s: parameters need a name and must start a segment\n", pattern);
+                return -1;
+            }
+
+            if (!(n = param_child(*p == ':' ? &n->param : &n->wildcard, p + 1, len, pattern))) {
+                return -1;
+            }
+
+            p += len + 1;
+            continue;
+        }
+
+        // Static bytes up to the next parameter
+        len = strcspn(p, ":*");
+
+        for (i = 0; i < n->childCount && n->indices[i] != *p; ++i);
+
+        if (i == n->childCount) {
+            if (!(child = new_node(p, len)) || add_child(n, child) == -1) {
+                return -1;
+            }
+
+            n = child;
+            p += len;
+            continue;
+        }
+
+        child = n->children[i];
+
+        for (common = 0; common < len && common < child->prefixLength && child->prefix[common] == p[common]; ++common);
+
+        if (common < child->prefixLength && split_node(child, common) == -1) {
+            return -1;
+        }
+
+        n = child;
+        p += common;
+    }
+
+    if (n->handlers[method]) {
+        fprintf(stderr, "Route %s %s: registered twice\n", method_name(method), pattern);
+        return -1;
+    }
+
+    n->handlers[method] = handler;
+
+    return 0;
+}
+
+static int has_handler(const struct RouteNode *n) {
+    int i;
+
+    for (i = 0; i < HTTP_METHOD_COUNT; ++i) {
+        if (n->handlers[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int push_param(struct RouteContext *ctx, const char *name, const char *value, size_t length) {
+    if (ctx->paramCount == ROUTER_MAX_PARAMS) {
+        return -1;
+    }
+
+    ctx->params[ctx->paramCount].name = name;
+    ctx->params[ctx->paramCount].value = value;
+    ctx->params[ctx->paramCount++].length = length;
+
+    return 0;
+}
+
+/**
+ * Finds the node for the rest of `path` below `n`, recording parameters in `ctx`
+*/
+static const struct RouteNode *lookup(const struct RouteNode *n, const char *path, struct RouteContext *ctx) {
+    const struct RouteNode *found;
+    const struct RouteNode *child;
+    int i, params = ctx->paramCount;
+    size_t len;
+
+    if (!*path && has_handler(n)) {
+        return n;
+    }
+
+    for (i = 0; i < n->childCount; ++i) {
+        if (n->indices[i] == *path) {
+            child = n->children[i];
+
+            if (strncmp(path, child->prefix, child->prefixLength) == 0
+                && (found = lookup(child, path + child->prefixLength, ctx))) {
+                return found;
+            }
+            break;
+        }
+    }
+
+    if (n->param && *path && *path != '/') {
+        len = strcspn(path, "/");
+
+        if (push_param(ctx, n->param->name, path, len) == 0 && (found = lookup(n->param, path + len, ctx))) {
+            return found;
+        }
+
+        ctx->paramCount = params;
+    }
+
+    if (n->wildcard && push_param(ctx, n->wildcard->name, path, strlen(path)) == 0) {
+        return n->wildcard;
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs the handler registered for the request's method and `ctx->path`
+ *
+ * One walk down the trie, without allocating. Returns the handler's status,
+ * or 404/405 if no route matches
+*/
+int router_dispatch(const struct Router *r, struct RouteContext *ctx) {
+    const struct RouteNode *n;
+
+    ctx->paramCount = 0;
+
+    if (!(n = lookup(&r->root, ctx->path, ctx))) {
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    if (!n->handlers[ctx->req->method]) {
+        return HTTP_STATUS_METHOD_NOT_ALLOWED;
+    }
+
+    return n->handlers[ctx->req->method](ctx);
+}
+
+/**
+ * Returns the value of parameter `name` (and its length), or NULL if the route has none
+*/
+const char *route_param(const struct RouteContext *ctx, const char *name, size_t *length) {
+    int i;
+
+    for (i = 0; i < ctx->paramCount; ++i) {
+        if (strcmp(ctx->params[i].name, name) == 0) {
+            *length = ctx->params[i].length;
+            return ctx->params[i].value;
+        }
+    }
+
+    return NULL;
+}
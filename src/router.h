@@ -0,0 +1,93 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http.h"
+#include "multipart.h"
+#include "websocket.h"
+#include "stream.h"
+
+#define ROUTER_MAX_PARAMS 8
+
+struct Worker;
+struct MapEntry;
+struct RouteContext;
+
+/**
+ * How a handler takes a multipart/form-data body a part at a time as it
+ * arrives, rather than whole. The part callbacks get the RouteContext as `user`
+ *
+ * Over HTTP/1 the handler runs as soon as the head is in, with no body, and
+ * answers from `end`. Exactly one of `end` and `abort` is called
+*/
+typedef struct UploadHandler {
+    struct MultipartCallbacks parts;
+    int (*end)(struct RouteContext *ctx); // After the closing delimiter: fills in the response, returns its status
+    void (*abort)(struct RouteContext *ctx); // Instead of `end`, when the body is cut short or malformed
+} UploadHandler;
+
+/**
+ * A `:name` or `*name` segment of the matched pattern, as a slice of the request path
+*/
+typedef struct RouteParam {
+    const char *name;
+    const char *value; // Not null terminated, except for a wildcard, which runs to the end of the path
+    size_t length;
+} RouteParam;
+
+/**
+ * Everything a handler gets for one request
+*/
+typedef struct RouteContext {
+    struct Worker *worker;
+    struct HttpRequest *req;
+    struct HttpResponse *res;
+    const char *path; // Normalized, see normalize_path
+    struct RouteParam params[ROUTER_MAX_PARAMS];
+    int paramCount;
+    int fileFd; // Set by handlers whose body is a file, sent after the headers. -1 otherwise
+    off_t fileOffset;
+    off_t fileSize;
+    int fileShared; // fileFd outlives the request (the bundle), the worker must not close it
+    struct MapEntry *mapping; // Set with fileFd when the body is a cached mapping, released after sending
+    const struct UploadHandler *upload; // Set by a handler returning 200 to take the body as an upload, see UploadHandler
+    void *uploadState; // The upload handler's own
+    const struct WebSocketHandler *websocket; // Set by a handler returning 101 to take a WebSocket upgrade
+    struct ResponseStream *stream; // Set by a handler to write its body as it is sent, see stream.h
+    int subscribe; // Set by a handler returning 200 to stream published events after the head, see sse.h
+    unsigned long long lastEventId; // The client has seen events up to this one, 0 for none
+} RouteContext;
+
+/**
+ * Fills in the response and returns its status
+*/
+typedef int (*RouteHandler)(struct RouteContext *ctx);
+
+/**
+ * Node of the radix trie. Static children are split on their longest common
+ * prefix, so each byte of a path is compared once on the way down
+*/
+typedef struct RouteNode {
+    char *prefix; // Static bytes matched by this node (empty for `:` and `*` nodes)
+    size_t prefixLength;
+    char *name; // Parameter name of a `:` or `*` node
+    struct RouteNode **children;
+    char *indices; // First byte of each static child
+    int childCount;
+    struct RouteNode *param; // `:name` child, matches up to the next `/`
+    struct RouteNode *wildcard; // `*name` child, matches the rest of the path
+    RouteHandler handlers[HTTP_METHOD_COUNT];
+} RouteNode;
+
+typedef struct Router {
+    struct RouteNode root;
+} Router;
+
+void router_init(struct Router *r);
+int router_add(struct Router *r, enum HttpMethod method, const char *pattern, RouteHandler handler);
+int router_dispatch(const struct Router *r, struct RouteContext *ctx);
+const char *route_param(const struct RouteContext *ctx, const char *name, size_t *length);
+
+#endif
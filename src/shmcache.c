@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "shmcache.h"
+
+#define READERS_MASK 0xFFFFFFFFULL
+#define SEQ_ONE (1ULL << 32)
+
+static struct ShmClass classes[SHMCACHE_MAX_CLASSES];
+static int classCount = 0;
+static unsigned long long *useClock = NULL; // Shared, orders lastUsed across workers
+static unsigned int *pins = NULL; // Shared, each worker slot's references to each slot
+static size_t slotTotal = 0;
+static int pinWorkers = 0;
+static int self = -1; // Worker slot of this process, see shmcache_forked
+
+/**
+ * Maps a cache of up to `bytes` of file bodies in memory shared by every
+ * process forked afterwards, split evenly between size classes from
+ * SHMCACHE_MIN_EXTENT up to the first that holds `maxFile`. 0 leaves it off.
+ * Each of `workers` worker slots gets a count of the references it holds to
+ * each cache slot
+ *
+ * Pages are only backed once a file is cached in them
+*/
+int shmcache_init(size_t bytes, size_t maxFile, int workers) {
+    size_t extent, share, total = 64;
+    char *base;
+    int i;
+
+    if (!bytes) {
+        return 0;
+    }
+
+    for (extent = SHMCACHE_MIN_EXTENT; classCount < SHMCACHE_MAX_CLASSES; extent <<= 1) {
+        classes[classCount++].extent = extent;
+
+        if (extent >= maxFile) {
+            break;
+        }
+    }
+
+    share = bytes / classCount;
+
+    for (i = 0; i < classCount; ++i) {
+        classes[i].count = share / classes[i].extent;
+        classes[i].first = slotTotal;
+        slotTotal += classes[i].count;
+        total += classes[i].count * (sizeof(struct ShmSlot) + classes[i].extent);
+    }
+
+    total += workers * slotTotal * sizeof(unsigned int);
+
+    base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) {
+        perror("Error mapping shared file cache");
+        classCount = 0;
+        slotTotal = 0;
+        return -1;
+    }
+
+    useClock = (unsigned long long *)base;
+    base += 64;
+
+    for (i = 0; i < classCount; ++i) {
+        classes[i].slots = (struct ShmSlot *)base;
+        base += classes[i].count * sizeof(struct ShmSlot);
+    }
+
+    for (i = 0; i < classCount; ++i) {
+        classes[i].data = base;
+        base += classes[i].count * classes[i].extent;
+    }
+
+    pins = (unsigned int *)base;
+    pinWorkers = workers;
+
+    return 0;
+}
+
+/**
+ * Makes this process worker slot `worker`, whose references are counted as its own
+*/
+void shmcache_forked(int worker) {
+    self = worker;
+}
+
+/**
+ * Where the references worker slot `worker` holds to `slot` are counted
+*/
+static unsigned int *pins_of(int worker, const struct ShmSlot *slot) {
+    int c;
+
+    for (c = 0; slot < classes[c].slots || slot >= classes[c].slots + classes[c].count; ++c);
+
+    return &pins[worker * slotTotal + classes[c].first + (slot - classes[c].slots)];
+}
+
+/**
+ * Takes a reference to the body in `slot`, unless a worker is filling it
+ *
+ * Counted for the worker only once taken, and in shmcache_release no longer
+ * counted before it is dropped: a worker dying in between leaves a reference
+ * behind, which keeps the slot from being refilled, but is never dropped twice
+*/
+static int acquire(struct ShmSlot *slot) {
+    unsigned long long state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+    do {
+        if (state & SEQ_ONE) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&slot->state, &state, state + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    if (self != -1) {
+        __atomic_fetch_add(pins_of(self, slot), 1, __ATOMIC_RELAXED);
+    }
+
+    return 1;
+}
+
+void shmcache_release(struct ShmSlot *slot) {
+    if (self != -1) {
+        __atomic_fetch_sub(pins_of(self, slot), 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_sub(&slot->state, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drops the references worker slot `worker` held when it exited, and empties
+ * any slot it was filling, so a worker that crashed or was killed mid-send
+ * does not leave slots nobody can refill. Called by the master once the
+ * worker is reaped, before the slot is given to a new one
+*/
+void shmcache_worker_exited(int worker) {
+    struct ShmSlot *slot;
+    unsigned int *count;
+    size_t i;
+    int c;
+
+    if (worker < 0 || worker >= pinWorkers) {
+        return;
+    }
+
+    for (c = 0; c < classCount; ++c) {
+        for (i = 0; i < classes[c].count; ++i) {
+            slot = &classes[c].slots[i];
+            count = &pins[worker * slotTotal + classes[c].first + i];
+
+            if (*count) {
+                __atomic_fetch_sub(&slot->state, *count, __ATOMIC_RELEASE);
+                *count = 0;
+            }
+
+            // Its body is half written: emptied, and its count made even for another worker to fill
+            if (slot->filler == worker + 1) {
+                slot->hash = 0;
+                slot->filler = 0;
+                __atomic_fetch_add(&slot->state, SEQ_ONE, __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+static int is_fresh(const struct ShmSlot *slot, const struct stat *st) {
+    return slot->ino == st->st_ino && slot->dev == st->st_dev && slot->size == st->st_size
+        && slot->mtime.tv_sec == st->st_mtim.tv_sec && slot->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Reads all of `fd` into `dst`. Returns -1 if it is no longer `size` bytes long
+*/
+static int read_whole(int fd, char *dst, off_t size) {
+    off_t off = 0;
+    ssize_t n;
+
+    while (off < size) {
+        n = pread(fd, dst + off, size - off, off);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        off += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the cached body of the open file `fd` (described by `st`), pinned
+ * in `*pin` until shmcache_release. On a miss the caller fills the slot
+ * itself, so the next request for the file finds it in whichever worker it
+ * lands on
+ *
+ * Returns NULL if the file is too large for the cache or every slot it could
+ * go in is busy, and the caller is left to serve it some other way
+*/
+const char *shmcache_get(const char *key, unsigned long hash, int fd, const struct stat *st, struct ShmSlot **pin, int *hit) {
+    size_t keyLength = strlen(key), i;
+    unsigned long long now, state, victimState = 0;
+    struct ShmSlot *slot, *victim = NULL;
+    struct ShmClass *cls = NULL;
+    char *data;
+    int c;
+
+    *hit = 0;
+    hash = hash ? hash : 1;
+
+    for (c = 0; c < classCount && !cls; ++c) {
+        if (classes[c].count && classes[c].extent >= keyLength + (size_t)st->st_size) {
+            cls = &classes[c];
+        }
+    }
+
+    if (!cls) {
+        return NULL;
+    }
+
+    now = __atomic_add_fetch(useClock, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < SHMCACHE_MAX_PROBE && i < cls->count; ++i) {
+        slot = &cls->slots[(hash + i) % cls->count];
+        data = cls->data + ((hash + i) % cls->count) * cls->extent;
+
+        // Only a slot that looks like ours is worth pinning to make sure
+        if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == hash && acquire(slot)) {
+            if (slot->hash == hash && slot->keyLength == keyLength && memcmp(data, key, keyLength) == 0) {
+                if (is_fresh(slot, st)) {
+                    __atomic_store_n(&slot->lastUsed, now, __ATOMIC_RELAXED);
+                    *pin = slot;
+                    *hit = 1;
+                    return data + keyLength;
+                }
+
+                // Changed since it was cached, refilled below once nobody is sending the old one
+                shmcache_release(slot);
+                victim = slot;
+                break;
+            }
+
+            shmcache_release(slot);
+        }
+
+        // Of the slots nobody is using, an empty one or else the least recently used
+        state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+        if ((state & (SEQ_ONE | READERS_MASK)) == 0 && (!victim || (victim->hash
+            && (!slot->hash || __atomic_load_n(&slot->lastUsed, __ATOMIC_RELAXED) < __atomic_load_n(&victim->lastUsed, __ATOMIC_RELAXED))))) {
+            victim = slot;
+        }
+    }
+
+    if (!victim) {
+        return NULL;
+    }
+
+    // Claimed only if still unused, another worker filling or sending from it wins
+    victimState = __atomic_load_n(&victim->state, __ATOMIC_ACQUIRE);
+
+    if ((victimState & (SEQ_ONE | READERS_MASK))
+        || !__atomic_compare_exchange_n(&victim->state, &victimState, victimState + SEQ_ONE, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    // Set only while the count is odd, cleared before it is even again
+    data = cls->data + (victim - cls->slots) * cls->extent;
+    victim->filler = self + 1;
+    victim->hash = 0;
+    memcpy(data, key, keyLength);
+
+    if (read_whole(fd, data + keyLength, st->st_size) == -1) {
+        victim->filler = 0;
+        __atomic_store_n(&victim->state, victimState + 2 * SEQ_ONE, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    victim->keyLength = keyLength;
+    victim->dev = st->st_dev;
+    victim->ino = st->st_ino;
+    victim->size = st->st_size;
+    victim->mtime = st->st_mtim;
+    __atomic_store_n(&victim->lastUsed, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->hash, hash, __ATOMIC_RELAXED);
+
+    // Published with the caller's reference already taken
+    victim->filler = 0;
+    __atomic_store_n(&victim->state, victimState + 2 * SEQ_ONE + 1, __ATOMIC_RELEASE);
+
+    if (self != -1) {
+        __atomic_fetch_add(pins_of(self, victim), 1, __ATOMIC_RELAXED);
+    }
+
+    *pin = victim;
+
+    return data + keyLength;
+}
@@ -0,0 +1,58 @@
+#ifndef SHMCACHE_H_
+#define SHMCACHE_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define SHMCACHE_MIN_EXTENT 4096 // Smallest size class, each class after it doubles
+#define SHMCACHE_MAX_CLASSES 16
+#define SHMCACHE_MAX_PROBE 8
+
+/**
+ * One cached file in memory every worker shares: its key (normalized path)
+ * and body fill the slot's extent of its class's data region
+ *
+ * `state` is a sequence count in the high half and the number of requests
+ * sending from the body in the low half. The count is odd while a worker
+ * fills the slot, which it may only start on a slot nobody is sending from,
+ * and readers only pin a slot whose count is even. So a pinned body is
+ * never rewritten under a send, and a reader that finds the count changed
+ * knows what it read of the metadata is stale
+ *
+ * Those counts have no owner of their own, so each worker's share of them is
+ * also kept by worker slot (as is who is filling a slot), for the master to
+ * take back what a worker that died still held, see shmcache_worker_exited
+*/
+typedef struct ShmSlot {
+    unsigned long long state;
+    unsigned long long lastUsed;
+    unsigned long hash; // 0 while empty
+    int filler; // Worker slot + 1 of the worker filling it, 0 if none is
+    size_t keyLength;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} __attribute__((aligned(64))) ShmSlot;
+
+/**
+ * Files whose key and body fit `extent` bytes, and no smaller class. A key
+ * probes up to SHMCACHE_MAX_PROBE slots from where its hash falls
+*/
+typedef struct ShmClass {
+    size_t extent;
+    size_t count;
+    size_t first; // Index of its first slot among every class's, see ShmSlot
+    struct ShmSlot *slots;
+    char *data;
+} ShmClass;
+
+int shmcache_init(size_t bytes, size_t maxFile, int workers);
+void shmcache_forked(int worker);
+void shmcache_worker_exited(int worker);
+const char *shmcache_get(const char *key, unsigned long hash, int fd, const struct stat *st, struct ShmSlot **pin, int *hit);
+void shmcache_release(struct ShmSlot *slot);
+
+#endif
@@ -1,23 +1,95 @@
+#define _GNU_SOURCE // accept4
+
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include "socket.h"
 
-int create_listening_socket() {
+/**
+ * Sets an integer socket option, warning (but not failing) if the kernel refuses it
+*/
+static void set_option(int sockfd, int level, int name, int value, const char *label) {
+    if (setsockopt(sockfd, level, name, &value, sizeof(value)) == -1) {
+        fprintf(stderr, "Warning: could not set %s: %s\n", label, strerror(errno));
+    }
+}
+
+/**
+ * Splits `host:port` / `[v6host]:port` / `port` into host and port strings
+*/
+static int split_address(const char *address, char *host, size_t hostSize, const char **port) {
+    const char *sep;
+    size_t len;
+
+    if (address[0] == '[') {
+        sep = strstr(address, "]:");
+
+        if (!sep) {
+            return -1;
+        }
+
+        len = sep - address - 1;
+        *port = sep + 2;
+        ++address;
+    } else if ((sep = strrchr(address, ':')) != NULL) {
+        len = sep - address;
+        *port = sep + 1;
+    } else {
+        // Bare port binds every IPv4 address, as before
+        strcpy(host, "0.0.0.0");
+        *port = address;
+        return 0;
+    }
+
+    if (len == 0 || len >= hostSize) {
+        return -1;
+    }
+
+    memcpy(host, address, len);
+    host[len] = '\0';
+
+    return 0;
+}
+
+/**
+ * Creates a non-blocking listening socket for `address` (see ListenerConfig)
+ *
+ * TCP listeners get the handshake/latency options from the config. Buffer
+ * sizes and TCP_NODELAY are set on the listener so accepted sockets inherit
+ * them without a syscall per connection
+*/
+int create_listening_socket(const char *address, const struct ServerConfig *c) {
     int sockfd;
+    char host[CONFIG_ADDRESS_MAX];
+    const char *port;
     struct addrinfo hints, *servinfo;
 
+    if (strncmp(address, "unix:", 5) == 0) {
+        return create_unix_listening_socket(address + 5, c->unixSocketMode, c->backlog);
+    }
+
+    if (split_address(address, host, sizeof(host), &port) == -1) {
+        fprintf(stderr, "Invalid listen address: %s\n", address);
+        return -1;
+    }
+
     memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
 
-    if (getaddrinfo(NULL, PORT, &hints, &servinfo) != 0) {
-        perror("Error getting address information \n");
+    if (getaddrinfo(host, port, &hints, &servinfo) != 0) {
+        fprintf(stderr, "Error getting address information for %s\n", address);
         return -1;
     }
 
@@ -25,22 +97,330 @@ int create_listening_socket() {
 
     if (sockfd == -1) {
         perror("Error creating socket");
+        freeaddrinfo(servinfo);
         return -1;
     }
 
+    // Restarts must not wait for TIME_WAIT connections to expire
+    set_option(sockfd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+
+    // Keep [::] from also claiming IPv4 so it can sit next to a 0.0.0.0 listener
+    if (servinfo->ai_family == AF_INET6) {
+        set_option(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, 1, "IPV6_V6ONLY");
+    }
+
+    if (c->tcpNoDelay) {
+        set_option(sockfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+
+    // Set before listen() so the advertised window scale matches
+    if (c->rcvBuf > 0) {
+        set_option(sockfd, SOL_SOCKET, SO_RCVBUF, c->rcvBuf, "SO_RCVBUF");
+    }
+
+    if (c->sndBuf > 0) {
+        set_option(sockfd, SOL_SOCKET, SO_SNDBUF, c->sndBuf, "SO_SNDBUF");
+    }
+
+#ifdef TCP_DEFER_ACCEPT
+    // Only wake a worker once the request has arrived
+    if (c->tcpDeferAccept > 0) {
+        set_option(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, c->tcpDeferAccept, "TCP_DEFER_ACCEPT");
+    }
+#endif
+
     if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
-        perror("Error binding socket \n");
+        perror("Error binding socket");
         close(sockfd);
+        freeaddrinfo(servinfo);
         return -1;
     }
 
     freeaddrinfo(servinfo);
 
-    if (listen(sockfd, BACKLOG) == -1) {
+#ifdef TCP_FASTOPEN
+    // Let repeat clients send the request in the SYN
+    if (c->tcpFastOpen > 0) {
+        set_option(sockfd, IPPROTO_TCP, TCP_FASTOPEN, c->tcpFastOpen, "TCP_FASTOPEN");
+    }
+#endif
+
+    if (listen(sockfd, c->backlog) == -1) {
         perror("Error listening");
         close(sockfd);
         return -1;
     }
 
+    // Workers poll several listeners, so a connection taken by another worker must not block accept
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+
     return sockfd;
 }
+
+/**
+ * Accepts a connection as a non-blocking, close-on-exec socket
+ *
+ * Uses accept4 where available so both flags cost no extra syscalls
+*/
+int accept_connection(int listenSockfd, struct sockaddr_storage *addr) {
+    socklen_t addrLen = sizeof(struct sockaddr_storage);
+    int sockfd;
+
+#ifdef SOCK_NONBLOCK
+    sockfd = accept4(listenSockfd, (struct sockaddr *)addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    sockfd = accept(listenSockfd, (struct sockaddr *)addr, &addrLen);
+
+    if (sockfd != -1) {
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+        fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    // Unix peers are usually unnamed, make sure the family is still recorded
+    if (sockfd != -1 && addrLen < sizeof(addr->ss_family)) {
+        addr->ss_family = AF_UNIX;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Creates a listening Unix domain stream socket for local (reverse proxy) traffic
+ *
+ * A path starting with `@` binds in the Linux abstract namespace, which needs no
+ * file cleanup and ignores `mode`. Otherwise a stale socket file is replaced and
+ * the new one is given `mode` permissions
+*/
+int create_unix_listening_socket(const char *path, mode_t mode, int backlog) {
+    int sockfd;
+    struct sockaddr_un addr;
+    socklen_t addrLen;
+    size_t pathLen = strlen(path);
+    struct stat st;
+
+    if (pathLen == 0 || pathLen >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Invalid Unix socket path: %s\n", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, pathLen);
+
+    if (path[0] == '@') {
+        // Abstract names are the bytes after a leading NUL, not NUL terminated
+        addr.sun_path[0] = '\0';
+        addrLen = offsetof(struct sockaddr_un, sun_path) + pathLen;
+    } else {
+        addrLen = sizeof addr;
+
+        // Only remove what is actually a (stale) socket, never a regular file
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+    }
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sockfd == -1) {
+        perror("Error creating Unix socket");
+        return -1;
+    }
+
+    if (bind(sockfd, (struct sockaddr *)&addr, addrLen) == -1) {
+        perror("Error binding Unix socket");
+        close(sockfd);
+        return -1;
+    }
+
+    if (path[0] != '@' && chmod(path, mode) == -1) {
+        perror("Error setting Unix socket permissions");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, backlog) == -1) {
+        perror("Error listening on Unix socket");
+        close(sockfd);
+        return -1;
+    }
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+
+    return sockfd;
+}
+
+/**
+ * Fills in the address of a Unix domain socket (`@name` for the abstract namespace)
+*/
+static int unix_address(const char *path, struct sockaddr_un *addr, socklen_t *addrLen) {
+    size_t pathLen = strlen(path);
+
+    if (pathLen == 0 || pathLen >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, pathLen);
+    *addrLen = sizeof *addr;
+
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        *addrLen = offsetof(struct sockaddr_un, sun_path) + pathLen;
+    }
+
+    return 0;
+}
+
+/**
+ * Resolves an address to connect to: `host:port`, `[v6host]:port` or
+ * `unix:path` (unix:@name = abstract namespace), as listeners are given
+*/
+int resolve_address(const char *address, struct sockaddr_storage *addr, socklen_t *addrLen) {
+    char host[CONFIG_ADDRESS_MAX];
+    const char *port;
+    struct addrinfo hints, *servinfo;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        return unix_address(address + 5, (struct sockaddr_un *)addr, addrLen);
+    }
+
+    if (split_address(address, host, sizeof(host), &port) == -1) {
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    if (getaddrinfo(host, port, &hints, &servinfo) != 0) {
+        return -1;
+    }
+
+    memcpy(addr, servinfo->ai_addr, servinfo->ai_addrlen);
+    *addrLen = servinfo->ai_addrlen;
+    freeaddrinfo(servinfo);
+
+    return 0;
+}
+
+/**
+ * Connects to a Unix domain stream socket (`@name` for the abstract namespace)
+*/
+int connect_unix_socket(const char *path) {
+    int sockfd;
+    struct sockaddr_un addr;
+    socklen_t addrLen;
+
+    if (unix_address(path, &addr, &addrLen) == -1) {
+        return -1;
+    }
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr *)&addr, addrLen) == -1) {
+        close(sockfd);
+        return -1;
+    }
+
+    fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+
+    return sockfd;
+}
+
+/**
+ * Passes listening sockets and their configured addresses to another process
+ *
+ * The fds travel as SCM_RIGHTS ancillary data, so the receiver gets the same
+ * kernel sockets (and accept queues) rather than binding new ones
+*/
+int send_listeners(int sockfd, const int fds[], char addresses[][CONFIG_ADDRESS_MAX], int count) {
+    struct ListenerHandoff handoff;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+
+    memset(&handoff, 0, sizeof handoff);
+    handoff.count = count;
+    memcpy(handoff.addresses, addresses, sizeof(handoff.addresses[0]) * count);
+
+    iov.iov_base = &handoff;
+    iov.iov_len = sizeof handoff;
+
+    memset(&msg, 0, sizeof msg);
+    memset(control, 0, sizeof control);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    if (sendmsg(sockfd, &msg, 0) != (ssize_t)sizeof handoff) {
+        perror("Error sending listeners");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Receives listening sockets sent by send_listeners, returns how many arrived
+*/
+int receive_listeners(int sockfd, int fds[], char addresses[][CONFIG_ADDRESS_MAX]) {
+    struct ListenerHandoff handoff;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    int count = 0, i;
+
+    iov.iov_base = &handoff;
+    iov.iov_len = sizeof handoff;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    if (recvmsg(sockfd, &msg, MSG_WAITALL) != (ssize_t)sizeof handoff) {
+        perror("Error receiving listeners");
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    }
+
+    if (count != handoff.count || count > MAX_LISTENERS) {
+        fprintf(stderr, "Listener handoff expected %d sockets, got %d\n", handoff.count, count);
+        for (i = 0; i < count && i < MAX_LISTENERS; ++i) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        memcpy(addresses[i], handoff.addresses[i], CONFIG_ADDRESS_MAX);
+        addresses[i][CONFIG_ADDRESS_MAX - 1] = '\0';
+    }
+
+    return count;
+}
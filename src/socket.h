@@ -1,9 +1,25 @@
 #ifndef SOCKET_H_
 #define SOCKET_H_
 
-#define PORT "3000"
-#define BACKLOG 10
+#include <sys/types.h>
+#include <sys/socket.h>
 
-int create_listening_socket();
+#include "config.h"
+
+/**
+ * Message sent alongside the listening fds during a binary upgrade
+*/
+typedef struct ListenerHandoff {
+    int count;
+    char addresses[MAX_LISTENERS][CONFIG_ADDRESS_MAX];
+} ListenerHandoff;
+
+int create_listening_socket(const char *address, const struct ServerConfig *c);
+int create_unix_listening_socket(const char *path, mode_t mode, int backlog);
+int accept_connection(int listenSockfd, struct sockaddr_storage *addr);
+int resolve_address(const char *address, struct sockaddr_storage *addr, socklen_t *addrLen);
+int connect_unix_socket(const char *path);
+int send_listeners(int sockfd, const int fds[], char addresses[][CONFIG_ADDRESS_MAX], int count);
+int receive_listeners(int sockfd, int fds[], char addresses[][CONFIG_ADDRESS_MAX]);
 
 #endif
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "sse.h"
+
+static struct SseRing *ring = NULL;
+static int *notifyfds = NULL;
+static int notifyCount = 0;
+
+/**
+ * Maps the event ring in memory shared by every process forked afterwards, and
+ * gives each of `workers` worker slots an eventfd to be woken through
+*/
+int sse_init(int workers) {
+    int i;
+
+    ring = mmap(NULL, sizeof(struct SseRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (ring == MAP_FAILED) {
+        perror("Error mapping event ring");
+        ring = NULL;
+        return -1;
+    }
+
+    if (!(notifyfds = malloc(sizeof(int) * workers))) {
+        perror("Error allocating event notifiers");
+        return -1;
+    }
+
+    for (notifyCount = 0; notifyCount < workers; ++notifyCount) {
+#ifdef __linux__
+        notifyfds[notifyCount] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+        notifyfds[notifyCount] = -1;
+#endif
+        if (notifyfds[notifyCount] == -1) {
+            perror("Error creating event notifier");
+            for (i = 0; i < notifyCount; ++i) {
+                close(notifyfds[i]);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * The eventfd worker slot `worker` is woken through when an event is published
+*/
+int sse_notify_fd(int worker) {
+    return worker < notifyCount ? notifyfds[worker] : -1;
+}
+
+static size_t append(char *dst, size_t cap, size_t off, const char *src, size_t len) {
+    if (off < cap) {
+        memcpy(dst + off, src, off + len <= cap ? len : cap - off);
+    }
+
+    return off + len;
+}
+
+/**
+ * Serializes an event into `dst`, a `data:` line for each line of `data`
+ * (which may end with CRLF, LF or CR)
+ *
+ * Never writes more than `cap` bytes, returns the full length like serialize_response
+*/
+static size_t serialize(char *dst, size_t cap, unsigned long long id, const char *event, const char *data, size_t length) {
+    char line[SSE_NAME_MAX + 32];
+    size_t off, start = 0, i;
+    int len;
+
+    len = snprintf(line, sizeof(line), "id: %llu\n", id);
+    off = append(dst, cap, 0, line, len);
+
+    if (event && *event) {
+        len = snprintf(line, sizeof(line), "event: %s\n", event);
+        off = append(dst, cap, off, line, len);
+    }
+
+    for (i = 0; i <= length; ++i) {
+        if (i < length && data[i] != '\r' && data[i] != '\n') {
+            continue;
+        }
+
+        off = append(dst, cap, off, "data: ", 6);
+        off = append(dst, cap, off, data + start, i - start);
+        off = append(dst, cap, off, "\n", 1);
+
+        if (i + 1 < length && data[i] == '\r' && data[i + 1] == '\n') {
+            ++i;
+        }
+        start = i + 1;
+    }
+
+    return append(dst, cap, off, "\n", 1);
+}
+
+/**
+ * Publishes an event to the subscribers of every worker. `event` names its
+ * type, NULL or empty for the default `message`
+ *
+ * Returns its id, or -1 if it is too large or its type is not a valid name
+*/
+long long sse_publish(const char *event, const char *data, size_t length) {
+    struct SseSlot *slot;
+    unsigned long long id;
+    unsigned long long one = 1;
+    int i;
+
+    if (!ring || (event && (strlen(event) >= SSE_NAME_MAX || strpbrk(event, "\r\n")))
+        || serialize(NULL, 0, ~0ULL, event, data, length) > SSE_EVENT_MAX) {
+        return -1;
+    }
+
+    while (__atomic_test_and_set(&ring->lock, __ATOMIC_ACQUIRE));
+
+    id = ring->last + 1;
+    slot = &ring->slots[id & (SSE_RING_SLOTS - 1)];
+
+    // Readers copying the event it replaces see it change under them
+    __atomic_store_n(&slot->id, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->length = serialize(slot->data, sizeof(slot->data), id, event, data, length);
+
+    __atomic_store_n(&slot->id, id, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->last, id, __ATOMIC_RELEASE);
+    __atomic_clear(&ring->lock, __ATOMIC_RELEASE);
+
+    for (i = 0; i < notifyCount; ++i) {
+        write(notifyfds[i], &one, sizeof(one));
+    }
+
+    return id;
+}
+
+/**
+ * Copies event `id` out of the ring, or returns NULL if it has been overwritten
+*/
+static struct SseEvent *read_slot(unsigned long long id) {
+    const struct SseSlot *slot = &ring->slots[id & (SSE_RING_SLOTS - 1)];
+    struct SseEvent *e;
+    size_t length;
+
+    if (__atomic_load_n(&slot->id, __ATOMIC_ACQUIRE) != id) {
+        return NULL;
+    }
+
+    length = slot->length;
+
+    if (length > SSE_EVENT_MAX || !(e = malloc(sizeof(struct SseEvent) + length))) {
+        return NULL;
+    }
+
+    memcpy(e->data, slot->data, length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&slot->id, __ATOMIC_RELAXED) != id) {
+        free(e);
+        return NULL;
+    }
+
+    e->refs = 1;
+    e->id = id;
+    e->length = length;
+
+    return e;
+}
+
+/**
+ * Creates worker slot `worker`'s hub, which only sees events published from now on
+*/
+struct SseHub *sse_hub_create(int worker) {
+    static const char comment[] = ":\n\n";
+    struct SseHub *h;
+
+    if (!ring || !(h = calloc(1, sizeof(struct SseHub)))) {
+        return NULL;
+    }
+
+    if (!(h->heartbeat = malloc(sizeof(struct SseEvent) + sizeof(comment) - 1))) {
+        free(h);
+        return NULL;
+    }
+
+    h->heartbeat->refs = 1;
+    h->heartbeat->id = 0;
+    h->heartbeat->length = sizeof(comment) - 1;
+    memcpy(h->heartbeat->data, comment, sizeof(comment) - 1);
+
+    h->notifyfd = sse_notify_fd(worker);
+    h->seen = __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+
+    return h;
+}
+
+/**
+ * Returns the next event published since the hub last looked, with a
+ * reference for the caller, or NULL once it has seen them all
+ *
+ * A hub that fell more than the ring behind skips the events it missed
+*/
+struct SseEvent *sse_next(struct SseHub *h) {
+    unsigned long long last = __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+    struct SseEvent *e;
+
+    while (h->seen < last) {
+        if (last - h->seen > SSE_RING_SLOTS) {
+            h->seen = last - SSE_RING_SLOTS;
+        }
+
+        if ((e = read_slot(++h->seen))) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+void sse_event_put(struct SseEvent *e) {
+    if (e && --e->refs == 0) {
+        free(e);
+    }
+}
+
+/**
+ * Creates a subscriber for a client that has seen events up to `lastId` (0 if none)
+*/
+struct SseSubscriber *sse_subscriber_create(unsigned long long lastId) {
+    struct SseSubscriber *s = calloc(1, sizeof(struct SseSubscriber));
+
+    if (s) {
+        s->lastId = lastId;
+    }
+
+    return s;
+}
+
+/**
+ * Adds `s` to the hub, queueing the events it missed that the ring still holds.
+ * No more than half a queue of them, the rest are lost to it
+*/
+void sse_subscribe(struct SseHub *h, struct SseSubscriber *s) {
+    unsigned long long id = s->lastId + 1;
+    struct SseEvent *e;
+
+    s->prev = NULL;
+    s->next = h->subscribers;
+    if (h->subscribers) {
+        h->subscribers->prev = s;
+    }
+    h->subscribers = s;
+
+    if (!s->lastId || s->lastId >= h->seen) {
+        return;
+    }
+
+    if (h->seen - s->lastId > SSE_QUEUE_MAX / 2) {
+        id = h->seen - SSE_QUEUE_MAX / 2 + 1;
+    }
+
+    for (; id <= h->seen; ++id) {
+        if ((e = read_slot(id))) {
+            sse_queue(s, e);
+            sse_event_put(e);
+        }
+    }
+}
+
+void sse_unsubscribe(struct SseHub *h, struct SseSubscriber *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else if (h->subscribers == s) {
+        h->subscribers = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+
+    s->prev = s->next = NULL;
+}
+
+/**
+ * Frees `s`, which must not be in a hub, dropping what is still queued for it
+*/
+void sse_subscriber_free(struct SseSubscriber *s) {
+    if (!s) {
+        return;
+    }
+
+    for (; s->count; --s->count) {
+        sse_event_put(s->queue[s->first]);
+        s->first = (s->first + 1) % SSE_QUEUE_MAX;
+    }
+
+    free(s);
+}
+
+/**
+ * Queues `e` for `s`, taking a reference. Returns -1 if its queue is full
+*/
+int sse_queue(struct SseSubscriber *s, struct SseEvent *e) {
+    if (s->count == SSE_QUEUE_MAX) {
+        return -1;
+    }
+
+    s->queue[(s->first + s->count++) % SSE_QUEUE_MAX] = e;
+    ++e->refs;
+
+    return 0;
+}
+
+/**
+ * Points `iov` at up to `max` of the queued events, returning how many
+*/
+int sse_output(const struct SseSubscriber *s, struct iovec *iov, int max) {
+    const struct SseEvent *e;
+    int i;
+
+    for (i = 0; i < s->count && i < max; ++i) {
+        e = s->queue[(s->first + i) % SSE_QUEUE_MAX];
+        iov[i].iov_base = (char *)e->data + (i ? 0 : s->sent);
+        iov[i].iov_len = e->length - (i ? 0 : s->sent);
+    }
+
+    return i;
+}
+
+/**
+ * Drops `n` sent bytes from the front of the queue
+*/
+void sse_output_sent(struct SseSubscriber *s, size_t n) {
+    struct SseEvent *e;
+
+    while (s->count && n >= (e = s->queue[s->first])->length - s->sent) {
+        n -= e->length - s->sent;
+        s->sent = 0;
+        s->first = (s->first + 1) % SSE_QUEUE_MAX;
+        --s->count;
+        sse_event_put(e);
+    }
+
+    s->sent += n;
+}
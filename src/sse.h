@@ -0,0 +1,86 @@
+#ifndef SSE_H_
+#define SSE_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SSE_PATH "/events"
+#define SSE_CONTENT_TYPE "text/event-stream"
+#define SSE_RING_SLOTS 256 // Events kept for subscribers catching up, must be a power of 2
+#define SSE_EVENT_MAX 8192 // Serialized, larger ones are refused with a 413
+#define SSE_NAME_MAX 64 // Of an event's type
+#define SSE_QUEUE_MAX 64 // Events queued for a subscriber, one that falls further behind is disconnected
+
+/**
+ * One event as it is sent, `id:`, `event:` and `data:` lines and the blank
+ * line after them. A slot is being written while its `id` is 0 (see sse_publish)
+*/
+typedef struct SseSlot {
+    unsigned long long id;
+    size_t length;
+    char data[SSE_EVENT_MAX];
+} __attribute__((aligned(64))) SseSlot;
+
+/**
+ * The events published by every worker, in memory they all share
+ *
+ * A publisher serializes its event once into the slot for its id, then wakes
+ * every worker (see sse_notify_fd). Workers copy each new event out once, and
+ * check its id again afterwards in case it was overwritten meanwhile
+*/
+typedef struct SseRing {
+    int lock; // Held by the worker publishing
+    unsigned long long last; // Id of the newest event, 0 before the first
+    struct SseSlot slots[SSE_RING_SLOTS];
+} SseRing;
+
+/**
+ * A worker's copy of an event, shared by every subscriber it is queued for
+*/
+typedef struct SseEvent {
+    int refs;
+    unsigned long long id;
+    size_t length;
+    char data[];
+} SseEvent;
+
+/**
+ * A connection streaming events. Its queue holds references, so an event sent
+ * to many subscribers is never copied for any of them
+*/
+typedef struct SseSubscriber {
+    struct SseSubscriber *prev;
+    struct SseSubscriber *next;
+    struct SseEvent *queue[SSE_QUEUE_MAX];
+    int first;
+    int count;
+    size_t sent; // Of the first event in the queue
+    unsigned long long lastId; // Given by a reconnecting client, caught up on when it subscribes
+    struct Connection *connection;
+} SseSubscriber;
+
+/**
+ * A worker's subscribers, and how far it has read the ring
+*/
+typedef struct SseHub {
+    struct SseSubscriber *subscribers;
+    unsigned long long seen;
+    struct SseEvent *heartbeat; // A comment sent to quiet subscribers, never freed
+    int notifyfd;
+} SseHub;
+
+int sse_init(int workers);
+int sse_notify_fd(int worker);
+long long sse_publish(const char *event, const char *data, size_t length);
+struct SseHub *sse_hub_create(int worker);
+struct SseEvent *sse_next(struct SseHub *h);
+void sse_event_put(struct SseEvent *e);
+struct SseSubscriber *sse_subscriber_create(unsigned long long lastId);
+void sse_subscribe(struct SseHub *h, struct SseSubscriber *s);
+void sse_unsubscribe(struct SseHub *h, struct SseSubscriber *s);
+void sse_subscriber_free(struct SseSubscriber *s);
+int sse_queue(struct SseSubscriber *s, struct SseEvent *e);
+int sse_output(const struct SseSubscriber *s, struct iovec *iov, int max);
+void sse_output_sent(struct SseSubscriber *s, size_t n);
+
+#endif
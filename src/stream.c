@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "stream.h"
+
+struct ResponseStream *stream_create(const struct StreamHandler *handler, void *state, struct BufferPool *pool) {
+    struct ResponseStream *s = calloc(1, sizeof(struct ResponseStream));
+
+    if (s) {
+        s->handler = handler;
+        s->state = state;
+        s->pool = pool;
+    }
+
+    return s;
+}
+
+static void put_chain(struct BufferPool *pool, struct PoolBuffer *b) {
+    struct PoolBuffer *next;
+
+    for (; b; b = next) {
+        next = b->next;
+        b->next = NULL;
+        pool_put(pool, b);
+    }
+}
+
+/**
+ * Frees `s`, letting its handler free its state first
+*/
+void stream_free(struct ResponseStream *s) {
+    if (!s) {
+        return;
+    }
+
+    if (s->handler->close) {
+        s->handler->close(s);
+    }
+
+    put_chain(s->pool, s->chunks);
+    put_chain(s->pool, s->open);
+    free(s->collected);
+    free(s);
+}
+
+/**
+ * Queues the buffer being written, if anything was, so the next write starts another
+*/
+static void seal(struct ResponseStream *s) {
+    struct PoolBuffer *b = s->open;
+
+    if (!b) {
+        return;
+    }
+
+    s->open = NULL;
+
+    if (b->len == STREAM_HEADROOM) {
+        pool_put(s->pool, b);
+        return;
+    }
+
+    if (s->chunksTail) {
+        s->chunksTail->next = b;
+    } else {
+        s->chunks = b;
+    }
+    s->chunksTail = b;
+}
+
+/**
+ * Makes room to write in the open buffer, returning how much there is
+*/
+static size_t room(struct ResponseStream *s) {
+    if (s->open && s->open->len + STREAM_TRAILER == s->open->cap) {
+        seal(s);
+    }
+
+    if (!s->open) {
+        if (!(s->open = pool_get(s->pool, POOL_LARGE))) {
+            return 0;
+        }
+        s->open->next = NULL;
+        s->open->len = STREAM_HEADROOM;
+    }
+
+    return s->open->cap - STREAM_TRAILER - s->open->len;
+}
+
+/**
+ * Appends `length` bytes to the body. Returns -1 if no buffer could be had
+*/
+int stream_write(struct ResponseStream *s, const void *data, size_t length) {
+    const char *p = data;
+    size_t take;
+
+    while (length) {
+        if (!(take = room(s))) {
+            return -1;
+        }
+
+        take = length < take ? length : take;
+        memcpy(s->open->data + s->open->len, p, take);
+        s->open->len += take;
+        s->queued += take;
+        p += take;
+        length -= take;
+    }
+
+    return 0;
+}
+
+/**
+ * Appends formatted text to the body, straight into its buffer when it fits
+*/
+int stream_printf(struct ResponseStream *s, const char *format, ...) {
+    va_list args;
+    size_t avail;
+    char *text;
+    int len, r;
+
+    if (!(avail = room(s))) {
+        return -1;
+    }
+
+    va_start(args, format);
+    len = vsnprintf(s->open->data + s->open->len, avail + 1, format, args);
+    va_end(args);
+
+    // vsnprintf wrote its terminating NUL into the trailer's room, which is only filled when framing
+    if (len >= 0 && (size_t)len <= avail) {
+        s->open->len += len;
+        s->queued += len;
+        return 0;
+    }
+
+    if (len < 0 || !(text = malloc(len + 1))) {
+        return -1;
+    }
+
+    va_start(args, format);
+    vsnprintf(text, len + 1, format, args);
+    va_end(args);
+
+    r = stream_write(s, text, len);
+    free(text);
+
+    return r;
+}
+
+/**
+ * Marks the body complete, once what was written has been sent
+*/
+void stream_end(struct ResponseStream *s) {
+    s->ended = 1;
+}
+
+/**
+ * Asks the producer for more until enough is waiting to be sent or the body
+ * has ended. Returns -1 if it failed, or returned without doing either
+*/
+int stream_fill(struct ResponseStream *s) {
+    size_t before;
+
+    while (!s->ended && s->queued < STREAM_LOW_WATER) {
+        before = s->queued;
+
+        if (s->handler->produce(s) == -1 || (!s->ended && s->queued == before)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static size_t hex_digits(size_t n) {
+    size_t digits = 1;
+
+    while (n >>= 4) {
+        ++digits;
+    }
+
+    return digits;
+}
+
+/**
+ * Where a chunk's framed bytes start in its buffer
+*/
+static size_t frame_start(const struct ResponseStream *s, const struct PoolBuffer *b) {
+    return s->chunked ? STREAM_HEADROOM - hex_digits(b->len - STREAM_HEADROOM) - 2 : STREAM_HEADROOM;
+}
+
+static size_t frame_end(const struct ResponseStream *s, const struct PoolBuffer *b) {
+    return b->len + (s->chunked ? STREAM_TRAILER : 0);
+}
+
+/**
+ * Frames a chunk in place: its size line in the headroom, its CRLF after it
+*/
+static void frame(const struct ResponseStream *s, struct PoolBuffer *b) {
+    char line[STREAM_HEADROOM + 1];
+    int len;
+
+    if (!s->chunked) {
+        return;
+    }
+
+    len = snprintf(line, sizeof(line), "%zx\r\n", b->len - STREAM_HEADROOM);
+    memcpy(b->data + STREAM_HEADROOM - len, line, len);
+    memcpy(b->data + b->len, "\r\n", STREAM_TRAILER);
+}
+
+/**
+ * Points `iov` at up to `max` pieces of what is waiting to be sent, the last
+ * chunk included once the body has ended. Returns how many
+*/
+int stream_output(struct ResponseStream *s, struct iovec *iov, int max) {
+    struct PoolBuffer *b;
+    size_t start;
+    int count = 0;
+
+    // What has been written so far is sent as a chunk of its own
+    seal(s);
+
+    for (b = s->chunks; b && count < max; b = b->next, ++count) {
+        frame(s, b);
+        start = frame_start(s, b) + (count ? 0 : s->sent);
+        iov[count].iov_base = b->data + start;
+        iov[count].iov_len = frame_end(s, b) - start;
+    }
+
+    if (!b && count < max && s->ended && s->chunked && s->sent < strlen(STREAM_LAST_CHUNK)) {
+        start = s->chunks ? 0 : s->sent;
+        iov[count].iov_base = (char *)STREAM_LAST_CHUNK + start;
+        iov[count++].iov_len = strlen(STREAM_LAST_CHUNK) - start;
+    }
+
+    return count;
+}
+
+/**
+ * Drops up to `n` sent bytes from the front of what is waiting, returning how
+ * many of them were the stream's
+*/
+size_t stream_output_sent(struct ResponseStream *s, size_t n) {
+    struct PoolBuffer *b;
+    size_t used = 0, left;
+
+    while ((b = s->chunks)) {
+        left = frame_end(s, b) - frame_start(s, b) - s->sent;
+
+        if (n < left) {
+            s->sent += n;
+            return used + n;
+        }
+
+        n -= left;
+        used += left;
+        s->sent = 0;
+        s->queued -= b->len - STREAM_HEADROOM;
+        s->chunks = b->next;
+        if (!s->chunks) {
+            s->chunksTail = NULL;
+        }
+        b->next = NULL;
+        pool_put(s->pool, b);
+    }
+
+    if (s->ended && s->chunked) {
+        left = strlen(STREAM_LAST_CHUNK) - s->sent;
+        left = n < left ? n : left;
+        s->sent += left;
+        used += left;
+    }
+
+    return used;
+}
+
+/**
+ * Returns 1 once the body has ended and all of it has been sent
+*/
+int stream_done(const struct ResponseStream *s) {
+    return s->ended && !s->chunks && (!s->open || s->open->len == STREAM_HEADROOM)
+        && (!s->chunked || s->sent == strlen(STREAM_LAST_CHUNK));
+}
+
+/**
+ * Runs the producer to the end and returns the whole body, held by `s`, for
+ * protocols that frame bodies their own way (HTTP/2). NULL if it failed
+*/
+char *stream_collect(struct ResponseStream *s, size_t *length) {
+    struct PoolBuffer *b;
+    size_t before, off = 0;
+
+    while (!s->ended) {
+        before = s->queued;
+
+        if (s->handler->produce(s) == -1 || (!s->ended && s->queued == before)) {
+            return NULL;
+        }
+    }
+
+    seal(s);
+
+    if (!(s->collected = malloc(s->queued + 1))) {
+        return NULL;
+    }
+
+    for (b = s->chunks; b; b = b->next) {
+        memcpy(s->collected + off, b->data + STREAM_HEADROOM, b->len - STREAM_HEADROOM);
+        off += b->len - STREAM_HEADROOM;
+    }
+
+    put_chain(s->pool, s->chunks);
+    s->chunks = s->chunksTail = NULL;
+    s->queued = 0;
+    *length = off;
+
+    return s->collected;
+}
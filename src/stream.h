@@ -0,0 +1,60 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+
+#define STREAM_HEADROOM 8 // Before each chunk's data, for its size line (hex of a large buffer, CRLF)
+#define STREAM_TRAILER 2 // After it, for its CRLF
+#define STREAM_LOW_WATER 65536 // The producer is asked for more while less than this is waiting to be sent
+#define STREAM_LAST_CHUNK "0\r\n\r\n"
+
+struct ResponseStream;
+
+/**
+ * What a handler streaming its body does. A handler takes this over from
+ * building the body up front by setting it on the RouteContext
+*/
+typedef struct StreamHandler {
+    int (*produce)(struct ResponseStream *s); // Writes more of the body, or ends it. -1 aborts the response
+    void (*close)(struct ResponseStream *s); // Sent, aborted or never started: frees `state`
+} StreamHandler;
+
+/**
+ * A response body written as it is sent
+ *
+ * The producer is only called while the client keeps up, so a slow client
+ * holds a few buffers rather than the whole body. Writes fill pooled buffers
+ * that each go out as one chunk: space is kept around the data for the
+ * chunk's framing, so it is framed where it lies and sent with the rest in
+ * one gathered write. On HTTP/1.0 the same buffers go out unframed and the
+ * connection closes after them
+*/
+typedef struct ResponseStream {
+    struct PoolBuffer *chunks; // Framed, waiting to be sent
+    struct PoolBuffer *chunksTail;
+    struct PoolBuffer *open; // Being written, framed once it is sent
+    size_t sent; // Of the first chunk, framing included, or of the last chunk once they are gone
+    size_t queued; // Written, not yet sent
+    int chunked; // Framed in chunks, otherwise delimited by closing the connection
+    int ended;
+    char *collected; // The whole body, for HTTP/2, see stream_collect
+    const struct StreamHandler *handler;
+    void *state; // The handler's own
+    struct BufferPool *pool;
+} ResponseStream;
+
+struct ResponseStream *stream_create(const struct StreamHandler *handler, void *state, struct BufferPool *pool);
+void stream_free(struct ResponseStream *s);
+int stream_write(struct ResponseStream *s, const void *data, size_t length);
+int stream_printf(struct ResponseStream *s, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void stream_end(struct ResponseStream *s);
+int stream_fill(struct ResponseStream *s);
+int stream_output(struct ResponseStream *s, struct iovec *iov, int max);
+size_t stream_output_sent(struct ResponseStream *s, size_t n);
+int stream_done(const struct ResponseStream *s);
+char *stream_collect(struct ResponseStream *s, size_t *length);
+
+#endif
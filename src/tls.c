@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#include "tls.h"
+
+/**
+ * A connection's TLS state, indexed by its fd
+ *
+ * Once the handshake hands both directions to the kernel (kTLS) the SSL is
+ * freed and the socket is read and written like any other. It is kept while
+ * records still have to be encrypted or decrypted in process: `kernelSend`
+ * says writes can still bypass it
+*/
+typedef struct TlsSession {
+    SSL *ssl;
+    int kernelSend;
+} TlsSession;
+
+static struct TlsSession *sessions = NULL;
+static int sessionCount = 0;
+
+static struct TlsSession *find_session(int fd) {
+    return fd >= 0 && fd < sessionCount && sessions[fd].ssl ? &sessions[fd] : NULL;
+}
+
+/**
+ * Makes room in the session table for `fd`
+*/
+static int reserve_session(int fd) {
+    struct TlsSession *grown;
+    int count = sessionCount ? sessionCount : 1024;
+
+    if (fd < sessionCount) {
+        return 0;
+    }
+
+    while (count <= fd) {
+        count *= 2;
+    }
+
+    if (!(grown = realloc(sessions, count * sizeof(struct TlsSession)))) {
+        return -1;
+    }
+
+    memset(grown + sessionCount, 0, (count - sessionCount) * sizeof(struct TlsSession));
+    sessions = grown;
+    sessionCount = count;
+
+    return 0;
+}
+
+/**
+ * Builds the context every TLS listener shares, from the configured certificate
+ *
+ * Created by the master before forking, so workers resume each other's
+ * sessions: the ticket keys are made once per master and survive reloads
+*/
+struct ssl_ctx_st *tls_create(const struct ServerConfig *c) {
+    static unsigned char ticketKeys[TLS_TICKET_KEY_LENGTH];
+    static int ticketKeysSet = 0;
+    SSL_CTX *ctx;
+
+    if (!c->tlsCertificate[0] || !c->tlsCertificateKey[0]) {
+        fprintf(stderr, "TLS listeners need tls_certificate and tls_certificate_key\n");
+        return NULL;
+    }
+
+    if (!ticketKeysSet && RAND_bytes(ticketKeys, sizeof(ticketKeys)) != 1) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    ticketKeysSet = 1;
+
+    if (!(ctx = SSL_CTX_new(TLS_server_method()))) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+
+    // Records are handed to the kernel after the handshake where it supports them
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION
+        | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+
+    if (SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS) != 1
+        || SSL_CTX_set_ciphersuites(ctx, TLS_CIPHERSUITES) != 1
+        || SSL_CTX_set_session_id_context(ctx, (const unsigned char *)TLS_SESSION_ID_CONTEXT, strlen(TLS_SESSION_ID_CONTEXT)) != 1
+        || SSL_CTX_set_tlsext_ticket_keys(ctx, ticketKeys, sizeof(ticketKeys)) != 1
+        || SSL_CTX_use_certificate_chain_file(ctx, c->tlsCertificate) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, c->tlsCertificateKey, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "Error setting up TLS with %s\n", c->tlsCertificate);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void tls_free(struct ssl_ctx_st *ctx) {
+    SSL_CTX_free(ctx);
+}
+
+/**
+ * Starts the server side of a handshake on a newly accepted `fd`
+*/
+int tls_accept(struct ssl_ctx_st *ctx, int fd) {
+    SSL *ssl;
+
+    if (reserve_session(fd) == -1 || !(ssl = SSL_new(ctx))) {
+        return -1;
+    }
+
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return -1;
+    }
+
+    SSL_set_accept_state(ssl);
+    sessions[fd].ssl = ssl;
+    sessions[fd].kernelSend = 0;
+
+    return 0;
+}
+
+/**
+ * Carries the handshake on `fd` on as far as the socket allows
+ *
+ * Returns 1 once it is done, 0 if it is waiting on the socket for the epoll
+ * events in `*want`, -1 if it failed
+*/
+int tls_handshake(int fd, unsigned int *want) {
+    struct TlsSession *s = find_session(fd);
+    int r;
+
+    if (!s) {
+        return -1;
+    }
+
+    ERR_clear_error();
+    r = SSL_do_handshake(s->ssl);
+
+    if (r == 1) {
+        s->kernelSend = BIO_get_ktls_send(SSL_get_wbio(s->ssl)) > 0;
+
+        // The kernel has both directions, nothing is left for OpenSSL to do
+        if (s->kernelSend && BIO_get_ktls_recv(SSL_get_rbio(s->ssl)) > 0) {
+            tls_close(fd);
+        }
+
+        return 1;
+    }
+
+    switch (SSL_get_error(s->ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+            *want = EPOLLIN;
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            *want = EPOLLOUT;
+            return 0;
+        default:
+            ERR_clear_error();
+            return -1;
+    }
+}
+
+/**
+ * Returns 1 if whatever is written to `fd` goes out as it is, or encrypted by
+ * the kernel, so sendfile and splice can write to it
+*/
+int tls_zero_copy(int fd) {
+    struct TlsSession *s = find_session(fd);
+
+    return !s || s->kernelSend;
+}
+
+/**
+ * Returns 1 if OpenSSL holds decrypted bytes of `fd` that epoll will not report
+*/
+int tls_pending(int fd) {
+    struct TlsSession *s = find_session(fd);
+
+    return s && SSL_pending(s->ssl) > 0;
+}
+
+/**
+ * Turns a failed SSL_read or SSL_write into what recv and send would have returned
+*/
+static ssize_t io_result(SSL *ssl, int r) {
+    int savedErrno = errno;
+
+    switch (SSL_get_error(ssl, r)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            errno = savedErrno ? savedErrno : ECONNRESET;
+            ERR_clear_error();
+            return -1;
+        default:
+            errno = EIO;
+            ERR_clear_error();
+            return -1;
+    }
+}
+
+/**
+ * recv for a client socket, decrypting in process if the kernel does not
+*/
+ssize_t tls_recv(int fd, void *buf, size_t len) {
+    struct TlsSession *s = find_session(fd);
+    int n;
+
+    if (!s) {
+        return recv(fd, buf, len, 0);
+    }
+
+    ERR_clear_error();
+    errno = 0;
+    n = SSL_read(s->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+
+    return n > 0 ? n : io_result(s->ssl, n);
+}
+
+/**
+ * send for a client socket, encrypting in process if the kernel does not
+ *
+ * A write that would block has to be repeated with at least the same bytes,
+ * which resending from the front of what is queued always does
+*/
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags) {
+    struct TlsSession *s = find_session(fd);
+    int n;
+
+    if (!s || s->kernelSend) {
+        return send(fd, buf, len, flags);
+    }
+
+    ERR_clear_error();
+    errno = 0;
+    n = SSL_write(s->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+
+    return n > 0 ? n : io_result(s->ssl, n);
+}
+
+/**
+ * sendmsg for a client socket. Encrypted in process, the buffers are gathered
+ * into a single record first, so none may be a file mapping: a copy from one
+ * faults if the file shrinks. Such responses are marked copiesBody and send
+ * the file with pread instead
+*/
+ssize_t tls_sendmsg(int fd, const struct msghdr *msg, int flags) {
+    struct TlsSession *s = find_session(fd);
+    char record[TLS_RECORD_SIZE];
+    size_t len = 0, take, i;
+
+    if (!s || s->kernelSend) {
+        return sendmsg(fd, msg, flags);
+    }
+
+    for (i = 0; i < msg->msg_iovlen && len < sizeof(record); ++i) {
+        take = msg->msg_iov[i].iov_len < sizeof(record) - len ? msg->msg_iov[i].iov_len : sizeof(record) - len;
+        memcpy(record + len, msg->msg_iov[i].iov_base, take);
+        len += take;
+    }
+
+    return tls_send(fd, record, len, flags);
+}
+
+/**
+ * Drops the TLS state of `fd`, before it is closed. Nothing is sent: a
+ * connection is only closed once done with or given up on
+*/
+void tls_close(int fd) {
+    struct TlsSession *s = find_session(fd);
+
+    if (s) {
+        SSL_free(s->ssl);
+        s->ssl = NULL;
+        s->kernelSend = 0;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+// Only ciphers the kernel can take over (AES-GCM since Linux 4.13, ChaCha20-Poly1305 since 5.11)
+#define TLS_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20"
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS_TICKET_KEY_LENGTH 80 // Name, HMAC and AES keys, see SSL_CTX_set_tlsext_ticket_keys
+#define TLS_SESSION_ID_CONTEXT "basic-http"
+#define TLS_RECORD_SIZE 16384 // Most plaintext one record carries
+
+struct ssl_ctx_st;
+
+struct ssl_ctx_st *tls_create(const struct ServerConfig *c);
+void tls_free(struct ssl_ctx_st *ctx);
+int tls_accept(struct ssl_ctx_st *ctx, int fd);
+int tls_handshake(int fd, unsigned int *want);
+int tls_zero_copy(int fd);
+int tls_pending(int fd);
+ssize_t tls_recv(int fd, void *buf, size_t len);
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags);
+ssize_t tls_sendmsg(int fd, const struct msghdr *msg, int flags);
+void tls_close(int fd);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/**
+ * Creates a tracer keeping one request in every `sample`, NULL if 0
+*/
+struct Tracer *trace_create(unsigned int sample) {
+    struct Tracer *t;
+
+    if (!sample || !(t = calloc(1, sizeof(struct Tracer)))) {
+        return NULL;
+    }
+
+    t->sample = sample;
+
+    return t;
+}
+
+/**
+ * Called as each request starts. Returns its trace id if it is to be traced, 0 if not
+*/
+unsigned int trace_begin(struct Tracer *t) {
+    if (!t || ++t->requests < t->sample) {
+        return 0;
+    }
+
+    t->requests = 0;
+
+    // 0 means untraced, so it is skipped when the id wraps
+    if (!++t->lastId) {
+        ++t->lastId;
+    }
+
+    return t->lastId;
+}
+
+/**
+ * Records that request `request` spent `start` to `end` (ns) in `name`. Does
+ * nothing for a request that is not traced
+*/
+void trace_span(struct Tracer *t, unsigned int request, const char *name, unsigned long long start, unsigned long long end, int status) {
+    struct TraceSpan *s;
+
+    if (!t || !request) {
+        return;
+    }
+
+    s = &t->spans[t->recorded++ % TRACE_RING_SPANS];
+    s->start = start;
+    s->duration = end > start ? end - start : 0;
+    s->name = name;
+    s->request = request;
+    s->status = status;
+}
+
+/**
+ * Writes the spans the ring holds to `<path>.<worker>.json` as Chrome
+ * trace-event JSON, oldest first. Each request gets a row of its own, so
+ * the phases of requests a worker interleaves do not overlap
+*/
+int trace_dump(const struct Tracer *t, const char *path, int worker) {
+    unsigned long long i, first;
+    const struct TraceSpan *s;
+    char name[4096];
+    FILE *fp;
+
+    if (!t) {
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "%s.%d.json", path, worker);
+
+    if (!(fp = fopen(name, "w"))) {
+        perror("Error opening trace file");
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+        (int)getpid(), worker);
+
+    first = t->recorded > TRACE_RING_SPANS ? t->recorded - TRACE_RING_SPANS : 0;
+
+    for (i = first; i < t->recorded; ++i) {
+        s = &t->spans[i % TRACE_RING_SPANS];
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%u",
+            s->name, s->start / 1000, s->start % 1000, s->duration / 1000, s->duration % 1000, (int)getpid(), s->request);
+
+        if (s->status) {
+            fprintf(fp, ",\"args\":{\"status\":%d}", s->status);
+        }
+
+        fputc('}', fp);
+    }
+
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+
+    if (fclose(fp) == EOF) {
+        perror("Error writing trace file");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+
+/**
+ * Static tracepoints at the phase boundaries of a request, under the
+ * provider `basic_http`. Built against <sys/sdt.h> (systemtap-sdt-dev) each
+ * is a single nop plus an ELF note, which bpftrace or perf can attach to in
+ * a running server, e.g.
+ *
+ *   bpftrace -e 'usdt:./bin/server:basic_http:handler_done { @[arg1] = count(); }'
+ *
+ * Without the header they compile to nothing
+*/
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT 1
+#endif
+#endif
+
+#ifdef TRACE_USDT
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(basic_http, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(basic_http, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(basic_http, name, a, b, c)
+#else
+#define TRACE_PROBE1(name, a) do { } while (0)
+#define TRACE_PROBE2(name, a, b) do { } while (0)
+#define TRACE_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#define TRACE_RING_SPANS 4096 // Per worker, the oldest are overwritten
+
+/**
+ * One timed phase of a sampled request. `name` is a string literal
+*/
+typedef struct TraceSpan {
+    unsigned long long start; // ns, metrics_now_ns
+    unsigned long long duration;
+    const char *name;
+    unsigned int request; // Trace id of the request, spans of one request share it
+    int status; // Of the response, on the span covering the whole request
+} TraceSpan;
+
+/**
+ * A worker's in-process tracer: every `sample`th request has the time it
+ * spends in each phase kept in a ring, which trace_dump writes out as Chrome
+ * trace-event JSON (load it in chrome://tracing or Perfetto)
+*/
+typedef struct Tracer {
+    struct TraceSpan spans[TRACE_RING_SPANS];
+    unsigned long long recorded; // Total, the next goes in spans[recorded % TRACE_RING_SPANS]
+    unsigned int sample;
+    unsigned int requests; // Seen since the last one sampled
+    unsigned int lastId;
+} Tracer;
+
+struct Tracer *trace_create(unsigned int sample);
+unsigned int trace_begin(struct Tracer *t);
+void trace_span(struct Tracer *t, unsigned int request, const char *name, unsigned long long start, unsigned long long end, int status);
+int trace_dump(const struct Tracer *t, const char *path, int worker);
+
+#endif
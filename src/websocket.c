@@ -0,0 +1,553 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include "websocket.h"
+
+/**
+ * Returns 1 if `list`, a comma separated header value, has `token` in it
+*/
+static int has_token(const char *list, const char *token) {
+    size_t length = strlen(token), len;
+
+    while (list && *list) {
+        list += strspn(list, " \t,");
+        len = strcspn(list, " \t,");
+
+        if (len == length && strncasecmp(list, token, length) == 0) {
+            return 1;
+        }
+
+        list += len;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns 1 if `req` asks to switch to WebSocket, whether or not it does so properly
+*/
+int websocket_requested(const struct HttpRequest *req) {
+    return req->method == GET && has_token(get_header_value("Upgrade", req->headers), "websocket");
+}
+
+/**
+ * Checks the handshake of a WebSocket request (RFC 6455 4.2.1) and writes its
+ * Sec-WebSocket-Accept, null terminated, into `accept`
+ * (WEBSOCKET_ACCEPT_LENGTH + 1 bytes)
+ *
+ * Returns -1 if the request is not a valid opening handshake
+*/
+int websocket_accept_key(const struct HttpRequest *req, char *accept) {
+    const char *key = get_header_value("Sec-WebSocket-Key", req->headers);
+    const char *version = get_header_value("Sec-WebSocket-Version", req->headers);
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    char joined[64];
+
+    // A base64 nonce of 16 bytes
+    if (strcmp(req->version, HTTP_VERSION_1_1) != 0 || !has_token(get_header_value(HTTP_HEADER_CONNECTION, req->headers), "upgrade")
+        || !version || strcmp(version, WEBSOCKET_VERSION) != 0 || !key || strlen(key) != 24 || strcmp(key + 22, "==") != 0) {
+        return -1;
+    }
+
+    memcpy(joined, key, 24);
+    memcpy(joined + 24, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+
+    SHA1((const unsigned char *)joined, 24 + sizeof(WEBSOCKET_GUID) - 1, digest);
+    EVP_EncodeBlock((unsigned char *)accept, digest, sizeof(digest));
+
+    return 0;
+}
+
+struct WebSocket *websocket_create(const struct WebSocketHandler *handler, struct BufferPool *pool) {
+    struct WebSocket *ws = calloc(1, sizeof(struct WebSocket));
+
+    if (ws) {
+        ws->handler = handler;
+        ws->pool = pool;
+    }
+
+    return ws;
+}
+
+/**
+ * Tells the handler the connection is gone and releases what it held, except
+ * `in`, which is the caller's to return to its pool first
+*/
+void websocket_free(struct WebSocket *ws) {
+    struct PoolBuffer *b;
+
+    if (!ws) {
+        return;
+    }
+
+    if (ws->opened && ws->handler->close) {
+        ws->handler->close(ws);
+    }
+
+    while ((b = ws->out)) {
+        ws->out = b->next;
+        b->next = NULL;
+        pool_put(ws->pool, b);
+    }
+
+    free(ws->message);
+    free(ws);
+}
+
+/**
+ * Unmasks a run of payload that starts `offset` bytes into its frame, a word
+ * at a time: the 4 byte mask repeats, so it is widened to 8 once and XORed
+ * over whole words, which compilers also vectorize
+*/
+static void unmask(unsigned char *data, size_t len, const unsigned char *mask, unsigned long long offset) {
+    unsigned char key[8];
+    uint64_t word, wide;
+    size_t i;
+
+    for (i = 0; i < sizeof(key); ++i) {
+        key[i] = mask[(offset + i) & 3];
+    }
+    memcpy(&wide, key, sizeof(wide));
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, data + i, 8);
+        word ^= wide;
+        memcpy(data + i, &word, 8);
+    }
+
+    for (; i < len; ++i) {
+        data[i] ^= key[i & 7];
+    }
+}
+
+/**
+ * Returns 1 if `s` is well-formed UTF-8 (RFC 3629), skipping ASCII a word at a time
+*/
+static int valid_utf8(const unsigned char *s, size_t len) {
+    size_t i = 0, n, j;
+    uint64_t word;
+    unsigned int cp;
+
+    while (i < len) {
+        if (i + 8 <= len) {
+            memcpy(&word, s + i, 8);
+            if (!(word & 0x8080808080808080ULL)) {
+                i += 8;
+                continue;
+            }
+        }
+
+        if (s[i] < 0x80) {
+            ++i;
+            continue;
+        }
+
+        if ((s[i] & 0xE0) == 0xC0) {
+            n = 1;
+            cp = s[i] & 0x1F;
+        } else if ((s[i] & 0xF0) == 0xE0) {
+            n = 2;
+            cp = s[i] & 0x0F;
+        } else if ((s[i] & 0xF8) == 0xF0) {
+            n = 3;
+            cp = s[i] & 0x07;
+        } else {
+            return 0;
+        }
+
+        if (i + n >= len) {
+            return 0;
+        }
+
+        for (j = 1; j <= n; ++j) {
+            if ((s[i + j] & 0xC0) != 0x80) {
+                return 0;
+            }
+            cp = (cp << 6) | (s[i + j] & 0x3F);
+        }
+
+        // Overlong forms, surrogates and past the last code point
+        if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000)
+            || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+            return 0;
+        }
+
+        i += n + 1;
+    }
+
+    return 1;
+}
+
+/**
+ * Frames `length` bytes into pooled buffers at the back of the queue. A
+ * payload too large for one buffer runs on into the next
+*/
+int websocket_send(struct WebSocket *ws, enum WebSocketOpcode opcode, const void *data, size_t length) {
+    const char *payload = data;
+    struct PoolBuffer *b, *head = NULL, *tail = NULL;
+    unsigned char header[10];
+    size_t headerLength = 2, queued = 0, take;
+    int i;
+
+    if (ws->closeSent) {
+        return -1;
+    }
+
+    // A client that does not keep up is not buffered for without end, though it is still told why it is closed
+    if (opcode != WEBSOCKET_CLOSE && ws->outLength + length > WEBSOCKET_MAX_OUTPUT) {
+        return -1;
+    }
+
+    // Server frames are never masked
+    header[0] = 0x80 | opcode;
+    if (length < 126) {
+        header[1] = length;
+    } else if (length <= 0xFFFF) {
+        header[1] = 126;
+        header[2] = length >> 8;
+        header[3] = length & 0xFF;
+        headerLength = 4;
+    } else {
+        header[1] = 127;
+        for (i = 0; i < 8; ++i) {
+            header[2 + i] = (unsigned long long)length >> (56 - 8 * i) & 0xFF;
+        }
+        headerLength = 10;
+    }
+
+    do {
+        if (!(b = pool_get(ws->pool, headerLength + length <= POOL_SMALL_SIZE ? POOL_SMALL : POOL_LARGE))) {
+            while ((b = head)) {
+                head = b->next;
+                b->next = NULL;
+                pool_put(ws->pool, b);
+            }
+            return -1;
+        }
+
+        if (!head) {
+            memcpy(b->data, header, headerLength);
+            b->len = headerLength;
+            head = b;
+        } else {
+            tail->next = b;
+        }
+        tail = b;
+
+        if ((take = length < b->cap - b->len ? length : b->cap - b->len)) {
+            memcpy(b->data + b->len, payload, take);
+        }
+        b->len += take;
+        payload += take;
+        length -= take;
+        queued += b->len;
+    } while (length);
+
+    ws->outLength += queued;
+
+    if (ws->outTail) {
+        ws->outTail->next = head;
+    } else {
+        ws->out = head;
+    }
+    ws->outTail = tail;
+
+    return 0;
+}
+
+/**
+ * Starts the closing handshake with `code`. Nothing is sent after it
+*/
+int websocket_close(struct WebSocket *ws, int code) {
+    unsigned char payload[2] = { code >> 8, code & 0xFF };
+    int result;
+
+    if (ws->closeSent) {
+        return 0;
+    }
+
+    result = websocket_send(ws, WEBSOCKET_CLOSE, payload, sizeof(payload));
+    ws->closeSent = 1;
+
+    return result;
+}
+
+/**
+ * Pings a quiet client. Returns -1 if the last ping has had no answer since,
+ * or the connection is closing, and it should be given up on
+*/
+int websocket_ping(struct WebSocket *ws) {
+    if (ws->pingSent || ws->closeSent) {
+        return -1;
+    }
+
+    ws->pingSent = 1;
+
+    return websocket_send(ws, WEBSOCKET_PING, NULL, 0);
+}
+
+/**
+ * Returns 1 if a close frame's code may be sent by a peer (RFC 6455 7.4)
+*/
+static int valid_close_code(int code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+/**
+ * Acts on a whole control frame: answers pings, and closes back
+*/
+static int on_control(struct WebSocket *ws) {
+    const unsigned char *payload = (const unsigned char *)ws->control;
+    int code = WEBSOCKET_CLOSE_NORMAL;
+
+    switch (ws->frameOpcode) {
+        case WEBSOCKET_PING:
+            return ws->closeSent ? 0 : websocket_send(ws, WEBSOCKET_PONG, ws->control, ws->controlLength);
+        case WEBSOCKET_CLOSE:
+            ws->closeReceived = 1;
+
+            if (ws->controlLength >= 2) {
+                code = payload[0] << 8 | payload[1];
+
+                if (!valid_close_code(code) || !valid_utf8(payload + 2, ws->controlLength - 2)) {
+                    websocket_close(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+                    return -1;
+                }
+            } else if (ws->controlLength == 1) {
+                websocket_close(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+                return -1;
+            }
+
+            websocket_close(ws, code);
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Hands a whole message to the handler
+*/
+static int on_message(struct WebSocket *ws) {
+    int result = 0;
+
+    if (ws->messageOpcode == WEBSOCKET_TEXT && !valid_utf8((const unsigned char *)ws->message, ws->messageLength)) {
+        result = WEBSOCKET_CLOSE_INVALID_DATA;
+    } else if (!ws->closeSent && ws->handler->message) {
+        result = ws->handler->message(ws, ws->messageOpcode, ws->message ? ws->message : "", ws->messageLength);
+    }
+
+    free(ws->message);
+    ws->message = NULL;
+    ws->messageLength = ws->messageCap = 0;
+    ws->messageOpcode = WEBSOCKET_CONTINUATION;
+
+    if (result) {
+        websocket_close(ws, result);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads a frame header off the front of `data`, checking it against what may
+ * come next
+ *
+ * Returns its length, 0 if it has not all arrived, -1 with a close queued if
+ * it breaks the protocol
+*/
+static ssize_t read_header(struct WebSocket *ws, const unsigned char *data, size_t length) {
+    size_t headerLength = 2, i;
+    unsigned long long payload;
+    int control, code = WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+
+    if (length < 2) {
+        return 0;
+    }
+
+    // No extensions are agreed on, so no reserved bits, and clients always mask
+    if ((data[0] & 0x70) || !(data[1] & 0x80)) {
+        websocket_close(ws, code);
+        return -1;
+    }
+
+    payload = data[1] & 0x7F;
+    headerLength += payload == 126 ? 2 : payload == 127 ? 8 : 0;
+    headerLength += 4;
+
+    if (length < headerLength) {
+        return 0;
+    }
+
+    ws->frameFin = data[0] >> 7;
+    ws->frameOpcode = data[0] & 0x0F;
+    control = ws->frameOpcode & 0x8;
+
+    if (payload == 126) {
+        payload = data[2] << 8 | data[3];
+    } else if (payload == 127) {
+        for (payload = 0, i = 2; i < 10; ++i) {
+            payload = payload << 8 | data[i];
+        }
+
+        // The most significant bit of a 64-bit length must be 0
+        if (payload >> 63) {
+            websocket_close(ws, code);
+            return -1;
+        }
+    }
+
+    if (control) {
+        if (!ws->frameFin || payload > WEBSOCKET_MAX_CONTROL
+            || (ws->frameOpcode != WEBSOCKET_CLOSE && ws->frameOpcode != WEBSOCKET_PING && ws->frameOpcode != WEBSOCKET_PONG)) {
+            websocket_close(ws, code);
+            return -1;
+        }
+    } else if (ws->frameOpcode == WEBSOCKET_CONTINUATION ? ws->messageOpcode == WEBSOCKET_CONTINUATION
+        : (ws->frameOpcode != WEBSOCKET_TEXT && ws->frameOpcode != WEBSOCKET_BINARY) || ws->messageOpcode != WEBSOCKET_CONTINUATION) {
+        // A continuation with nothing to continue, or a new message before the last ended
+        websocket_close(ws, code);
+        return -1;
+    } else if (payload > WEBSOCKET_MAX_MESSAGE - ws->messageLength) {
+        websocket_close(ws, WEBSOCKET_CLOSE_TOO_BIG);
+        return -1;
+    }
+
+    if (!control && ws->frameOpcode != WEBSOCKET_CONTINUATION) {
+        ws->messageOpcode = ws->frameOpcode;
+    }
+
+    memcpy(ws->frameMask, data + headerLength - 4, 4);
+    ws->frameLeft = payload;
+    ws->frameOffset = 0;
+    ws->controlLength = 0;
+    ws->frameOpen = 1;
+
+    return headerLength;
+}
+
+/**
+ * Copies a run of unmasked payload to the control frame or message it belongs to
+*/
+static int take_payload(struct WebSocket *ws, const unsigned char *data, size_t length) {
+    size_t cap;
+    char *grown;
+
+    if (ws->frameOpcode & 0x8) {
+        memcpy(ws->control + ws->controlLength, data, length);
+        ws->controlLength += length;
+        return 0;
+    }
+
+    if (ws->messageLength + length > ws->messageCap) {
+        for (cap = ws->messageCap ? ws->messageCap : 256; cap < ws->messageLength + length; cap *= 2);
+
+        if (!(grown = realloc(ws->message, cap))) {
+            websocket_close(ws, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+            return -1;
+        }
+
+        ws->message = grown;
+        ws->messageCap = cap;
+    }
+
+    memcpy(ws->message + ws->messageLength, data, length);
+    ws->messageLength += length;
+
+    return 0;
+}
+
+/**
+ * Parses the frames in `data`, as far as they have arrived, unmasking their
+ * payloads in place. Pings are answered, messages handed to the handler once
+ * whole, and a close answered with one
+ *
+ * Returns the number of bytes used, which leaves at most an incomplete frame
+ * header. Returns -1 with a close queued if the client broke the protocol
+*/
+ssize_t websocket_receive(struct WebSocket *ws, unsigned char *data, size_t length) {
+    size_t used = 0, take;
+    ssize_t n;
+
+    while (used < length && !ws->closeReceived) {
+        if (!ws->frameOpen) {
+            if ((n = read_header(ws, data + used, length - used)) <= 0) {
+                return n == -1 ? -1 : (ssize_t)used;
+            }
+            used += n;
+        }
+
+        take = length - used < ws->frameLeft ? length - used : ws->frameLeft;
+        unmask(data + used, take, ws->frameMask, ws->frameOffset);
+
+        if (take_payload(ws, data + used, take) == -1) {
+            return -1;
+        }
+
+        used += take;
+        ws->frameLeft -= take;
+        ws->frameOffset += take;
+
+        if (ws->frameLeft) {
+            break;
+        }
+
+        // Any frame shows the client is still there
+        ws->frameOpen = 0;
+        ws->pingSent = 0;
+
+        if (ws->frameOpcode & 0x8) {
+            if (on_control(ws) == -1) {
+                return -1;
+            }
+        } else if (ws->frameFin && on_message(ws) == -1) {
+            return -1;
+        }
+    }
+
+    // Nothing is read after the client's close
+    return ws->closeReceived ? (ssize_t)length : (ssize_t)used;
+}
+
+/**
+ * Points `iov` at up to `max` of the queued buffers, returning how many
+*/
+int websocket_output(const struct WebSocket *ws, struct iovec *iov, int max) {
+    const struct PoolBuffer *b;
+    int count = 0;
+
+    for (b = ws->out; b && count < max; b = b->next, ++count) {
+        iov[count].iov_base = (char *)b->data + (count ? 0 : ws->outSent);
+        iov[count].iov_len = b->len - (count ? 0 : ws->outSent);
+    }
+
+    return count;
+}
+
+/**
+ * Drops `n` sent bytes from the front of the queue
+*/
+void websocket_output_sent(struct WebSocket *ws, size_t n) {
+    struct PoolBuffer *b;
+
+    ws->outLength -= n < ws->outLength ? n : ws->outLength;
+
+    while ((b = ws->out) && n >= b->len - ws->outSent) {
+        n -= b->len - ws->outSent;
+        ws->out = b->next;
+        b->next = NULL;
+        pool_put(ws->pool, b);
+        ws->outSent = 0;
+    }
+
+    if (!ws->out) {
+        ws->outTail = NULL;
+    }
+
+    ws->outSent += n;
+}
@@ -0,0 +1,97 @@
+#ifndef WEBSOCKET_H_
+#define WEBSOCKET_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "http.h"
+#include "pool.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" // RFC 6455 1.3
+#define WEBSOCKET_VERSION "13"
+#define WEBSOCKET_ACCEPT_LENGTH 28 // Base64 of a SHA-1
+#define WEBSOCKET_MAX_HEADER 14 // Frame header, extended length and mask
+#define WEBSOCKET_MAX_CONTROL 125 // Payload of a ping, pong or close
+#define WEBSOCKET_MAX_MESSAGE 1048576 // Reassembled from its fragments, larger ones are refused with 1009
+#define WEBSOCKET_MAX_OUTPUT 4194304 // Queued for a client, a slower one is closed with 1008
+
+typedef enum WebSocketOpcode {
+    WEBSOCKET_CONTINUATION = 0x0,
+    WEBSOCKET_TEXT = 0x1,
+    WEBSOCKET_BINARY = 0x2,
+    WEBSOCKET_CLOSE = 0x8,
+    WEBSOCKET_PING = 0x9,
+    WEBSOCKET_PONG = 0xA
+} WebSocketOpcode;
+
+#define WEBSOCKET_CLOSE_NORMAL 1000
+#define WEBSOCKET_CLOSE_GOING_AWAY 1001
+#define WEBSOCKET_CLOSE_PROTOCOL_ERROR 1002
+#define WEBSOCKET_CLOSE_UNSUPPORTED 1003
+#define WEBSOCKET_CLOSE_INVALID_DATA 1007
+#define WEBSOCKET_CLOSE_POLICY 1008
+#define WEBSOCKET_CLOSE_TOO_BIG 1009
+#define WEBSOCKET_CLOSE_INTERNAL_ERROR 1011
+
+struct WebSocket;
+
+/**
+ * What a route speaking WebSocket does with its connections. A handler takes
+ * the upgrade by setting it on the RouteContext and returning 101
+*/
+typedef struct WebSocketHandler {
+    int (*open)(struct WebSocket *ws); // After the 101, returns -1 to close with 1011
+    int (*message)(struct WebSocket *ws, enum WebSocketOpcode opcode, const char *data, size_t len); // 0, or a code to close with
+    void (*close)(struct WebSocket *ws); // The connection is gone, only if `open` succeeded
+} WebSocketHandler;
+
+/**
+ * One WebSocket connection
+ *
+ * Frames are parsed out of `in` as their bytes arrive: a payload is unmasked
+ * where it was read and copied into the message being reassembled, so `in`
+ * only ever holds the start of a frame header. Frames sent are written into
+ * pooled buffers queued in `out`, sent with one gathered write
+*/
+typedef struct WebSocket {
+    struct PoolBuffer *in;
+    struct PoolBuffer *out;
+    struct PoolBuffer *outTail;
+    size_t outSent; // Of the first buffer in `out`
+    size_t outLength; // Queued, not yet sent
+    int frameOpen; // Reading a frame's payload
+    enum WebSocketOpcode frameOpcode;
+    int frameFin;
+    unsigned char frameMask[4];
+    unsigned long long frameLeft; // Payload bytes still to come
+    unsigned long long frameOffset; // Payload bytes seen, which the mask is rotated by
+    char control[WEBSOCKET_MAX_CONTROL]; // Payload of the control frame being read
+    size_t controlLength;
+    char *message; // Being reassembled, NULL between messages
+    size_t messageLength;
+    size_t messageCap;
+    enum WebSocketOpcode messageOpcode; // Text or binary, continuation while none is open
+    int opened; // `open` succeeded, so `close` is due
+    int pingSent; // Waiting for a frame since the last ping, see websocket_ping
+    int closeSent;
+    int closeReceived;
+    const struct WebSocketHandler *handler;
+    void *state; // The handler's own
+    struct BufferPool *pool;
+    struct Worker *worker;
+    struct Connection *connection;
+} WebSocket;
+
+int websocket_requested(const struct HttpRequest *req);
+int websocket_accept_key(const struct HttpRequest *req, char *accept);
+struct WebSocket *websocket_create(const struct WebSocketHandler *handler, struct BufferPool *pool);
+void websocket_free(struct WebSocket *ws);
+ssize_t websocket_receive(struct WebSocket *ws, unsigned char *data, size_t length);
+int websocket_send(struct WebSocket *ws, enum WebSocketOpcode opcode, const void *data, size_t length);
+int websocket_close(struct WebSocket *ws, int code);
+int websocket_ping(struct WebSocket *ws);
+int websocket_output(const struct WebSocket *ws, struct iovec *iov, int max);
+void websocket_output_sent(struct WebSocket *ws, size_t n);
+
+#endif
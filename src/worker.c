@@ -0,0 +1,2397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "http.h"
+#include "metrics.h"
+#include "access_log.h"
+#include "socket.h"
+#include "files.h"
+#include "router.h"
+#include "multipart.h"
+#include "websocket.h"
+#include "sse.h"
+#include "stream.h"
+#include "h2.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "tls.h"
+#include "trace.h"
+#include "acceptor.h"
+#include "worker.h"
+
+// Set by SIGQUIT: stop accepting, finish the requests in flight, then exit
+static volatile sig_atomic_t stopping = 0;
+
+static void on_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+// Set by SIGUSR1: write out the sampled request traces
+static volatile sig_atomic_t dumpRequested = 0;
+
+static void on_dump(int sig) {
+    (void)sig;
+    dumpRequested = 1;
+}
+
+/**
+ * A request whose handler takes its multipart body as it arrives
+ *
+ * Each read of the body is parsed and dropped from the connection's buffer
+ * straight away, so an upload of any size holds only this
+*/
+typedef struct Upload {
+    struct RouteContext ctx; // Owns the request and the response the handler fills in
+    char path[FILES_PATH_MAX];
+    struct MultipartParser parser;
+    unsigned long long left; // Bytes of the body still to come
+} Upload;
+
+/**
+ * Gives up on an upload whose body will not all arrive
+*/
+static void drop_upload(struct Upload *u) {
+    u->ctx.upload->abort(&u->ctx);
+    free_response(u->ctx.res);
+    free_request(u->ctx.req);
+    free(u);
+}
+
+/**
+ * Milliseconds since the worker started, the clock connection deadlines are kept in
+*/
+unsigned int worker_clock(const struct Worker *w) {
+    return (unsigned int)((metrics_now_ns() - w->clockStart) / 1000000ULL);
+}
+
+/**
+ * Counts the response and queues its access log record
+*/
+static void log_response(struct Worker *w, struct AccessLogRecord *rec, unsigned long long startNs,
+    int status, ssize_t bytesSent) {
+    metrics_count_status(w->metrics, status);
+    METRICS_ADD(w->metrics->bytesOut, bytesSent > 0 ? bytesSent : 0);
+
+    rec->status = status;
+    rec->bytes = bytesSent > 0 ? bytesSent : 0;
+    rec->durationNs = metrics_now_ns() - startNs;
+
+    if (w->accessLog && access_log_write(w->accessLog, rec) == -1) {
+        METRICS_ADD(w->metrics->accessLogDrops, 1);
+    }
+}
+
+/**
+ * Sends a short error response and gives up on whatever does not fit in the socket buffer
+ *
+ * For connections about to be closed, where waiting for the client is not worth it
+*/
+static void send_error_now(int sockfd, int status) {
+    char buf[HTTP_RESPONSE_BUFFER_SIZE];
+    struct HttpRequestHeader connection = { HTTP_HEADER_CONNECTION, "close", NULL };
+    struct HttpResponse res = { NULL, &connection, NULL };
+    size_t length = serialize_response(buf, sizeof(buf), &res, status);
+
+    if (length <= sizeof(buf)) {
+        tls_send(sockfd, buf, length, MSG_DONTWAIT);
+    }
+}
+
+static void release_response(struct Worker *w, struct Response *o) {
+    if (o->proxy) {
+        proxy_abort(w, o->proxy);
+    }
+    if (o->upload) {
+        drop_upload(o->upload);
+    }
+    if (o->websocket) {
+        websocket_free(o->websocket);
+    }
+    if (o->events) {
+        sse_subscriber_free(o->events);
+    }
+    stream_free(o->stream);
+    if (o->mapping) {
+        mapcache_release(o->mapping);
+    }
+    if (o->fileFd != -1 && !o->fileShared) {
+        close(o->fileFd);
+    }
+    if (o->buf) {
+        pool_put(w->pool, o->buf);
+    } else {
+        free(o->data);
+    }
+
+    o->next = w->freeResponses;
+    w->freeResponses = o;
+}
+
+static void close_connection(struct Worker *w, struct Connection *c) {
+    struct Response *o;
+
+    if (c->protocol == CONNECTION_UPSTREAM) {
+        proxy_close(w, c);
+        return;
+    }
+
+    if (c->protocol == CONNECTION_H2) {
+        pool_put(w->pool, c->h2->in);
+        h2_session_free(c->h2);
+    } else if (c->protocol == CONNECTION_WEBSOCKET) {
+        pool_put(w->pool, c->ws->in);
+        websocket_free(c->ws);
+    } else if (c->protocol == CONNECTION_EVENTS) {
+        sse_unsubscribe(w->events, c->sse);
+        sse_subscriber_free(c->sse);
+    } else {
+        pool_put(w->pool, c->in);
+    }
+
+    while ((o = c->out)) {
+        c->out = o->next;
+        release_response(w, o);
+    }
+
+    // Closing the socket also takes it out of the epoll set
+    tls_close(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    connection_put(w->connections, c);
+
+    METRICS_ADD(w->metrics->connectionsClosed, 1);
+}
+
+/**
+ * Moves `c` to `state` with that state's timeout, switching between waiting
+ * to read and waiting to write as needed
+*/
+static int watch(struct Worker *w, struct Connection *c, enum ConnectionState state) {
+    struct epoll_event ev;
+    int timeoutMs = state == CONNECTION_IDLE ? w->config->keepAliveTimeoutMs
+        : state == CONNECTION_READING ? w->config->requestTimeoutMs : HTTP_SEND_TIMEOUT_MS;
+
+    if ((c->state == CONNECTION_WRITING) != (state == CONNECTION_WRITING)) {
+        ev.events = state == CONNECTION_WRITING ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = c;
+
+        if (epoll_ctl(w->epollfd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+            return -1;
+        }
+    }
+
+    connection_arm(w->connections, c, state, worker_clock(w) + timeoutMs);
+
+    return 0;
+}
+
+/**
+ * Logs the response at the front of the queue, now sent, and drops it
+ *
+ * Returns 1 if the connection stays open for another request
+*/
+static int finish_response(struct Worker *w, struct Connection *c) {
+    struct Response *o = c->out;
+    int keepAlive = o->keepAlive && !stopping;
+    unsigned long long now = metrics_now_ns();
+
+    metrics_observe(w->metrics, METRICS_PHASE_SEND, now - o->sendStart);
+    log_response(w, &o->rec, o->requestStart, o->status, o->bytes);
+    trace_span(w->tracer, o->traceId, "send", o->sendStart, now, 0);
+    trace_span(w->tracer, o->traceId, "request", o->requestStart, now, o->status);
+    TRACE_PROBE3(response_done, c->fd, o->status, o->bytes);
+
+    c->out = o->next;
+    release_response(w, o);
+
+    return keepAlive;
+}
+
+static int file_pending(const struct Response *o) {
+    return o->fileFd != -1 && o->fileOffset < o->fileEnd;
+}
+
+/**
+ * Sends one batch of the queue: everything in memory up to the next file
+ * body in one sendmsg, or that file body with sendfile
+ *
+ * Returns 1 if the batch went out whole, 0 if the socket is full, -1 on error
+ * or once a response after which the connection closes has been sent
+*/
+static int flush_batch(struct Worker *w, struct Connection *c, int *corked) {
+    struct iovec iov[WORKER_MAX_IOV];
+    struct msghdr msg;
+    struct Response *o = c->out;
+    size_t left, take;
+    ssize_t n;
+    int count = 0, flags = 0, tcp = c->family == AF_INET || c->family == AF_INET6;
+
+    // What is left of each queued head and in-memory body, up to the first file body
+    for (; o && count + 2 <= WORKER_MAX_IOV; o = o->next) {
+        if (o->sent < o->length) {
+            iov[count].iov_base = o->data + o->sent;
+            iov[count++].iov_len = o->length - o->sent;
+        }
+        if (o->sent < o->length + o->bodyLength) {
+            take = o->sent > o->length ? o->sent - o->length : 0;
+            iov[count].iov_base = (char *)o->body + take;
+            iov[count++].iov_len = o->bodyLength - take;
+        }
+        if (file_pending(o)) {
+            // The head should share a packet with the start of the file
+            flags = tcp ? MSG_MORE : 0;
+            break;
+        }
+        // Written as it is sent, and only while the client keeps up
+        if (o->stream) {
+            if (stream_fill(o->stream) == -1) {
+                return -1;
+            }
+            count += stream_output(o->stream, iov + count, WORKER_MAX_IOV - count);
+            if (!stream_done(o->stream)) {
+                break;
+            }
+        }
+    }
+
+    if (count) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        n = tls_sendmsg(c->fd, &msg, flags);
+
+        if (n == -1 && errno == EINTR) {
+            return 1;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n == -1) {
+            // A file shrank under its mapping, map them afresh next time
+            if (errno == EFAULT) {
+                for (o = c->out; o; o = o->next) {
+                    if (o->mapping) {
+                        mapcache_invalidate(w->mapCache, o->mapping);
+                    }
+                }
+            }
+            return -1;
+        }
+
+        TRACE_PROBE2(sent, c->fd, n);
+
+        // Hand the bytes sent out to the responses they belong to, finishing those done
+        while ((o = c->out) && n >= 0) {
+            left = o->length + o->bodyLength - o->sent;
+            take = (size_t)n < left ? (size_t)n : left;
+            o->sent += take;
+            o->bytes += take;
+            n -= take;
+
+            if (take < left || file_pending(o)) {
+                break;
+            }
+            if (o->stream) {
+                take = stream_output_sent(o->stream, n);
+                o->bytes += take;
+                n -= take;
+
+                if (!stream_done(o->stream)) {
+                    break;
+                }
+            }
+            if (!finish_response(w, c)) {
+                return -1;
+            }
+        }
+
+        return 1;
+    }
+
+    // Only a file body is left at the front. Cork it if more responses follow it, so its tail and
+    // the next head fill whole packets; finishing the queue uncorks
+    o = c->out;
+
+    if (tcp && o->next && !*corked) {
+        *corked = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, corked, sizeof(*corked));
+    }
+
+    while (file_pending(o)) {
+#ifdef __linux__
+        // Also over TLS once the kernel encrypts the records
+        if (tls_zero_copy(c->fd)) {
+            n = sendfile(c->fd, o->fileFd, &o->fileOffset, o->fileEnd - o->fileOffset);
+        } else
+#endif
+        {
+            char buf[TLS_RECORD_SIZE];
+
+            n = pread(o->fileFd, buf, o->fileEnd - o->fileOffset < (off_t)sizeof(buf) ? o->fileEnd - o->fileOffset : (off_t)sizeof(buf), o->fileOffset);
+            if (n > 0 && (n = tls_send(c->fd, buf, n, 0)) > 0) {
+                o->fileOffset += n;
+            }
+        }
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        // Also covers the file shrinking while it is sent
+        if (n <= 0) {
+            return -1;
+        }
+
+        o->bytes += n;
+        TRACE_PROBE2(sent, c->fd, n);
+    }
+
+    return finish_response(w, c) ? 1 : -1;
+}
+
+/**
+ * Sends as much of the connection's queued responses as the socket takes without blocking
+ *
+ * Pipelined responses go out together, so a wakeup usually costs one syscall
+ * however many requests it answers. Returns 1 once the queue is empty, 0 if
+ * the socket is full, -1 on error or once the connection should be closed
+*/
+static int flush_responses(struct Worker *w, struct Connection *c) {
+    int corked = 0, done = 1;
+
+    while (c->out && (done = flush_batch(w, c, &corked)) == 1);
+
+    if (corked) {
+        corked = 0;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked));
+    }
+
+    return done;
+}
+
+static struct Response *new_response(struct Worker *w) {
+    struct Response *o = w->freeResponses;
+
+    if (o) {
+        w->freeResponses = o->next;
+    } else if (!(o = malloc(sizeof(struct Response)))) {
+        return NULL;
+    }
+
+    memset(o, 0, offsetof(struct Response, rec));
+    o->fileFd = -1;
+    o->traceId = trace_begin(w->tracer);
+
+    return o;
+}
+
+/**
+ * Serializes `o` into the smallest buffer it fits and adds it to the back of the queue
+ *
+ * On failure `o` is left for the caller to release
+*/
+static int queue_response(struct Worker *w, struct Connection *c, struct Response *o, struct HttpResponse *res) {
+    int streamed = o->body || o->fileFd != -1 || o->events || o->stream;
+    struct Response **tail;
+    enum PoolClass cls;
+    size_t cap = 0;
+
+    // Mapped and file bodies follow the head, the handler has already set their Content-Length. Event
+    // streams and streamed bodies have none, answer_in_version says how they end
+    for (cls = POOL_SMALL; ; ++cls) {
+        o->buf = cls < POOL_CLASS_COUNT ? pool_get(w->pool, cls) : NULL;
+        o->data = o->buf ? o->buf->data : NULL;
+        cap = o->buf ? o->buf->cap : 0;
+
+        o->length = streamed ? serialize_head(o->data, cap, res, o->status, -1)
+            : serialize_response(o->data, cap, res, o->status);
+
+        if (o->length <= cap || cls >= POOL_CLASS_COUNT) {
+            break;
+        }
+
+        pool_put(w->pool, o->buf);
+    }
+
+    if (o->length > cap) {
+        o->buf = NULL;
+
+        if (!(o->data = malloc(o->length))) {
+            return -1;
+        }
+
+        if (streamed) {
+            serialize_head(o->data, o->length, res, o->status, -1);
+        } else {
+            serialize_response(o->data, o->length, res, o->status);
+        }
+    }
+
+    o->sendStart = metrics_now_ns();
+
+    for (tail = &c->out; *tail; tail = &(*tail)->next);
+    *tail = o;
+
+    return 0;
+}
+
+/**
+ * Adds the pre-serialized 429 to the back of the queue, see ratelimit_response
+ *
+ * Copied, since the shared one is dated again while this may still be sending
+*/
+static int queue_limited(struct Worker *w, struct Connection *c, struct Response *o) {
+    const char *limited = ratelimit_response(&o->length);
+    struct Response **tail;
+
+    if (!(o->buf = pool_get(w->pool, POOL_SMALL))) {
+        return -1;
+    }
+
+    o->data = o->buf->data;
+    memcpy(o->data, limited, o->length);
+    o->sendStart = metrics_now_ns();
+
+    for (tail = &c->out; *tail; tail = &(*tail)->next);
+    *tail = o;
+
+    return 0;
+}
+
+/**
+ * Returns the offset just past the blank line ending the head at the front of
+ * `c->in`, or 0 if it has not all arrived
+ *
+ * Only picks up where the last search stopped: scan_head_end is restarted a few
+ * bytes back so a line end split across reads is still found
+*/
+static size_t find_head_end(struct Connection *c) {
+    const struct PoolBuffer *b;
+    size_t base = 0, from = c->scanned > 3 ? c->scanned - 3 : 0, end;
+    int state = 0;
+
+    for (b = c->in; b; base += b->len, b = b->next) {
+        if (from >= base + b->len) {
+            continue;
+        }
+
+        end = scan_head_end(b->data + (from > base ? from - base : 0), b->len - (from > base ? from - base : 0), &state);
+
+        if (end) {
+            c->scanned = (from > base ? from : base) + end;
+            return c->scanned;
+        }
+    }
+
+    c->scanned = base;
+
+    return 0;
+}
+
+/**
+ * Names the request in its access log record, a path too long for the record truncated
+*/
+static void record_request(struct Response *o, const struct HttpRequest *req) {
+    size_t length = strlen(req->path);
+
+    if (length > sizeof(o->rec.path) - 1) {
+        length = sizeof(o->rec.path) - 1;
+    }
+
+    strcpy(o->rec.method, method_name(req->method));
+    memcpy(o->rec.path, req->path, length);
+    o->rec.path[length] = '\0';
+}
+
+/**
+ * Runs the handler for `req` with `ctx`, and fills in `o` with its status and
+ * body. `path` is the request's normalized path, and lasts as long as `ctx`
+ *
+ * Returns the handler's response, or NULL if there is none and `o->status` says why
+*/
+static struct HttpResponse *route_request(struct Worker *w, struct RouteContext *ctx, const char *path,
+    struct HttpRequest *req, struct Response *o) {
+    unsigned long long start = metrics_now_ns(), end;
+    struct HttpResponse *res = NULL;
+
+    record_request(o, req);
+
+    res = calloc(1, sizeof(struct HttpResponse));
+
+    if (!res) {
+        o->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        return NULL;
+    }
+
+    TRACE_PROBE2(handler_start, req->method, req->path);
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->worker = w;
+    ctx->req = req;
+    ctx->res = res;
+    ctx->path = path;
+    ctx->fileFd = -1;
+
+    o->status = router_dispatch(w->router, ctx);
+
+    end = metrics_now_ns();
+    metrics_observe(w->metrics, METRICS_PHASE_HANDLER, end - start);
+    trace_span(w->tracer, o->traceId, "handler", start, end, 0);
+    TRACE_PROBE2(handler_done, req->path, o->status);
+
+    o->mapping = ctx->mapping;
+    o->stream = ctx->stream;
+
+    // Only the kernel reads a mapping, in send, where a file shrinking under it fails with EFAULT. A copy
+    // in process would fault instead, so that reads the file (a mapping of the shared cache is memory)
+    if (ctx->mapping && ctx->fileFd != -1) {
+        if (o->copiesBody && !ctx->mapping->shared) {
+            mapcache_release(ctx->mapping);
+            o->mapping = NULL;
+        } else {
+            close(ctx->fileFd);
+            ctx->fileFd = -1;
+        }
+    }
+
+    if (ctx->fileFd != -1) {
+        o->fileFd = ctx->fileFd;
+        o->fileShared = ctx->fileShared;
+        o->fileOffset = ctx->fileOffset;
+        o->fileEnd = ctx->fileOffset + ctx->fileSize;
+    }
+
+    if (o->status == HTTP_STATUS_OK && o->mapping) {
+        o->body = o->mapping->map;
+        o->bodyLength = o->mapping->size;
+    } else if (o->status != HTTP_STATUS_OK && o->fileFd != -1) {
+        // Only a 200 sends the file, but it still has to be closed
+        if (!o->fileShared) {
+            close(o->fileFd);
+        }
+        o->fileFd = -1;
+    }
+
+    return res;
+}
+
+/**
+ * Finishes an upload with its handler's `end` once the whole body has parsed,
+ * otherwise with its `abort`. Returns the status to answer with
+*/
+static int end_upload(struct RouteContext *ctx, struct MultipartParser *parser, int failed) {
+    if (!failed && multipart_done(parser)) {
+        return ctx->upload->end(ctx);
+    }
+
+    ctx->upload->abort(ctx);
+
+    // A callback that stopped the parse says why, otherwise the body was cut short or malformed
+    if (parser->result >= HTTP_STATUS_BAD_REQUEST && parser->result < 600) {
+        return parser->result;
+    }
+
+    return parser->result ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_BAD_REQUEST;
+}
+
+/**
+ * Runs the handler for `req`, whose body (if any) is all here, filling in `o`
+ * with its status and body. `path` is the request's normalized path
+ *
+ * Returns the handler's response, or NULL if there is none and `o->status` says why
+*/
+static struct HttpResponse *dispatch_request(struct Worker *w, struct HttpRequest *req, const char *path,
+    struct Response *o) {
+    struct RouteContext ctx;
+    struct MultipartParser parser;
+    struct HttpResponse *res = route_request(w, &ctx, path, req, o);
+    int failed;
+
+    // An upload handler given a body that is already in memory (over HTTP/2) parses it in one go
+    if (res && ctx.upload) {
+        failed = multipart_init(&parser, get_header_value(HTTP_HEADER_CONTENT_TYPE, req->headers), &ctx.upload->parts,
+            &ctx) == -1 || multipart_parse(&parser, req->body ? req->body : "", req->contentLength) == -1;
+        o->status = end_upload(&ctx, &parser, failed);
+    }
+
+    // Streamed once the head is sent, see start_events
+    if (res && ctx.subscribe && o->status == HTTP_STATUS_OK && !(o->events = sse_subscriber_create(ctx.lastEventId))) {
+        o->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    return res;
+}
+
+/**
+ * Takes a token for `req` from its client's bucket, then from the client's
+ * bucket for the first route limit its normalized `path` falls under, the
+ * path it is routed by however it was spelled
+ *
+ * Returns 1 with `o` set up for a 429 if either was empty. Clients on Unix
+ * sockets are never limited
+*/
+static int rate_limited(struct Worker *w, const struct Connection *c, struct HttpRequest *req, const char *path,
+    struct Response *o) {
+    const struct ServerConfig *config = w->config;
+    const struct RateRoute *r;
+    int i, allowed = 1;
+
+    if (c->family != AF_INET && c->family != AF_INET6) {
+        return 0;
+    }
+
+    if (config->rateLimit) {
+        allowed = ratelimit_take(ratelimit_key(c->family, c->addr, 0), config->rateLimit, config->rateBurst, 1);
+    }
+
+    for (i = 0; allowed && i < config->rateRouteCount; ++i) {
+        r = &config->rateRoutes[i];
+
+        if (strncmp(path, r->prefix, r->prefixLength) == 0) {
+            allowed = ratelimit_take(ratelimit_key(c->family, c->addr, i + 1), r->rate, r->burst, 1);
+            break;
+        }
+    }
+
+    if (allowed) {
+        return 0;
+    }
+
+    record_request(o, req);
+    o->status = HTTP_STATUS_TOO_MANY_REQUESTS;
+    METRICS_ADD(w->metrics->rateLimited, 1);
+
+    return 1;
+}
+
+/**
+ * Returns the HTTP2-Settings of a request asking to switch to HTTP/2 (RFC 7540 3.2), or NULL
+*/
+static const char *h2c_upgrade_settings(struct HttpRequest *req) {
+    const char *upgrade = get_header_value("Upgrade", req->headers);
+    const char *settings = get_header_value("HTTP2-Settings", req->headers);
+    size_t len;
+
+    if (!upgrade || !settings) {
+        return NULL;
+    }
+
+    // One of a comma separated list of protocols
+    while (*upgrade) {
+        while (*upgrade == ' ' || *upgrade == ',') {
+            ++upgrade;
+        }
+
+        len = strcspn(upgrade, " ,");
+
+        if (len == 3 && strncasecmp(upgrade, "h2c", 3) == 0) {
+            return settings;
+        }
+
+        upgrade += len;
+    }
+
+    return NULL;
+}
+
+/**
+ * Answers in the client's version, and tells HTTP/1.0 clients (or HTTP/1.1
+ * ones, when closing) what happens next
+ *
+ * A streamed body is sent in chunks to HTTP/1.1 clients. HTTP/1.0 ones have
+ * no chunks, the connection closes after it instead
+*/
+static void answer_in_version(struct Response *o, const struct HttpRequest *req, struct HttpResponse *res) {
+    if (strcmp(req->version, HTTP_VERSION_1_1) == 0) {
+        res->version = HTTP_VERSION_1_1;
+    }
+    if (o->stream && res->version && add_response_header("Transfer-Encoding", "chunked", res) == 0) {
+        o->stream->chunked = 1;
+    } else if (o->stream) {
+        o->keepAlive = 0;
+    }
+    if (res->version ? !o->keepAlive : o->keepAlive) {
+        add_response_header(HTTP_HEADER_CONNECTION, o->keepAlive ? "keep-alive" : "close", res);
+    }
+}
+
+/**
+ * Runs the handler for a multipart request as soon as its head is in, see
+ * handle_request. A handler taking the body as an upload leaves `o->upload`
+ * set up to receive it, with the request, and `*res` NULL
+*/
+static int start_upload(struct Worker *w, struct Connection *c, struct HttpRequest *req, const char *path,
+    struct Response *o, struct HttpResponse **resOut) {
+    static const char continued[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    const char *expect = get_header_value("Expect", req->headers);
+    struct HttpResponse *res;
+    struct Upload *u;
+
+    record_request(o, req);
+
+    // The body is parsed as it comes, which needs its length up front
+    if (!get_header_value(HTTP_HEADER_CONTENT_LENGTH, req->headers)) {
+        o->status = HTTP_STATUS_LENGTH_REQUIRED;
+        free_request(req);
+        return 1;
+    }
+
+    if (req->contentLength > w->config->uploadMaxBytes) {
+        o->status = HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE;
+        free_request(req);
+        return 1;
+    }
+
+    if (!(u = calloc(1, sizeof(struct Upload)))) {
+        o->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        free_request(req);
+        return 1;
+    }
+
+    // Kept with the upload, which its handler's context points into as the body arrives
+    strcpy(u->path, path);
+
+    if (!(res = route_request(w, &u->ctx, u->path, req, o))) {
+        free(u);
+        free_request(req);
+        return 1;
+    }
+
+    // Answered without the body, which is left unread
+    if (!u->ctx.upload) {
+        free(u);
+        o->keepAlive = 0;
+        answer_in_version(o, req, res);
+        free_request(req);
+        *resOut = res;
+        return 1;
+    }
+
+    // Its boundary was found above, a body that cannot be parsed fails as it arrives
+    multipart_init(&u->parser, get_header_value(HTTP_HEADER_CONTENT_TYPE, req->headers), &u->ctx.upload->parts, &u->ctx);
+    u->left = req->contentLength;
+    o->upload = u;
+    o->keepAlive = req->keepAlive && !stopping;
+
+    // A client waiting to hear the body is wanted before sending it
+    if (expect && strcasecmp(expect, "100-continue") == 0 && strcmp(req->version, HTTP_VERSION_1_1) == 0) {
+        tls_send(c->fd, continued, sizeof(continued) - 1, MSG_DONTWAIT);
+    }
+
+    return 1;
+}
+
+/**
+ * Runs the handler for a request to switch to WebSocket, see handle_request. A
+ * route that takes it answers 101, with the connection to switch to left in
+ * `o->websocket`. Any other answer is sent like that of a plain request
+*/
+static int accept_websocket(struct Worker *w, struct HttpRequest *req, const char *path, struct Response *o,
+    struct HttpResponse **resOut) {
+    char accept[WEBSOCKET_ACCEPT_LENGTH + 1];
+    struct RouteContext ctx;
+    struct HttpResponse *res;
+
+    if (websocket_accept_key(req, accept) == -1) {
+        record_request(o, req);
+        o->status = HTTP_STATUS_BAD_REQUEST;
+        free_request(req);
+        return 1;
+    }
+
+    if (!(res = route_request(w, &ctx, path, req, o))) {
+        free_request(req);
+        return 1;
+    }
+
+    o->keepAlive = req->keepAlive && !stopping;
+
+    if (ctx.websocket && o->status == HTTP_STATUS_SWITCHING_PROTOCOLS) {
+        o->keepAlive = 1;
+        res->version = HTTP_VERSION_1_1;
+
+        if (!(o->websocket = websocket_create(ctx.websocket, w->pool))
+            || add_response_header("Upgrade", "websocket", res) == -1
+            || add_response_header(HTTP_HEADER_CONNECTION, "Upgrade", res) == -1
+            || add_response_header("Sec-WebSocket-Accept", accept, res) == -1) {
+            websocket_free(o->websocket);
+            o->websocket = NULL;
+            o->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            free_response(res);
+            free_request(req);
+            return 1;
+        }
+    } else {
+        answer_in_version(o, req, res);
+    }
+
+    free_request(req);
+    *resOut = res;
+
+    return 1;
+}
+
+/**
+ * Parses the request at the front of `raw` and runs its handler, filling in `o`
+ *
+ * Returns 0 if the request needs `*consumed` bytes in all and not all of them
+ * have arrived yet. Otherwise returns 1 with the handler's response in `*res`,
+ * or NULL there if the request could not be handled and `o->status` says why.
+ * A request switching to HTTP/2 is left in `*pass` to be answered there, with
+ * the 101 to send first in `*res`. So is one for the proxy, which only needs
+ * its head consumed: its body is streamed upstream as it arrives. So is a
+ * multipart body, parsed for its handler as it arrives (see start_upload). A
+ * request switching to WebSocket is answered in `*res` with `o->websocket`
+ * set, see accept_websocket. A client over its rate limit gets a NULL `*res`
+ * and a 429 in `o->status`
+*/
+static int handle_request(struct Worker *w, struct Connection *c, const char *raw, size_t headEnd, size_t total,
+    size_t *consumed, struct Response *o, struct HttpResponse **resOut, struct HttpRequest **pass) {
+    int status = HTTP_STATUS_OK;
+    unsigned long long start, end;
+    struct HttpRequest *req = NULL;
+    struct HttpResponse *res = NULL;
+    size_t headLength = headEnd, boundaryLength;
+    char path[FILES_PATH_MAX];
+
+    *resOut = NULL;
+
+    TRACE_PROBE2(parse_start, c->fd, total);
+    start = metrics_now_ns();
+    req = parse_request_head(raw, total, &headLength, &status);
+
+    // Limited and routed by where the path leads, however it is spelled
+    if (req && normalize_path(path, sizeof(path), req->path, strlen(req->path)) == -1) {
+        record_request(o, req);
+        free_request(req);
+        req = NULL;
+        status = HTTP_STATUS_BAD_REQUEST;
+    }
+
+    // Proxied requests wait for the responses ahead of them, then go up as they are
+    if (req && w->proxy && proxy_matches(w->proxy, path)) {
+        if (c->out) {
+            free_request(req);
+            return 0;
+        }
+
+        o->requestStart = start;
+
+        // Matched once its dot segments are resolved, which the upstream must not get to do otherwise
+        if (has_dot_segment(req->path, strlen(req->path))) {
+            record_request(o, req);
+            o->status = HTTP_STATUS_BAD_REQUEST;
+            free_request(req);
+            return 1;
+        }
+
+        if (rate_limited(w, c, req, path, o)) {
+            free_request(req);
+            return 1;
+        }
+
+        *consumed = headLength;
+        o->keepAlive = req->keepAlive && !stopping;
+        record_request(o, req);
+        *pass = req;
+
+        return 1;
+    }
+
+    // Multipart bodies are handed over as they arrive, also waiting for the responses ahead
+    if (req && (req->method == POST || req->method == PUT)
+        && multipart_boundary(get_header_value(HTTP_HEADER_CONTENT_TYPE, req->headers), &boundaryLength)) {
+        if (c->out) {
+            free_request(req);
+            return 0;
+        }
+
+        o->requestStart = start;
+        end = metrics_now_ns();
+        metrics_observe(w->metrics, METRICS_PHASE_PARSE, end - start);
+        trace_span(w->tracer, o->traceId, "parse", start, end, 0);
+        TRACE_PROBE2(parse_done, c->fd, status);
+
+        if (rate_limited(w, c, req, path, o)) {
+            free_request(req);
+            return 1;
+        }
+
+        *consumed = headLength;
+
+        return start_upload(w, c, req, path, o, resOut);
+    }
+
+    if (req && parse_request_body(req, raw + headLength, total - headLength, &status) == -1) {
+        free_request(req);
+        req = NULL;
+    }
+
+    end = metrics_now_ns();
+    metrics_observe(w->metrics, METRICS_PHASE_PARSE, end - start);
+    trace_span(w->tracer, o->traceId, "parse", start, end, 0);
+    TRACE_PROBE2(parse_done, c->fd, status);
+
+    *consumed = headEnd + (req ? req->contentLength : 0);
+
+    // The body is still on its way, parse again once it is all here
+    if (req && *consumed > total) {
+        free_request(req);
+        return 0;
+    }
+
+    o->requestStart = start;
+    o->status = status;
+
+    if (!req) {
+        return 1;
+    }
+
+    // Switching to WebSocket waits for the responses ahead of it
+    if (c->out && websocket_requested(req)) {
+        free_request(req);
+        return 0;
+    }
+
+    // Only once the request is whole, so one that has to be parsed again is not counted twice
+    if (rate_limited(w, c, req, path, o)) {
+        free_request(req);
+        return 1;
+    }
+
+    // Only between responses, and without a body to carry over
+    if (w->config->http2 && !c->out && !req->contentLength && strcmp(req->version, HTTP_VERSION_1_1) == 0
+        && h2c_upgrade_settings(req)) {
+        record_request(o, req);
+        o->status = HTTP_STATUS_SWITCHING_PROTOCOLS;
+        o->keepAlive = 1;
+
+        if (!(res = calloc(1, sizeof(struct HttpResponse)))
+            || add_response_header(HTTP_HEADER_CONNECTION, "Upgrade", res) == -1
+            || add_response_header("Upgrade", "h2c", res) == -1) {
+            free_response(res);
+            free_request(req);
+            o->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+            return 1;
+        }
+
+        res->version = HTTP_VERSION_1_1;
+        *pass = req;
+        *resOut = res;
+
+        return 1;
+    }
+
+    if (websocket_requested(req)) {
+        return accept_websocket(w, req, path, o, resOut);
+    }
+
+    res = dispatch_request(w, req, path, o);
+
+    if (!res) {
+        free_request(req);
+        return 1;
+    }
+
+    o->keepAlive = req->keepAlive && !stopping && !o->events;
+    answer_in_version(o, req, res);
+
+    // Closed to end it, but open until then
+    if (o->events) {
+        o->keepAlive = 1;
+    }
+
+    free_request(req);
+
+    *resOut = res;
+
+    return 1;
+}
+
+/**
+ * Starts the access log record of a request on `c`
+*/
+static void start_record(struct Response *o, const struct Connection *c) {
+    struct timespec now;
+
+    memset(&o->rec, 0, offsetof(struct AccessLogRecord, path) + 1);
+    clock_gettime(CLOCK_REALTIME, &now);
+    o->rec.timeNs = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    o->rec.family = c->family;
+    o->rec.port = c->port;
+    memcpy(o->rec.addr, c->addr, sizeof(c->addr));
+}
+
+/**
+ * Answers a request on an HTTP/2 stream through the same handlers as HTTP/1
+*/
+static void on_h2_request(struct H2Session *s, unsigned int streamId, struct HttpRequest *req, int status) {
+    struct Worker *w = s->worker;
+    struct HttpResponse *res = NULL;
+    struct Response *o = new_response(w);
+    char path[FILES_PATH_MAX];
+
+    if (!o) {
+        free_request(req);
+        h2_goaway(s, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    start_record(o, s->connection);
+    o->requestStart = metrics_now_ns();
+    o->copiesBody = 1;
+    o->status = status;
+
+    if (req && normalize_path(path, sizeof(path), req->path, strlen(req->path)) == -1) {
+        record_request(o, req);
+        free_request(req);
+        req = NULL;
+        o->status = HTTP_STATUS_BAD_REQUEST;
+    }
+
+    // The proxy streams bodies over HTTP/1.1, the client is asked to retry there (RFC 7540 8.1.1)
+    if (req && w->proxy && proxy_matches(w->proxy, path)) {
+        free_request(req);
+        release_response(w, o);
+
+        if (h2_reset(s, streamId, H2_HTTP_1_1_REQUIRED) == -1) {
+            h2_goaway(s, H2_INTERNAL_ERROR);
+        }
+        return;
+    }
+
+    // Answered from the status alone, HTTP/2 frames its own 429
+    if (req && rate_limited(w, s->connection, req, path, o)) {
+        free_request(req);
+        req = NULL;
+    }
+
+    if (req) {
+        res = dispatch_request(w, req, path, o);
+        free_request(req);
+    }
+
+    // HTTP/2 frames a streamed body itself, as it does any other
+    if (o->stream && !(o->body = stream_collect(o->stream, &o->bodyLength))) {
+        free_response(res);
+        res = NULL;
+        o->status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        stream_free(o->stream);
+        o->stream = NULL;
+    }
+
+    // Event streams are served over HTTP/1.1 only, where they have the connection to themselves
+    if (o->events) {
+        free_response(res);
+        release_response(w, o);
+
+        if (h2_reset(s, streamId, H2_HTTP_1_1_REQUIRED) == -1) {
+            h2_goaway(s, H2_INTERNAL_ERROR);
+        }
+        return;
+    }
+
+    o->sendStart = metrics_now_ns();
+
+    if (h2_respond(s, streamId, o, res) == -1) {
+        h2_goaway(s, H2_INTERNAL_ERROR);
+    }
+
+    free_response(res);
+}
+
+static void on_h2_done(struct H2Session *s, struct Response *o) {
+    struct Worker *w = s->worker;
+    unsigned long long now = metrics_now_ns();
+
+    metrics_observe(w->metrics, METRICS_PHASE_SEND, now - o->sendStart);
+    log_response(w, &o->rec, o->requestStart, o->status, o->bytes);
+    trace_span(w->tracer, o->traceId, "send", o->sendStart, now, 0);
+    trace_span(w->tracer, o->traceId, "request", o->requestStart, now, o->status);
+    TRACE_PROBE3(response_done, s->connection->fd, o->status, o->bytes);
+    release_response(w, o);
+}
+
+/**
+ * Switches `c` to HTTP/2, handing the session what has arrived after the
+ * preface or upgrade request. An upgrading request is answered on stream 1
+*/
+static int start_h2(struct Worker *w, struct Connection *c, struct HttpRequest *upgrade) {
+    struct H2Session *s = h2_session_create(on_h2_request, on_h2_done, w, c);
+
+    if (!s) {
+        free_request(upgrade);
+        return -1;
+    }
+
+    s->in = c->in;
+    c->h2 = s;
+    c->protocol = CONNECTION_H2;
+    c->scanned = 0;
+
+    if (upgrade && h2_upgrade(s, h2c_upgrade_settings(upgrade), upgrade) == -1) {
+        free_request(upgrade);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Tells an HTTP/2 client the connection is closing, as far as the socket
+ * takes it without blocking
+*/
+static void send_goaway_now(struct Connection *c) {
+    struct H2Session *s = c->h2;
+
+    h2_goaway(s, H2_NO_ERROR);
+    tls_send(c->fd, s->out + s->outSent, s->outLength - s->outSent, MSG_DONTWAIT);
+}
+
+/**
+ * Takes every complete frame buffered on an HTTP/2 connection, then sends
+ * what that framed and as much of the streams' responses as the socket and
+ * flow control allow. Closes the connection when done with it
+*/
+static void serve_h2(struct Worker *w, struct Connection *c) {
+    struct H2Session *s = c->h2;
+    ssize_t n = 0, sent;
+    size_t total;
+    char *raw;
+    int done;
+
+    if (s->in) {
+        total = pool_chain_length(s->in);
+        raw = s->in->data;
+
+        // Frames are parsed in one piece, which only a chain has to be copied for
+        if (s->in->next && !(raw = malloc(total))) {
+            close_connection(w, c);
+            return;
+        }
+
+        if (raw != s->in->data) {
+            pool_copy_chain(raw, s->in);
+        }
+
+        n = h2_receive(s, (const unsigned char *)raw, total);
+
+        if (raw != s->in->data) {
+            free(raw);
+        }
+
+        if (n > 0) {
+            METRICS_ADD(w->metrics->bytesIn, n);
+            s->in = pool_consume(w->pool, s->in, n);
+        }
+    }
+
+    // Streams already open are still answered
+    if (stopping) {
+        h2_goaway(s, H2_NO_ERROR);
+    }
+
+    // The 101 of an upgrade goes out before the session's first frame
+    if (c->out && (done = flush_responses(w, c)) != 1) {
+        if (done == -1 || watch(w, c, CONNECTION_WRITING) == -1) {
+            close_connection(w, c);
+        }
+        return;
+    }
+
+    for (;;) {
+        if (h2_pump(s) == -1) {
+            close_connection(w, c);
+            return;
+        }
+
+        if (s->outSent == s->outLength) {
+            break;
+        }
+
+        sent = tls_send(c->fd, s->out + s->outSent, s->outLength - s->outSent, 0);
+
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (n == -1 || watch(w, c, CONNECTION_WRITING) == -1) {
+                close_connection(w, c);
+            }
+            return;
+        }
+        if (sent == -1) {
+            close_connection(w, c);
+            return;
+        }
+
+        h2_output_sent(s, sent);
+    }
+
+    // After a connection error, or a GOAWAY once the streams it left open are done
+    if (n == -1 || (s->goaway && !s->streamCount)) {
+        close_connection(w, c);
+        return;
+    }
+
+    // Streams waiting on the client (for a request body or window) have the request timeout between frames
+    if (watch(w, c, s->streamCount || s->in ? CONNECTION_READING : CONNECTION_IDLE) == -1) {
+        close_connection(w, c);
+    }
+}
+
+/**
+ * Switches `c` to WebSocket once the 101 in `o` is sent, handing it what has
+ * already arrived after the request. The route's handler can queue its first
+ * frames straight away
+*/
+static void start_websocket(struct Worker *w, struct Connection *c, struct Response *o) {
+    struct WebSocket *ws = o->websocket;
+
+    o->websocket = NULL;
+    ws->in = c->in;
+    ws->worker = w;
+    ws->connection = c;
+    c->ws = ws;
+    c->protocol = CONNECTION_WEBSOCKET;
+    c->scanned = 0;
+
+    if (ws->handler->open && ws->handler->open(ws) == -1) {
+        websocket_close(ws, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+        return;
+    }
+
+    ws->opened = 1;
+}
+
+/**
+ * Tells a WebSocket client the connection is closing, as far as the socket
+ * takes it without blocking
+*/
+static void send_close_now(struct Connection *c) {
+    struct WebSocket *ws = c->ws;
+    struct iovec iov[WORKER_MAX_IOV];
+    struct msghdr msg;
+
+    websocket_close(ws, WEBSOCKET_CLOSE_GOING_AWAY);
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = websocket_output(ws, iov, WORKER_MAX_IOV);
+    tls_sendmsg(c->fd, &msg, MSG_DONTWAIT);
+}
+
+/**
+ * Takes the frames that have arrived on a WebSocket connection, then sends
+ * what they and the handler queued, as far as the socket takes it. Closes the
+ * connection when done with it
+ *
+ * A quiet connection is pinged once its keep-alive timeout passes, and closed
+ * if it stays quiet for another (see expire_connections)
+*/
+static void serve_websocket(struct Worker *w, struct Connection *c) {
+    struct WebSocket *ws = c->ws;
+    struct iovec iov[WORKER_MAX_IOV];
+    struct msghdr msg;
+    ssize_t n = 0, sent;
+    size_t total;
+    char *raw;
+    int done;
+
+    if (ws->in) {
+        total = pool_chain_length(ws->in);
+        raw = ws->in->data;
+
+        // Frames are parsed in one piece, which only a chain has to be copied for
+        if (ws->in->next && !(raw = malloc(total))) {
+            close_connection(w, c);
+            return;
+        }
+
+        if (raw != ws->in->data) {
+            pool_copy_chain(raw, ws->in);
+        }
+
+        n = websocket_receive(ws, (unsigned char *)raw, total);
+
+        if (raw != ws->in->data) {
+            free(raw);
+        }
+
+        if (n > 0) {
+            METRICS_ADD(w->metrics->bytesIn, n);
+            ws->in = pool_consume(w->pool, ws->in, n);
+        }
+    }
+
+    if (stopping) {
+        websocket_close(ws, WEBSOCKET_CLOSE_GOING_AWAY);
+    }
+
+    // The 101 goes out before the first frame
+    if (c->out && (done = flush_responses(w, c)) != 1) {
+        if (done == -1 || watch(w, c, CONNECTION_WRITING) == -1) {
+            close_connection(w, c);
+        }
+        return;
+    }
+
+    while (ws->out) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = websocket_output(ws, iov, WORKER_MAX_IOV);
+
+        sent = tls_sendmsg(c->fd, &msg, 0);
+
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (n == -1 || watch(w, c, CONNECTION_WRITING) == -1) {
+                close_connection(w, c);
+            }
+            return;
+        }
+        if (sent == -1) {
+            close_connection(w, c);
+            return;
+        }
+
+        METRICS_ADD(w->metrics->bytesOut, sent);
+        websocket_output_sent(ws, sent);
+    }
+
+    // After a protocol error, or once both sides have sent a close (the server closes the TCP connection first)
+    if (n == -1 || (ws->closeSent && ws->closeReceived)) {
+        close_connection(w, c);
+        return;
+    }
+
+    // The rest of a frame, and the client's answer to a close, have the request timeout
+    if (watch(w, c, ws->in || ws->frameOpen || ws->closeSent ? CONNECTION_READING : CONNECTION_IDLE) == -1) {
+        close_connection(w, c);
+    }
+}
+
+/**
+ * Subscribes `c` to the worker's events once the head in `o` is sent. Nothing
+ * after the request is read, a client can only end the stream by closing
+*/
+static void start_events(struct Worker *w, struct Connection *c, struct Response *o) {
+    struct SseSubscriber *s = o->events;
+
+    o->events = NULL;
+    pool_put(w->pool, c->in);
+    c->in = NULL;
+    s->connection = c;
+    c->sse = s;
+    c->protocol = CONNECTION_EVENTS;
+    c->scanned = 0;
+
+    sse_subscribe(w->events, s);
+}
+
+/**
+ * Sends the events queued for a subscriber, as far as the socket takes them,
+ * in one gathered write of the shared copies
+ *
+ * A quiet stream gets a comment once its keep-alive timeout passes, which
+ * keeps proxies from closing it and finds clients that have gone
+*/
+static void serve_events(struct Worker *w, struct Connection *c) {
+    struct SseSubscriber *s = c->sse;
+    struct iovec iov[WORKER_MAX_IOV];
+    struct msghdr msg;
+    ssize_t sent;
+    int done;
+
+    // The head goes out before the first event
+    if (c->out && (done = flush_responses(w, c)) != 1) {
+        if (done == -1 || watch(w, c, CONNECTION_WRITING) == -1) {
+            close_connection(w, c);
+        }
+        return;
+    }
+
+    while (s->count) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = sse_output(s, iov, WORKER_MAX_IOV);
+
+        sent = tls_sendmsg(c->fd, &msg, 0);
+
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (watch(w, c, CONNECTION_WRITING) == -1) {
+                close_connection(w, c);
+            }
+            return;
+        }
+        if (sent == -1) {
+            close_connection(w, c);
+            return;
+        }
+
+        METRICS_ADD(w->metrics->bytesOut, sent);
+        sse_output_sent(s, sent);
+    }
+
+    if (stopping || watch(w, c, CONNECTION_IDLE) == -1) {
+        close_connection(w, c);
+    }
+}
+
+/**
+ * Queues the events published since the worker last looked for every
+ * subscriber, then sends them to each that is not already waiting to write
+ *
+ * Each event is copied out of the ring once, however many subscribers it
+ * goes to. One that falls a whole queue behind is disconnected, and can
+ * reconnect with Last-Event-ID for what it missed
+*/
+static void deliver_events(struct Worker *w) {
+    struct SseHub *h = w->events;
+    struct SseSubscriber *s, *next;
+    struct SseEvent *e;
+    unsigned long long count;
+
+    while (read(h->notifyfd, &count, sizeof(count)) == -1 && errno == EINTR);
+
+    while ((e = sse_next(h))) {
+        for (s = h->subscribers; s; s = next) {
+            next = s->next;
+
+            if (sse_queue(s, e) == -1) {
+                close_connection(w, s->connection);
+            }
+        }
+
+        sse_event_put(e);
+    }
+
+    for (s = h->subscribers; s; s = next) {
+        next = s->next;
+
+        if (s->count && s->connection->state != CONNECTION_WRITING) {
+            serve_events(w, s->connection);
+        }
+    }
+}
+
+/**
+ * Takes the next complete request off the front of `c->in` and queues its response
+ *
+ * Returns 1 if a response was queued, 0 if the request is not complete yet,
+ * -1 if the connection should be closed
+*/
+static int next_request(struct Worker *w, struct Connection *c) {
+    size_t headEnd, total, consumed;
+    struct HttpRequestHeader connection = { HTTP_HEADER_CONNECTION, "close", NULL };
+    struct HttpResponse closing = { NULL, &connection, NULL };
+    struct HttpResponse *res = NULL;
+    struct HttpRequest *pass = NULL;
+    struct Response *o;
+    char *raw;
+    int ready = 1, queued;
+
+    if (!c->in) {
+        return 0;
+    }
+
+    // A client with prior knowledge of HTTP/2 opens with its preface instead
+    if (w->config->http2 && !c->out
+        && memcmp(c->in->data, H2_PREFACE, c->in->len < H2_PREFACE_LENGTH ? c->in->len : H2_PREFACE_LENGTH) == 0) {
+        if (c->in->len < H2_PREFACE_LENGTH) {
+            return 0;
+        }
+        return start_h2(w, c, NULL) == -1 ? -1 : 1;
+    }
+
+    total = consumed = pool_chain_length(c->in);
+    headEnd = find_head_end(c);
+
+    if (!headEnd && total < HTTP_MAX_HEAD_SIZE) {
+        return 0;
+    }
+
+    if (!(o = new_response(w))) {
+        return -1;
+    }
+
+    start_record(o, c);
+    o->copiesBody = !tls_zero_copy(c->fd);
+
+    if (!headEnd) {
+        o->requestStart = metrics_now_ns();
+        o->status = HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
+    } else {
+        // The parser wants the request in one piece, which only a chain has to be copied for
+        raw = c->in->data;
+
+        if (c->in->next && !(raw = malloc(total))) {
+            release_response(w, o);
+            return -1;
+        }
+
+        if (raw != c->in->data) {
+            pool_copy_chain(raw, c->in);
+        }
+
+        ready = handle_request(w, c, raw, headEnd, total, &consumed, o, &res, &pass);
+
+        if (raw != c->in->data) {
+            free(raw);
+        }
+    }
+
+    if (!ready) {
+        release_response(w, o);
+        return 0;
+    }
+
+    // An upload, with its body left in `c->in` to be parsed as it arrives
+    if (o->upload) {
+        METRICS_ADD(w->metrics->bytesIn, consumed);
+        c->in = pool_consume(w->pool, c->in, consumed);
+        c->scanned = 0;
+        c->out = o;
+        return 1;
+    }
+
+    // Proxied, with its body left in `c->in` to be streamed up
+    if (pass && !res) {
+        METRICS_ADD(w->metrics->bytesIn, consumed);
+        c->in = pool_consume(w->pool, c->in, consumed);
+        c->scanned = 0;
+
+        if (proxy_start(w, c, pass, o) == 0) {
+            return 1;
+        }
+
+        // Answered like any request that could not be handled, and with what is left unread
+        pass = NULL;
+        total = consumed = 0;
+    }
+
+    // A request that could not be handled has no framing left to trust
+    if (!res) {
+        o->keepAlive = 0;
+        consumed = total;
+    }
+
+    if (!res && o->status == HTTP_STATUS_TOO_MANY_REQUESTS) {
+        queued = queue_limited(w, c, o);
+    } else {
+        queued = queue_response(w, c, o, res ? res : &closing);
+    }
+
+    if (queued == -1) {
+        free_response(res);
+        free_request(pass);
+        release_response(w, o);
+        return -1;
+    }
+
+    free_response(res);
+
+    METRICS_ADD(w->metrics->bytesIn, consumed);
+
+    // Whatever follows is the start of the next request
+    c->in = pool_consume(w->pool, c->in, consumed);
+    c->scanned = 0;
+
+    if (pass) {
+        return start_h2(w, c, pass) == -1 ? -1 : 1;
+    }
+
+    if (o->websocket) {
+        start_websocket(w, c, o);
+    } else if (o->events) {
+        start_events(w, c, o);
+    }
+
+    return 1;
+}
+
+/**
+ * Parses what has arrived of the body of the upload at the front of `c->out`,
+ * and queues its response once it is all in
+ *
+ * Returns 1 once the response is queued, 0 while more of the body is to come,
+ * -1 if the connection should be closed
+*/
+static int receive_upload(struct Worker *w, struct Connection *c) {
+    struct Response *o = c->out;
+    struct Upload *u = o->upload;
+    struct HttpResponse *res = u->ctx.res;
+    size_t take;
+    int failed = 0;
+
+    while (c->in && u->left && !failed) {
+        take = c->in->len < u->left ? c->in->len : u->left;
+        failed = multipart_parse(&u->parser, c->in->data, take) == -1;
+        u->left -= take;
+        METRICS_ADD(w->metrics->bytesIn, take);
+        c->in = pool_consume(w->pool, c->in, take);
+    }
+
+    c->scanned = 0;
+
+    if (u->left && !failed) {
+        return 0;
+    }
+
+    o->upload = NULL;
+    o->status = end_upload(&u->ctx, &u->parser, failed);
+
+    // Whatever of the body is left unread has no framing left to trust
+    if (u->left) {
+        o->keepAlive = 0;
+    }
+
+    answer_in_version(o, u->ctx.req, res);
+    free_request(u->ctx.req);
+    free(u);
+
+    // Queued again, now that there is something to send
+    c->out = NULL;
+
+    if (queue_response(w, c, o, res) == -1) {
+        free_response(res);
+        release_response(w, o);
+        return -1;
+    }
+
+    free_response(res);
+
+    return 1;
+}
+
+/**
+ * Answers the requests buffered on `c` for as long as their responses go out
+ * without blocking. Closes the connection when done with it
+ *
+ * Every complete request already received is handled (up to
+ * WORKER_MAX_PIPELINE) before any response is sent, so a pipelining client
+ * gets all of them in one write
+*/
+static void serve(struct Worker *w, struct Connection *c) {
+    const struct Response *o;
+    int ready, served = 0, queued;
+
+    for (;;) {
+        // An upload's body comes before anything else is read or sent
+        if (c->out && c->out->upload && (ready = receive_upload(w, c)) != 1) {
+            if (ready == -1 || watch(w, c, CONNECTION_READING) == -1) {
+                close_connection(w, c);
+            }
+            return;
+        }
+
+        for (queued = 0, o = c->out; o; o = o->next, ++queued) {
+            if (!o->keepAlive) {
+                queued = WORKER_MAX_PIPELINE;
+                break;
+            }
+        }
+
+        ready = 0;
+        while (queued < WORKER_MAX_PIPELINE && (ready = next_request(w, c)) == 1) {
+            // Switched to HTTP/2, which takes it from here
+            if (c->protocol == CONNECTION_H2) {
+                serve_h2(w, c);
+                return;
+            }
+
+            // Likewise to WebSocket
+            if (c->protocol == CONNECTION_WEBSOCKET) {
+                serve_websocket(w, c);
+                return;
+            }
+
+            // Or an event stream
+            if (c->protocol == CONNECTION_EVENTS) {
+                serve_events(w, c);
+                return;
+            }
+
+            // Forwarded upstream, the proxy carries on with both sockets
+            if (c->out->proxy) {
+                return;
+            }
+
+            // Its body is read first
+            if (c->out->upload) {
+                break;
+            }
+
+            // Nothing after a response that closes the connection
+            for (o = c->out; o->next; o = o->next);
+            queued = o->keepAlive ? queued + 1 : WORKER_MAX_PIPELINE;
+        }
+
+        if (ready == -1) {
+            close_connection(w, c);
+            return;
+        }
+
+        if (c->out && c->out->upload) {
+            continue;
+        }
+
+        if (!c->out) {
+            // A partial request keeps the deadline it started with
+            if (c->in && c->state == CONNECTION_READING && !served) {
+                return;
+            }
+            if (watch(w, c, c->in ? CONNECTION_READING : CONNECTION_IDLE) == -1) {
+                close_connection(w, c);
+            }
+            return;
+        }
+
+        if ((ready = flush_responses(w, c)) == -1) {
+            close_connection(w, c);
+            return;
+        }
+
+        if (!ready) {
+            if (watch(w, c, CONNECTION_WRITING) == -1) {
+                close_connection(w, c);
+            }
+            return;
+        }
+
+        served = 1;
+    }
+}
+
+/**
+ * Reads what has arrived on `c` into `*in`, taking a buffer only now that there is data
+ *
+ * Returns the number of bytes read, 0 if the client closed, or -1 with errno set
+*/
+static ssize_t read_some(struct Worker *w, struct Connection *c, struct PoolBuffer **in) {
+    struct PoolBuffer *tail, *large;
+    ssize_t n, total = 0;
+
+    if (!*in && !(*in = pool_get(w->pool, POOL_SMALL))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (tail = *in; tail->next; tail = tail->next);
+
+    do {
+        if (tail->len == tail->cap) {
+            // Outgrew a small buffer: move to a large one. Only heads past that get a chain
+            if (!(large = pool_get(w->pool, POOL_LARGE))) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            if (tail->cls == POOL_SMALL) {
+                memcpy(large->data, tail->data, tail->len);
+                large->len = tail->len;
+                pool_put(w->pool, *in);
+                *in = large;
+            } else {
+                tail->next = large;
+            }
+
+            tail = large;
+        }
+
+        do {
+            n = tls_recv(c->fd, tail->data + tail->len, tail->cap - tail->len);
+        } while (n == -1 && errno == EINTR);
+
+        if (n > 0) {
+            tail->len += n;
+            total += n;
+        }
+    // The rest of a record decrypted in process would never wake epoll, it is taken now
+    } while (n > 0 && tls_pending(c->fd));
+
+    if (total) {
+        return total;
+    }
+
+    if ((*in)->len == 0) {
+        // Nothing came after all, an idle connection holds no buffer
+        pool_put(w->pool, *in);
+        *in = NULL;
+    }
+
+    return n;
+}
+
+/**
+ * Reads and drops whatever a subscriber sends, closing the stream once it has gone
+*/
+static void on_events_readable(struct Worker *w, struct Connection *c) {
+    char discard[512];
+    ssize_t n;
+
+    do {
+        n = tls_recv(c->fd, discard, sizeof(discard));
+    } while (n > 0 || (n == -1 && errno == EINTR));
+
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        close_connection(w, c);
+    }
+}
+
+static void on_readable(struct Worker *w, struct Connection *c) {
+    ssize_t n;
+
+    if (c->protocol == CONNECTION_EVENTS) {
+        on_events_readable(w, c);
+        return;
+    }
+
+    n = read_some(w, c, c->protocol == CONNECTION_H2 ? &c->h2->in
+        : c->protocol == CONNECTION_WEBSOCKET ? &c->ws->in : &c->in);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    if (n <= 0) {
+        close_connection(w, c);
+        return;
+    }
+
+    if (c->protocol == CONNECTION_H2) {
+        serve_h2(w, c);
+        return;
+    }
+
+    if (c->protocol == CONNECTION_WEBSOCKET) {
+        serve_websocket(w, c);
+        return;
+    }
+
+    // The request deadline runs from its first byte
+    if (c->state == CONNECTION_IDLE && watch(w, c, CONNECTION_READING) == -1) {
+        close_connection(w, c);
+        return;
+    }
+
+    serve(w, c);
+}
+
+/**
+ * Carries a TLS handshake on, then reads the first request as on any connection
+ *
+ * The handshake has the request timeout the connection was accepted with
+*/
+static void on_handshake(struct Worker *w, struct Connection *c) {
+    unsigned int want = 0;
+    int done = tls_handshake(c->fd, &want);
+
+    if (done == -1) {
+        close_connection(w, c);
+        return;
+    }
+
+    if (!done) {
+        if ((want == EPOLLOUT) != (c->state == CONNECTION_WRITING)
+            && watch(w, c, want == EPOLLOUT ? CONNECTION_WRITING : CONNECTION_READING) == -1) {
+            close_connection(w, c);
+        }
+        return;
+    }
+
+    c->protocol = CONNECTION_HTTP1;
+
+    if (c->state == CONNECTION_WRITING && watch(w, c, CONNECTION_READING) == -1) {
+        close_connection(w, c);
+        return;
+    }
+
+    on_readable(w, c);
+}
+
+static void on_writable(struct Worker *w, struct Connection *c) {
+    int done;
+
+    if (c->protocol == CONNECTION_H2) {
+        serve_h2(w, c);
+        return;
+    }
+
+    if (c->protocol == CONNECTION_WEBSOCKET) {
+        serve_websocket(w, c);
+        return;
+    }
+
+    if (c->protocol == CONNECTION_EVENTS) {
+        serve_events(w, c);
+        return;
+    }
+
+    done = flush_responses(w, c);
+
+    if (done == -1) {
+        close_connection(w, c);
+        return;
+    }
+
+    if (!done) {
+        // Still making progress, so the send timeout starts over
+        connection_arm(w->connections, c, CONNECTION_WRITING, worker_clock(w) + HTTP_SEND_TIMEOUT_MS);
+        return;
+    }
+
+    serve(w, c);
+}
+
+/**
+ * Carries on with a client once the proxy is done with its request, as
+ * far as it got (see ProxyResult)
+*/
+static void proxy_result(struct Worker *w, struct Connection *c, int result) {
+    struct HttpRequestHeader connection = { HTTP_HEADER_CONNECTION, "close", NULL };
+    struct HttpResponse closing = { NULL, &connection, NULL };
+    struct Response *o = c->out;
+
+    switch (result) {
+        case PROXY_DONE:
+            if (finish_response(w, c)) {
+                serve(w, c);
+            } else {
+                close_connection(w, c);
+            }
+            break;
+        case PROXY_FAILED:
+            // Whatever of the request body is still unread has no framing left to trust
+            c->out = NULL;
+            o->keepAlive = 0;
+
+            if (queue_response(w, c, o, &closing) == -1) {
+                release_response(w, o);
+                close_connection(w, c);
+                return;
+            }
+
+            serve(w, c);
+            break;
+        case PROXY_CLOSE:
+            close_connection(w, c);
+            break;
+    }
+}
+
+/**
+ * Makes room for a new connection at max_connections by closing the longest idle one
+*/
+static int make_room(struct Worker *w) {
+    struct Connection *c = w->connections->timers[CONNECTION_IDLE];
+
+    if (!c) {
+        return -1;
+    }
+
+    close_connection(w, c);
+
+    return 0;
+}
+
+/**
+ * Starts serving `sockfd`, starting the handshake if it is a `tls` one.
+ * Connections refused here only get a response on plain listeners
+*/
+static void adopt_connection(struct Worker *w, int sockfd, const struct sockaddr_storage *connAddr, int tls) {
+    struct Connection *c;
+    struct epoll_event ev;
+    const char *limited;
+    size_t length;
+
+    METRICS_ADD(w->metrics->connectionsOpened, 1);
+    TRACE_PROBE2(accepted, sockfd, tls);
+
+    if ((int)w->connections->active >= w->config->maxConnections && make_room(w) == -1) {
+        if (!tls) {
+            send_error_now(sockfd, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        close(sockfd);
+        METRICS_ADD(w->metrics->connectionsClosed, 1);
+        return;
+    }
+
+    if (!(c = connection_get(w->connections, sockfd))) {
+        if (!tls) {
+            send_error_now(sockfd, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
+        close(sockfd);
+        METRICS_ADD(w->metrics->connectionsClosed, 1);
+        return;
+    }
+
+    // Only the parts the access log needs, the rest of the address would double the struct
+    c->family = connAddr->ss_family;
+    if (connAddr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)connAddr;
+        memcpy(c->addr, &in->sin_addr, sizeof(in->sin_addr));
+        c->port = ntohs(in->sin_port);
+    } else if (connAddr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)connAddr;
+        memcpy(c->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        c->port = ntohs(in6->sin6_port);
+    }
+
+    // Only a look at the client's bucket: the token is taken by the request it sends
+    if (w->config->rateLimit && (c->family == AF_INET || c->family == AF_INET6)
+        && !ratelimit_take(ratelimit_key(c->family, c->addr, 0), w->config->rateLimit, w->config->rateBurst, 0)) {
+        if (!tls) {
+            limited = ratelimit_response(&length);
+            send(sockfd, limited, length, MSG_DONTWAIT);
+        }
+        METRICS_ADD(w->metrics->rateLimited, 1);
+        close_connection(w, c);
+        return;
+    }
+
+    if (tls) {
+        if (tls_accept(w->tls, sockfd) == -1) {
+            close_connection(w, c);
+            return;
+        }
+        c->protocol = CONNECTION_TLS_HANDSHAKE;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+        perror("Error watching connection");
+        close_connection(w, c);
+        return;
+    }
+
+    // A new connection has the request timeout to send its first request
+    connection_arm(w->connections, c, CONNECTION_READING, worker_clock(w) + w->config->requestTimeoutMs);
+
+    // With deferred accept the ClientHello is usually here already
+    if (tls) {
+        on_handshake(w, c);
+    }
+}
+
+/**
+ * Accepts what is waiting on a listener
+*/
+static void accept_connections(struct Worker *w, int listenSockfd, int tls) {
+    struct sockaddr_storage connAddr;
+    int newSockfd, accepted;
+
+    for (accepted = 0; accepted < w->config->acceptBatch && !stopping; ++accepted) {
+        newSockfd = accept_connection(listenSockfd, &connAddr);
+
+        if (newSockfd == -1) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                METRICS_ADD(w->metrics->acceptErrors, 1);
+                perror("Error accepting");
+            }
+            break;
+        }
+
+        adopt_connection(w, newSockfd, &connAddr, tls);
+    }
+}
+
+/**
+ * Takes up to acceptBatch of the connections the acceptor threads handed this
+ * worker. Returns how many
+*/
+static int receive_connections(struct Worker *w) {
+    struct sockaddr_storage connAddr;
+    int sockfd, tls, received;
+
+    for (received = 0; received < w->config->acceptBatch; ++received) {
+        if ((sockfd = acceptor_receive(w->id, &connAddr, &tls)) == -1) {
+            break;
+        }
+
+        adopt_connection(w, sockfd, &connAddr, tls);
+    }
+
+    return received;
+}
+
+/**
+ * Closes connections whose deadline has passed
+*/
+static void expire_connections(struct Worker *w) {
+    unsigned int now = worker_clock(w);
+    struct Connection *c;
+    int result;
+
+    while ((c = connection_expired(w->connections, CONNECTION_IDLE, now))) {
+        // A quiet WebSocket is pinged, and only closed if it stays quiet
+        if (c->protocol == CONNECTION_WEBSOCKET && websocket_ping(c->ws) == 0) {
+            serve_websocket(w, c);
+            continue;
+        }
+        // Likewise a quiet event stream gets a comment
+        if (c->protocol == CONNECTION_EVENTS && sse_queue(c->sse, w->events->heartbeat) == 0) {
+            serve_events(w, c);
+            continue;
+        }
+        if (c->protocol == CONNECTION_H2) {
+            send_goaway_now(c);
+        }
+        close_connection(w, c);
+    }
+
+    while ((c = connection_expired(w->connections, CONNECTION_READING, now))) {
+        if (c->protocol == CONNECTION_H2) {
+            send_goaway_now(c);
+        } else if (c->protocol == CONNECTION_HTTP1) {
+            send_error_now(c->fd, HTTP_STATUS_REQUEST_TIME_OUT);
+        }
+        close_connection(w, c);
+    }
+
+    while ((c = connection_expired(w->connections, CONNECTION_WRITING, now))) {
+        if (c->protocol == CONNECTION_UPSTREAM) {
+            if ((c = proxy_expired(w, c, &result))) {
+                proxy_result(w, c, result);
+            }
+            continue;
+        }
+        close_connection(w, c);
+    }
+}
+
+/**
+ * Stops accepting and closes connections that are between requests
+*/
+static void stop_accepting(struct Worker *w) {
+    struct Connection *c;
+    int i;
+
+    for (i = 0; i < w->listenerCount && w->handoffFd == -1; ++i) {
+        epoll_ctl(w->epollfd, EPOLL_CTL_DEL, w->listenSockfds[i], NULL);
+    }
+
+    // The master hands no more once it retires the worker, those it already has are served
+    if (w->handoffFd != -1) {
+        while (receive_connections(w) > 0);
+        epoll_ctl(w->epollfd, EPOLL_CTL_DEL, w->handoffFd, NULL);
+    }
+
+    // Pooled upstream connections are idle ones too, and none are pooled from here on
+    if (w->proxy) {
+        proxy_drain(w);
+    }
+
+    while ((c = w->connections->timers[CONNECTION_IDLE])) {
+        if (c->protocol == CONNECTION_H2) {
+            send_goaway_now(c);
+        } else if (c->protocol == CONNECTION_WEBSOCKET) {
+            send_close_now(c);
+        }
+        close_connection(w, c);
+    }
+}
+
+/**
+ * Runs the worker's event loop, serving every connection it accepts
+ *
+ * Listeners and connections share one epoll set. Listeners are added with
+ * EPOLLEXCLUSIVE so a new connection wakes one worker rather than all of
+ * them, and each wakeup accepts up to acceptBatch connections. Connections
+ * are watched for reading until a response blocks, then for writing until it
+ * has gone out, and otherwise only cost their Connection (see connection.h)
+ *
+ * With acceptor threads the worker watches its acceptor channel rather than
+ * the listeners, and takes the connections the master hands it from there
+ *
+ * Returns once SIGQUIT asks it to stop and the requests in flight are done
+*/
+void worker_run(struct Worker *w) {
+    struct epoll_event events[WORKER_MAX_EVENTS], ev;
+    struct Connection *c, *client;
+    struct sigaction sa;
+    int i, n, timeout, probe, result, listening = 1;
+
+    // No SA_RESTART so a blocked epoll_wait returns and sees the flag
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGQUIT, &sa, NULL);
+    sa.sa_handler = on_dump;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (w->config->mmapMaxBytes > 0 && !w->mapCache) {
+        w->mapCache = mapcache_create();
+    }
+
+    if (!w->pool && !(w->pool = pool_create())) {
+        perror("Error creating buffer pool");
+        return;
+    }
+
+    if (!w->connections && !(w->connections = connection_table_create())) {
+        perror("Error creating connection table");
+        return;
+    }
+
+    if (w->config->proxyPrefix[0] && !w->proxy && !(w->proxy = proxy_create(w->config))) {
+        perror("Error creating proxy");
+        return;
+    }
+
+    if (w->config->events && !w->events && !(w->events = sse_hub_create(w->id))) {
+        perror("Error creating event hub");
+        return;
+    }
+
+    if (w->config->traceSample > 0 && !w->tracer && !(w->tracer = trace_create(w->config->traceSample))) {
+        perror("Error creating tracer");
+        return;
+    }
+
+    if ((w->epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("Error creating epoll instance");
+        return;
+    }
+
+    // Woken when any worker publishes an event
+    if (w->events) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = w->events;
+
+        if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->events->notifyfd, &ev) == -1) {
+            perror("Error watching event notifier");
+            return;
+        }
+    }
+
+    w->clockStart = metrics_now_ns();
+
+    // Handed its connections by the master's acceptor threads instead, see acceptor_init
+    if ((w->handoffFd = acceptor_fd(w->id)) != -1) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &w->handoffFd;
+
+        if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->handoffFd, &ev) == -1) {
+            perror("Error watching acceptor channel");
+            return;
+        }
+    }
+
+    for (i = 0; i < w->listenerCount && w->handoffFd == -1; ++i) {
+        ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+        ev.data.ptr = &w->listenSockfds[i];
+
+        if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->listenSockfds[i], &ev) == -1) {
+            perror("Error watching listener");
+            return;
+        }
+    }
+
+    while (!stopping || w->connections->active > 0) {
+        if (stopping && listening) {
+            stop_accepting(w);
+            listening = 0;
+            continue;
+        }
+
+        // Upstreams that are down are probed between events
+        timeout = connection_next_timeout(w->connections, worker_clock(w));
+        if (w->proxy && (probe = proxy_check(w)) != -1 && (timeout == -1 || probe < timeout)) {
+            timeout = probe;
+        }
+
+        // Nothing closed so far has events left to handle, the batch about to come is all new
+        connection_recycle(w->connections);
+        n = epoll_wait(w->epollfd, events, WORKER_MAX_EVENTS, timeout);
+
+        if (dumpRequested) {
+            dumpRequested = 0;
+            trace_dump(w->tracer, w->config->tracePath, w->id);
+        }
+
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("Error waiting for events");
+            }
+            continue;
+        }
+
+        for (i = 0; i < n; ++i) {
+            if ((int *)events[i].data.ptr >= w->listenSockfds && (int *)events[i].data.ptr < w->listenSockfds + w->listenerCount) {
+                if (listening) {
+                    accept_connections(w, *(int *)events[i].data.ptr,
+                        w->config->listeners[(int *)events[i].data.ptr - w->listenSockfds].tls);
+                }
+                continue;
+            }
+
+            if (events[i].data.ptr == &w->handoffFd) {
+                if (listening) {
+                    receive_connections(w);
+                }
+                continue;
+            }
+
+            if (w->events && events[i].data.ptr == w->events) {
+                deliver_events(w);
+                continue;
+            }
+
+            c = events[i].data.ptr;
+
+            // Closed earlier in this batch, and kept from reuse until it is over, see connection_put
+            if (c->fd == -1) {
+                continue;
+            }
+
+            if (c->protocol == CONNECTION_UPSTREAM) {
+                if ((client = proxy_upstream_event(w, c, events[i].events, &result))) {
+                    proxy_result(w, client, result);
+                }
+            } else if (c->protocol == CONNECTION_TLS_HANDSHAKE) {
+                on_handshake(w, c);
+            } else if (c->out && c->out->proxy) {
+                proxy_result(w, c, proxy_client_event(w, c, events[i].events));
+            } else if (c->state == CONNECTION_WRITING) {
+                on_writable(w, c);
+            } else {
+                on_readable(w, c);
+            }
+        }
+
+        expire_connections(w);
+    }
+
+    close(w->epollfd);
+}
@@ -0,0 +1,54 @@
+#ifndef WORKER_H_
+#define WORKER_H_
+
+#include <sys/socket.h>
+
+#include "config.h"
+#include "metrics.h"
+#include "access_log.h"
+#include "router.h"
+#include "bundle.h"
+#include "mapcache.h"
+#include "pool.h"
+#include "connection.h"
+
+#define WORKER_MAX_EVENTS 256 // Readiness events taken per epoll_wait
+#define WORKER_MAX_PIPELINE 16 // Responses queued per connection before it stops reading
+#define WORKER_MAX_IOV 64 // Buffers gathered into one write
+
+struct Proxy;
+struct SseHub;
+struct Tracer;
+struct ssl_ctx_st;
+
+/**
+ * A long-lived worker process accepting on the shared listening sockets
+*/
+typedef struct Worker {
+    int id;
+    int listenSockfds[MAX_LISTENERS];
+    int listenerCount;
+    int rootfd; // Document root, see files_open
+    int uploadfd; // Where uploads are stored, -1 without an upload_dir
+    const struct Router *router;
+    const struct Bundle *bundle; // Static asset bundle, no entries if none is configured
+    struct MapCache *mapCache; // Created by worker_run, NULL when mmap serving is off
+    struct BufferPool *pool; // Receive buffers, created by worker_run
+    struct ConnectionTable *connections; // Created by worker_run
+    struct Response *freeResponses;
+    struct Proxy *proxy; // Created by worker_run when proxy_prefix is set, else NULL
+    struct SseHub *events; // Created by worker_run when events are on, else NULL
+    struct Tracer *tracer; // Created by worker_run when trace_sample is set, else NULL
+    struct ssl_ctx_st *tls; // Shared by the TLS listeners, NULL without any
+    int epollfd;
+    int handoffFd; // Connections from the master's acceptor threads arrive here, -1 when the worker accepts them itself
+    unsigned long long clockStart; // Connection deadlines count milliseconds from here
+    const struct ServerConfig *config;
+    struct MetricsSlot *metrics;
+    struct AccessLogRing *accessLog;
+} Worker;
+
+void worker_run(struct Worker *w);
+unsigned int worker_clock(const struct Worker *w);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/hpack.h"
+
+/**
+ * Decoder tests: the examples of RFC 7541 Appendix C, whose responses run the
+ * dynamic table through evictions, and the cases around them that once went
+ * wrong. Build with -fsanitize=address to have a read of an evicted entry
+ * reported, rather than only noticed if its bytes happen to change
+ *
+ * Usage: hpack_test
+*/
+
+static int failures = 0;
+
+#define CHECK(cond, name) do { \
+    if (cond) { \
+        printf("ok   %s\n", name); \
+    } else { \
+        printf("FAIL %s\n", name); \
+        ++failures; \
+    } \
+} while (0)
+
+/**
+ * The decoded headers of a block, one `name: value` line each
+*/
+typedef struct Decoded {
+    char text[1024];
+    size_t length;
+} Decoded;
+
+static int collect(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength) {
+    struct Decoded *d = arg;
+    int n = snprintf(d->text + d->length, sizeof(d->text) - d->length, "%.*s: %.*s\n",
+        (int)nameLength, name, (int)valueLength, value);
+
+    if (n < 0 || (size_t)n >= sizeof(d->text) - d->length) {
+        return -1;
+    }
+
+    d->length += n;
+
+    return 0;
+}
+
+/**
+ * Decodes the block written as `hex` (as in the RFC's dumps) with table `t`.
+ * Checks it decodes to `expected` and leaves the table holding `count`
+ * entries in `size` bytes
+*/
+static void check_block(struct HpackTable *t, const char *hex, const char *expected, size_t count, size_t size,
+    const char *name) {
+    unsigned char block[512];
+    struct Decoded d;
+    size_t length = 0;
+    unsigned int byte;
+
+    for (; hex[0] && hex[1] && length < sizeof block; hex += 2) {
+        sscanf(hex, "%2x", &byte);
+        block[length++] = byte;
+    }
+
+    memset(&d, 0, sizeof d);
+
+    CHECK(hpack_decode(t, block, length, collect, &d) == 0 && strcmp(d.text, expected) == 0
+        && t->count == count && t->size == size, name);
+}
+
+/**
+ * C.4: requests with Huffman-coded strings, filling the table
+*/
+static void test_requests(void) {
+    static const char first[] = ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n";
+    static const char second[] = ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+        "cache-control: no-cache\n";
+    static const char third[] = ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n"
+        "custom-key: custom-value\n";
+    struct HpackTable t;
+
+    hpack_table_init(&t, HPACK_DEFAULT_TABLE_SIZE);
+
+    check_block(&t, "828684418cf1e3c2e5f23a6ba0ab90f4ff", first, 1, 57, "C.4.1 first request");
+    check_block(&t, "828684be5886a8eb10649cbf", second, 2, 110, "C.4.2 second request");
+    check_block(&t, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", third, 3, 164, "C.4.3 third request");
+
+    hpack_table_free(&t);
+}
+
+static const char firstResponse[] = ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+    "location: https://www.example.com\n";
+static const char secondResponse[] = ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+    "location: https://www.example.com\n";
+static const char thirdResponse[] = ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n"
+    "location: https://www.example.com\ncontent-encoding: gzip\n"
+    "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n";
+
+/**
+ * C.5: responses in a 256 byte table, each after the first evicting entries
+*/
+static void test_responses(void) {
+    struct HpackTable t;
+
+    hpack_table_init(&t, 256);
+
+    check_block(&t, "4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d54"
+        "6e1768747470733a2f2f7777772e6578616d706c652e636f6d", firstResponse, 4, 222, "C.5.1 first response");
+    check_block(&t, "4803333037c1c0bf", secondResponse, 4, 222, "C.5.2 second response evicts one entry");
+    check_block(&t, "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a6970"
+        "7738666f6f3d4153444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d6167653d333630303b"
+        "2076657273696f6e3d31", thirdResponse, 3, 215, "C.5.3 third response evicts four entries");
+
+    hpack_table_free(&t);
+}
+
+/**
+ * C.6: the same responses with Huffman-coded strings
+*/
+static void test_huffman_responses(void) {
+    struct HpackTable t;
+
+    hpack_table_init(&t, 256);
+
+    check_block(&t, "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b"
+        "97c8e9ae82ae43d3", firstResponse, 4, 222, "C.6.1 first response");
+    check_block(&t, "4883640effc1c0bf", secondResponse, 4, 222, "C.6.2 second response evicts one entry");
+    check_block(&t, "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdf"
+        "cd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007", thirdResponse, 3, 215,
+        "C.6.3 third response evicts four entries");
+
+    hpack_table_free(&t);
+}
+
+/**
+ * A literal with incremental indexing whose name is that of the only dynamic
+ * entry, and too big to fit beside it: adding it evicts the entry its name
+ * came from, which must not be what the header is read from
+*/
+static void test_name_of_evicted_entry(void) {
+    struct HpackTable t;
+
+    hpack_table_init(&t, 64);
+
+    check_block(&t, "4002616201" "63", "ab: c\n", 1, 35, "literal with a new name is indexed");
+    check_block(&t, "7e14" "7676767676767676767676767676767676767676", "ab: vvvvvvvvvvvvvvvvvvvv\n", 1, 54,
+        "literal named by the entry it evicts");
+
+    hpack_table_free(&t);
+}
+
+int main(void) {
+    test_requests();
+    test_responses();
+    test_huffman_responses();
+    test_name_of_evicted_entry();
+
+    printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,812 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT 3197
+#define DEFAULT_SERVER "./bin/server"
+#define BUNDLE_PACK "./bin/bundle_pack"
+#define READ_TIMEOUT_MS 2000
+#define ACCESS_LOG_PATH_MAX 192 // As in src/access_log.h
+#define BIG_FILE_SIZE 200000 // Mapped by the server (under mmap_max_bytes), and more than an HTTP/2 window
+
+/**
+ * Regression tests for malformed and hostile input, run against a real
+ * server: each test connects, sends what once crashed or misled a worker,
+ * and checks the answer. Starts bin/server on a loopback port with its own
+ * config, access log and document root, and stops it at the end. Run from
+ * the repository root, where bin/bundle_pack packs the root for the bundle tests
+ *
+ * Usage: server_test [-p port] [-s server_binary]
+*/
+
+static int port = DEFAULT_PORT;
+static char configPath[] = "/tmp/server_test_conf.XXXXXX";
+static char logPath[] = "/tmp/server_test_log.XXXXXX";
+static char rootPath[] = "/tmp/server_test_root.XXXXXX";
+static char listedPath[sizeof(rootPath) + 16];
+static char childPath[sizeof(listedPath) + 16];
+static char bigPath[sizeof(rootPath) + 16];
+static char pagePath[sizeof(rootPath) + 16];
+static char bundlePath[] = "/tmp/server_test_bundle.XXXXXX";
+static int failures = 0;
+
+#define CHECK(cond, name) do { \
+    if (cond) { \
+        printf("ok   %s\n", name); \
+    } else { \
+        printf("FAIL %s\n", name); \
+        ++failures; \
+    } \
+} while (0)
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    nanosleep(&ts, NULL);
+}
+
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (sockfd == -1 || connect(sockfd, (struct sockaddr *)&addr, sizeof addr) == -1) {
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Creates the config and access log files and the document root
+*/
+static int create_files(void) {
+    int fd;
+
+    if ((fd = mkstemp(configPath)) == -1) {
+        perror("Error creating test config");
+        return -1;
+    }
+    close(fd);
+    close(mkstemp(logPath));
+
+    // A directory whose name needs escaping both in a URL and in HTML, with one entry to link to
+    snprintf(listedPath, sizeof(listedPath), "%s/a#\"<b", mkdtemp(rootPath) ? rootPath : "");
+    snprintf(childPath, sizeof(childPath), "%s/c", listedPath);
+
+    if (mkdir(listedPath, 0700) == -1 || mkdir(childPath, 0700) == -1) {
+        perror("Error creating test document root");
+        return -1;
+    }
+
+    snprintf(bigPath, sizeof(bigPath), "%s/big", rootPath);
+
+    if ((fd = open(bigPath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1 || ftruncate(fd, BIG_FILE_SIZE) == -1) {
+        perror("Error creating test file");
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+static void remove_files(void) {
+    unlink(configPath);
+    unlink(logPath);
+    unlink(bigPath);
+    unlink(pagePath);
+    unlink(bundlePath);
+    rmdir(childPath);
+    rmdir(listedPath);
+    rmdir(rootPath);
+}
+
+/**
+ * Writes the config, with `extra` lines after the common ones, starts the
+ * server and waits until it accepts
+*/
+static pid_t start_server(const char *server, const char *extra) {
+    char listen[32];
+    FILE *fp;
+    pid_t pid;
+    int fd, i;
+
+    if (!(fp = fopen(configPath, "w"))) {
+        perror("Error writing test config");
+        return -1;
+    }
+
+    fprintf(fp, "workers 1\naccess_log %s\ndocument_root %s\nautoindex on\n%s", logPath, rootPath, extra);
+    fclose(fp);
+
+    snprintf(listen, sizeof(listen), "127.0.0.1:%d", port);
+
+    // Or the child's freopen flushes what this process has yet to print
+    fflush(stdout);
+
+    if ((pid = fork()) == 0) {
+        freopen("/dev/null", "w", stdout);
+        execl(server, server, "-c", configPath, "-l", listen, (char *)NULL);
+        perror("Error starting server");
+        _exit(1);
+    }
+
+    for (i = 0; i < 50; ++i) {
+        sleep_ms(100);
+
+        if ((fd = connect_server()) != -1) {
+            close(fd);
+            return pid;
+        }
+    }
+
+    fprintf(stderr, "Server did not start on port %d\n", port);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    return -1;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/**
+ * Reads exactly `length` bytes, or returns -1 if the connection closes or stays quiet first
+*/
+static int read_exact(int sockfd, void *dst, size_t length) {
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < length) {
+        if (poll(&pfd, 1, READ_TIMEOUT_MS) != 1 || (n = recv(sockfd, (char *)dst + got, length - got, 0)) <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads HTTP/2 frames until a GOAWAY, returning its error code, or -1 if the
+ * connection ends without one
+*/
+static long read_goaway(int sockfd) {
+    unsigned char head[9], payload[16384];
+    size_t length;
+
+    while (read_exact(sockfd, head, sizeof head) == 0) {
+        length = (size_t)head[0] << 16 | head[1] << 8 | head[2];
+
+        if (length > sizeof(payload) || read_exact(sockfd, payload, length) == -1) {
+            return -1;
+        }
+
+        if (head[3] == 0x7 && length >= 8) {
+            return (long)payload[4] << 24 | payload[5] << 16 | payload[6] << 8 | payload[7];
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * A CONTINUATION on stream 0 with no header block open is a connection error,
+ * not a continuation of nothing. A worker that crashes on it closes without a GOAWAY
+*/
+static void test_h2_stray_continuation(void) {
+    static const char frames[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+        "\x00\x00\x00\x04\x00\x00\x00\x00\x00" // SETTINGS
+        "\x00\x00\x04\x09\x00\x00\x00\x00\x00" "abcd"; // CONTINUATION, stream 0
+    int sockfd = connect_server();
+
+    send(sockfd, frames, sizeof(frames) - 1, 0);
+    CHECK(read_goaway(sockfd) == 0x1, "h2 stray CONTINUATION is a PROTOCOL_ERROR");
+    close(sockfd);
+}
+
+/**
+ * Reads HTTP/2 frames until a HEADERS on stream `id`, copying its block into
+ * `block`. Returns the block's length, or -1 if the connection ends without one
+*/
+static long read_headers(int sockfd, unsigned int id, unsigned char *block, size_t cap) {
+    unsigned char head[9], payload[16384];
+    size_t length;
+
+    while (read_exact(sockfd, head, sizeof head) == 0) {
+        length = (size_t)head[0] << 16 | head[1] << 8 | head[2];
+
+        if (length > sizeof(payload) || read_exact(sockfd, payload, length) == -1) {
+            return -1;
+        }
+
+        if (head[3] == 0x1 && ((unsigned int)head[5] << 24 | head[6] << 16 | head[7] << 8 | head[8]) == id) {
+            length = length < cap ? length : cap;
+            memcpy(block, payload, length);
+            return (long)length;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * A header block of a few KiB indexing one large table entry over and over
+ * decodes to far more than SETTINGS_MAX_HEADER_LIST_SIZE, and is answered
+ * with 431 rather than kept
+*/
+static void test_h2_header_list_size(void) {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+        "\x00\x00\x00\x04\x00\x00\x00\x00\x00"; // SETTINGS
+    unsigned char frame[9 + 8192], block[256];
+    size_t length = 9;
+    long blockLength;
+    int sockfd = connect_server(), i;
+
+    // :method GET, :scheme http, :path /, then x-big with a 4000 byte value, indexed
+    memcpy(frame + length, "\x82\x86\x84\x40\x05x-big\x7f\xa1\x1e", 13);
+    length += 13;
+    memset(frame + length, 'a', 4000);
+    length += 4000;
+
+    // And 20 more times by its index, 62: over 80000 bytes decoded
+    for (i = 0; i < 20; ++i) {
+        frame[length++] = 0xbe;
+    }
+
+    // HEADERS on stream 1, END_STREAM | END_HEADERS
+    frame[0] = (length - 9) >> 16;
+    frame[1] = (length - 9) >> 8;
+    frame[2] = length - 9;
+    memcpy(frame + 3, "\x01\x05\x00\x00\x00\x01", 6);
+
+    send(sockfd, preface, sizeof(preface) - 1, 0);
+    send(sockfd, frame, length, 0);
+
+    // :status 431 is not in the static table, so it is a literal with the name indexed
+    blockLength = read_headers(sockfd, 1, block, sizeof block);
+    CHECK(blockLength >= 5 && memcmp(block, "\x08\x03" "431", 5) == 0, "h2 oversized header list is answered with 431");
+    close(sockfd);
+}
+
+/**
+ * Reads one HTTP/2 frame into `head` and `payload`, returns its length or -1
+*/
+static long read_frame(int sockfd, unsigned char head[9], unsigned char *payload, size_t cap) {
+    size_t length;
+
+    if (read_exact(sockfd, head, 9) == -1) {
+        return -1;
+    }
+
+    length = (size_t)head[0] << 16 | head[1] << 8 | head[2];
+
+    return length <= cap && read_exact(sockfd, payload, length) == 0 ? (long)length : -1;
+}
+
+/**
+ * HTTP/2 copies a body into its frames, so a file shrinking while it is sent
+ * must not be read through its mapping, which would fault and take the worker
+ * down. Waits out the stream's window, truncates the file, then opens the
+ * window: the stream is reset, and the connection answers a PING after it
+*/
+static void test_h2_truncated_file(void) {
+    static const char request[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+        "\x00\x00\x00\x04\x00\x00\x00\x00\x00" // SETTINGS
+        "\x00\x00\x08\x01\x05\x00\x00\x00\x01" "\x82\x86\x04\x04/big"; // HEADERS GET /big, stream 1
+    static const char more[] = "\x00\x00\x04\x08\x00\x00\x00\x00\x00" "\x00\x10\x00\x00" // WINDOW_UPDATE, connection
+        "\x00\x00\x04\x08\x00\x00\x00\x00\x01" "\x00\x10\x00\x00" // WINDOW_UPDATE, stream 1
+        "\x00\x00\x08\x06\x00\x00\x00\x00\x00" "pingpong"; // PING
+    unsigned char head[9], payload[16384];
+    long length, received = 0;
+    int sockfd = connect_server(), answered = 0;
+
+    send(sockfd, request, sizeof(request) - 1, 0);
+
+    // The default window is 65535 bytes
+    while (received < 65535 && (length = read_frame(sockfd, head, payload, sizeof payload)) != -1) {
+        if (head[3] == 0x0) {
+            received += length;
+        }
+    }
+
+    truncate(bigPath, 0);
+    send(sockfd, more, sizeof(more) - 1, 0);
+
+    while (!answered && read_frame(sockfd, head, payload, sizeof payload) != -1) {
+        answered = head[3] == 0x6 && (head[4] & 0x1);
+    }
+
+    CHECK(received == 65535 && answered, "h2 body of a file truncated while it is sent does not fault");
+    close(sockfd);
+}
+
+/**
+ * Opens a WebSocket on the live metrics endpoint, returns -1 if the upgrade is refused
+*/
+static int open_websocket(void) {
+    static const char upgrade[] = "GET /metrics/live HTTP/1.1\r\nHost: localhost\r\n"
+        "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    char head[1024];
+    size_t length = 0;
+    int sockfd = connect_server();
+
+    if (sockfd == -1 || send(sockfd, upgrade, sizeof(upgrade) - 1, 0) == -1) {
+        return -1;
+    }
+
+    // Byte by byte, so nothing after the head is read with it
+    while (length < sizeof(head) - 1 && read_exact(sockfd, head + length, 1) == 0) {
+        head[++length] = '\0';
+
+        if (length >= 4 && memcmp(head + length - 4, "\r\n\r\n", 4) == 0) {
+            if (strncmp(head, "HTTP/1.1 101", 12) == 0) {
+                return sockfd;
+            }
+            break;
+        }
+    }
+
+    close(sockfd);
+
+    return -1;
+}
+
+/**
+ * Reads server frames until a close, returning its status code, or -1 if the
+ * connection ends without one
+*/
+static long read_close(int sockfd) {
+    unsigned char head[10], payload[65536];
+    unsigned long long length;
+    int i;
+
+    while (read_exact(sockfd, head, 2) == 0) {
+        length = head[1] & 0x7F;
+
+        if (length == 126) {
+            if (read_exact(sockfd, head + 2, 2) == -1) {
+                return -1;
+            }
+            length = head[2] << 8 | head[3];
+        } else if (length == 127) {
+            if (read_exact(sockfd, head + 2, 8) == -1) {
+                return -1;
+            }
+            for (length = 0, i = 2; i < 10; ++i) {
+                length = length << 8 | head[i];
+            }
+        }
+
+        if (length > sizeof(payload) || read_exact(sockfd, payload, length) == -1) {
+            return -1;
+        }
+
+        if ((head[0] & 0x0F) == 0x8) {
+            return length >= 2 ? (long)(payload[0] << 8 | payload[1]) : 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Sends `first` then `second` on a new WebSocket and returns the close code the server answers with
+*/
+static long websocket_close_code(const char *first, size_t firstLength, const char *second, size_t secondLength) {
+    long code;
+    int sockfd;
+
+    if ((sockfd = open_websocket()) == -1) {
+        return -1;
+    }
+
+    send(sockfd, first, firstLength, 0);
+    if (second) {
+        send(sockfd, second, secondLength, 0);
+    }
+
+    code = read_close(sockfd);
+    close(sockfd);
+
+    return code;
+}
+
+/**
+ * A 64-bit frame length with its top bit set is a protocol error, including
+ * one that would wrap the reassembled message length back under the limit,
+ * and one merely past the limit is too big
+*/
+static void test_websocket_lengths(void) {
+    static const char topBit[] = "\x82\xff\x80\x00\x00\x00\x00\x00\x00\x01" "mask";
+    static const char fragment[] = "\x02\x84" "mask" "abcd";
+    static const char wrapping[] = "\x80\xff\xff\xff\xff\xff\xff\xff\xff\xfd" "mask";
+    static const char oversized[] = "\x80\xff\x7f\xff\xff\xff\xff\xff\xff\xfe" "mask";
+
+    CHECK(websocket_close_code(topBit, sizeof(topBit) - 1, NULL, 0) == 1002,
+        "websocket length with the top bit set closes with 1002");
+    CHECK(websocket_close_code(fragment, sizeof(fragment) - 1, wrapping, sizeof(wrapping) - 1) == 1002,
+        "websocket fragment length wrapping the message length closes with 1002");
+    CHECK(websocket_close_code(fragment, sizeof(fragment) - 1, oversized, sizeof(oversized) - 1) == 1009,
+        "websocket fragment past the message limit closes with 1009");
+}
+
+/**
+ * A path longer than an access log record holds is logged truncated, and
+ * terminated: the writer thread reads the record as a C string
+*/
+static void test_long_path_logged(void) {
+    char request[512], line[1024], expect[256];
+    FILE *fp;
+    int sockfd, i, found = 0;
+
+    memset(expect, 0, sizeof expect);
+    expect[0] = '/';
+    memset(expect + 1, 'a', ACCESS_LOG_PATH_MAX - 2);
+
+    snprintf(request, sizeof(request), "GET /%0300d HTTP/1.0\r\n\r\n", 0);
+    memset(request + 5, 'a', 300);
+
+    if ((sockfd = connect_server()) != -1) {
+        send(sockfd, request, strlen(request), 0);
+        while (read_exact(sockfd, line, 1) == 0);
+        close(sockfd);
+    }
+
+    // The writer thread flushes every few milliseconds
+    for (i = 0; i < 20 && !found; ++i) {
+        sleep_ms(100);
+
+        if (!(fp = fopen(logPath, "r"))) {
+            continue;
+        }
+        while (!found && fgets(line, sizeof(line), fp)) {
+            found = strstr(line, " path=/aaaa") != NULL;
+        }
+        fclose(fp);
+    }
+
+    CHECK(found && strstr(line, expect) && strstr(line, expect)[strlen(expect)] == ' ',
+        "long request path is logged truncated to the record");
+}
+
+/**
+ * Reads a response until the server closes the connection, returns its length
+*/
+static size_t read_response(int sockfd, char *dst, size_t cap) {
+    size_t length = 0;
+
+    while (length < cap - 1 && read_exact(sockfd, dst + length, 1) == 0) {
+        ++length;
+    }
+    dst[length] = '\0';
+
+    return length;
+}
+
+/**
+ * Directory listing links carry the requested path percent-encoded, so a
+ * directory name can neither inject markup nor cut the link short at a `#`
+*/
+static void test_listing_escapes_path(void) {
+    static const char request[] = "GET /a%23%22%3Cb HTTP/1.0\r\n\r\n";
+    char response[4096] = "";
+    int sockfd;
+
+    if ((sockfd = connect_server()) != -1) {
+        send(sockfd, request, sizeof(request) - 1, 0);
+        read_response(sockfd, response, sizeof response);
+        close(sockfd);
+    }
+
+    CHECK(strstr(response, "<a href=\"/a%23%22%3Cb/c/\">c/</a>") && strstr(response, "<h1>Index of /a#&quot;&lt;b/</h1>"),
+        "directory listing escapes the requested path");
+}
+
+/**
+ * A path segment longer than a file name can be names no file, rather than
+ * failing the request
+*/
+static void test_long_name_not_found(void) {
+    char request[512], response[4096] = "";
+    int sockfd;
+
+    snprintf(request, sizeof(request), "GET /%0300d HTTP/1.0\r\n\r\n", 0);
+
+    if ((sockfd = connect_server()) != -1) {
+        send(sockfd, request, strlen(request), 0);
+        read_response(sockfd, response, sizeof response);
+        close(sockfd);
+    }
+
+    CHECK(strncmp(response, "HTTP/1.0 404", 12) == 0, "over-long file name is not found");
+}
+
+/**
+ * Sends `request` on a new connection and reads what comes back until the server closes it
+*/
+static void exchange(const char *request, char *response, size_t cap) {
+    int sockfd;
+
+    response[0] = '\0';
+
+    if ((sockfd = connect_server()) != -1) {
+        send(sockfd, request, strlen(request), 0);
+        read_response(sockfd, response, cap);
+        close(sockfd);
+    }
+}
+
+static int count(const char *s, const char *needle) {
+    int n = 0;
+
+    while ((s = strstr(s, needle))) {
+        ++n;
+        s += strlen(needle);
+    }
+
+    return n;
+}
+
+/**
+ * A body is skipped by its Content-Length whatever the method, so it cannot
+ * pass for a request of its own, and a body framed any other way is refused
+*/
+static void test_request_framing(void) {
+    static const char smuggled[] = "GET /nothing HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char request[512], response[16384];
+
+    snprintf(request, sizeof(request), "GET / HTTP/1.1\r\nHost: localhost\r\nContent-Length: %d\r\n\r\n%s"
+        "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", (int)strlen(smuggled), smuggled);
+    exchange(request, response, sizeof response);
+    CHECK(count(response, "HTTP/1.1 200") == 2 && !strstr(response, "HTTP/1.1 404"),
+        "GET body is skipped, not read as a request");
+
+    // Refused before the request's version is known, so answered in HTTP/1.0
+    exchange("POST / HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "24\r\nGET /nothing HTTP/1.1\r\nHost: a\r\n\r\n\r\n0\r\n\r\n", response, sizeof response);
+    CHECK(strncmp(response + 8, " 501", 4) == 0 && count(response, "HTTP/1.") == 1,
+        "chunked request body is refused and the connection closed");
+
+    exchange("POST / HTTP/1.1\r\nHost: localhost\r\nContent-Length: 3\r\nContent-Length: 4\r\n\r\nabcd",
+        response, sizeof response);
+    CHECK(strncmp(response + 8, " 400", 4) == 0, "conflicting Content-Length is refused");
+
+    exchange("POST / HTTP/1.1\r\nHost: localhost\r\nContent-Length: 3x\r\n\r\nabc", response, sizeof response);
+    CHECK(strncmp(response + 8, " 400", 4) == 0, "malformed Content-Length is refused");
+}
+
+/**
+ * Reads until the server closes the connection. Returns 0 on EOF, -1 if it
+ * stays open past the read timeout
+*/
+static int read_to_eof(int sockfd) {
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    char buf[4096];
+    ssize_t n;
+
+    while (poll(&pfd, 1, READ_TIMEOUT_MS) == 1) {
+        if ((n = recv(sockfd, buf, sizeof buf, 0)) <= 0) {
+            return n == 0 ? 0 : -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * With acceptor threads the master hands each connection to a worker, and
+ * must not keep its own copy open: the worker closing it has to reach the client
+*/
+static void test_handed_off_close(void) {
+    static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    int sockfd, eof = -1;
+
+    if ((sockfd = connect_server()) != -1) {
+        send(sockfd, request, sizeof(request) - 1, 0);
+        eof = read_to_eof(sockfd);
+        close(sockfd);
+    }
+
+    CHECK(eof == 0, "handed off connection closes after Connection: close");
+}
+
+/**
+ * Packs the document root, with a page gzip makes smaller, into the bundle
+ * with gzip variants. Returns the config line serving from it, or NULL
+*/
+static const char *pack_bundle(char *config, size_t cap) {
+    char command[256];
+    FILE *fp;
+    int fd, i;
+
+    snprintf(pagePath, sizeof(pagePath), "%s/page.html", rootPath);
+
+    if ((fd = mkstemp(bundlePath)) == -1 || !(fp = fopen(pagePath, "w"))) {
+        perror("Error creating test bundle");
+        return NULL;
+    }
+    close(fd);
+
+    for (i = 0; i < 200; ++i) {
+        fputs("<p>Compressible</p>\n", fp);
+    }
+    fclose(fp);
+
+    snprintf(command, sizeof(command), BUNDLE_PACK " -z -o %s %s > /dev/null", bundlePath, rootPath);
+
+    if (system(command) != 0) {
+        fprintf(stderr, "Error packing test bundle\n");
+        return NULL;
+    }
+
+    snprintf(config, cap, "bundle %s\n", bundlePath);
+
+    return config;
+}
+
+/**
+ * Copies the ETag of `response` into `dst`, empty if it has none
+*/
+static void response_etag(const char *response, char *dst, size_t cap) {
+    const char *etag = strstr(response, "ETag: ");
+    size_t len = etag ? strcspn(etag + 6, "\r\n") : 0;
+
+    snprintf(dst, cap, "%.*s", (int)len, etag ? etag + 6 : "");
+}
+
+/**
+ * A bundle entry's gzip variant goes only to clients giving gzip a weight
+ * above 0, and is tagged apart from the identity one, in both ETag and If-None-Match
+*/
+static void test_bundle_encoding(void) {
+    char request[256], response[16384], identity[64], gzip[64];
+
+    exchange("GET /page.html HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip;q=0, identity\r\n"
+        "Connection: close\r\n\r\n", response, sizeof response);
+    response_etag(response, identity, sizeof identity);
+    CHECK(strncmp(response, "HTTP/1.1 200", 12) == 0 && !strstr(response, "Content-Encoding"),
+        "gzip;q=0 gets the identity variant");
+
+    exchange("GET /page.html HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: br, *;q=0.5\r\n"
+        "Connection: close\r\n\r\n", response, sizeof response);
+    response_etag(response, gzip, sizeof gzip);
+    CHECK(strstr(response, "Content-Encoding: gzip") && strcmp(identity, gzip) != 0
+        && strstr(gzip, "-gz\""), "gzip variant, taken through *, has a tag of its own");
+
+    snprintf(request, sizeof(request), "GET /page.html HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n"
+        "If-None-Match: %s\r\nConnection: close\r\n\r\n", identity);
+    exchange(request, response, sizeof response);
+    CHECK(strncmp(response, "HTTP/1.1 200", 12) == 0, "identity tag does not match the gzip variant");
+
+    snprintf(request, sizeof(request), "GET /page.html HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n"
+        "If-None-Match: \"other\", %s\r\nConnection: close\r\n\r\n", gzip);
+    exchange(request, response, sizeof response);
+    CHECK(strncmp(response, "HTTP/1.1 304", 12) == 0, "gzip tag in If-None-Match matches the gzip variant");
+}
+
+/**
+ * A route limit (one request, see main) covers its path however it is spelled:
+ * routing normalizes the path, so the limit has to go by the same path
+*/
+static void test_rate_limit_spellings(void) {
+    static const char *const paths[] = { "//limited", "/./limited", "/%6cimited", "/other/../limited" };
+    char request[256], response[4096];
+    size_t i;
+
+    exchange("GET /limited HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", response, sizeof response);
+    CHECK(strncmp(response, "HTTP/1.1 404", 12) == 0, "first request on a limited route is let through");
+
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+        snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n",
+            paths[i]);
+        exchange(request, response, sizeof response);
+        snprintf(request, sizeof(request), "%s is limited as the route it reaches", paths[i]);
+        CHECK(strncmp(response + 8, " 429", 4) == 0, request);
+    }
+}
+
+/**
+ * The proxy prefix (/api, upstream down, see main) is matched by where a path
+ * leads. A target with dot segments is refused rather than forwarded for the
+ * upstream to resolve, perhaps to outside the prefix
+*/
+static void test_proxy_paths(void) {
+    char response[4096];
+
+    exchange("GET /%61pi/x HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", response, sizeof response);
+    CHECK(strncmp(response + 8, " 502", 4) == 0, "encoded path under the prefix is proxied");
+
+    exchange("GET /api/../x HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", response, sizeof response);
+    CHECK(strncmp(response, "HTTP/1.1 404", 12) == 0, "path leading out of the prefix is not proxied");
+
+    exchange("GET /api/x/%2e%2e/y HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", response, sizeof response);
+    CHECK(strncmp(response + 8, " 400", 4) == 0, "proxied path with dot segments is refused");
+}
+
+int main(int argc, char *argv[]) {
+    const char *server = DEFAULT_SERVER;
+    char extra[128];
+    pid_t pid;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 's': server = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-s server_binary]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Files are mapped by the worker, not copied into the shared cache, see test_h2_truncated_file
+    if (create_files() == -1 || (pid = start_server(server, "shared_cache_bytes 0\n")) == -1) {
+        remove_files();
+        return 2;
+    }
+
+    test_h2_stray_continuation();
+    test_h2_header_list_size();
+    test_h2_truncated_file();
+    test_websocket_lengths();
+    test_long_path_logged();
+    test_listing_escapes_path();
+    test_long_name_not_found();
+    test_request_framing();
+
+    stop_server(pid);
+
+    // Again with the master accepting, a route limit and a proxy
+    if ((pid = start_server(server, "acceptor_threads 1\nrate_limit_route /limited 1 1\n"
+        "proxy_prefix /api\nproxy_upstream 127.0.0.1:1\n")) == -1) {
+        remove_files();
+        return 2;
+    }
+
+    test_handed_off_close();
+    test_rate_limit_spellings();
+    test_proxy_paths();
+
+    stop_server(pid);
+
+    // Once more from a bundle
+    if (!pack_bundle(extra, sizeof extra) || (pid = start_server(server, extra)) == -1) {
+        remove_files();
+        return 2;
+    }
+
+    test_bundle_encoding();
+
+    stop_server(pid);
+    remove_files();
+
+    printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../src/shmcache.h"
+
+/**
+ * Shared file cache tests: references a worker still held when it exited
+ * are given back by shmcache_worker_exited, as the master does on reaping it
+ *
+ * Usage: shmcache_test
+*/
+
+static int failures = 0;
+
+#define CHECK(cond, name) do { \
+    if (cond) { \
+        printf("ok   %s\n", name); \
+    } else { \
+        printf("FAIL %s\n", name); \
+        ++failures; \
+    } \
+} while (0)
+
+/**
+ * Rewrites the file `fd` with `body` (of the same length) and a later mtime
+*/
+static void rewrite(int fd, const char *body, struct stat *st, long sec) {
+    struct timespec times[2] = { { sec, 0 }, { sec, 0 } };
+
+    pwrite(fd, body, strlen(body), 0);
+    futimens(fd, times);
+    fstat(fd, st);
+}
+
+/**
+ * A worker exiting with a body pinned (as one killed mid-send does) keeps the
+ * slot from being refilled once the file changes, until the master drops its pins
+*/
+static void test_pins_of_exited_worker(int fd) {
+    struct ShmSlot *pin;
+    struct stat st;
+    const char *body;
+    pid_t pid;
+    int hit, status = 0;
+
+    rewrite(fd, "hello", &st, 1000);
+
+    if ((pid = fork()) == 0) {
+        shmcache_forked(0);
+        _exit(shmcache_get("/a", 1234, fd, &st, &pin, &hit) ? 0 : 1);
+    }
+
+    waitpid(pid, &status, 0);
+    CHECK(pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0, "worker caches and pins the file");
+
+    rewrite(fd, "world", &st, 2000);
+    CHECK(!shmcache_get("/a", 1234, fd, &st, &pin, &hit), "changed file is not refilled under a pin");
+
+    shmcache_worker_exited(0);
+    body = shmcache_get("/a", 1234, fd, &st, &pin, &hit);
+    CHECK(body && !hit && memcmp(body, "world", 5) == 0, "changed file is refilled once the worker is reaped");
+
+    if (body) {
+        shmcache_release(pin);
+    }
+}
+
+int main(void) {
+    char path[] = "/tmp/shmcache_test.XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd == -1 || shmcache_init(1 << 20, SHMCACHE_MIN_EXTENT, 2) == -1) {
+        perror("Error setting up");
+        return 2;
+    }
+
+    unlink(path);
+
+    test_pins_of_exited_worker(fd);
+
+    close(fd);
+
+    printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+
+    return failures ? 1 : 0;
+}
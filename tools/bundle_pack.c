@@ -0,0 +1,319 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "../src/bundle.h"
+#include "../src/mime.h"
+
+/**
+ * Packs every regular file beneath a directory into a static asset bundle (see src/bundle.h)
+ *
+ * Usage: bundle_pack [-z] [-m mime_types] [-o bundle_file] root_dir
+ *
+ * Paths are stored relative to `root_dir`, which should be the server's
+ * document_root. With -z a gzip variant is stored for files it makes smaller.
+ * MIME types come from the table at `mime_types` (MIME_TYPES_PATH, relative
+ * to the repository root, by default), and packing fails if it cannot be read.
+ * The bundle is written next to its final name and renamed into place, so a
+ * running server never maps a half-written file
+*/
+
+#define DEFAULT_OUTPUT "./static.bundle"
+
+typedef struct PackEntry {
+    char *path;
+    char mime[BUNDLE_MIME_MAX];
+    unsigned char *data;
+    size_t length;
+    unsigned char *gzip;
+    size_t gzipLength;
+} PackEntry;
+
+static struct PackEntry *entries = NULL;
+static size_t entryCount = 0, entryCap = 0;
+static size_t rootLength;
+static const char *outputPath = DEFAULT_OUTPUT;
+static const char *mimeTypesPath = MIME_TYPES_PATH;
+static int gzipVariants = 0;
+static struct stat skip[2]; // The bundle being written and the one it replaces
+
+static unsigned char *read_file(const char *path, size_t length) {
+    unsigned char *data = malloc(length ? length : 1);
+    FILE *fp = fopen(path, "rb");
+
+    if (!data || !fp || fread(data, 1, length, fp) != length) {
+        perror(path);
+        free(data);
+        if (fp) {
+            fclose(fp);
+        }
+        return NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+/**
+ * Gzips `data`, keeping the result only if it is smaller
+*/
+static void gzip_entry(struct PackEntry *e) {
+    z_stream zs;
+    size_t cap = compressBound(e->length) + 32;
+
+    memset(&zs, 0, sizeof zs);
+
+    // windowBits 15 + 16 writes a gzip header and trailer
+    if (!(e->gzip = malloc(cap)) || deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(e->gzip);
+        e->gzip = NULL;
+        return;
+    }
+
+    zs.next_in = e->data;
+    zs.avail_in = e->length;
+    zs.next_out = e->gzip;
+    zs.avail_out = cap;
+
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < e->length) {
+        e->gzipLength = zs.total_out;
+    } else {
+        free(e->gzip);
+        e->gzip = NULL;
+    }
+
+    deflateEnd(&zs);
+}
+
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    struct PackEntry *e;
+    int i;
+
+    (void)ftw;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    // Never pack a bundle into itself
+    for (i = 0; i < 2; ++i) {
+        if (st->st_ino == skip[i].st_ino && st->st_dev == skip[i].st_dev) {
+            return 0;
+        }
+    }
+
+    if (entryCount == entryCap) {
+        entryCap = entryCap ? entryCap * 2 : 64;
+        entries = realloc(entries, sizeof(struct PackEntry) * entryCap);
+
+        if (!entries) {
+            perror("Error allocating entries");
+            return -1;
+        }
+    }
+
+    e = &entries[entryCount];
+    memset(e, 0, sizeof(struct PackEntry));
+
+    e->path = strdup(path + rootLength);
+    e->length = st->st_size;
+
+    if (!e->path || !(e->data = read_file(path, e->length))) {
+        return -1;
+    }
+
+    // A table that cannot be read would leave every entry DEFAULT_MIME
+    if (mime_type_from_path(e->mime, e->path) == -1) {
+        perror(mimeTypesPath);
+        return -1;
+    }
+
+    if (!e->mime[0]) {
+        strcpy(e->mime, DEFAULT_MIME);
+    }
+
+    if (gzipVariants) {
+        gzip_entry(e);
+    }
+
+    ++entryCount;
+
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct PackEntry *)a)->path, ((const struct PackEntry *)b)->path);
+}
+
+/**
+ * 64-bit FNV-1a of the contents, so an unchanged file keeps its ETag across builds
+*/
+static unsigned long long content_hash(const unsigned char *data, size_t length) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < length; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t align(uint64_t offset) {
+    return (offset + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+}
+
+static int write_at(FILE *fp, uint64_t offset, const void *data, size_t length) {
+    return fseeko(fp, offset, SEEK_SET) == 0 && fwrite(data, 1, length, fp) == length ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    struct BundleHeader header;
+    struct BundleEntry *index;
+    char *strings, *p, root[4096], tmpPath[4096];
+    uint64_t stringsLength = 0, offset, saved = 0;
+    size_t i, j;
+    FILE *fp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "zm:o:")) != -1) {
+        switch (opt) {
+            case 'z': gzipVariants = 1; break;
+            case 'm': mimeTypesPath = optarg; break;
+            case 'o': outputPath = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-z] [-m mime_types] [-o bundle_file] root_dir\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-z] [-m mime_types] [-o bundle_file] root_dir\n", argv[0]);
+        return 1;
+    }
+
+    // Before anything is written, rather than only once a file with an extension is looked up
+    if (access(mimeTypesPath, R_OK) == -1) {
+        perror(mimeTypesPath);
+        return 1;
+    }
+
+    mime_set_types_path(mimeTypesPath);
+
+    // Paths in the bundle start after `root/`
+    snprintf(root, sizeof(root), "%s", argv[optind]);
+    while (strlen(root) > 1 && root[strlen(root) - 1] == '/') {
+        root[strlen(root) - 1] = '\0';
+    }
+    rootLength = strlen(root) + 1;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", outputPath);
+
+    if (!(fp = fopen(tmpPath, "wb")) || fstat(fileno(fp), &skip[0]) == -1) {
+        perror(tmpPath);
+        return 1;
+    }
+
+    stat(outputPath, &skip[1]);
+
+    if (nftw(root, add_file, 64, FTW_PHYS) == -1) {
+        perror("Error walking root");
+        return 1;
+    }
+
+    qsort(entries, entryCount, sizeof(struct PackEntry), compare_entries);
+
+    // String table: paths, then each distinct MIME type once
+    for (i = 0; i < entryCount; ++i) {
+        stringsLength += strlen(entries[i].path) + 1 + strlen(entries[i].mime) + 1;
+    }
+
+    strings = calloc(1, stringsLength + 1);
+    index = calloc(entryCount ? entryCount : 1, sizeof(struct BundleEntry));
+
+    if (!strings || !index) {
+        perror("Error allocating index");
+        return 1;
+    }
+
+    p = strings;
+
+    for (i = 0; i < entryCount; ++i) {
+        index[i].pathOffset = p - strings;
+        index[i].pathLength = strlen(entries[i].path);
+        p += sprintf(p, "%s", entries[i].path) + 1;
+    }
+
+    for (i = 0; i < entryCount; ++i) {
+        for (j = 0; j < i && strcmp(entries[j].mime, entries[i].mime) != 0; ++j);
+
+        if (j < i) {
+            index[i].mimeOffset = index[j].mimeOffset;
+        } else {
+            index[i].mimeOffset = p - strings;
+            p += sprintf(p, "%s", entries[i].mime) + 1;
+        }
+    }
+
+    stringsLength = p - strings;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.entryCount = entryCount;
+    header.stringsOffset = sizeof(struct BundleHeader) + entryCount * sizeof(struct BundleEntry);
+    header.stringsLength = stringsLength;
+
+    // Contents, each starting on its own page
+    offset = header.stringsOffset + stringsLength;
+
+    for (i = 0; i < entryCount; ++i) {
+        index[i].offset = align(offset);
+        index[i].length = entries[i].length;
+        offset = index[i].offset + index[i].length;
+
+        if (entries[i].gzip) {
+            index[i].gzipOffset = align(offset);
+            index[i].gzipLength = entries[i].gzipLength;
+            offset = index[i].gzipOffset + index[i].gzipLength;
+            saved += entries[i].length - entries[i].gzipLength;
+        }
+
+        snprintf(index[i].etag, sizeof(index[i].etag), "\"%016llx\"", content_hash(entries[i].data, entries[i].length));
+    }
+
+    header.size = offset;
+
+    if (write_at(fp, 0, &header, sizeof header) == -1
+        || write_at(fp, sizeof header, index, entryCount * sizeof(struct BundleEntry)) == -1
+        || write_at(fp, header.stringsOffset, strings, stringsLength) == -1) {
+        perror(tmpPath);
+        return 1;
+    }
+
+    for (i = 0; i < entryCount; ++i) {
+        if (write_at(fp, index[i].offset, entries[i].data, entries[i].length) == -1
+            || (entries[i].gzip && write_at(fp, index[i].gzipOffset, entries[i].gzip, entries[i].gzipLength) == -1)) {
+            perror(tmpPath);
+            return 1;
+        }
+    }
+
+    // Seeking past the end leaves a hole, make sure the file really is header.size long
+    if (fflush(fp) != 0 || ftruncate(fileno(fp), header.size) == -1 || fclose(fp) != 0 || rename(tmpPath, outputPath) == -1) {
+        perror(outputPath);
+        return 1;
+    }
+
+    printf("Packed %zu files into %s (%llu bytes, gzip saves %llu)\n", entryCount, outputPath,
+        (unsigned long long)header.size, (unsigned long long)saved);
+
+    return 0;
+}